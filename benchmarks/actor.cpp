@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/actor.h>
+#include <cps/future/thread_pool.h>
+
+/**
+ * Message throughput and ask() round-trip latency for cps::actor, against
+ * the mutex-and-deque mailbox it replaces.
+ *
+ * Throughput: several sender threads each tell the actor N messages, and
+ * we time until a final ask() comes back. Latency: one thread asks, waits
+ * for the reply, and asks again.
+ *
+ * Both actors run on a single-threaded pool, with the same batching, so
+ * the difference is the mailbox.
+ *
+ * Usage: actor [messages per sender] [senders] [round trips]
+ */
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+double
+percentile(std::vector<double> &v, double p)
+{
+	auto idx = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+	return v[idx];
+}
+
+/** The usual hand-rolled version: a deque under a mutex, and a flag saying whether we're scheduled */
+template<typename Message, typename Reply>
+class mutex_actor {
+public:
+	mutex_actor(
+		cps::executor &exec,
+		std::function<Reply(Message &)> code,
+		size_t batch = 64
+	):state_(std::make_shared<shared_state>(exec, std::move(code), batch))
+	{
+	}
+
+	void tell(Message m) { send(state_, std::move(m), nullptr); }
+
+	std::shared_ptr<cps::future<Reply>> ask(Message m) {
+		auto reply = cps::future<Reply>::create_shared();
+		send(state_, std::move(m), reply);
+		return reply;
+	}
+
+private:
+	struct envelope {
+		Message message;
+		std::shared_ptr<cps::future<Reply>> reply;
+	};
+
+	struct shared_state {
+		shared_state(
+			cps::executor &exec,
+			std::function<Reply(Message &)> code,
+			size_t batch
+		):exec(exec),
+		  code(std::move(code)),
+		  batch(batch),
+		  scheduled(false)
+		{
+		}
+
+		cps::executor &exec;
+		std::function<Reply(Message &)> code;
+		size_t batch;
+		std::mutex mutex;
+		std::deque<envelope> queue;
+		bool scheduled;
+	};
+
+	static void send(const std::shared_ptr<shared_state> &s, Message m, std::shared_ptr<cps::future<Reply>> reply) {
+		bool post = false;
+		{
+			std::lock_guard<std::mutex> guard { s->mutex };
+			s->queue.push_back(envelope { std::move(m), std::move(reply) });
+			if(!s->scheduled)
+				post = s->scheduled = true;
+		}
+		if(post)
+			s->exec.post([s] { drain(s); });
+	}
+
+	static void drain(const std::shared_ptr<shared_state> &s) {
+		for(size_t n = 0; n < s->batch; ++n) {
+			envelope e;
+			{
+				std::lock_guard<std::mutex> guard { s->mutex };
+				if(s->queue.empty()) {
+					s->scheduled = false;
+					return;
+				}
+				e = std::move(s->queue.front());
+				s->queue.pop_front();
+			}
+			Reply r = s->code(e.message);
+			if(e.reply)
+				e.reply->done(r);
+		}
+		s->exec.post([s] { drain(s); });
+	}
+
+	std::shared_ptr<shared_state> state_;
+};
+
+template<typename Actor>
+void
+run(const char *name, size_t messages, size_t senders, size_t round_trips)
+{
+	cps::thread_pool pool { 1 };
+	long total = 0;
+	Actor a { pool, [&total](int &n) { return total += n; } };
+
+	auto start = clock::now();
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < senders; ++t)
+		threads.emplace_back([&a, messages] {
+			for(size_t i = 0; i < messages; ++i)
+				a.tell(1);
+		});
+	for(auto &t : threads)
+		t.join();
+	auto last = a.ask(0);
+	while(last->is_pending())
+		std::this_thread::yield();
+	auto elapsed = clock::now() - start;
+	size_t count = messages * senders;
+
+	std::vector<double> rtt;
+	rtt.reserve(round_trips);
+	for(size_t i = 0; i < round_trips; ++i) {
+		auto sent = clock::now();
+		auto f = a.ask(1);
+		while(f->is_pending())
+			;
+		rtt.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - sent).count() / 1000.0);
+	}
+	std::sort(rtt.begin(), rtt.end());
+
+	std::cout
+		<< name << ": " << count << " messages from " << senders << " senders in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << "ms, "
+		<< count / std::chrono::duration<double>(elapsed).count() / 1e6 << "M msg/s"
+		<< (last->value() == static_cast<long>(count) ? "" : " (LOST MESSAGES)") << std::endl
+		<< "  ask round trip: p50 " << percentile(rtt, 0.5) << u8"µs"
+		<< ", p99 " << percentile(rtt, 0.99) << u8"µs"
+		<< ", max " << percentile(rtt, 1.0) << u8"µs" << std::endl;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t messages = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+	const size_t senders = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+	const size_t round_trips = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 10000;
+
+	run<cps::actor<int, long>>("lock-free mailbox", messages, senders, round_trips);
+	run<mutex_actor<int, long>>("mutex mailbox", messages, senders, round_trips);
+	return 0;
+}
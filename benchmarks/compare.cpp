@@ -0,0 +1,175 @@
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_BOOST_THREAD
+#define BOOST_THREAD_VERSION 4
+#define BOOST_THREAD_PROVIDES_FUTURE_CONTINUATION
+#define BOOST_THREAD_PROVIDES_FUTURE_WHEN_ALL_WHEN_ANY
+#include <boost/thread/future.hpp>
+#endif
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+/**
+ * The same workloads against cps::future, std::promise/std::future and,
+ * if it was found at build time, Boost.Thread's futures.
+ *
+ * - create/resolve: make a future, attach a handler or wait, resolve it
+ * - chain: a continuation chain of the given depth. std::future has no
+ *   continuations, so each step there is a std::async thread blocked on
+ *   the previous step
+ * - fan-in: wait for a set of futures to complete
+ *
+ * Usage: compare [iterations] [chain depth] [fan-in width]
+ */
+
+namespace {
+
+template<typename F>
+void
+measure(const char *library, const char *workload, size_t count, size_t ops, F code)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	for(size_t i = 0; i < count; ++i)
+		code();
+	auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::high_resolution_clock::now() - start
+	).count();
+	std::cout
+		<< workload << " / " << library << ": "
+		<< elapsed / (double)count << "ns per iteration, "
+		<< elapsed / (double)(count * ops) << "ns per future"
+		<< std::endl;
+}
+
+void
+create_resolve(size_t count)
+{
+	measure("cps::future", "create/resolve", count, 1, [] {
+		int seen = 0;
+		auto f = cps::future<int>::create_shared();
+		f->on_done([&seen](int v) { seen = v; });
+		f->done(1);
+	});
+	measure("std::future", "create/resolve", count, 1, [] {
+		std::promise<int> p;
+		auto f = p.get_future();
+		p.set_value(1);
+		f.get();
+	});
+#ifdef HAVE_BOOST_THREAD
+	measure("boost::future", "create/resolve", count, 1, [] {
+		int seen = 0;
+		boost::promise<int> p;
+		auto f = p.get_future().then(boost::launch::sync, [&seen](boost::future<int> f) {
+			return seen = f.get();
+		});
+		p.set_value(1);
+		f.get();
+	});
+#endif
+}
+
+void
+chain(size_t count, size_t depth)
+{
+	measure("cps::future", "chain", count, depth, [depth] {
+		auto first = cps::future<int>::create_shared();
+		auto f = first;
+		for(size_t i = 0; i < depth; ++i) {
+			f = f->then([](int v) {
+				return cps::resolved_future(v + 1);
+			});
+		}
+		first->done(0);
+		if(f->value() != (int)depth)
+			std::abort();
+	});
+	measure("std::future (thread per step)", "chain", count, depth, [depth] {
+		std::promise<int> first;
+		auto f = first.get_future();
+		for(size_t i = 0; i < depth; ++i) {
+			f = std::async(std::launch::async, [prev = std::move(f)]() mutable {
+				return prev.get() + 1;
+			});
+		}
+		first.set_value(0);
+		if(f.get() != (int)depth)
+			std::abort();
+	});
+#ifdef HAVE_BOOST_THREAD
+	measure("boost::future", "chain", count, depth, [depth] {
+		boost::promise<int> first;
+		auto f = first.get_future();
+		for(size_t i = 0; i < depth; ++i) {
+			f = f.then(boost::launch::sync, [](boost::future<int> prev) {
+				return prev.get() + 1;
+			});
+		}
+		first.set_value(0);
+		if(f.get() != (int)depth)
+			std::abort();
+	});
+#endif
+}
+
+void
+fan_in(size_t count, size_t width)
+{
+	measure("cps::future", "fan-in", count, width, [width] {
+		std::vector<std::shared_ptr<cps::future<int>>> items;
+		for(size_t i = 0; i < width; ++i)
+			items.push_back(cps::future<int>::create_shared());
+		auto all = cps::needs_all(items);
+		for(auto &it : items)
+			it->done(1);
+		if(!all->is_done())
+			std::abort();
+	});
+	measure("std::future", "fan-in", count, width, [width] {
+		std::vector<std::promise<int>> promises(width);
+		std::vector<std::future<int>> items;
+		for(auto &p : promises)
+			items.push_back(p.get_future());
+		for(auto &p : promises)
+			p.set_value(1);
+		for(auto &it : items)
+			it.get();
+	});
+#ifdef HAVE_BOOST_THREAD
+	measure("boost::future", "fan-in", count, width, [width] {
+		std::vector<boost::promise<int>> promises(width);
+		std::vector<boost::future<int>> items;
+		for(auto &p : promises)
+			items.push_back(p.get_future());
+		auto all = boost::when_all(items.begin(), items.end());
+		for(auto &p : promises)
+			p.set_value(1);
+		all.get();
+	});
+#endif
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+	const size_t depth = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 8;
+	const size_t width = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 16;
+#ifndef HAVE_BOOST_THREAD
+	std::cout << "Boost.Thread not found at build time, skipping boost::future" << std::endl;
+#endif
+	create_resolve(count);
+	/* The std::future chain spawns a thread per step, so keep that one short */
+	chain(count / 100 ? count / 100 : 1, depth);
+	fan_in(count / 10 ? count / 10 : 1, width);
+	return 0;
+}
+
@@ -0,0 +1,131 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <unistd.h>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/fiber.h>
+
+using namespace cps;
+
+/**
+ * Fiber costs: context switches, and memory with many fibers suspended at
+ * once.
+ *
+ * - yield: one fiber yielding in a loop, two switches per iteration
+ * - await: fibers suspended on pending futures, resumed when they resolve
+ * - footprint: N fibers all suspended on their own future, reporting RSS
+ *   and kernel mappings per fiber, with and without guard pages
+ *
+ * Usage: fibers [suspended fibers] [yield iterations] [stack size]
+ */
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+size_t
+rss()
+{
+	std::ifstream in { "/proc/self/statm" };
+	size_t size = 0, resident = 0;
+	in >> size >> resident;
+	return resident * ::sysconf(_SC_PAGESIZE);
+}
+
+size_t
+mappings()
+{
+	std::ifstream in { "/proc/self/maps" };
+	std::string line;
+	size_t n = 0;
+	while(std::getline(in, line))
+		++n;
+	return n;
+}
+
+double
+ns_since(clock::time_point start, size_t count)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count() / (double)count;
+}
+
+void
+yield_cost(size_t iterations, size_t stack_size)
+{
+	fiber_scheduler sched { stack_size };
+	sched.spawn([iterations] {
+		for(size_t i = 0; i < iterations; ++i)
+			fiber_scheduler::yield();
+		return 0;
+	});
+	auto start = clock::now();
+	sched.run();
+	std::cout
+		<< "yield: " << ns_since(start, iterations) << "ns per yield, "
+		<< ns_since(start, iterations * 2) << "ns per context switch" << std::endl;
+}
+
+/** Suspends N fibers on pending futures, then resolves them all */
+void
+footprint(size_t count, size_t stack_size, bool guard)
+{
+	const char *name = guard ? "guard pages" : "no guard pages";
+	std::vector<std::shared_ptr<future<int>>> inputs;
+	inputs.reserve(count);
+	for(size_t i = 0; i < count; ++i)
+		inputs.push_back(future<int>::create_shared());
+
+	auto rss_start = rss();
+	auto maps_start = mappings();
+	fiber_scheduler sched { stack_size, guard };
+	size_t started = 0;
+	auto start = clock::now();
+	try {
+		for(; started < count; ++started) {
+			auto input = inputs[started];
+			sched.spawn([input] { return await(input); });
+		}
+	} catch(const std::system_error &e) {
+		std::cout << name << ": stopped at " << started << " fibers: " << e.what() << std::endl;
+	}
+	sched.run_once();
+	auto spawned = clock::now();
+	auto rss_used = rss() - rss_start;
+	auto maps_used = mappings() - maps_start;
+
+	auto resolve_start = clock::now();
+	for(size_t i = 0; i < started; ++i)
+		inputs[i]->done(static_cast<int>(i));
+	sched.run();
+
+	std::cout
+		<< name << ": " << started << " suspended fibers with " << sched.stacks().stack_size() / 1024 << "KiB stacks, "
+		<< rss_used / (double)started << " RSS bytes/fiber, "
+		<< maps_used / (double)started << " mappings/fiber" << std::endl
+		<< "  spawn and run to the first await: "
+		<< std::chrono::duration_cast<std::chrono::nanoseconds>(spawned - start).count() / (double)started << "ns/fiber" << std::endl
+		<< "  resolve, resume and finish: " << ns_since(resolve_start, started) << "ns/fiber" << std::endl;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+	const size_t iterations = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000000;
+	const size_t stack_size = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 64 * 1024;
+
+	yield_cost(iterations, stack_size);
+	footprint(count, stack_size, true);
+	footprint(count, stack_size, false);
+	return 0;
+}
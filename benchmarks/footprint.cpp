@@ -0,0 +1,249 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <malloc.h>
+#include <unistd.h>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+using namespace cps;
+
+/**
+ * Memory cost of pending futures.
+ *
+ * Creates N pending future<int> instances, each with K on_done callbacks,
+ * and reports resident memory and allocator usage per future. A breakdown
+ * by component comes first, measured on a small sample.
+ *
+ * Usage: footprint [counts] [callbacks]
+ *
+ * Both arguments are comma-separated lists, defaulting to
+ * 1000000,10000000,50000000 and 0,1,4. Runs that look like they won't fit
+ * in available memory are skipped.
+ */
+
+namespace {
+
+std::atomic<size_t> allocations { 0 };
+std::atomic<size_t> requested_bytes { 0 };
+/** Live bytes as the allocator sees them, including its own rounding */
+std::atomic<long> live_bytes { 0 };
+
+struct snapshot {
+	size_t count;
+	size_t requested;
+	long live;
+
+	static snapshot now() { return snapshot { allocations, requested_bytes, live_bytes }; }
+};
+
+/** Resident set size in bytes */
+size_t
+rss()
+{
+	std::ifstream in { "/proc/self/statm" };
+	size_t size = 0, resident = 0;
+	in >> size >> resident;
+	return resident * ::sysconf(_SC_PAGESIZE);
+}
+
+/** MemAvailable from /proc/meminfo, in bytes */
+size_t
+available()
+{
+	std::ifstream in { "/proc/meminfo" };
+	std::string key;
+	size_t value;
+	std::string unit;
+	while(in >> key >> value >> unit) {
+		if(key == "MemAvailable:")
+			return value * 1024;
+	}
+	return 0;
+}
+
+std::vector<size_t>
+parse_list(const char *arg)
+{
+	std::vector<size_t> out;
+	std::stringstream ss { arg };
+	std::string item;
+	while(std::getline(ss, item, ','))
+		out.push_back(std::stoul(item));
+	return out;
+}
+
+/** Gives us access to the callback list for the breakdown */
+class probe : public future<int> {
+public:
+	using future<int>::future;
+
+	size_t task_bytes() const {
+		return tasks_.capacity() * sizeof(tasks_[0]);
+	}
+};
+
+void
+add_callbacks(future<int> &f, size_t callbacks)
+{
+	for(size_t i = 0; i < callbacks; ++i)
+		f.on_done([](int) { });
+}
+
+/** Per-component costs, measured over a small sample */
+void
+breakdown(size_t callbacks)
+{
+	const size_t sample = 10000;
+	std::vector<std::shared_ptr<future<int>>> keep;
+	keep.reserve(sample * 2);
+
+	auto before = snapshot::now();
+	for(size_t i = 0; i < sample; ++i)
+		keep.push_back(future<int>::create_shared(std::string { }));
+	auto bare = snapshot::now();
+	for(size_t i = 0; i < sample; ++i)
+		keep.push_back(future<int>::create_shared());
+	auto labelled = snapshot::now();
+
+	/* Callback cost, split into the vector and the std::function heap storage */
+	std::vector<std::shared_ptr<probe>> probes;
+	probes.reserve(sample);
+	for(size_t i = 0; i < sample; ++i) {
+		auto p = std::make_shared<probe>(std::string { });
+		p->shared(p);
+		probes.push_back(p);
+	}
+	auto probe_start = snapshot::now();
+	size_t vector_bytes = 0;
+	for(auto &p : probes) {
+		add_callbacks(*p, callbacks);
+		vector_bytes += p->task_bytes();
+	}
+	auto with_callbacks = snapshot::now();
+
+	const double object = (bare.live - before.live) / (double)sample;
+	const double label = (labelled.live - bare.live) / (double)sample - object;
+	const double callback_total = (with_callbacks.live - probe_start.live) / (double)sample;
+	const double vector = vector_bytes / (double)sample;
+	const double storage = callback_total - vector;
+	const double allocs = (with_callbacks.count - probe_start.count) / (double)sample;
+
+	std::cout
+		<< "Breakdown for " << callbacks << " callback(s), live allocator bytes per future:" << std::endl
+		<< "  future<int> object:                " << sizeof(future<int>) << std::endl
+		<< "  object + shared_ptr control block: " << object << " (1 allocation)" << std::endl
+		<< "  default label string:              " << label
+		<< (label > 0 ? " (\"unlabelled future\" is too long for the small string buffer)" : "") << std::endl
+		<< "  callback vector:                   " << vector
+		<< " (" << sizeof(std::function<void(future<int> &)>) << " bytes per std::function slot)" << std::endl
+		<< "  std::function heap storage:        " << storage << std::endl
+		<< "  callback allocations:              " << allocs << " (including vector regrowth)" << std::endl;
+}
+
+void
+run(size_t count, size_t callbacks)
+{
+	std::vector<std::shared_ptr<future<int>>> futures;
+	auto rss_start = rss();
+	auto before = snapshot::now();
+	futures.reserve(count);
+	auto reserved = snapshot::now();
+	auto start = std::chrono::high_resolution_clock::now();
+	for(size_t i = 0; i < count; ++i) {
+		auto f = future<int>::create_shared();
+		add_callbacks(*f, callbacks);
+		futures.push_back(std::move(f));
+	}
+	auto elapsed = std::chrono::high_resolution_clock::now() - start;
+	auto after = snapshot::now();
+	/* Don't count the vector of shared_ptrs we're holding the futures in */
+	const size_t holder = reserved.live - before.live;
+	auto rss_used = rss() - rss_start;
+
+	std::cout
+		<< count << " futures, " << callbacks << " callback(s): "
+		<< ((double)rss_used - holder) / count << " RSS bytes/future, "
+		<< (after.live - reserved.live) / (double)count << " live allocator bytes/future, "
+		<< (after.requested - reserved.requested) / (double)count << " requested bytes/future, "
+		<< (after.count - reserved.count) / (double)count << " allocations/future, "
+		<< std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (double)count << "ns/future"
+		<< std::endl;
+}
+
+}
+
+void *
+operator new(size_t size)
+{
+	if(auto p = std::malloc(size ? size : 1)) {
+		++allocations;
+		requested_bytes += size;
+		live_bytes += ::malloc_usable_size(p);
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void
+operator delete(void *p) noexcept
+{
+	if(p)
+		live_bytes -= ::malloc_usable_size(p);
+	std::free(p);
+}
+
+__attribute__((noinline)) void
+operator delete(void *p, size_t) noexcept
+{
+	if(p)
+		live_bytes -= ::malloc_usable_size(p);
+	std::free(p);
+}
+
+int
+main(int argc, char **argv)
+{
+	auto counts = parse_list(argc > 1 ? argv[1] : "1000000,10000000,50000000");
+	auto callbacks = parse_list(argc > 2 ? argv[2] : "0,1,4");
+
+	for(auto k : callbacks)
+		breakdown(k);
+	std::cout << std::endl;
+
+	for(auto k : callbacks) {
+		/* Rough guess from a small run, so we can skip the ones that won't fit */
+		const size_t sample = 10000;
+		long used = 0;
+		{
+			auto before = snapshot::now();
+			std::vector<std::shared_ptr<future<int>>> futures;
+			for(size_t i = 0; i < sample; ++i) {
+				futures.push_back(future<int>::create_shared());
+				add_callbacks(*futures.back(), k);
+			}
+			used = snapshot::now().live - before.live;
+		}
+		const double estimate = used / (double)sample + 64;
+		for(auto n : counts) {
+			if(estimate * n > available() * 0.9) {
+				std::cout
+					<< n << " futures, " << k << " callback(s): skipped, needs about "
+					<< (size_t)(estimate * n / (1024 * 1024)) << "MiB" << std::endl;
+				continue;
+			}
+			run(n, k);
+			::malloc_trim(0);
+		}
+	}
+	return 0;
+}
+
@@ -0,0 +1,159 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/simulation.h>
+
+using namespace cps;
+
+/**
+ * Tail latency under a few request policies, run in virtual time.
+ *
+ * The simulated backend mostly answers in a couple of milliseconds, but one
+ * request in a hundred stalls for a couple of hundred. We compare sending a
+ * single request, retrying after a timeout, and hedging with a second request.
+ *
+ * Usage: latency_simulation [requests] [seed]
+ */
+
+namespace {
+
+using duration = scheduler::duration;
+
+/** Mostly lognormal around 2ms, with an occasional long stall */
+latency_injector::sampler
+backend_latency()
+{
+	std::lognormal_distribution<double> normal(std::log(2000.0), 0.4);
+	std::uniform_real_distribution<double> coin(0.0, 1.0);
+	return [normal, coin](std::mt19937_64 &rng) mutable -> duration {
+		double us = normal(rng);
+		if(coin(rng) < 0.01)
+			us += 200000.0;
+		return std::chrono::duration_cast<duration>(std::chrono::duration<double, std::micro>(us));
+	};
+}
+
+/** Resolves result from whichever attempt completes first */
+void
+race(std::shared_ptr<future<int>> result, std::shared_ptr<future<int>> attempt)
+{
+	attempt->on_ready([result](future<int> &f) {
+		if(result->is_pending() && f.is_done())
+			result->done(f.value());
+	});
+	result->on_ready([attempt](future<int> &) {
+		if(attempt->is_pending())
+			attempt->cancel();
+	});
+}
+
+std::shared_ptr<future<int>>
+plain(simulated_scheduler &, latency_injector &backend)
+{
+	return backend.respond(0);
+}
+
+std::shared_ptr<future<int>>
+timeout_retry(simulated_scheduler &sim, latency_injector &backend)
+{
+	auto result = future<int>::create_shared();
+	auto first = backend.respond(0);
+	race(result, first);
+	auto timer = sim.after(std::chrono::milliseconds(10));
+	timer->on_done([result, first, &backend](int) {
+		if(!result->is_pending())
+			return;
+		/* Give up on the first attempt entirely */
+		if(first->is_pending())
+			first->cancel();
+		race(result, backend.respond(0));
+	});
+	result->on_ready([timer](future<int> &) {
+		if(timer->is_pending())
+			timer->cancel();
+	});
+	return result;
+}
+
+std::shared_ptr<future<int>>
+hedged(simulated_scheduler &sim, latency_injector &backend)
+{
+	auto result = future<int>::create_shared();
+	race(result, backend.respond(0));
+	auto timer = sim.after(std::chrono::milliseconds(4));
+	timer->on_done([result, &backend](int) {
+		if(result->is_pending())
+			race(result, backend.respond(0));
+	});
+	result->on_ready([timer](future<int> &) {
+		if(timer->is_pending())
+			timer->cancel();
+	});
+	return result;
+}
+
+void
+simulate(
+	const char *name,
+	size_t count,
+	uint64_t seed,
+	std::shared_ptr<future<int>> (*policy)(simulated_scheduler &, latency_injector &)
+)
+{
+	auto wall = std::chrono::high_resolution_clock::now();
+	simulated_scheduler sim { seed };
+	latency_injector backend { sim, backend_latency() };
+	std::vector<duration> latencies;
+	latencies.reserve(count);
+
+	/* Poisson arrivals at 1000 requests per (virtual) second */
+	std::exponential_distribution<double> gap(1.0 / 1000.0);
+	auto when = sim.now();
+	for(size_t i = 0; i < count; ++i) {
+		when += std::chrono::duration_cast<duration>(std::chrono::duration<double, std::micro>(gap(sim.random())));
+		sim.schedule(when, [&sim, &backend, &latencies, policy]() {
+			auto issued = sim.now();
+			policy(sim, backend)->on_ready([&sim, &latencies, issued](future<int> &) {
+				latencies.push_back(sim.now() - issued);
+			});
+		});
+	}
+	size_t events = sim.run();
+
+	std::sort(latencies.begin(), latencies.end());
+	auto pct = [&latencies](double p) {
+		if(latencies.empty())
+			return 0.0;
+		auto idx = std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()));
+		return std::chrono::duration_cast<std::chrono::microseconds>(latencies[idx]).count() / 1000.0;
+	};
+	auto elapsed = std::chrono::high_resolution_clock::now() - wall;
+	std::cout
+		<< name << ": p50 " << pct(0.5) << "ms"
+		<< ", p99 " << pct(0.99) << "ms"
+		<< ", p99.9 " << pct(0.999) << "ms"
+		<< ", max " << pct(1.0) << "ms"
+		<< " (" << events << " events, "
+		<< std::chrono::duration_cast<std::chrono::seconds>(sim.now().time_since_epoch()).count() << "s simulated in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << "ms)"
+		<< std::endl;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+	const uint64_t seed = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1;
+	simulate("plain", count, seed, &plain);
+	simulate("timeout+retry", count, seed, &timeout_retry);
+	simulate("hedged", count, seed, &hedged);
+	return 0;
+}
+
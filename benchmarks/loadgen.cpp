@@ -0,0 +1,360 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+using namespace cps;
+
+/**
+ * Synthetic workload generator.
+ *
+ * Builds graphs of futures from a configurable mix of ->then, needs_all and
+ * needs_any, resolves the leaves from a set of threads, and reports how long
+ * each graph took to complete, how much allocation that cost and the peak RSS.
+ *
+ * Options (all --name=value):
+ *
+ *   --graphs     number of graphs to build and resolve (10000)
+ *   --batch      graphs resolved together per round (16)
+ *   --width      fan-out for needs_all/needs_any nodes (4)
+ *   --depth      maximum depth of each graph (4)
+ *   --then       relative weight of ->then nodes (6)
+ *   --all        relative weight of needs_all nodes (3)
+ *   --any        relative weight of needs_any nodes (1)
+ *   --fail       fraction of leaves which fail rather than complete (0)
+ *   --threads    threads resolving leaves (1)
+ *   --seed       random seed (1)
+ */
+
+namespace {
+
+std::atomic<size_t> allocations { 0 };
+std::atomic<size_t> allocated_bytes { 0 };
+
+struct options {
+	size_t graphs = 10000;
+	size_t batch = 16;
+	size_t width = 4;
+	size_t depth = 4;
+	double then_weight = 6;
+	double all_weight = 3;
+	double any_weight = 1;
+	double failure_rate = 0;
+	size_t threads = 1;
+	uint64_t seed = 1;
+};
+
+options
+parse(int argc, char **argv)
+{
+	options o;
+	for(int i = 1; i < argc; ++i) {
+		std::string arg { argv[i] };
+		auto eq = arg.find('=');
+		if(arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+			std::cerr << "Unexpected argument " << arg << ", expected --name=value" << std::endl;
+			std::exit(1);
+		}
+		auto name = arg.substr(2, eq - 2);
+		auto value = arg.substr(eq + 1);
+		if(name == "graphs") o.graphs = std::stoul(value);
+		else if(name == "batch") o.batch = std::stoul(value);
+		else if(name == "width") o.width = std::stoul(value);
+		else if(name == "depth") o.depth = std::stoul(value);
+		else if(name == "then") o.then_weight = std::stod(value);
+		else if(name == "all") o.all_weight = std::stod(value);
+		else if(name == "any") o.any_weight = std::stod(value);
+		else if(name == "fail") o.failure_rate = std::stod(value);
+		else if(name == "threads") o.threads = std::stoul(value);
+		else if(name == "seed") o.seed = std::stoull(value);
+		else {
+			std::cerr << "Unknown option " << name << std::endl;
+			std::exit(1);
+		}
+	}
+	if(!o.batch) o.batch = 1;
+	if(!o.threads) o.threads = 1;
+	if(!o.width) o.width = 1;
+	return o;
+}
+
+/** One leaf to resolve, and how */
+struct leaf {
+	std::shared_ptr<future<int>> f;
+	bool fails;
+};
+
+/** Builds random graphs and records their leaves */
+class graph_builder {
+public:
+	graph_builder(
+		const options &o,
+		std::mt19937_64 &rng
+	):o_(o),
+	  rng_(rng),
+	  kind_({ o.then_weight, o.all_weight, o.any_weight }),
+	  fail_(o.failure_rate),
+	  nodes_(0)
+	{
+	}
+
+	std::shared_ptr<future<int>>
+	build(std::vector<leaf> &leaves)
+	{
+		return node(o_.depth, leaves);
+	}
+
+	/** Total number of futures created by ->build so far, not counting library internals */
+	size_t nodes() const { return nodes_; }
+
+private:
+	std::shared_ptr<future<int>>
+	node(size_t depth, std::vector<leaf> &leaves)
+	{
+		++nodes_;
+		if(depth == 0) {
+			auto f = future<int>::create_shared();
+			leaves.push_back(leaf { f, fail_(rng_) });
+			return f;
+		}
+		switch(kind_(rng_)) {
+		case 0:
+			return node(depth - 1, leaves)->then([](int v) {
+				return resolved_future(v + 1);
+			});
+		case 1: {
+			std::vector<std::shared_ptr<future<int>>> children;
+			for(size_t i = 0; i < o_.width; ++i)
+				children.push_back(node(depth - 1, leaves));
+			return needs_all(children);
+		}
+		default: {
+			std::vector<std::shared_ptr<future<int>>> children;
+			for(size_t i = 0; i < o_.width; ++i)
+				children.push_back(node(depth - 1, leaves));
+			return needs_any(children);
+		}
+		}
+	}
+
+	const options &o_;
+	std::mt19937_64 &rng_;
+	std::discrete_distribution<int> kind_;
+	std::bernoulli_distribution fail_;
+	size_t nodes_;
+};
+
+/**
+ * Threads that resolve leaves. Each round hands out a list of leaves, and
+ * thread i takes every Nth one starting at i.
+ */
+class resolver_pool {
+public:
+	resolver_pool(
+		size_t count
+	):count_(count),
+	  generation_(0),
+	  remaining_(0),
+	  stopping_(false)
+	{
+		for(size_t i = 1; i < count_; ++i)
+			threads_.emplace_back([this, i] { worker(i); });
+	}
+
+	~resolver_pool() {
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			stopping_ = true;
+		}
+		start_.notify_all();
+		for(auto &t : threads_)
+			t.join();
+	}
+
+	/** Resolves all the given leaves, returning once every thread has finished */
+	void
+	resolve(const std::vector<leaf> &leaves)
+	{
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			leaves_ = &leaves;
+			remaining_ = count_ - 1;
+			++generation_;
+		}
+		start_.notify_all();
+		run(leaves, 0);
+		std::unique_lock<std::mutex> lock { mutex_ };
+		finished_.wait(lock, [this] { return remaining_ == 0; });
+	}
+
+private:
+	void
+	worker(size_t idx)
+	{
+		size_t seen = 0;
+		for(;;) {
+			const std::vector<leaf> *leaves;
+			{
+				std::unique_lock<std::mutex> lock { mutex_ };
+				start_.wait(lock, [this, seen] { return stopping_ || generation_ != seen; });
+				if(stopping_)
+					return;
+				seen = generation_;
+				leaves = leaves_;
+			}
+			run(*leaves, idx);
+			{
+				std::lock_guard<std::mutex> guard { mutex_ };
+				--remaining_;
+			}
+			finished_.notify_one();
+		}
+	}
+
+	void
+	run(const std::vector<leaf> &leaves, size_t idx)
+	{
+		for(size_t i = idx; i < leaves.size(); i += count_) {
+			if(leaves[i].fails)
+				leaves[i].f->fail("injected failure");
+			else
+				leaves[i].f->done(1);
+		}
+	}
+
+	size_t count_;
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable start_;
+	std::condition_variable finished_;
+	const std::vector<leaf> *leaves_;
+	size_t generation_;
+	size_t remaining_;
+	bool stopping_;
+};
+
+double
+percentile(std::vector<std::chrono::nanoseconds> &v, double p)
+{
+	if(v.empty())
+		return 0;
+	auto idx = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+	return v[idx].count() / 1000.0;
+}
+
+}
+
+/* Count every allocation. The deletes are kept out of line so that the
+ * compiler doesn't see malloc/free pairs through our replacement new.
+ */
+void *
+operator new(size_t size)
+{
+	++allocations;
+	allocated_bytes += size;
+	if(auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void
+operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+__attribute__((noinline)) void
+operator delete(void *p, size_t) noexcept
+{
+	std::free(p);
+}
+
+int
+main(int argc, char **argv)
+{
+	auto o = parse(argc, argv);
+	std::mt19937_64 rng { o.seed };
+	graph_builder builder { o, rng };
+	resolver_pool pool { o.threads };
+
+	std::vector<std::chrono::nanoseconds> latencies;
+	latencies.reserve(o.graphs);
+	size_t done = 0, failed = 0, cancelled = 0, leaf_count = 0;
+	std::chrono::nanoseconds build_time { 0 }, resolve_time { 0 };
+	const size_t alloc_start = allocations, bytes_start = allocated_bytes;
+
+	for(size_t n = 0; n < o.graphs; n += o.batch) {
+		std::vector<leaf> leaves;
+		std::vector<std::shared_ptr<future<int>>> roots;
+		auto start = std::chrono::steady_clock::now();
+		for(size_t i = 0; i < o.batch && n + i < o.graphs; ++i)
+			roots.push_back(builder.build(leaves));
+		/* Spread each graph's leaves across threads in a random order */
+		std::shuffle(leaves.begin(), leaves.end(), rng);
+		leaf_count += leaves.size();
+
+		auto ready = std::make_shared<std::vector<std::chrono::steady_clock::time_point>>(roots.size());
+		for(size_t i = 0; i < roots.size(); ++i) {
+			roots[i]->on_ready([ready, i](future<int> &) {
+				(*ready)[i] = std::chrono::steady_clock::now();
+			});
+		}
+		auto resolving = std::chrono::steady_clock::now();
+		build_time += resolving - start;
+		pool.resolve(leaves);
+		resolve_time += std::chrono::steady_clock::now() - resolving;
+
+		for(size_t i = 0; i < roots.size(); ++i) {
+			auto &r = roots[i];
+			if(r->is_done()) ++done;
+			else if(r->is_failed()) ++failed;
+			else if(r->is_cancelled()) ++cancelled;
+			if(r->is_ready())
+				latencies.push_back((*ready)[i] - resolving);
+		}
+	}
+
+	const size_t alloc_count = allocations - alloc_start;
+	const size_t alloc_bytes = allocated_bytes - bytes_start;
+	std::sort(latencies.begin(), latencies.end());
+	struct rusage usage;
+	::getrusage(RUSAGE_SELF, &usage);
+	auto total = build_time + resolve_time;
+
+	std::cout
+		<< "graphs: " << o.graphs
+		<< " (width " << o.width << ", depth " << o.depth
+		<< ", then/all/any " << o.then_weight << "/" << o.all_weight << "/" << o.any_weight
+		<< ", failure rate " << o.failure_rate
+		<< ", " << o.threads << " threads)" << std::endl
+		<< "nodes: " << builder.nodes() << ", leaves: " << leaf_count << std::endl
+		<< "outcome: " << done << " done, " << failed << " failed, " << cancelled << " cancelled, "
+		<< (o.graphs - done - failed - cancelled) << " still pending" << std::endl
+		<< "throughput: " << (o.graphs / (total.count() / 1e9)) << " graphs/s, "
+		<< (builder.nodes() / (total.count() / 1e9)) << " nodes/s" << std::endl
+		<< "build: " << (build_time.count() / 1e6) << "ms, resolve: " << (resolve_time.count() / 1e6) << "ms" << std::endl
+		<< "completion latency: p50 " << percentile(latencies, 0.5) << u8"µs"
+		<< ", p90 " << percentile(latencies, 0.9) << u8"µs"
+		<< ", p99 " << percentile(latencies, 0.99) << u8"µs"
+		<< ", p99.9 " << percentile(latencies, 0.999) << u8"µs"
+		<< ", max " << percentile(latencies, 1.0) << u8"µs" << std::endl
+		<< "allocations: " << alloc_count << " (" << (alloc_count / (double)builder.nodes()) << " per node), "
+		<< alloc_bytes << " bytes (" << (alloc_bytes / (double)builder.nodes()) << " per node)" << std::endl
+		<< "peak RSS: " << usage.ru_maxrss << " KiB" << std::endl;
+	return 0;
+}
+
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/rate_limiter.h>
+#include <cps/future/realtime.h>
+
+/**
+ * Overhead and accuracy of token_bucket.
+ *
+ * Overhead: threads hammer ->try_acquire on a bucket that never runs dry,
+ * so every call takes the lock-free fast path. The same loop over a
+ * straightforward mutex-protected bucket is the baseline.
+ *
+ * Accuracy: one producer issues acquires against a bucket refilling at
+ * the target rate, keeping a window of them outstanding, on a
+ * realtime_scheduler. Each acquire should be released when its token
+ * becomes available; we report how late that happens, the rate actually
+ * achieved, and how many timers and scheduler wakeups it took.
+ *
+ * Usage: rate_limiter [acquires] [rate per second] [burst] [threads]
+ */
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+std::chrono::microseconds
+cpu_time()
+{
+	struct rusage ru { };
+	::getrusage(RUSAGE_SELF, &ru);
+	return std::chrono::microseconds(
+		(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec
+	);
+}
+
+double
+percentile(std::vector<double> &v, double p)
+{
+	auto idx = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+	return v[idx];
+}
+
+/** The obvious bucket: refill on each call, under a lock */
+class mutex_bucket {
+public:
+	mutex_bucket(
+		double rate,
+		double burst
+	):rate_(rate),
+	  burst_(burst),
+	  tokens_(burst),
+	  last_(clock::now())
+	{
+	}
+
+	bool try_acquire(size_t n = 1) {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		auto now = clock::now();
+		tokens_ = std::min(burst_, tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+		last_ = now;
+		if(tokens_ < n)
+			return false;
+		tokens_ -= n;
+		return true;
+	}
+
+private:
+	std::mutex mutex_;
+	double rate_;
+	double burst_;
+	double tokens_;
+	clock::time_point last_;
+};
+
+template<typename Bucket>
+void
+overhead(const char *name, Bucket &bucket, size_t count, size_t threads)
+{
+	std::vector<std::thread> workers;
+	std::atomic<size_t> refused { 0 };
+	auto start = clock::now();
+	for(size_t t = 0; t < threads; ++t) {
+		workers.emplace_back([&bucket, &refused, count, threads] {
+			size_t r = 0;
+			for(size_t i = 0; i < count / threads; ++i)
+				r += !bucket.try_acquire();
+			refused += r;
+		});
+	}
+	for(auto &w : workers)
+		w.join();
+	auto elapsed = clock::now() - start;
+	std::cout
+		<< name << ", " << threads << " thread(s): "
+		<< std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (double)count << "ns/acquire"
+		<< " (" << refused << " refused)" << std::endl;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+	const double rate = argc > 2 ? std::strtod(argv[2], nullptr) : 1e6;
+	const double burst = argc > 3 ? std::strtod(argv[3], nullptr) : 100;
+	const size_t threads = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 4;
+
+	{
+		cps::realtime_scheduler sched;
+		for(size_t t : { size_t(1), threads }) {
+			cps::token_bucket bucket { sched, 1e9, 1e9 };
+			overhead("token_bucket::try_acquire", bucket, count * 10, t);
+			mutex_bucket baseline { 1e9, 1e9 };
+			overhead("mutex bucket", baseline, count * 10, t);
+		}
+	}
+
+	cps::realtime_scheduler sched;
+	cps::token_bucket bucket { sched, rate, burst };
+	const size_t window = 10000;
+	std::vector<clock::time_point> issued(count);
+	std::vector<clock::time_point> released(count);
+	std::atomic<size_t> remaining { count };
+	std::deque<std::shared_ptr<cps::future<int>>> outstanding;
+
+	auto cpu_start = cpu_time();
+	auto start = clock::now();
+	for(size_t i = 0; i < count; ++i) {
+		while(outstanding.size() >= window) {
+			if(outstanding.front()->is_pending())
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+			else
+				outstanding.pop_front();
+		}
+		issued[i] = clock::now();
+		auto f = bucket.acquire();
+		f->on_done([&released, &remaining, i](int) {
+			released[i] = clock::now();
+			--remaining;
+		});
+		outstanding.push_back(std::move(f));
+	}
+	while(remaining)
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	auto elapsed = clock::now() - start;
+	auto cpu = cpu_time() - cpu_start;
+
+	/* Token i is available at start + (i + 1 - burst) / rate, or when it was asked for if later */
+	std::vector<double> lag;
+	lag.reserve(count);
+	for(size_t i = 0; i < count; ++i) {
+		double offset = std::max(0.0, (i + 1 - burst) / rate);
+		auto due = std::max(issued[i], start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(offset)));
+		lag.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(released[i] - due).count() / 1000.0);
+	}
+	std::sort(lag.begin(), lag.end());
+	double seconds = std::chrono::duration<double>(elapsed).count();
+	double expected = std::max(0.0, (count - burst) / rate);
+
+	std::cout
+		<< "accuracy: " << count << " acquires at " << rate << "/s, burst " << burst << std::endl
+		<< "  " << seconds * 1000 << "ms wall, expected " << expected * 1000 << "ms"
+		<< " (" << (seconds - expected) / expected * 100 << "% over)"
+		<< ", achieved " << (count - burst) / seconds << "/s" << std::endl
+		<< "  " << cpu.count() * 1000.0 / count << "ns CPU/acquire"
+		<< ", " << bucket.timers() << " timers, " << sched.wakeups() << " scheduler wakeups" << std::endl
+		<< "  release lateness: p50 " << percentile(lag, 0.5) << u8"µs"
+		<< ", p99 " << percentile(lag, 0.99) << u8"µs"
+		<< ", max " << percentile(lag, 1.0) << u8"µs"
+		<< ", early " << percentile(lag, 0.0) << u8"µs" << std::endl;
+	return 0;
+}
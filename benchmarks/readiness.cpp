@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/readiness.h>
+
+/**
+ * Finding the ready few among many futures: walking them all and asking
+ * each ->is_ready, against a readiness_set.
+ *
+ * Each round resolves a handful of randomly chosen futures, finds them,
+ * and replaces them with fresh ones, the way a server would with the next
+ * read on each session that had data. The readiness_set is timed with
+ * whichever scan this CPU supports, and with the scalar one for
+ * comparison.
+ *
+ * Usage: readiness [futures] [ready per round] [rounds]
+ */
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+	const size_t per_round = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 16;
+	const size_t rounds = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 2000;
+
+	std::mt19937 rng { 42 };
+	std::uniform_int_distribution<size_t> pick { 0, count - 1 };
+	std::vector<std::vector<size_t>> chosen(rounds);
+	for(auto &c : chosen)
+		for(size_t i = 0; i < per_round; ++i)
+			c.push_back(pick(rng));
+
+	std::vector<std::shared_ptr<cps::future<int>>> futures(count);
+	for(auto &f : futures)
+		f = cps::future<int>::create_shared();
+
+	{
+		size_t found = 0;
+		clock::duration spent { };
+		for(auto &round : chosen) {
+			for(auto i : round)
+				if(futures[i]->is_pending())
+					futures[i]->done(1);
+			auto start = clock::now();
+			for(size_t i = 0; i < count; ++i) {
+				if(futures[i]->is_ready()) {
+					++found;
+					futures[i] = cps::future<int>::create_shared();
+				}
+			}
+			spent += clock::now() - start;
+		}
+		std::cout
+			<< "walking futures: " << found << " found, "
+			<< std::chrono::duration_cast<std::chrono::nanoseconds>(spent).count() / rounds / 1000.0
+			<< u8"µs per round" << std::endl;
+	}
+
+	{
+		cps::readiness_set set { count };
+		for(size_t i = 0; i < count; ++i) {
+			futures[i] = cps::future<int>::create_shared();
+			set.watch(i, futures[i]);
+		}
+		size_t found = 0;
+		clock::duration spent { };
+		std::vector<size_t> ready;
+		for(auto &round : chosen) {
+			for(auto i : round)
+				if(futures[i]->is_pending())
+					futures[i]->done(1);
+			ready.clear();
+			auto start = clock::now();
+			set.take(ready);
+			for(auto i : ready) {
+				futures[i] = cps::future<int>::create_shared();
+				set.watch(i, futures[i]);
+			}
+			spent += clock::now() - start;
+			found += ready.size();
+		}
+		std::cout
+			<< "readiness_set" << (cps::readiness_set::vectorized() ? " (AVX2)" : " (scalar)") << ": "
+			<< found << " found, "
+			<< std::chrono::duration_cast<std::chrono::nanoseconds>(spent).count() / rounds / 1000.0
+			<< u8"µs per round, " << set.notifications() << " notifications" << std::endl;
+	}
+
+	/* The scan on its own, each way, over the same bits */
+	using scan = void (*)(std::atomic<uint64_t> *, size_t, std::vector<size_t> &);
+	auto time_scan = [&](const char *name, scan fn) {
+		const size_t words = (count + 63) / 64;
+		std::unique_ptr<std::atomic<uint64_t>[]> bitmap(new std::atomic<uint64_t>[words]);
+		for(size_t w = 0; w < words; ++w)
+			bitmap[w] = 0;
+		size_t found = 0;
+		clock::duration spent { };
+		std::vector<size_t> ready;
+		for(auto &round : chosen) {
+			for(auto i : round)
+				bitmap[i / 64] |= uint64_t(1) << (i % 64);
+			ready.clear();
+			auto start = clock::now();
+			fn(bitmap.get(), words, ready);
+			spent += clock::now() - start;
+			found += ready.size();
+		}
+		std::cout
+			<< "  " << name << " scan: " << found << " found, "
+			<< std::chrono::duration_cast<std::chrono::nanoseconds>(spent).count() / rounds / 1000.0
+			<< u8"µs per round" << std::endl;
+	};
+	time_scan("scalar", [](std::atomic<uint64_t> *w, size_t n, std::vector<size_t> &out) {
+		cps::detail::scan_scalar(w, n, out);
+	});
+#if CPS_READINESS_AVX2
+	if(cps::readiness_set::vectorized())
+		time_scan("AVX2", cps::detail::scan_avx2);
+#endif
+	return 0;
+}
@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/trace.h>
+
+using namespace cps;
+
+/**
+ * Replays a recorded future graph against this build of the library.
+ *
+ * Record a trace by building an application with FUTURE_TRACE set to 1 and
+ * pointing cps::trace::record_to at a recorder. This tool then rebuilds the
+ * same graph - the same then/needs_all/needs_any edges - and resolves the
+ * externally-resolved futures at their recorded times from as many threads
+ * as the recording used.
+ *
+ * Usage: replay trace-file [--speed=1.0] [--threads=N]
+ *
+ * A speed of 0 ignores the recorded timing and resolves everything as fast
+ * as possible, which is the mode to use for regression benchmarks.
+ */
+
+namespace {
+
+/** A future from the trace, and how it came to be resolved */
+struct node {
+	enum class kind { leaf, then, needs_all, needs_any };
+	kind type = kind::leaf;
+	uint64_t created = 0;
+	bool resolved = false;
+	uint64_t resolved_at = 0;
+	uint32_t thread = 0;
+	trace::resolution state = trace::resolution::pending;
+	/** Source future for ->then, or inputs for needs_all/needs_any */
+	std::vector<size_t> inputs;
+	/** The future returned from the ->then callback, if we saw one */
+	long then_result = -1;
+	std::shared_ptr<future<int>> f;
+	bool building = false;
+};
+
+class graph {
+public:
+	explicit graph(const std::vector<trace::event> &events) {
+		for(auto &ev : events) {
+			switch(ev.type) {
+			case trace::event_type::created:
+				lookup(ev.id).created = ev.time;
+				break;
+			case trace::event_type::resolved: {
+				auto &n = lookup(ev.id);
+				n.resolved = true;
+				n.resolved_at = ev.time;
+				n.thread = ev.thread;
+				n.state = ev.state;
+				break;
+			}
+			case trace::event_type::linked: {
+				auto source = index(ev.id);
+				auto &target = lookup(ev.target);
+				switch(ev.kind) {
+				case trace::link::then:
+					target.type = node::kind::then;
+					target.inputs.push_back(source);
+					break;
+				case trace::link::then_result:
+					target.then_result = source;
+					break;
+				case trace::link::needs_all:
+					target.type = node::kind::needs_all;
+					target.inputs.push_back(source);
+					break;
+				case trace::link::needs_any:
+					target.type = node::kind::needs_any;
+					target.inputs.push_back(source);
+					break;
+				}
+				break;
+			}
+			}
+		}
+	}
+
+	/** Creates futures for every node, linking them up as recorded */
+	void build() {
+		for(size_t i = 0; i < nodes_.size(); ++i)
+			build(i);
+	}
+
+	std::vector<node> &nodes() { return nodes_; }
+
+private:
+	size_t index(uint64_t id) {
+		auto it = ids_.find(id);
+		if(it != ids_.end())
+			return it->second;
+		ids_.emplace(id, nodes_.size());
+		nodes_.emplace_back();
+		return nodes_.size() - 1;
+	}
+
+	node &lookup(uint64_t id) { return nodes_[index(id)]; }
+
+	std::shared_ptr<future<int>> build(size_t idx) {
+		auto &n = nodes_[idx];
+		if(n.f)
+			return n.f;
+		if(n.building)
+			throw std::runtime_error("cycle in trace graph");
+		n.building = true;
+		std::vector<std::shared_ptr<future<int>>> inputs;
+		for(auto i : n.inputs)
+			inputs.push_back(build(i));
+		/* nodes_ is not resized from here on, so references stay valid */
+		auto &self = nodes_[idx];
+		switch(self.type) {
+		case node::kind::leaf:
+			self.f = future<int>::create_shared();
+			break;
+		case node::kind::then: {
+			auto nodes = &nodes_;
+			long result = self.then_result;
+			self.f = inputs.front()->then([nodes, result](int) {
+				if(result < 0)
+					throw std::runtime_error("no result recorded for this ->then");
+				return (*nodes)[result].f;
+			});
+			break;
+		}
+		case node::kind::needs_all:
+			self.f = needs_all(inputs);
+			break;
+		case node::kind::needs_any:
+			self.f = needs_any(inputs);
+			break;
+		}
+		/* The ->then result must exist before anything resolves */
+		if(self.then_result >= 0)
+			build(self.then_result);
+		self.building = false;
+		return self.f;
+	}
+
+	std::vector<node> nodes_;
+	std::unordered_map<uint64_t, size_t> ids_;
+};
+
+double
+percentile(std::vector<double> &v, double p)
+{
+	if(v.empty())
+		return 0;
+	auto idx = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+	return v[idx];
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	if(argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " trace-file [--speed=1.0] [--threads=N]" << std::endl;
+		return 1;
+	}
+	double speed = 1.0;
+	size_t threads = 0;
+	for(int i = 2; i < argc; ++i) {
+		std::string arg { argv[i] };
+		if(arg.compare(0, 8, "--speed=") == 0)
+			speed = std::stod(arg.substr(8));
+		else if(arg.compare(0, 10, "--threads=") == 0)
+			threads = std::stoul(arg.substr(10));
+		else {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return 1;
+		}
+	}
+
+	std::ifstream in { argv[1], std::ios::binary };
+	if(!in) {
+		std::cerr << "Could not open " << argv[1] << std::endl;
+		return 1;
+	}
+	auto events = trace::read(in);
+	graph g { events };
+
+	auto build_start = std::chrono::steady_clock::now();
+	g.build();
+	auto built = std::chrono::steady_clock::now();
+	auto &nodes = g.nodes();
+
+	/* Externally-resolved futures are the leaves, grouped by the recorded thread */
+	uint32_t recorded_threads = 0;
+	size_t leaves = 0, derived = 0;
+	for(auto &n : nodes) {
+		if(n.resolved)
+			recorded_threads = std::max(recorded_threads, n.thread + 1);
+		if(n.type == node::kind::leaf) ++leaves; else ++derived;
+	}
+	if(!threads)
+		threads = std::max<uint32_t>(recorded_threads, 1);
+	std::vector<std::vector<size_t>> schedule(threads);
+	for(size_t i = 0; i < nodes.size(); ++i) {
+		if(nodes[i].type == node::kind::leaf && nodes[i].resolved)
+			schedule[nodes[i].thread % threads].push_back(i);
+	}
+	for(auto &s : schedule) {
+		std::sort(s.begin(), s.end(), [&nodes](size_t a, size_t b) {
+			return nodes[a].resolved_at < nodes[b].resolved_at;
+		});
+	}
+
+	/* Record when each derived future resolves during the replay */
+	std::vector<std::chrono::steady_clock::time_point> replayed(nodes.size());
+	for(size_t i = 0; i < nodes.size(); ++i) {
+		if(nodes[i].type == node::kind::leaf)
+			continue;
+		auto *slot = &replayed[i];
+		nodes[i].f->on_ready([slot](future<int> &) {
+			*slot = std::chrono::steady_clock::now();
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for(size_t t = 0; t < threads; ++t) {
+		workers.emplace_back([&nodes, &schedule, t, start, speed] {
+			for(auto idx : schedule[t]) {
+				auto &n = nodes[idx];
+				if(speed > 0)
+					std::this_thread::sleep_until(start + std::chrono::nanoseconds(static_cast<uint64_t>(n.resolved_at / speed)));
+				if(!n.f->is_pending())
+					continue;
+				switch(n.state) {
+				case trace::resolution::done: n.f->done(1); break;
+				case trace::resolution::failed: n.f->fail("replayed failure"); break;
+				case trace::resolution::cancelled: n.f->cancel(); break;
+				default: break;
+				}
+			}
+		});
+	}
+	for(auto &w : workers)
+		w.join();
+	auto elapsed = std::chrono::steady_clock::now() - start;
+
+	/* Compare with the recording: did the same futures end up in the same states, and how late were they? */
+	size_t mismatched = 0;
+	std::vector<double> lag;
+	for(size_t i = 0; i < nodes.size(); ++i) {
+		auto &n = nodes[i];
+		if(n.type == node::kind::leaf)
+			continue;
+		auto state = n.f->is_done() ? trace::resolution::done
+			: n.f->is_failed() ? trace::resolution::failed
+			: n.f->is_cancelled() ? trace::resolution::cancelled
+			: trace::resolution::pending;
+		if(state != n.state)
+			++mismatched;
+		if(n.resolved && n.f->is_ready() && speed > 0) {
+			auto expected = start + std::chrono::nanoseconds(static_cast<uint64_t>(n.resolved_at / speed));
+			lag.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(replayed[i] - expected).count() / 1000.0);
+		}
+	}
+	std::sort(lag.begin(), lag.end());
+
+	auto ms = [](std::chrono::steady_clock::duration d) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0;
+	};
+	std::cout
+		<< "trace: " << events.size() << " events, " << nodes.size() << " futures ("
+		<< leaves << " leaves, " << derived << " derived), " << recorded_threads << " resolving threads" << std::endl
+		<< "build: " << ms(built - build_start) << "ms" << std::endl
+		<< "replay: " << ms(elapsed) << "ms on " << threads << " threads";
+	if(speed > 0)
+		std::cout << " (recorded " << (events.empty() ? 0 : events.back().time / 1e6) << "ms at speed " << speed << ")";
+	else
+		std::cout << ", " << (nodes.size() / (std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1e9)) << " futures/s";
+	std::cout << std::endl;
+	if(speed > 0)
+		std::cout
+			<< "derived future lag vs recording: p50 " << percentile(lag, 0.5) << u8"µs"
+			<< ", p99 " << percentile(lag, 0.99) << u8"µs"
+			<< ", max " << percentile(lag, 1.0) << u8"µs" << std::endl;
+	std::cout
+		<< "derived futures ending in a different state: " << mismatched << std::endl;
+	return 0;
+}
+
@@ -0,0 +1,135 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/server.h>
+
+/**
+ * Connection setup rate over loopback for sharded_server, and how evenly
+ * SO_REUSEPORT spreads connections across the shards.
+ *
+ * Client threads each connect, send a byte, wait for it to come back and
+ * close, over and over, so every request is a fresh connection and the
+ * accept path is what's being measured. This is run with one shard, then
+ * with the number asked for.
+ *
+ * Usage: server [shards] [client threads] [connections per client]
+ */
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+/** One byte back, then done with the connection */
+std::shared_ptr<cps::future<int>>
+pong(const cps::accepted_connection &c)
+{
+	auto finished = cps::future<int>::create_shared();
+	c.io.recv(c.fd)->on_ready([c, finished](cps::future<cps::buffer> &got) {
+		if(!got.is_done()) {
+			finished->done(0);
+			return;
+		}
+		c.io.send(c.fd, got.value())->on_ready([finished](cps::future<size_t> &) {
+			finished->done(0);
+		});
+	});
+	return finished;
+}
+
+bool
+ping(uint16_t port)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int one = 1;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	/* Close with a reset, so we don't run out of ports to TIME_WAIT */
+	struct linger l { 1, 0 };
+	::setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	struct sockaddr_in addr { };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	bool ok = false;
+	char c = 'x';
+	if(::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0 && ::send(fd, &c, 1, 0) == 1) {
+		ssize_t n;
+		while((n = ::recv(fd, &c, 1, 0)) < 0 && errno == EINTR)
+			;
+		ok = n == 1;
+	}
+	::close(fd);
+	return ok;
+}
+
+void
+run(size_t shards, size_t clients, size_t per_client)
+{
+	cps::server_options opts;
+	opts.address = "127.0.0.1";
+	opts.shards = shards;
+	cps::sharded_server server { opts, pong };
+
+	std::atomic<size_t> failed { 0 };
+	auto start = clock::now();
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < clients; ++t)
+		threads.emplace_back([&] {
+			for(size_t i = 0; i < per_client; ++i)
+				if(!ping(server.port()))
+					++failed;
+		});
+	for(auto &t : threads)
+		t.join();
+	double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+	size_t total = 0, most = 0, least = SIZE_MAX;
+	for(size_t i = 0; i < server.shards(); ++i) {
+		size_t n = server.accepted(i);
+		total += n;
+		most = std::max(most, n);
+		least = std::min(least, n);
+	}
+	std::cout << shards << " shard(s): "
+		<< static_cast<size_t>(static_cast<double>(total) / seconds) << " connections/s";
+	if(failed)
+		std::cout << ", " << failed << " failed";
+	std::cout << std::endl << "  per shard:";
+	for(size_t i = 0; i < server.shards(); ++i)
+		std::cout << " " << server.accepted(i) << " (cpu " << server.cpu(i) << ")";
+	std::cout << std::endl;
+	if(shards > 1)
+		std::cout << "  busiest/quietest: " << static_cast<double>(most) / static_cast<double>(std::max<size_t>(least, 1))
+			<< ", busiest/mean: " << static_cast<double>(most) * static_cast<double>(shards) / static_cast<double>(total)
+			<< std::endl;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t shards = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::max(2u, std::thread::hardware_concurrency());
+	const size_t clients = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+	const size_t per_client = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 5000;
+
+	std::cout << clients << " client threads, " << per_client << " connections each" << std::endl;
+	run(1, clients, per_client);
+	run(shards, clients, per_client);
+	return 0;
+}
@@ -0,0 +1,170 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/socket_io.h>
+
+/**
+ * Loopback echo: requests per second, and system calls the server makes
+ * per request, for each socket_io backend.
+ *
+ * The server runs on a reactor and echoes whatever it receives. A client
+ * thread opens a number of connections and keeps one small request in
+ * flight on each, reading the echo back before sending the next. System
+ * calls are counted by the server - the reactor's own plus the backend's
+ * - so the client's are left out.
+ *
+ * Usage: socket_io [connections] [requests per connection] [request size]
+ */
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+int
+listen_loopback(uint16_t &port)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int one = 1;
+	::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr { };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(fd, 1024) != 0) {
+		std::perror("listen");
+		std::exit(1);
+	}
+	socklen_t len = sizeof(addr);
+	::getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &len);
+	port = ntohs(addr.sin_port);
+	return fd;
+}
+
+int
+connect_loopback(uint16_t port)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int one = 1;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	struct sockaddr_in addr { };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if(::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+		std::perror("connect");
+		std::exit(1);
+	}
+	return fd;
+}
+
+/** Echoes everything on one connection, until the peer goes away */
+void
+echo(cps::socket_io &io, int fd)
+{
+	io.recv(fd)->on_ready([&io, fd](cps::future<cps::buffer> &f) {
+		if(!f.is_done()) {
+			io.close(fd);
+			return;
+		}
+		io.send(fd, f.value());
+		echo(io, fd);
+	});
+}
+
+void
+serve(cps::socket_io &io, int listener)
+{
+	io.accept(listener)->on_ready([&io, listener](cps::future<int> &f) {
+		if(!f.is_done())
+			return;
+		echo(io, f.value());
+		serve(io, listener);
+	});
+}
+
+void
+run(cps::io_backend backend, size_t connections, size_t requests, size_t size)
+{
+	cps::reactor loop;
+	auto io = cps::make_socket_io(loop, backend);
+	uint16_t port;
+	int listener = listen_loopback(port);
+	serve(*io, listener);
+
+	clock::duration spent { };
+	size_t before = 0;
+	std::thread client { [&] {
+		std::vector<int> fds;
+		for(size_t i = 0; i < connections; ++i)
+			fds.push_back(connect_loopback(port));
+		std::vector<char> out(size, 'x'), in(size);
+		/* One warm-up round, so the server has accepted everyone before we start counting */
+		auto round = [&] {
+			for(auto fd : fds)
+				if(::send(fd, out.data(), size, 0) != static_cast<ssize_t>(size))
+					std::exit(1);
+			for(auto fd : fds)
+				for(size_t got = 0; got < size; ) {
+					auto n = ::recv(fd, in.data() + got, size - got, 0);
+					if(n <= 0)
+						std::exit(1);
+					got += static_cast<size_t>(n);
+				}
+		};
+		round();
+		loop.post([&] { before = loop.syscalls() + io->syscalls(); });
+		auto start = clock::now();
+		for(size_t r = 0; r < requests; ++r)
+			round();
+		spent = clock::now() - start;
+		for(auto fd : fds)
+			::close(fd);
+		loop.stop();
+	} };
+	loop.run();
+	client.join();
+	size_t calls = loop.syscalls() + io->syscalls() - before;
+
+	double seconds = std::chrono::duration<double>(spent).count();
+	double total = static_cast<double>(connections * requests);
+	std::cout << io->name() << ": "
+		<< static_cast<size_t>(total / seconds) << " requests/s, "
+		<< static_cast<double>(calls) / total << " server syscalls/request"
+		<< std::endl;
+	io.reset();
+	::close(listener);
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t connections = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+	const size_t requests = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2000;
+	const size_t size = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 64;
+
+	std::cout << connections << " connections, " << requests << " requests each, " << size << " bytes" << std::endl;
+	run(cps::io_backend::epoll, connections, requests, size);
+#if CPS_HAVE_IO_URING
+	if(cps::uring_socket_io::supported()) {
+		run(cps::io_backend::io_uring, connections, requests, size);
+		return 0;
+	}
+#endif
+	std::cout << "io_uring: not available" << std::endl;
+	return 0;
+}
@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/std_future.h>
+
+/**
+ * Cost of turning std::future into cps::future, with N bridged futures
+ * outstanding at once.
+ *
+ * A producer thread fulfils the promises in order, pausing briefly after
+ * each batch so the bridge sees a steady trickle rather than one burst.
+ * We report CPU time per future for the whole process, and the delay
+ * between set_value and the cps::future's callback.
+ *
+ * The poller is compared against the obvious approach of one thread per
+ * std::future blocked in ->get, if the system lets us start that many.
+ *
+ * Usage: std_future_bridge [concurrent futures] [batch size] [pause between batches in µs]
+ */
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+/** User plus system CPU time for the process so far */
+std::chrono::microseconds
+cpu_time()
+{
+	struct rusage ru { };
+	::getrusage(RUSAGE_SELF, &ru);
+	return std::chrono::microseconds(
+		(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec
+	);
+}
+
+double
+percentile(std::vector<double> &v, double p)
+{
+	auto idx = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+	return v[idx];
+}
+
+/**
+ * Runs one bridging strategy. The bridge callback turns a std::future into
+ * a cps::future and may throw std::system_error if it can't keep up.
+ */
+template<typename F>
+void
+run(const char *name, size_t count, size_t batch, std::chrono::microseconds pause, F bridge)
+{
+	std::vector<std::promise<int>> promises(count);
+	std::vector<clock::time_point> fulfilled(count);
+	std::vector<clock::time_point> seen(count);
+	std::atomic<size_t> remaining { count };
+	std::vector<std::shared_ptr<cps::future<int>>> bridged;
+	bridged.reserve(count);
+
+	auto cpu_start = cpu_time();
+	auto start = clock::now();
+	try {
+		for(size_t i = 0; i < count; ++i) {
+			auto f = bridge(promises[i].get_future());
+			f->on_done([&seen, &remaining, i](int) {
+				seen[i] = clock::now();
+				--remaining;
+			});
+			bridged.push_back(std::move(f));
+		}
+	} catch(const std::system_error &e) {
+		std::cout << name << ": gave up after " << bridged.size() << " futures (" << e.what() << ")" << std::endl;
+		/* Let anything we did start finish, so the threads can exit */
+		for(size_t i = 0; i < count; ++i)
+			promises[i].set_value(0);
+		while(remaining > count - bridged.size())
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		return;
+	}
+	auto setup = clock::now();
+
+	std::thread producer([&] {
+		for(size_t i = 0; i < count; ++i) {
+			fulfilled[i] = clock::now();
+			promises[i].set_value(static_cast<int>(i));
+			if((i + 1) % batch == 0)
+				std::this_thread::sleep_for(pause);
+		}
+	});
+	producer.join();
+	while(remaining)
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	auto elapsed = clock::now() - start;
+	auto cpu = cpu_time() - cpu_start;
+
+	std::vector<double> lag;
+	lag.reserve(count);
+	for(size_t i = 0; i < count; ++i)
+		lag.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(seen[i] - fulfilled[i]).count() / 1000.0);
+	std::sort(lag.begin(), lag.end());
+
+	std::cout
+		<< name << ": " << count << " futures, "
+		<< std::chrono::duration_cast<std::chrono::nanoseconds>(setup - start).count() / (double)count << "ns setup/future, "
+		<< cpu.count() / (double)count << u8"µs CPU/future, "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << "ms wall" << std::endl
+		<< "  fulfil to callback: p50 " << percentile(lag, 0.5) << u8"µs"
+		<< ", p99 " << percentile(lag, 0.99) << u8"µs"
+		<< ", max " << percentile(lag, 1.0) << u8"µs" << std::endl;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+	const size_t batch = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100;
+	const std::chrono::microseconds pause { argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 1000 };
+
+	{
+		cps::std_future_poller poller;
+		run("shared poller", count, batch, pause, [&poller](std::future<int> f) {
+			return poller.watch(std::move(f));
+		});
+		std::cout << "  " << poller.rounds() << " polling rounds" << std::endl;
+	}
+
+	std::vector<std::thread> threads;
+	threads.reserve(count);
+	run("thread per future", count, batch, pause, [&threads](std::future<int> f) {
+		auto out = cps::future<int>::create_shared();
+		auto source = std::make_shared<std::future<int>>(std::move(f));
+		threads.emplace_back([out, source] {
+			out->done(source->get());
+		});
+		return out;
+	});
+	for(auto &t : threads)
+		t.join();
+	return 0;
+}
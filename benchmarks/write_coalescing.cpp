@@ -0,0 +1,133 @@
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/write_queue.h>
+
+using namespace cps;
+
+/**
+ * Compares one write() per 64-byte message against write_queue coalescing,
+ * over a unix socket pair with a reader thread draining the other end.
+ *
+ * Usage: write_coalescing [messages] [messages per loop iteration]
+ */
+
+namespace {
+
+const size_t message_size = 64;
+
+/** Reads until we've seen the expected number of bytes */
+std::thread
+start_reader(int fd, size_t expected)
+{
+	return std::thread([fd, expected] {
+		char buf[65536];
+		size_t total = 0;
+		while(total < expected) {
+			auto n = ::read(fd, buf, sizeof(buf));
+			if(n <= 0)
+				break;
+			total += n;
+		}
+	});
+}
+
+void
+report(const char *name, size_t count, size_t syscalls, std::chrono::nanoseconds elapsed)
+{
+	double secs = elapsed.count() / 1e9;
+	std::cout
+		<< name << ": "
+		<< count << " messages, "
+		<< (syscalls / (double)count) << " syscalls/message, "
+		<< (count / secs) << " messages/s, "
+		<< (count * message_size / secs / (1024 * 1024)) << " MiB/s"
+		<< std::endl;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+	const size_t batch = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 32;
+	const std::string payload(message_size, 'x');
+
+	{
+		int fds[2];
+		::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+		::fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		auto reader = start_reader(fds[1], count * message_size);
+		size_t syscalls = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for(size_t i = 0; i < count; ++i) {
+			auto f = future<size_t>::create_shared();
+			for(;;) {
+				++syscalls;
+				auto n = ::send(fds[0], payload.data(), payload.size(), MSG_NOSIGNAL);
+				if(n == (ssize_t)payload.size())
+					break;
+				/* Keep it simple: wait for space and retry the whole message */
+				struct pollfd p { fds[0], POLLOUT, 0 };
+				++syscalls;
+				::poll(&p, 1, -1);
+			}
+			f->done(payload.size());
+		}
+		reader.join();
+		report("write per message", count, syscalls, std::chrono::high_resolution_clock::now() - start);
+		::close(fds[0]);
+		::close(fds[1]);
+	}
+
+	{
+		int fds[2];
+		::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+		::fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		auto reader = start_reader(fds[1], count * message_size);
+		reactor loop;
+		size_t iterations = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		{
+			write_queue q { loop, fds[0] };
+			auto message = buffer::copy(payload);
+			size_t completed = 0;
+			for(size_t i = 0; i < count; ) {
+				for(size_t j = 0; j < batch && i < count; ++j, ++i) {
+					q.send(message)->on_done([&completed](size_t) { ++completed; });
+				}
+				loop.run_once(0);
+				++iterations;
+			}
+			while(completed < count) {
+				loop.run_once(-1);
+				++iterations;
+			}
+			reader.join();
+			/* The reactor counts its own epoll_wait and epoll_ctl calls */
+			report("write_queue", count, q.write_calls() + loop.syscalls(), std::chrono::high_resolution_clock::now() - start);
+			std::cout
+				<< "  (" << q.write_calls() << " sendmsg calls, "
+				<< loop.syscalls() << " reactor calls over "
+				<< iterations << " iterations, "
+				<< batch << " messages per iteration)"
+				<< std::endl;
+		}
+		loop.remove(fds[0]);
+		::close(fds[0]);
+		::close(fds[1]);
+	}
+	return 0;
+}
+
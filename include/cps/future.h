@@ -17,6 +17,16 @@
  */
 // #define UNCAUGHT_EXCEPTION_DEBUGGING
 
+/**
+ * Set this to 1 to build in the trace hooks from cps/future/trace.h:
+ * every future gets a trace ID, and creation, linking and resolution are
+ * reported to the active trace recorder. It changes the layout of
+ * cps::future, so every translation unit in a program must agree on it.
+ */
+#ifndef FUTURE_TRACE
+#define FUTURE_TRACE 0
+#endif
+
 #include <cps/future/error_code.h>
 #include <cps/future/is_string.h>
 #include <cps/future/implementation.h>
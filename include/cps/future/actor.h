@@ -0,0 +1,242 @@
+#pragma once
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#include <cps/future.h>
+#include <cps/future/executor.h>
+
+namespace cps {
+
+/**
+ * Multiple-producer, single-consumer queue, without locks.
+ *
+ * This is the intrusive queue described by Dmitry Vyukov: producers swing
+ * the head pointer with a single exchange and then link the previous node
+ * to theirs; the consumer follows next pointers from the tail. A push is
+ * wait-free. A pop can see a push that is halfway done - head swung but
+ * link not yet written - and reports the queue empty in that case, so
+ * callers that know an item is there (see actor) wait for the link.
+ *
+ * Any number of threads may push; only one may pop at a time.
+ */
+template<typename T>
+class mpsc_queue {
+public:
+	mpsc_queue(
+	):head_(&stub_),
+	  tail_(&stub_)
+	{
+		stub_.next.store(nullptr, std::memory_order_relaxed);
+	}
+
+	mpsc_queue(const mpsc_queue &) = delete;
+	mpsc_queue &operator=(const mpsc_queue &) = delete;
+
+	~mpsc_queue() {
+		T v;
+		while(pop(v))
+			;
+	}
+
+	void push(T v) {
+		auto *n = new node;
+		n->value = std::move(v);
+		n->next.store(nullptr, std::memory_order_relaxed);
+		auto *prev = head_.exchange(n, std::memory_order_acq_rel);
+		prev->next.store(n, std::memory_order_release);
+	}
+
+	/** Takes the oldest item, returning false if there's nothing (yet) */
+	bool pop(T &out) {
+		node *tail = tail_;
+		node *next = tail->next.load(std::memory_order_acquire);
+		if(tail == &stub_) {
+			if(!next)
+				return false;
+			/* Step past the stub */
+			tail_ = tail = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if(next) {
+			tail_ = next;
+			out = std::move(tail->value);
+			delete tail;
+			return true;
+		}
+		/* tail is the last node: put the stub back behind it so we can take it */
+		if(tail != head_.load(std::memory_order_acquire))
+			return false;
+		stub_.next.store(nullptr, std::memory_order_relaxed);
+		auto *prev = head_.exchange(&stub_, std::memory_order_acq_rel);
+		prev->next.store(&stub_, std::memory_order_release);
+		next = tail->next.load(std::memory_order_acquire);
+		if(!next)
+			return false;
+		tail_ = next;
+		out = std::move(tail->value);
+		delete tail;
+		return true;
+	}
+
+private:
+	struct node {
+		std::atomic<node *> next;
+		T value;
+	};
+
+	std::atomic<node *> head_;
+	/* Only the consumer touches this */
+	node *tail_;
+	node stub_;
+};
+
+/**
+ * A handler with a mailbox: messages are processed one at a time, in the
+ * order each sender sent them, on the given executor.
+ *
+ * ->tell queues a message; ->ask does the same and returns a future for the
+ * handler's reply, which fails if the handler throws. The mailbox is an
+ * mpsc_queue, and a counter of queued messages decides who schedules the
+ * actor: whoever takes it from zero posts a drain to the executor. So an
+ * idle actor holds no thread and costs nothing but its memory, and a busy
+ * one runs up to `batch` messages per visit to the executor before
+ * posting itself again, which keeps one chatty actor from starving the
+ * others sharing a pool.
+ *
+ *     actor<int, size_t> counter { pool, [total = size_t(0)](int n) mutable {
+ *         return total += n;
+ *     } };
+ *     counter.tell(3);
+ *     counter.ask(4)->on_done([](size_t total) { ... });
+ *
+ * The handler is only ever running on one thread at a time, so the state
+ * it captures needs no locking. Any thread may ->tell or ->ask. Destroying
+ * the actor doesn't lose messages: anything queued is still handled.
+ */
+template<typename Message, typename Reply = int>
+class actor {
+public:
+	using handler = std::function<Reply(Message &)>;
+
+	actor(
+		executor &exec,
+		handler code,
+		size_t batch = 64
+	):state_(std::make_shared<shared_state>(exec, std::move(code), batch))
+	{
+	}
+
+	actor(const actor &) = delete;
+	actor &operator=(const actor &) = delete;
+
+	/** Queues a message, ignoring the reply */
+	void tell(Message m) {
+		shared_state::send(state_, envelope { std::move(m), nullptr });
+	}
+
+	/** Queues a message, returning a future for the reply */
+	std::shared_ptr<future<Reply>> ask(Message m) {
+		auto reply = future<Reply>::create_shared(u8"actor::ask");
+		shared_state::send(state_, envelope { std::move(m), reply });
+		return reply;
+	}
+
+	/** Messages waiting, including any being handled right now */
+	size_t queued() const { return state_->pending.load(std::memory_order_relaxed); }
+
+	/** Number of times the actor has been posted to its executor */
+	size_t activations() const { return state_->activations.load(std::memory_order_relaxed); }
+
+private:
+	struct envelope {
+		Message message;
+		std::shared_ptr<future<Reply>> reply;
+	};
+
+	struct shared_state {
+		shared_state(
+			executor &exec,
+			handler code,
+			size_t batch
+		):exec(exec),
+		  code(std::move(code)),
+		  batch(batch ? batch : 1),
+		  pending(0),
+		  activations(0)
+		{
+		}
+
+		static void send(const std::shared_ptr<shared_state> &self, envelope e) {
+			self->mailbox.push(std::move(e));
+			/* Whoever takes us off zero schedules the drain */
+			if(self->pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+				schedule(self);
+		}
+
+		static void schedule(const std::shared_ptr<shared_state> &self) {
+			self->activations.fetch_add(1, std::memory_order_relaxed);
+			self->exec.post([self] { drain(self); });
+		}
+
+		static void drain(const std::shared_ptr<shared_state> &self) {
+			size_t n = 0;
+			envelope e;
+			for(; n < self->batch; ++n) {
+				/* The counter says there's a message, but its sender may not have
+				 * finished linking it in yet: that's a couple of instructions away */
+				while(!self->mailbox.pop(e))
+					std::this_thread::yield();
+				try {
+					handle(*self, e);
+				} catch(...) {
+					/* A reply's own callbacks threw: that's no reason to stop the actor */
+				}
+				e = envelope { };
+				if(self->pending.load(std::memory_order_acquire) == n + 1) {
+					++n;
+					break;
+				}
+			}
+			/* Anything sent meanwhile is ours to run, but give the executor a turn first */
+			if(self->pending.fetch_sub(n, std::memory_order_acq_rel) > n)
+				schedule(self);
+		}
+
+		static void handle(shared_state &self, envelope &e) {
+			if(!e.reply) {
+				try {
+					self.code(e.message);
+				} catch(...) {
+					/* Nobody asked, so nobody to tell */
+				}
+				return;
+			}
+			Reply r;
+			try {
+				r = self.code(e.message);
+			} catch(...) {
+				/* The asker may have cancelled meanwhile */
+				if(e.reply->is_pending())
+					e.reply->fail_exception_pointer(std::current_exception());
+				return;
+			}
+			if(e.reply->is_pending())
+				e.reply->done(std::move(r));
+		}
+
+		executor &exec;
+		handler code;
+		const size_t batch;
+		mpsc_queue<envelope> mailbox;
+		std::atomic<size_t> pending;
+		std::atomic<size_t> activations;
+	};
+
+	std::shared_ptr<shared_state> state_;
+};
+
+};
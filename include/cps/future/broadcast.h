@@ -0,0 +1,384 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/source.h>
+
+namespace cps {
+
+/** What a broadcast subscriber does when it falls more than a ring's worth behind */
+enum class lag_policy {
+	/** Lose the items that were overwritten, and carry on from the oldest one left */
+	drop,
+	/** Lose the whole backlog, and carry on from the newest item */
+	skip_to_latest,
+	/** Hold up the publisher until this subscriber has caught up */
+	backpressure
+};
+
+/**
+ * One publisher, many subscribers, each seeing every item - over a single
+ * shared ring rather than a queue per subscriber.
+ *
+ * Items are written once into a ring of `capacity` slots. Each subscriber
+ * is just a cursor into it: ->next returns a future for the item at the
+ * cursor, resolved straight away if it has been published, otherwise when
+ * it is. So ->publish writes one slot and hands the item to subscribers
+ * already waiting for it; subscribers that are behind cost it nothing.
+ * Each subscriber gets its own copy of the item, so for large items
+ * publish a std::shared_ptr<const X>.
+ *
+ * A subscriber that falls more than `capacity` items behind is dealt with
+ * according to its lag_policy. drop and skip_to_latest subscribers lose
+ * items, counted by ->missed. backpressure subscribers don't: the publish
+ * that would overwrite an item they haven't read stays pending until they
+ * do, exactly like a full channel.
+ *
+ *     broadcast<quote> quotes { 1024 };
+ *     auto ui = quotes.subscribe(lag_policy::skip_to_latest);
+ *     auto recorder = quotes.subscribe(lag_policy::backpressure);
+ *     quotes.publish(q)->on_done([](int) { ... });
+ *     ui->next()->on_done([](quote q) { ... });
+ *
+ * A new subscriber sees items published after it subscribed. After
+ * ->close, or once the broadcast is destroyed, publishes fail and
+ * subscribers get end_of_stream once they've read what's left. Any thread
+ * may publish, subscribe or read; call ->next on one subscriber from one
+ * thread at a time.
+ */
+template<typename T>
+class broadcast {
+private:
+	struct cursor_state;
+	struct shared_state;
+
+public:
+	/** A cursor into the broadcast, taking items one future at a time */
+	class subscriber {
+	public:
+		subscriber(
+			std::shared_ptr<shared_state> channel,
+			std::shared_ptr<cursor_state> cursor
+		):channel_(std::move(channel)),
+		  cursor_(std::move(cursor))
+		{
+		}
+
+		subscriber(const subscriber &) = delete;
+		subscriber &operator=(const subscriber &) = delete;
+
+		/** Stops following the broadcast, cancelling anything still waiting */
+		~subscriber() {
+			channel_->unsubscribe(cursor_);
+		}
+
+		/** Returns a future for the next item */
+		std::shared_ptr<future<T>> next() {
+			return channel_->next(cursor_);
+		}
+
+		/** Items published which this subscriber hasn't read yet */
+		uint64_t lag() const {
+			std::lock_guard<std::mutex> guard { channel_->mutex };
+			return channel_->head - cursor_->position;
+		}
+
+		/** Items this subscriber lost by falling behind */
+		uint64_t missed() const {
+			std::lock_guard<std::mutex> guard { channel_->mutex };
+			return cursor_->missed;
+		}
+
+		lag_policy policy() const { return cursor_->policy; }
+
+		/** Returns the subscriber as an async_source, ending when the broadcast is closed */
+		static async_source<T> as_source(std::shared_ptr<subscriber> sub) {
+			return [sub] { return sub->next(); };
+		}
+
+	private:
+		std::shared_ptr<shared_state> channel_;
+		std::shared_ptr<cursor_state> cursor_;
+	};
+
+	explicit broadcast(
+		size_t capacity
+	):state_(std::make_shared<shared_state>(capacity ? capacity : 1))
+	{
+	}
+
+	broadcast(const broadcast &) = delete;
+	broadcast &operator=(const broadcast &) = delete;
+
+	/** Closes the broadcast; subscribers may outlive it, and read what's left */
+	virtual ~broadcast() {
+		close();
+	}
+
+	/** Starts following the broadcast from the next item published */
+	std::shared_ptr<subscriber> subscribe(lag_policy policy = lag_policy::drop) {
+		auto cursor = std::make_shared<cursor_state>(policy);
+		{
+			std::lock_guard<std::mutex> guard { state_->mutex };
+			cursor->position = state_->head;
+			if(policy == lag_policy::backpressure)
+				++state_->pinned_at_head;
+			++state_->subscribers;
+		}
+		return std::make_shared<subscriber>(state_, cursor);
+	}
+
+	/**
+	 * Publishes an item. The future resolves once it is in the ring - at
+	 * once unless a backpressure subscriber is a whole ring behind - and
+	 * fails if the broadcast is or becomes closed first.
+	 */
+	std::shared_ptr<future<int>> publish(T v) {
+		auto accepted = future<int>::create_shared(u8"broadcast::publish");
+		deliveries out;
+		{
+			std::lock_guard<std::mutex> guard { state_->mutex };
+			if(state_->closed)
+				return accepted->fail("broadcast is closed");
+			if(!state_->publishers.empty() || state_->pins[state_->slot(state_->head)] > 0) {
+				state_->publishers.emplace_back(std::move(v), accepted);
+				return accepted;
+			}
+			state_->write(std::move(v), out);
+		}
+		out.resolve();
+		return accepted->done(0);
+	}
+
+	/** Stops accepting items. Subscribers can still read what's in the ring. */
+	void close() {
+		std::vector<std::shared_ptr<future<T>>> readers;
+		std::vector<std::shared_ptr<future<int>>> publishers;
+		{
+			std::lock_guard<std::mutex> guard { state_->mutex };
+			if(state_->closed)
+				return;
+			state_->closed = true;
+			for(auto &c : state_->waiting) {
+				for(auto &f : c->waiting)
+					readers.push_back(std::move(f));
+				c->waiting.clear();
+			}
+			state_->waiting.clear();
+			for(auto &p : state_->publishers)
+				publishers.push_back(std::move(p.second));
+			state_->publishers.clear();
+		}
+		for(auto &f : readers)
+			if(f->is_pending())
+				f->fail_exception_pointer(end_of_stream());
+		for(auto &p : publishers)
+			if(p->is_pending())
+				p->fail("broadcast is closed");
+	}
+
+	/** Items published so far */
+	uint64_t published() const {
+		std::lock_guard<std::mutex> guard { state_->mutex };
+		return state_->head;
+	}
+
+	/** Publishers waiting on a backpressure subscriber */
+	size_t blocked() const {
+		std::lock_guard<std::mutex> guard { state_->mutex };
+		return state_->publishers.size();
+	}
+
+	size_t subscribers() const {
+		std::lock_guard<std::mutex> guard { state_->mutex };
+		return state_->subscribers;
+	}
+
+	size_t capacity() const { return state_->ring.size(); }
+
+	bool closed() const {
+		std::lock_guard<std::mutex> guard { state_->mutex };
+		return state_->closed;
+	}
+
+private:
+	/** Futures to resolve once we've let go of the lock */
+	struct deliveries {
+		std::vector<std::pair<std::shared_ptr<future<T>>, T>> items;
+		std::vector<std::shared_ptr<future<int>>> accepted;
+
+		void resolve() {
+			/* Readers and publishers may cancel at any time: the lock doesn't stop them */
+			for(auto &i : items)
+				if(i.first->is_pending())
+					i.first->done(std::move(i.second));
+			for(auto &a : accepted)
+				if(a->is_pending())
+					a->done(0);
+		}
+	};
+
+	struct cursor_state {
+		explicit cursor_state(lag_policy policy):policy(policy) { }
+
+		const lag_policy policy;
+		/** Sequence number of the next item to read */
+		uint64_t position = 0;
+		uint64_t missed = 0;
+		bool subscribed = true;
+		/** ->next calls waiting for items not yet published */
+		std::deque<std::shared_ptr<future<T>>> waiting;
+	};
+
+	struct shared_state {
+		explicit shared_state(
+			size_t capacity
+		):ring(capacity),
+		  pins(capacity, 0)
+		{
+		}
+
+		size_t slot(uint64_t seq) const { return static_cast<size_t>(seq % ring.size()); }
+
+		/** Oldest sequence number still in the ring */
+		uint64_t oldest() const { return head > ring.size() ? head - ring.size() : 0; }
+
+		/** Moves a cursor on, keeping the backpressure pins in step */
+		void move(cursor_state &c, uint64_t to) {
+			if(c.policy == lag_policy::backpressure) {
+				if(c.position < head)
+					--pins[slot(c.position)];
+				else
+					--pinned_at_head;
+				if(to < head)
+					++pins[slot(to)];
+				else
+					++pinned_at_head;
+			}
+			c.position = to;
+		}
+
+		/** Reads the item at the cursor, if it has been published */
+		bool read(cursor_state &c, T &out) {
+			if(c.position >= head)
+				return false;
+			if(c.position < oldest()) {
+				/* Overwritten: only possible for policies that let the publisher past */
+				uint64_t to = c.policy == lag_policy::skip_to_latest ? head - 1 : oldest();
+				c.missed += to - c.position;
+				move(c, to);
+			}
+			out = ring[slot(c.position)];
+			move(c, c.position + 1);
+			return true;
+		}
+
+		/** Puts an item in the ring and hands it to anyone waiting for it */
+		void write(T v, deliveries &out) {
+			ring[slot(head)] = std::move(v);
+			++head;
+			/* Backpressure cursors waiting at the head now point at this item */
+			pins[slot(head - 1)] += pinned_at_head;
+			pinned_at_head = 0;
+			size_t keep = 0;
+			for(size_t i = 0; i < waiting.size(); ++i) {
+				auto &c = waiting[i];
+				/* A cancelled ->next doesn't get to use up an item */
+				while(!c->waiting.empty() && !c->waiting.front()->is_pending())
+					c->waiting.pop_front();
+				if(c->waiting.empty())
+					continue;
+				T item;
+				read(*c, item);
+				out.items.emplace_back(std::move(c->waiting.front()), std::move(item));
+				c->waiting.pop_front();
+				if(!c->waiting.empty())
+					waiting[keep++] = std::move(c);
+			}
+			waiting.resize(keep);
+		}
+
+		/** Lets in publishers held up by backpressure, now there may be room */
+		void admit(deliveries &out) {
+			while(!publishers.empty() && pins[slot(head)] == 0) {
+				write(std::move(publishers.front().first), out);
+				out.accepted.push_back(std::move(publishers.front().second));
+				publishers.pop_front();
+			}
+		}
+
+		std::shared_ptr<future<T>> next(const std::shared_ptr<cursor_state> &c) {
+			auto item = future<T>::create_shared(u8"broadcast::next");
+			deliveries out;
+			T v;
+			{
+				std::lock_guard<std::mutex> guard { mutex };
+				if(!read(*c, v)) {
+					if(!closed) {
+						if(c->waiting.empty())
+							waiting.push_back(c);
+						c->waiting.push_back(item);
+						return item;
+					}
+					item->fail_exception_pointer(end_of_stream());
+					return item;
+				}
+				if(c->policy == lag_policy::backpressure)
+					admit(out);
+			}
+			item->done(std::move(v));
+			out.resolve();
+			return item;
+		}
+
+		void unsubscribe(const std::shared_ptr<cursor_state> &c) {
+			std::deque<std::shared_ptr<future<T>>> abandoned;
+			deliveries out;
+			{
+				std::lock_guard<std::mutex> guard { mutex };
+				if(!c->subscribed)
+					return;
+				c->subscribed = false;
+				--subscribers;
+				if(c->policy == lag_policy::backpressure) {
+					if(c->position < head)
+						--pins[slot(c->position)];
+					else
+						--pinned_at_head;
+					admit(out);
+				}
+				waiting.erase(std::remove(waiting.begin(), waiting.end(), c), waiting.end());
+				abandoned.swap(c->waiting);
+			}
+			out.resolve();
+			for(auto &f : abandoned)
+				if(f->is_pending())
+					f->cancel();
+		}
+
+		mutable std::mutex mutex;
+		std::vector<T> ring;
+		/** Backpressure cursors pointing at each slot: a slot with any can't be overwritten */
+		std::vector<size_t> pins;
+		/** Backpressure cursors waiting for the next item */
+		size_t pinned_at_head = 0;
+		/** Sequence number of the next item to publish */
+		uint64_t head = 0;
+		size_t subscribers = 0;
+		bool closed = false;
+		/** Subscribers with ->next calls waiting for the next item */
+		std::vector<std::shared_ptr<cursor_state>> waiting;
+		/** Items held up by backpressure, and the futures to resolve once they're in */
+		std::deque<std::pair<T, std::shared_ptr<future<int>>>> publishers;
+	};
+
+	std::shared_ptr<shared_state> state_;
+};
+
+};
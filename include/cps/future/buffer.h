@@ -0,0 +1,339 @@
+#pragma once
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <system_error>
+
+namespace cps {
+
+/**
+ * An immutable, reference-counted chain of bytes.
+ *
+ * The bytes live in one or more shared storage blocks, and a buffer is just
+ * a list of (block, offset, length) segments pointing into them. Copying,
+ * slicing and appending only touch that segment list, so a buffer can be
+ * passed by value through future<buffer>::done, ->value(), ->on_done and
+ * ->then without ever copying the payload.
+ *
+ * The segments map directly onto struct iovec, so a buffer can be handed to
+ * readv/writev as-is.
+ */
+class buffer {
+public:
+	/**
+	 * A contiguous run of bytes within a shared storage block.
+	 */
+	class segment {
+	public:
+		segment(
+			std::shared_ptr<const void> owner,
+			const char *data,
+			size_t size
+		):owner_(std::move(owner)),
+		  data_(data),
+		  size_(size)
+		{
+		}
+
+		/** Start of the bytes for this segment */
+		const char *data() const { return data_; }
+		/** Number of bytes in this segment */
+		size_t size() const { return size_; }
+
+		/** Returns a segment covering part of this one, sharing the same storage */
+		segment slice(size_t offset, size_t length) const {
+			return segment { owner_, data_ + offset, length };
+		}
+
+	private:
+		/** Keeps the underlying storage alive */
+		std::shared_ptr<const void> owner_;
+		const char *data_;
+		size_t size_;
+	};
+
+	using const_iterator = std::vector<segment>::const_iterator;
+
+	/** Default constructor - an empty buffer */
+	buffer():size_(0) { }
+
+	/**
+	 * Takes ownership of the given string. The bytes are not copied,
+	 * unless the string was short enough to be stored inline.
+	 */
+	static buffer take(std::string &&s) {
+		auto p = std::make_shared<std::string>(std::move(s));
+		const char *data = p->data();
+		size_t size = p->size();
+		return buffer { segment { std::move(p), data, size } };
+	}
+
+	/**
+	 * Takes ownership of the given vector without copying the bytes.
+	 */
+	static buffer take(std::vector<char> &&v) {
+		auto p = std::make_shared<std::vector<char>>(std::move(v));
+		const char *data = p->data();
+		size_t size = p->size();
+		return buffer { segment { std::move(p), data, size } };
+	}
+
+	/**
+	 * Refers to storage that's owned elsewhere. The owner is held for as
+	 * long as any buffer refers to the data.
+	 */
+	static buffer wrap(std::shared_ptr<const void> owner, const char *data, size_t size) {
+		return buffer { segment { std::move(owner), data, size } };
+	}
+
+	/**
+	 * Copies the given bytes into a new storage block. This is the only
+	 * factory that copies, and is intended for small literals and tests.
+	 */
+	static buffer copy(const void *data, size_t size) {
+		std::shared_ptr<char> p { new char[size ? size : 1], std::default_delete<char[]>() };
+		std::memcpy(p.get(), data, size);
+		const char *start = p.get();
+		return buffer { segment { std::move(p), start, size } };
+	}
+
+	/** Copies the given string into a new buffer */
+	static buffer copy(const std::string &s) {
+		return copy(s.data(), s.size());
+	}
+
+	/**
+	 * Reads up to max bytes from the given file descriptor. The kernel writes
+	 * directly into the storage block held by the returned buffer, so there is
+	 * no further copy between the read and whoever ends up consuming it.
+	 *
+	 * On error, ec is set and an empty buffer is returned. End of file gives an
+	 * empty buffer with ec clear.
+	 */
+	static buffer read(int fd, size_t max, std::error_code &ec) {
+		std::shared_ptr<char> p { new char[max ? max : 1], std::default_delete<char[]>() };
+		ssize_t rslt;
+		do {
+			rslt = ::read(fd, p.get(), max);
+		} while(rslt < 0 && errno == EINTR);
+		if(rslt < 0) {
+			ec = std::error_code(errno, std::system_category());
+			return buffer { };
+		}
+		ec.clear();
+		if(rslt == 0)
+			return buffer { };
+		const char *start = p.get();
+		return buffer { segment { std::move(p), start, static_cast<size_t>(rslt) } };
+	}
+
+	/**
+	 * Writes as much of this buffer as the kernel will accept in a single
+	 * writev call. Returns the number of bytes written, or 0 with ec set on
+	 * error.
+	 */
+	size_t write(int fd, std::error_code &ec) const {
+		std::vector<struct iovec> iov(std::min<size_t>(segments_.size(), IOV_MAX));
+		size_t count = to_iovec(iov.data(), iov.size());
+		ssize_t rslt;
+		do {
+			rslt = ::writev(fd, iov.data(), static_cast<int>(count));
+		} while(rslt < 0 && errno == EINTR);
+		if(rslt < 0) {
+			ec = std::error_code(errno, std::system_category());
+			return 0;
+		}
+		ec.clear();
+		return static_cast<size_t>(rslt);
+	}
+
+	/** Total number of bytes */
+	size_t size() const { return size_; }
+	/** Returns true if there are no bytes in this buffer */
+	bool empty() const { return size_ == 0; }
+	/** Number of segments in the chain */
+	size_t segment_count() const { return segments_.size(); }
+
+	const_iterator begin() const { return segments_.begin(); }
+	const_iterator end() const { return segments_.end(); }
+
+	/**
+	 * Appends the segments from another buffer. The bytes themselves are
+	 * shared, not copied.
+	 */
+	buffer &append(const buffer &other) {
+		segments_.insert(segments_.end(), other.segments_.begin(), other.segments_.end());
+		size_ += other.size_;
+		return *this;
+	}
+
+	/**
+	 * Returns a buffer covering length bytes starting from offset. Shares
+	 * storage with this buffer.
+	 * @throws std::out_of_range if the range extends past the end
+	 */
+	buffer slice(size_t offset, size_t length) const {
+		if(offset > size_ || length > size_ - offset)
+			throw std::out_of_range("buffer slice is out of range");
+		buffer b;
+		for(auto &it : segments_) {
+			if(!length)
+				break;
+			if(offset >= it.size()) {
+				offset -= it.size();
+				continue;
+			}
+			size_t n = std::min(it.size() - offset, length);
+			b.segments_.push_back(it.slice(offset, n));
+			b.size_ += n;
+			length -= n;
+			offset = 0;
+		}
+		return b;
+	}
+
+	/** Returns everything from offset onwards */
+	buffer slice(size_t offset) const {
+		if(offset > size_)
+			throw std::out_of_range("buffer slice is out of range");
+		return slice(offset, size_ - offset);
+	}
+
+	/**
+	 * Fills in up to count iovec entries, one per segment. Returns the number
+	 * of entries used.
+	 */
+	size_t to_iovec(struct iovec *iov, size_t count) const {
+		size_t n = 0;
+		for(auto &it : segments_) {
+			if(n == count)
+				break;
+			iov[n].iov_base = const_cast<char *>(it.data());
+			iov[n].iov_len = it.size();
+			++n;
+		}
+		return n;
+	}
+
+	/** Copies the bytes out into dest, which must have room for size() bytes */
+	void copy_to(void *dest) const {
+		char *p = static_cast<char *>(dest);
+		for(auto &it : segments_) {
+			std::memcpy(p, it.data(), it.size());
+			p += it.size();
+		}
+	}
+
+	/** Copies the bytes into a std::string */
+	std::string to_string() const {
+		std::string s(size_, '\0');
+		copy_to(&s[0]);
+		return s;
+	}
+
+	/** Bytewise comparison, regardless of how the segments are split */
+	bool operator==(const buffer &other) const {
+		if(size_ != other.size_)
+			return false;
+		auto a = segments_.begin();
+		auto b = other.segments_.begin();
+		size_t ao = 0, bo = 0, remaining = size_;
+		while(remaining) {
+			size_t n = std::min(a->size() - ao, b->size() - bo);
+			if(std::memcmp(a->data() + ao, b->data() + bo, n) != 0)
+				return false;
+			remaining -= n;
+			if((ao += n) == a->size()) { ++a; ao = 0; }
+			if((bo += n) == b->size()) { ++b; bo = 0; }
+		}
+		return true;
+	}
+
+	bool operator!=(const buffer &other) const { return !(*this == other); }
+
+private:
+	friend class read_block;
+
+	explicit buffer(segment s):size_(s.size()) {
+		if(size_)
+			segments_.push_back(std::move(s));
+	}
+
+	/** The chain itself */
+	std::vector<segment> segments_;
+	/** Total size across all segments */
+	size_t size_;
+};
+
+/**
+ * A block to read into, reused from one read to the next.
+ *
+ * buffer::read hands its whole block to the result, which is the right
+ * thing for a big read but means a ten-byte message pins 64KiB for as long
+ * as anyone holds it. This copies what was read into a buffer of its own
+ * size instead, unless it fills more than half the block: then the buffer
+ * takes the block, and we start a new one for next time.
+ *
+ * One per thread or reactor, not shared between threads.
+ */
+class read_block {
+public:
+	explicit read_block(size_t size = 65536):size_(size ? size : 1) { }
+
+	/** Reads from the fd; results as for buffer::read */
+	buffer read(int fd, std::error_code &ec) {
+		ssize_t rslt;
+		do {
+			rslt = ::read(fd, block(), size_);
+		} while(rslt < 0 && errno == EINTR);
+		return take(rslt, ec);
+	}
+
+	/** Reads through recv with the given flags - MSG_DONTWAIT, say - so sockets needn't be non-blocking */
+	buffer recv(int fd, int flags, std::error_code &ec) {
+		ssize_t rslt;
+		do {
+			rslt = ::recv(fd, block(), size_, flags);
+		} while(rslt < 0 && errno == EINTR);
+		return take(rslt, ec);
+	}
+
+	size_t size() const { return size_; }
+
+private:
+	char *block() {
+		if(!block_)
+			block_.reset(new char[size_], std::default_delete<char[]>());
+		return block_.get();
+	}
+
+	buffer take(ssize_t rslt, std::error_code &ec) {
+		if(rslt < 0) {
+			ec = std::error_code(errno, std::system_category());
+			return buffer { };
+		}
+		ec.clear();
+		size_t n = static_cast<size_t>(rslt);
+		if(n == 0)
+			return buffer { };
+		if(n <= size_ / 2)
+			return buffer::copy(block_.get(), n);
+		const char *start = block_.get();
+		return buffer { buffer::segment { std::move(block_), start, n } };
+	}
+
+	const size_t size_;
+	std::shared_ptr<char> block_;
+};
+
+};
+
@@ -0,0 +1,175 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/source.h>
+
+namespace cps {
+
+/**
+ * A bounded queue between producers and consumers, with futures on both
+ * sides.
+ *
+ * ->push returns a future which resolves once the item has been accepted,
+ * straight away if there's room. While the channel is full it stays
+ * pending, which is how backpressure reaches the producer: wait for it
+ * before pushing the next item. ->pop returns a future for the next item,
+ * pending until there is one.
+ *
+ * After ->close, pushes fail, producers still waiting for room are failed
+ * (their items are dropped), and once the queue drains ->pop fails with
+ * end_of_stream. That makes ->as_source a valid async_source.
+ *
+ * Any thread may push, pop or close.
+ */
+template<typename T>
+class channel {
+public:
+	explicit channel(
+		size_t capacity
+	):capacity_(capacity),
+	  closed_(false)
+	{
+	}
+
+	channel(const channel &) = delete;
+	channel &operator=(const channel &) = delete;
+
+	virtual ~channel() { }
+
+	/**
+	 * Queues an item. The future resolves once it is accepted, and fails if
+	 * the channel is or becomes closed first.
+	 */
+	std::shared_ptr<future<int>> push(T v) {
+		auto accepted = future<int>::create_shared();
+		for(;;) {
+			std::shared_ptr<future<T>> consumer;
+			{
+				std::lock_guard<std::mutex> guard { mutex_ };
+				if(closed_)
+					return accepted->fail("channel is closed");
+				/* Consumers may have given up on their ->pop since */
+				while(!consumers_.empty() && !consumers_.front()->is_pending())
+					consumers_.pop_front();
+				if(!consumers_.empty()) {
+					consumer = std::move(consumers_.front());
+					consumers_.pop_front();
+				} else if(items_.size() < capacity_) {
+					items_.push_back(std::move(v));
+				} else {
+					producers_.emplace_back(std::move(v), accepted);
+					return accepted;
+				}
+			}
+			/* ... or give up now we've let go of the lock, leaving us the item to try again with */
+			if(!consumer || consumer->try_done(v))
+				break;
+		}
+		return accepted->done(0);
+	}
+
+	/** Returns a future for the next item */
+	std::shared_ptr<future<T>> pop() {
+		auto item = future<T>::create_shared();
+		std::shared_ptr<future<int>> producer;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			/* Producers who have given up on their ->push take their items with them */
+			while(!producers_.empty() && !producers_.front().second->is_pending())
+				producers_.pop_front();
+			if(!items_.empty()) {
+				T v = std::move(items_.front());
+				items_.pop_front();
+				/* That made room for someone who was waiting */
+				if(!producers_.empty()) {
+					items_.push_back(std::move(producers_.front().first));
+					producer = std::move(producers_.front().second);
+					producers_.pop_front();
+				}
+				item->done(std::move(v));
+			} else if(!producers_.empty()) {
+				/* Only with zero capacity: take straight from the producer */
+				item->done(std::move(producers_.front().first));
+				producer = std::move(producers_.front().second);
+				producers_.pop_front();
+			} else if(closed_) {
+				item->fail_exception_pointer(end_of_stream());
+			} else {
+				consumers_.push_back(item);
+				return item;
+			}
+		}
+		/* Cancelled too late for us to see: the item has gone through regardless */
+		int accepted = 0;
+		if(producer)
+			producer->try_done(accepted);
+		return item;
+	}
+
+	/** Stops accepting items. Anything already queued can still be popped. */
+	void close() {
+		std::vector<std::shared_ptr<future<T>>> consumers;
+		std::vector<std::shared_ptr<future<int>>> producers;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			if(closed_)
+				return;
+			closed_ = true;
+			for(auto &c : consumers_)
+				consumers.push_back(std::move(c));
+			consumers_.clear();
+			for(auto &p : producers_)
+				producers.push_back(std::move(p.second));
+			producers_.clear();
+		}
+		for(auto &c : consumers)
+			if(c->is_pending())
+				c->fail_exception_pointer(end_of_stream());
+		for(auto &p : producers)
+			if(p->is_pending())
+				p->fail("channel is closed");
+	}
+
+	/** Returns the channel as an async_source, ending when it is closed and drained */
+	static async_source<T> as_source(std::shared_ptr<channel<T>> ch) {
+		return [ch] { return ch->pop(); };
+	}
+
+	/** Items in the queue, not counting producers waiting for room */
+	size_t size() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return items_.size();
+	}
+
+	/** Producers waiting for room */
+	size_t blocked() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return producers_.size();
+	}
+
+	size_t capacity() const { return capacity_; }
+
+	bool closed() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return closed_;
+	}
+
+private:
+	const size_t capacity_;
+	mutable std::mutex mutex_;
+	bool closed_;
+	std::deque<T> items_;
+	/** Items waiting for room, and the futures to resolve once there is */
+	std::deque<std::pair<T, std::shared_ptr<future<int>>>> producers_;
+	/** ->pop calls waiting for items */
+	std::deque<std::shared_ptr<future<T>>> consumers_;
+};
+
+};
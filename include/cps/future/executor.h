@@ -0,0 +1,29 @@
+#pragma once
+#include <functional>
+
+namespace cps {
+
+/**
+ * Something that can run code for us, at some point, on some thread.
+ *
+ * Where and when the code runs is entirely up to the implementation: a
+ * thread pool, an event loop, or a simulation.
+ */
+class executor {
+public:
+	virtual ~executor() { }
+
+	/** Queues the given code to run */
+	virtual void post(std::function<void()> code) = 0;
+};
+
+/**
+ * Runs everything immediately, on the calling thread.
+ */
+class inline_executor : public executor {
+public:
+	virtual void post(std::function<void()> code) override { code(); }
+};
+
+};
+
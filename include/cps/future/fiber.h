@@ -0,0 +1,393 @@
+#pragma once
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_set>
+#include <vector>
+
+#include <cps/future.h>
+
+namespace cps {
+
+/**
+ * Fixed-size stacks for fibers, allocated with mmap and recycled through a
+ * free list so that starting a fiber normally costs no system calls.
+ *
+ * With guard pages on, each stack has a PROT_NONE page below it, so an
+ * overflow faults instead of silently corrupting whatever is mapped next.
+ * That costs two kernel mappings per stack, and vm.max_map_count (65530 by
+ * default) then limits a process to a little over 32k stacks. Turn guard
+ * pages off if you need more fibers than that.
+ */
+class stack_pool {
+public:
+	/** A usable stack region, excluding any guard page */
+	struct stack {
+		void *base;
+		size_t size;
+	};
+
+	stack_pool(
+		size_t size = 64 * 1024,
+		bool guard = true
+	):page_(static_cast<size_t>(::sysconf(_SC_PAGESIZE))),
+	  size_((size + page_ - 1) / page_ * page_),
+	  guard_(guard),
+	  allocated_(0)
+	{
+	}
+
+	stack_pool(const stack_pool &) = delete;
+	stack_pool &operator=(const stack_pool &) = delete;
+
+	/** Unmaps the free stacks. Anything still handed out is the caller's problem. */
+	~stack_pool() {
+		for(auto &s : free_)
+			unmap(s);
+	}
+
+	/**
+	 * Returns a stack from the free list, or maps a new one.
+	 * @throws std::system_error if the kernel won't give us one
+	 */
+	stack allocate() {
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			if(!free_.empty()) {
+				auto s = free_.back();
+				free_.pop_back();
+				return s;
+			}
+		}
+		const size_t total = size_ + (guard_ ? page_ : 0);
+		void *p = ::mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(p == MAP_FAILED)
+			throw std::system_error(errno, std::system_category(), "could not map fiber stack");
+		if(guard_ && ::mprotect(p, page_, PROT_NONE) < 0) {
+			auto err = errno;
+			::munmap(p, total);
+			throw std::system_error(err, std::system_category(), "could not add fiber stack guard page (check vm.max_map_count)");
+		}
+		++allocated_;
+		return stack { static_cast<char *>(p) + (guard_ ? page_ : 0), size_ };
+	}
+
+	/** Puts a stack back on the free list */
+	void release(stack s) {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		free_.push_back(s);
+	}
+
+	/** Usable size of each stack, rounded up to whole pages */
+	size_t stack_size() const { return size_; }
+	/** Stacks mapped so far, whether in use or free */
+	size_t allocated() const { return allocated_; }
+	/** Stacks on the free list */
+	size_t available() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return free_.size();
+	}
+
+private:
+	void unmap(const stack &s) {
+		const size_t offset = guard_ ? page_ : 0;
+		::munmap(static_cast<char *>(s.base) - offset, s.size + offset);
+	}
+
+	const size_t page_;
+	const size_t size_;
+	const bool guard_;
+	mutable std::mutex mutex_;
+	std::vector<stack> free_;
+	size_t allocated_;
+};
+
+namespace detail {
+
+/** What a fiber's future holds, and how to get it from the body */
+template<typename T>
+struct fiber_result {
+	using type = T;
+
+	template<typename F>
+	static T call(F &code) { return code(); }
+};
+
+/** There's no cps::future<void>, so a body returning nothing gets a future<int> which resolves to 0 */
+template<>
+struct fiber_result<void> {
+	using type = int;
+
+	template<typename F>
+	static int call(F &code) {
+		code();
+		return 0;
+	}
+};
+
+}
+
+/**
+ * Runs blocking-style code as fibers over cps::future.
+ *
+ * ->spawn starts a fiber and returns a future for its result. Inside a
+ * fiber, cps::await(f) suspends just that fiber until f is ready: the
+ * fiber's continuation goes onto f's callback list, and when f resolves,
+ * wherever that happens, the fiber is put back on the ready queue.
+ *
+ * Fibers only ever run on the thread calling ->run or ->run_once, one at a
+ * time, so they can share state without locks as long as nothing else
+ * touches it. Futures may be resolved from any thread.
+ *
+ * Context switches use ucontext. swapcontext also saves and restores the
+ * signal mask, which costs a system call per switch. The fibers benchmark
+ * measures how much that is.
+ *
+ * Destroying the scheduler with fibers still suspended frees their stacks
+ * without unwinding them, so destructors of objects on those stacks do not
+ * run.
+ */
+class fiber_scheduler {
+public:
+	fiber_scheduler(
+		size_t stack_size = 64 * 1024,
+		bool guard_pages = true
+	):stacks_(stack_size, guard_pages),
+	  queue_(std::make_shared<ready_queue>()),
+	  switches_(0)
+	{
+	}
+
+	fiber_scheduler(const fiber_scheduler &) = delete;
+	fiber_scheduler &operator=(const fiber_scheduler &) = delete;
+
+	virtual ~fiber_scheduler() {
+		{
+			std::lock_guard<std::mutex> guard { queue_->mutex };
+			queue_->closed = true;
+		}
+		for(auto f : fibers_) {
+			stacks_.release(f->stack);
+			delete f;
+		}
+	}
+
+	/**
+	 * Starts a fiber running the given code, the next time we run. Returns
+	 * a future for whatever the code returns or throws: a future<int>
+	 * resolving to 0 if it returns nothing.
+	 */
+	template<typename F>
+	auto
+	spawn(F code, const std::string &label = u8"unlabelled future") -> std::shared_ptr<future<typename detail::fiber_result<decltype(code())>::type>>
+	{
+		using body_result = detail::fiber_result<decltype(code())>;
+		auto result = future<typename body_result::type>::create_shared(label);
+		std::unique_ptr<fiber> f { new fiber };
+		f->owner = this;
+		f->finished = false;
+		f->body = [code, result]() mutable {
+			std::exception_ptr ex;
+			bool got = false;
+			try {
+				auto value = body_result::call(code);
+				got = true;
+				/* The result may have been cancelled while we were running */
+				result->try_done(value);
+			} catch(...) {
+				/* Only the body's own exceptions are its result */
+				if(got)
+					throw;
+				ex = std::current_exception();
+			}
+			if(ex && result->is_pending())
+				result->fail_exception_pointer(ex);
+		};
+		f->stack = stacks_.allocate();
+		if(::getcontext(&f->context) < 0) {
+			stacks_.release(f->stack);
+			throw std::system_error(errno, std::system_category(), "getcontext failed");
+		}
+		f->context.uc_stack.ss_sp = f->stack.base;
+		f->context.uc_stack.ss_size = f->stack.size;
+		f->context.uc_link = nullptr;
+		/* makecontext only passes ints, so the pointer goes in two halves */
+		auto p = reinterpret_cast<uintptr_t>(f.get());
+		::makecontext(
+			&f->context,
+			reinterpret_cast<void (*)()>(&fiber_scheduler::trampoline),
+			2,
+			static_cast<unsigned int>(p >> 32),
+			static_cast<unsigned int>(p & 0xFFFFFFFFu)
+		);
+		fibers_.insert(f.get());
+		queue_->push(f.release());
+		return result;
+	}
+
+	/**
+	 * Runs every fiber that is ready right now, each until it finishes or
+	 * suspends. Returns false if there was nothing to run.
+	 */
+	bool run_once() {
+		std::vector<fiber *> batch;
+		{
+			std::lock_guard<std::mutex> guard { queue_->mutex };
+			batch.swap(queue_->ready);
+		}
+		for(auto f : batch)
+			resume(f);
+		return !batch.empty();
+	}
+
+	/**
+	 * Runs fibers until none are left, sleeping while they are all waiting
+	 * on futures.
+	 */
+	void run() {
+		while(!fibers_.empty()) {
+			if(run_once())
+				continue;
+			std::unique_lock<std::mutex> lock { queue_->mutex };
+			queue_->wake.wait(lock, [this] { return !queue_->ready.empty(); });
+		}
+	}
+
+	/** Fibers that have been started and not yet finished */
+	size_t fibers() const { return fibers_.size(); }
+	/** Number of times we have switched into a fiber */
+	size_t switches() const { return switches_; }
+	/** The stack pool, for stats */
+	const stack_pool &stacks() const { return stacks_; }
+
+	/** Returns true if we are running inside a fiber */
+	static bool in_fiber() { return current() != nullptr; }
+
+	/**
+	 * Suspends the current fiber and puts it straight back on the ready
+	 * queue, so that other ready fibers get a turn.
+	 */
+	static void yield() {
+		auto f = checked_current();
+		f->owner->queue_->push(f);
+		f->owner->suspend(f);
+	}
+
+	/**
+	 * Suspends the current fiber until the future is ready. Called through
+	 * cps::await.
+	 */
+	template<typename T>
+	static void wait(future<T> &target) {
+		if(target.is_ready())
+			return;
+		auto f = checked_current();
+		auto queue = f->owner->queue_;
+		target.on_ready([queue, f](future<T> &) {
+			queue->push(f);
+		});
+		f->owner->suspend(f);
+	}
+
+private:
+	struct fiber {
+		fiber_scheduler *owner;
+		ucontext_t context;
+		stack_pool::stack stack;
+		std::function<void()> body;
+		bool finished;
+	};
+
+	/**
+	 * Fibers waiting to run. Shared with the callbacks that wake fibers up,
+	 * which may outlive us if a future resolves after we're gone.
+	 */
+	struct ready_queue {
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::vector<fiber *> ready;
+		bool closed = false;
+
+		void push(fiber *f) {
+			{
+				std::lock_guard<std::mutex> guard { mutex };
+				if(closed)
+					return;
+				ready.push_back(f);
+			}
+			wake.notify_one();
+		}
+	};
+
+	static fiber *&current() {
+		static thread_local fiber *f = nullptr;
+		return f;
+	}
+
+	static fiber *checked_current() {
+		auto f = current();
+		if(!f)
+			throw std::logic_error("not running in a fiber");
+		return f;
+	}
+
+	static void trampoline(unsigned int high, unsigned int low) {
+		auto f = reinterpret_cast<fiber *>((static_cast<uintptr_t>(high) << 32) | low);
+		/* Nothing can propagate past the top of a fiber stack, and the body
+		 * already passes exceptions from the user's code on to the result */
+		try {
+			f->body();
+		} catch(...) {
+		}
+		f->body = nullptr;
+		f->finished = true;
+		f->owner->suspend(f);
+	}
+
+	void resume(fiber *f) {
+		auto previous = current();
+		current() = f;
+		++switches_;
+		::swapcontext(&scheduler_context_, &f->context);
+		current() = previous;
+		if(f->finished) {
+			fibers_.erase(f);
+			stacks_.release(f->stack);
+			delete f;
+		}
+	}
+
+	void suspend(fiber *f) {
+		::swapcontext(&f->context, &scheduler_context_);
+	}
+
+	stack_pool stacks_;
+	std::shared_ptr<ready_queue> queue_;
+	std::unordered_set<fiber *> fibers_;
+	ucontext_t scheduler_context_;
+	size_t switches_;
+};
+
+/**
+ * Waits for the future from inside a fiber, and returns its value. Failed
+ * and cancelled futures throw, as ->value does.
+ * @throws std::logic_error if called outside a fiber on a pending future
+ */
+template<typename T>
+T
+await(const std::shared_ptr<future<T>> &f)
+{
+	fiber_scheduler::wait(*f);
+	return f->value();
+}
+
+};
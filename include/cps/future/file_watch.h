@@ -0,0 +1,414 @@
+#pragma once
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/reactor.h>
+#include <cps/future/source.h>
+
+namespace cps {
+
+/** One or more changes to a watched path, merged together */
+struct file_event {
+	/** The path as passed to ->watch */
+	std::string path;
+	/** For a watched directory, the entry which changed */
+	std::string name;
+	/** IN_* bits from every event in the burst. IN_Q_OVERFLOW means events were lost: reload everything. */
+	uint32_t mask = 0;
+	/** Number of raw inotify events merged into this one */
+	size_t count = 0;
+};
+
+namespace detail {
+
+/** One watch on a path, with the events merged since it last delivered */
+struct file_subscription {
+	int wd;
+	std::string path;
+	/** Entry to match within the directory, or empty for everything */
+	std::string filter;
+	/** Events merged since the last delivery */
+	file_event pending;
+	/** When the first and latest of those arrived */
+	std::chrono::steady_clock::time_point first;
+	std::chrono::steady_clock::time_point last;
+	/** True once the burst has settled and can be handed out */
+	bool ready = false;
+	std::shared_ptr<future<file_event>> waiting;
+};
+
+/** Everything the watcher and its watches share */
+struct file_watch_state {
+	using clock = std::chrono::steady_clock;
+	using subscription = file_subscription;
+
+	/** Everything inotify might say about a file being created, changed, replaced or removed */
+	static constexpr uint32_t interest =
+		IN_CREATE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO
+		| IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+	file_watch_state(
+		reactor &loop,
+		clock::duration settle
+	):loop(loop),
+	  settle(settle),
+	  inotify_fd(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+	  timer_fd(::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+	{
+		if(inotify_fd < 0 || timer_fd < 0) {
+			int e = errno;
+			if(inotify_fd >= 0) ::close(inotify_fd);
+			if(timer_fd >= 0) ::close(timer_fd);
+			throw std::system_error(e, std::system_category(), "could not set up file watching");
+		}
+	}
+
+	static std::shared_ptr<subscription> subscribe(const std::shared_ptr<file_watch_state> &s, const std::string &path) {
+		if(s->closed)
+			throw std::logic_error("file watcher has been destroyed");
+		/* Directories are watched as themselves, files through their directory */
+		std::string dir = path, filter;
+		int wd = ::inotify_add_watch(s->inotify_fd, path.c_str(), interest | IN_ONLYDIR);
+		if(wd < 0 && (errno == ENOTDIR || errno == ENOENT)) {
+			/* A file, or something not there yet: watch for it in its directory */
+			auto slash = path.find_last_of('/');
+			dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+			filter = slash == std::string::npos ? path : path.substr(slash + 1);
+			wd = ::inotify_add_watch(s->inotify_fd, dir.c_str(), interest | IN_ONLYDIR);
+		}
+		if(wd < 0)
+			throw std::system_error(errno, std::system_category(), "could not watch " + path);
+		auto sub = std::make_shared<subscription>();
+		sub->wd = wd;
+		sub->path = path;
+		sub->filter = filter;
+		sub->pending.path = path;
+		s->dirs[wd].push_back(sub);
+		listen(s);
+		return sub;
+	}
+
+	static void unsubscribe(const std::shared_ptr<file_watch_state> &s, const std::shared_ptr<subscription> &sub) {
+		auto waiting = std::move(sub->waiting);
+		auto it = s->dirs.find(sub->wd);
+		if(it != s->dirs.end()) {
+			auto &subs = it->second;
+			subs.erase(std::remove(subs.begin(), subs.end(), sub), subs.end());
+			if(subs.empty()) {
+				s->dirs.erase(it);
+				if(!s->closed)
+					::inotify_rm_watch(s->inotify_fd, sub->wd);
+			}
+		}
+		if(waiting && waiting->is_pending())
+			waiting->cancel();
+	}
+
+	static void shutdown(const std::shared_ptr<file_watch_state> &s) {
+		s->closed = true;
+		s->loop.remove(s->inotify_fd);
+		s->loop.remove(s->timer_fd);
+		::close(s->inotify_fd);
+		::close(s->timer_fd);
+		std::vector<std::shared_ptr<future<file_event>>> waiting;
+		for(auto &it : s->dirs)
+			for(auto &sub : it.second)
+				if(sub->waiting)
+					waiting.push_back(std::move(sub->waiting));
+		for(auto &f : waiting)
+			if(f->is_pending())
+				f->cancel();
+	}
+
+	/** Waits for the inotify fd, unless we already are */
+	static void listen(const std::shared_ptr<file_watch_state> &s) {
+		if(s->listening || s->closed)
+			return;
+		s->listening = true;
+		s->loop.readable(s->inotify_fd)->on_ready([s](future<int> &r) {
+			s->listening = false;
+			if(!r.is_done() || s->closed)
+				return;
+			read_events(s);
+			listen(s);
+		});
+	}
+
+	static void read_events(const std::shared_ptr<file_watch_state> &s) {
+		alignas(struct inotify_event) char data[65536];
+		auto now = clock::now();
+		bool any = false;
+		for(;;) {
+			ssize_t n = ::read(s->inotify_fd, data, sizeof(data));
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				break;
+			for(char *p = data; p < data + n; ) {
+				auto *ev = reinterpret_cast<struct inotify_event *>(p);
+				p += sizeof(struct inotify_event) + ev->len;
+				++s->events;
+				std::string name = ev->len ? std::string(ev->name) : std::string();
+				for(auto &it : s->dirs) {
+					/* An overflow means we've lost track, so everyone hears about it */
+					if(!(ev->mask & IN_Q_OVERFLOW) && it.first != ev->wd)
+						continue;
+					for(auto &sub : it.second) {
+						/* A filtered watch only cares about its own entry, and the directory itself going away */
+						bool self = !ev->len;
+						if(!(ev->mask & IN_Q_OVERFLOW) && !sub->filter.empty() && !self && name != sub->filter)
+							continue;
+						sub->pending.mask |= ev->mask;
+						++sub->pending.count;
+						if(sub->filter.empty() && !name.empty())
+							sub->pending.name = name;
+						if(sub->pending.count == 1)
+							sub->first = now;
+						sub->last = now;
+						sub->ready = false;
+						any = true;
+					}
+				}
+			}
+		}
+		if(any)
+			schedule(s);
+	}
+
+	/** Arranges for ->settled to run once the earliest burst has gone quiet */
+	static void schedule(const std::shared_ptr<file_watch_state> &s) {
+		if(s->settle <= clock::duration::zero()) {
+			if(!s->deferred) {
+				s->deferred = true;
+				s->loop.defer([s] {
+					s->deferred = false;
+					if(!s->closed)
+						settled(s);
+				});
+			}
+			return;
+		}
+		clock::time_point due = clock::time_point::max();
+		for(auto &it : s->dirs)
+			for(auto &sub : it.second)
+				if(sub->pending.count && !sub->ready)
+					due = std::min(due, s->due(*sub));
+		if(due == clock::time_point::max())
+			return;
+		auto delay = std::max(due - clock::now(), clock::duration(std::chrono::microseconds(1)));
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count();
+		struct itimerspec spec { };
+		spec.it_value.tv_sec = ns / 1000000000;
+		spec.it_value.tv_nsec = ns % 1000000000;
+		::timerfd_settime(s->timer_fd, 0, &spec, nullptr);
+		if(!s->timing) {
+			s->timing = true;
+			s->loop.readable(s->timer_fd)->on_ready([s](future<int> &r) {
+				s->timing = false;
+				if(!r.is_done() || s->closed)
+					return;
+				uint64_t expirations;
+				while(::read(s->timer_fd, &expirations, sizeof(expirations)) > 0) { }
+				settled(s);
+				schedule(s);
+			});
+		}
+	}
+
+	/** Hands out every burst that has been quiet for long enough */
+	static void settled(const std::shared_ptr<file_watch_state> &s) {
+		auto now = clock::now();
+		std::vector<std::pair<std::shared_ptr<future<file_event>>, file_event>> deliver;
+		for(auto &it : s->dirs) {
+			for(auto &sub : it.second) {
+				if(!sub->pending.count || sub->ready || now < s->due(*sub))
+					continue;
+				sub->ready = true;
+				if(sub->waiting)
+					deliver.emplace_back(std::move(sub->waiting), take(*sub));
+			}
+		}
+		/* Callbacks may watch or unwatch, so resolve only once we're done with the lists */
+		for(auto &it : deliver) {
+			++s->delivered;
+			if(it.first->is_pending())
+				it.first->done(std::move(it.second));
+		}
+	}
+
+	/** When a burst counts as settled: once quiet, or once it has gone on too long */
+	clock::time_point due(const subscription &sub) const {
+		return std::min(sub.last + settle, sub.first + 10 * settle);
+	}
+
+	/** Takes the merged event off a subscription, leaving it empty for the next burst */
+	static file_event take(subscription &sub) {
+		file_event ev = std::move(sub.pending);
+		sub.pending = file_event { };
+		sub.pending.path = sub.path;
+		sub.ready = false;
+		return ev;
+	}
+
+	reactor &loop;
+	const clock::duration settle;
+	const int inotify_fd;
+	const int timer_fd;
+	bool closed = false;
+	bool listening = false;
+	bool timing = false;
+	bool deferred = false;
+	size_t events = 0;
+	size_t delivered = 0;
+	/** Subscriptions, by inotify watch */
+	std::map<int, std::vector<std::shared_ptr<subscription>>> dirs;
+};
+
+}
+
+/**
+ * A stream of changes to one path, from file_watcher::watch.
+ *
+ * ->next returns a future for the next change. Changes that happen while
+ * nobody is waiting are merged into a single event for the next call, so a
+ * slow consumer sees one "something changed" rather than a backlog.
+ * Destroying the handle stops the watch, and cancels a pending ->next.
+ */
+class file_watch {
+public:
+	file_watch(const file_watch &) = delete;
+	file_watch &operator=(const file_watch &) = delete;
+
+	~file_watch() {
+		detail::file_watch_state::unsubscribe(state_, sub_);
+	}
+
+	/** Returns a future for the next change */
+	std::shared_ptr<future<file_event>> next() {
+		auto f = future<file_event>::create_shared(u8"file_watch::next");
+		if(state_->closed) {
+			f->cancel();
+			return f;
+		}
+		if(sub_->ready) {
+			++state_->delivered;
+			return f->done(detail::file_watch_state::take(*sub_));
+		}
+		/* Only one caller at a time: a second ->next takes over from the first */
+		if(sub_->waiting && sub_->waiting->is_pending())
+			sub_->waiting->cancel();
+		sub_->waiting = f;
+		return f;
+	}
+
+	/** This watch as an async_source. The source keeps the watch alive. */
+	static async_source<file_event> as_source(std::shared_ptr<file_watch> w) {
+		return [w] { return w->next(); };
+	}
+
+private:
+	friend class file_watcher;
+
+	file_watch(
+		std::shared_ptr<detail::file_watch_state> state,
+		std::shared_ptr<detail::file_subscription> sub
+	):state_(std::move(state)),
+	  sub_(std::move(sub))
+	{
+	}
+
+	std::shared_ptr<detail::file_watch_state> state_;
+	std::shared_ptr<detail::file_subscription> sub_;
+};
+
+/**
+ * File change notifications as futures, from a single inotify descriptor
+ * watched by the reactor.
+ *
+ * Files are watched through their directory, filtered by name, so a file
+ * that's replaced by renaming a new copy over it - as most editors and
+ * deployment tools do - is still followed afterwards. Watches on the same
+ * directory share one inotify watch.
+ *
+ * Bursts are coalesced: a save usually produces several events (create,
+ * modify, close, rename), and we deliver one file_event once the path has
+ * been quiet for the settle time, with the mask bits of the whole burst.
+ * A path that never goes quiet, such as a busy log file, is reported at
+ * least every ten settle times. The settle timer is a timerfd on the same
+ * reactor. With a settle time of zero, events are delivered at the end of
+ * the reactor iteration which read them.
+ *
+ *     file_watcher watcher { loop };
+ *     watcher.changed("/etc/service.conf")->on_done([](file_event) {
+ *         reload_config();
+ *     });
+ *
+ * Use from the loop thread only.
+ */
+class file_watcher {
+public:
+	using clock = std::chrono::steady_clock;
+
+	file_watcher(
+		reactor &loop,
+		clock::duration settle = std::chrono::milliseconds(50)
+	):state_(std::make_shared<detail::file_watch_state>(loop, settle))
+	{
+	}
+
+	file_watcher(const file_watcher &) = delete;
+	file_watcher &operator=(const file_watcher &) = delete;
+
+	/** Cancels anything still waiting for a change */
+	~file_watcher() {
+		detail::file_watch_state::shutdown(state_);
+	}
+
+	/**
+	 * Watches a file or directory. For a directory, changes to any entry
+	 * are reported, with file_event::name set. A file need not exist yet,
+	 * as long as its directory does.
+	 * @throws std::system_error if the path (or, for a file, its directory)
+	 * can't be watched
+	 */
+	std::shared_ptr<file_watch> watch(const std::string &path) {
+		return std::shared_ptr<file_watch>(new file_watch(
+			state_,
+			detail::file_watch_state::subscribe(state_, path)
+		));
+	}
+
+	/** Returns a future for the next change to the given path, and then stops watching */
+	std::shared_ptr<future<file_event>> changed(const std::string &path) {
+		auto w = watch(path);
+		auto f = w->next();
+		/* The callback holds the watch open until the change arrives */
+		f->on_ready([w](future<file_event> &) { });
+		return f;
+	}
+
+	/** Number of inotify watches in use */
+	size_t watches() const { return state_->dirs.size(); }
+
+	/** Number of raw inotify events read so far */
+	size_t events() const { return state_->events; }
+
+	/** Number of file_events delivered so far */
+	size_t delivered() const { return state_->delivered; }
+
+private:
+	std::shared_ptr<detail::file_watch_state> state_;
+};
+
+};
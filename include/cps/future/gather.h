@@ -0,0 +1,214 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/scheduler.h>
+
+namespace cps {
+
+/** What happened to one input of a gather */
+enum class gather_status : uint8_t {
+	/** Still pending when the deadline passed */
+	missing,
+	done,
+	failed,
+	cancelled
+};
+
+/** What to do with inputs still pending at the deadline */
+enum class gather_policy {
+	/** Cancel them, so whoever is producing them can stop */
+	cancel_rest,
+	/** Leave them alone; their results are ignored */
+	abandon_rest
+};
+
+/**
+ * The outcome of gather_until: one value and status per input, in input
+ * order. values[i] is only meaningful where status[i] is done.
+ */
+template<typename T>
+struct partial_result {
+	std::vector<T> values;
+	std::vector<gather_status> status;
+
+	/** Number of inputs which didn't produce a value in time */
+	size_t missing() const {
+		size_t n = 0;
+		for(auto s : status)
+			n += s != gather_status::done;
+		return n;
+	}
+
+	/** True if every input produced a value */
+	bool complete() const { return missing() == 0; }
+};
+
+namespace detail {
+
+/** The one state object behind a gather: inputs register against it, and so does the timer */
+template<typename T>
+class gather_state {
+public:
+	gather_state(
+		const std::vector<std::shared_ptr<future<T>>> &in,
+		gather_policy policy
+	):inputs(in.begin(), in.end()),
+	  policy(policy),
+	  remaining(in.size()),
+	  finished(false),
+	  result(future<partial_result<T>>::create_shared(u8"gather_until"))
+	{
+		values.values.resize(in.size());
+		values.status.resize(in.size(), gather_status::missing);
+	}
+
+	/** One input has resolved */
+	static void arrived(const std::shared_ptr<gather_state> &self, size_t i, future<T> &in) {
+		{
+			std::lock_guard<std::mutex> guard { self->mutex };
+			if(self->finished)
+				return;
+			if(in.is_done()) {
+				self->values.values[i] = in.value();
+				self->values.status[i] = gather_status::done;
+			} else {
+				self->values.status[i] = in.is_cancelled() ? gather_status::cancelled : gather_status::failed;
+			}
+			if(--self->remaining > 0)
+				return;
+		}
+		finish(self);
+	}
+
+	/**
+	 * Resolves the result with whatever we have, unless it has been
+	 * cancelled, then deals with the timer and the rest of the inputs. Only
+	 * the first call does anything.
+	 */
+	static void finish(const std::shared_ptr<gather_state> &self) {
+		partial_result<T> out;
+		std::vector<std::weak_ptr<future<T>>> inputs;
+		std::shared_ptr<future<int>> timer;
+		{
+			std::lock_guard<std::mutex> guard { self->mutex };
+			if(self->finished)
+				return;
+			self->finished = true;
+			out = std::move(self->values);
+			inputs = std::move(self->inputs);
+			timer = self->timer.lock();
+		}
+		if(timer && timer->is_pending()) {
+			try {
+				timer->cancel();
+			} catch(const std::logic_error &) {
+				/* The timer fired as we got here */
+			}
+		}
+		self->result->try_done(out);
+		if(self->policy != gather_policy::cancel_rest)
+			return;
+		for(auto &weak : inputs) {
+			auto in = weak.lock();
+			if(!in || !in->is_pending())
+				continue;
+			try {
+				in->cancel();
+			} catch(const std::logic_error &) {
+				/* Resolved by someone else in the meantime */
+			}
+		}
+	}
+
+	std::mutex mutex;
+	/* Inputs and the timer hold us through their callbacks, so we only
+	 * hold them weakly: a gather nobody will ever resolve doesn't leak */
+	std::vector<std::weak_ptr<future<T>>> inputs;
+	const gather_policy policy;
+	size_t remaining;
+	bool finished;
+	partial_result<T> values;
+	std::weak_ptr<future<int>> timer;
+	std::shared_ptr<future<partial_result<T>>> result;
+};
+
+}
+
+/**
+ * Collects whatever the inputs have produced by the deadline.
+ *
+ * The result resolves as soon as every input has resolved, or when the
+ * deadline passes, whichever is first - it never fails. At the deadline,
+ * inputs still pending are reported as missing and then cancelled or
+ * abandoned according to the policy. Inputs which fail or are cancelled
+ * before then are reported as such, and don't hold up the rest.
+ *
+ * The whole gather is one state object and one timer on the scheduler.
+ * Each input gets just its callback registration, which is released if
+ * everything arrives in time.
+ *
+ *     gather_until(sched, sched.now() + std::chrono::milliseconds(50), shards)
+ *         ->on_done([](partial_result<hits> r) {
+ *             respond(r.values, r.status, r.missing());
+ *         });
+ *
+ * Inputs may resolve on any thread.
+ */
+template<typename T>
+std::shared_ptr<future<partial_result<T>>>
+gather_until(
+	scheduler &sched,
+	scheduler::time_point deadline,
+	std::vector<std::shared_ptr<future<T>>> inputs,
+	gather_policy policy = gather_policy::cancel_rest
+)
+{
+	using state = detail::gather_state<T>;
+	auto self = std::make_shared<state>(inputs, policy);
+	auto result = self->result;
+	if(inputs.empty()) {
+		state::finish(self);
+		return result;
+	}
+	auto timer = sched.at(deadline);
+	{
+		std::lock_guard<std::mutex> guard { self->mutex };
+		self->timer = timer;
+	}
+	timer->on_ready([self](future<int> &t) {
+		if(t.is_done())
+			state::finish(self);
+	});
+	/* Giving up on the result is like reaching the deadline */
+	std::weak_ptr<state> weak = self;
+	result->on_cancel([weak] {
+		if(auto self = weak.lock())
+			state::finish(self);
+	});
+	for(size_t i = 0; i < inputs.size() && !self->result->is_ready(); ++i) {
+		inputs[i]->on_ready([self, i](future<T> &in) {
+			state::arrived(self, i, in);
+		});
+	}
+	return result;
+}
+
+/** gather_until, with the deadline as a delay from now */
+template<typename T>
+std::shared_ptr<future<partial_result<T>>>
+gather_within(
+	scheduler &sched,
+	scheduler::duration budget,
+	std::vector<std::shared_ptr<future<T>>> inputs,
+	gather_policy policy = gather_policy::cancel_rest
+)
+{
+	return gather_until(sched, sched.now() + budget, std::move(inputs), policy);
+}
+
+};
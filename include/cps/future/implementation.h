@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <functional>
 #include <chrono>
 #include <exception>
 #include <stdexcept>
@@ -13,11 +14,25 @@
 
 #include <cps/future/error_code.h>
 #include <cps/future/is_string.h>
+#include <cps/future/reclaim.h>
 
 #ifdef UNCAUGHT_EXCEPTION_DEBUGGING
 #include <iostream>
 #endif
 
+#ifndef FUTURE_TRACE
+#define FUTURE_TRACE 0
+#endif
+
+#if FUTURE_TRACE
+#include <cps/future/trace.h>
+/** Reports an edge from one future to another, when tracing is enabled */
+#define CPS_FUTURE_TRACE_LINK(source, target, kind) \
+	cps::trace::linked((source).trace_id(), (target).trace_id(), cps::trace::link::kind)
+#else
+#define CPS_FUTURE_TRACE_LINK(source, target, kind)
+#endif
+
 namespace cps {
 
 /**
@@ -100,12 +115,20 @@ public:
 	  ex_(nullptr),
 	  created_(std::chrono::high_resolution_clock::now())
 	{
+#if FUTURE_TRACE
+		trace_id_ = trace::next_id();
+		trace::created(trace_id_);
+#endif
 	}
 
 	/**
-	 * Default destructor too - virtual, in case anyone wants to subclass.
+	 * Virtual, in case anyone wants to subclass. Hands the value to the
+	 * active reclaimer, if there is one and T opts in.
 	 */
-	virtual ~future() { }
+	virtual ~future() {
+		if(state_ == state::done)
+			retire_value(reclaim_in_background<T> { });
+	}
 
 	/** Returns the shared_ptr associated with this instance */
 	std::shared_ptr<future<T>>
@@ -210,6 +233,19 @@ public:
 		}, state::done);
 	}
 
+	/**
+	 * Marks this future as done with the value moved from v, unless it has
+	 * already been resolved - cancelled by another thread, say - in which
+	 * case v is left alone and we return false. For handing over something
+	 * which mustn't be lost if nobody wants it any more.
+	 */
+	bool try_done(T &v)
+	{
+		return resolve([&v](future<T>&f) {
+			f.value_ = std::move(v);
+		}, state::done);
+	}
+
 	/** Mark this future as failed */
 	template<
 		typename U,
@@ -477,6 +513,7 @@ public:
 		 * available, we'll propagate the result onto f.
 		 */
 		auto f = future_type::create_shared();
+		CPS_FUTURE_TRACE_LINK(*this, *f, then);
 
 		/* Gather the parameter pack by mapping the disparate types through our callback handler */
 		std::vector<std::function<return_type(const std::exception_ptr &)>> items {
@@ -498,6 +535,7 @@ public:
 					 * and set up propagation */
 					// std::cout << "will call value in ->then handler for done status\n";
 					auto inner = ok(me.value());
+					CPS_FUTURE_TRACE_LINK(*inner, *f, then_result);
 					inner->on_done([f](inner_type v) { f->done(v); })
 						->on_fail([f, inner](const std::string &) { f->fail_from(*inner); })
 						->on_cancel([f]() { f->cancel(); });
@@ -510,6 +548,7 @@ public:
 					for(auto &it : items) {
 						auto inner = it(me.ex_);
 						if(inner) {
+							CPS_FUTURE_TRACE_LINK(*inner, *f, then_result);
 							inner->on_done([f](inner_type v) { f->done(v); })
 								->on_fail([f, inner](const std::string &) { f->fail_from(*inner); })
 								->on_cancel([f]() { f->cancel(); });
@@ -576,6 +615,10 @@ public:
 
 	/** Returns the label for this future */
 	const std::string &label() const { return label_; }
+#if FUTURE_TRACE
+	/** Returns the ID used for this future in trace recordings */
+	uint64_t trace_id() const { return trace_id_; }
+#endif
 	/** Returns the exception pointer */
 	const std::exception_ptr &exception_ptr() const {
 		if(state_ != state::failed)
@@ -689,6 +732,16 @@ protected:
 	 * Runs the given code then updates the state.
 	 */
 	std::shared_ptr<future<T>> apply_state(std::function<void(future<T>&)> code, state s)
+	{
+		resolve(code, s, true);
+		return shared();
+	}
+
+	/**
+	 * Runs the given code and updates the state, if we're still pending.
+	 * Otherwise throws if strict, or returns false without running it.
+	 */
+	bool resolve(const std::function<void(future<T>&)> &code, state s, bool strict = false)
 	{
 		/* Cannot change state to pending, since we assume that we want
 		 * to call all deferred tasks.
@@ -698,8 +751,11 @@ protected:
 		std::vector<std::function<void(future<T> &)>> pending { };
 		{
 			std::lock_guard<std::mutex> guard { mutex_ };
-			if(state_ != state::pending)
+			if(state_ != state::pending) {
+				if(!strict)
+					return false;
 				throw std::logic_error("tried to resolve future twice, wanted " + state_string(s) + ":" + describe());
+			}
 
 			code(*this);
 			pending = std::move(tasks_);
@@ -710,12 +766,18 @@ protected:
 			state_ = s;
 			/* Might want to consider something like compare_exchange_strong(...) if we need a mutex-free version in future:? */
 		}
+#if FUTURE_TRACE
+		trace::resolved(trace_id_, static_cast<trace::resolution>(s));
+#endif
 		for(auto &v : pending) {
 			v(*this);
 		}
-		return shared();
+		return true;
 	}
 
+	void retire_value(std::true_type) { reclaim::retire(std::move(value_)); }
+	void retire_value(std::false_type) { }
+
 //#if CAN_COPY_FUTURES
 	/**
 	 * Locked constructor for internal use.
@@ -733,6 +795,9 @@ protected:
 	  resolved_(src.resolved_),
 	  value_(src.value_)
 	{
+#if FUTURE_TRACE
+		trace_id_ = src.trace_id_;
+#endif
 	}
 //#endif
 
@@ -752,6 +817,9 @@ protected:
 	  resolved_(std::move(src.resolved_)),
 	  value_(std::move(src.value_))
 	{
+#if FUTURE_TRACE
+		trace_id_ = src.trace_id_;
+#endif
 	}
 
 protected:
@@ -775,6 +843,10 @@ protected:
 	checkpoint created_;
 	/** When we were marked ready */
 	checkpoint resolved_;
+#if FUTURE_TRACE
+	/** Identifies this future in trace recordings */
+	uint64_t trace_id_;
+#endif
 };
 
 template<
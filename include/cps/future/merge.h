@@ -0,0 +1,285 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/source.h>
+
+namespace cps {
+
+/**
+ * Merges already-sorted async sources into one sorted stream.
+ *
+ * The first call to ->next asks every source for its first item. After that
+ * the heads of the sources sit in a binary heap, and each item we hand out
+ * leads to exactly one further request, to the source it came from. The
+ * smallest item is known, and handed out, as soon as that source delivers
+ * or reports it has ended - there's no need to wait for the slow shards.
+ *
+ * The result is itself an async source: ->next returns a future for the
+ * next item, failing with end_of_stream once every source has ended. If a
+ * source fails for any other reason, that failure is passed on and the
+ * merge stops.
+ *
+ * Sources may resolve on any thread. Handles are cheap to copy and share
+ * the same state.
+ */
+template<typename T, typename Compare = std::less<T>>
+class sorted_merge {
+public:
+	sorted_merge(
+		std::vector<async_source<T>> sources,
+		Compare compare = Compare()
+	):state_(std::make_shared<state>(std::move(sources), std::move(compare)))
+	{
+	}
+
+	/** Returns a future for the next item in sorted order */
+	std::shared_ptr<future<T>> next() {
+		return state::next(state_);
+	}
+
+	/** The merged stream as an async_source */
+	async_source<T> as_source() const {
+		auto s = state_;
+		return [s]() { return state::next(s); };
+	}
+
+	/**
+	 * Calls the given code for each item in order, and returns a future
+	 * for the number of items, which fails if a source did.
+	 */
+	std::shared_ptr<future<size_t>> for_each(std::function<void(const T &)> code) {
+		auto result = future<size_t>::create_shared();
+		each_loop::run(std::make_shared<each_loop>(state_, std::move(code), result));
+		return result;
+	}
+
+	/** Number of requests made to each source so far */
+	std::vector<size_t> requests() const {
+		std::lock_guard<std::mutex> guard { state_->mutex };
+		return state_->requests;
+	}
+
+private:
+	class state {
+	public:
+		state(
+			std::vector<async_source<T>> sources,
+			Compare compare
+		):sources(std::move(sources)),
+		  requests(this->sources.size(), 0),
+		  compare(std::move(compare)),
+		  started(false),
+		  outstanding(0)
+		{
+		}
+
+		static std::shared_ptr<future<T>> next(const std::shared_ptr<state> &self) {
+			auto f = future<T>::create_shared();
+			std::vector<size_t> fetch;
+			{
+				std::lock_guard<std::mutex> guard { self->mutex };
+				self->waiting.push_back(f);
+				if(!self->started) {
+					self->started = true;
+					self->outstanding = self->sources.size();
+					for(size_t i = 0; i < self->sources.size(); ++i)
+						fetch.push_back(i);
+				}
+			}
+			for(auto i : fetch)
+				request(self, i);
+			deliver(self);
+			return f;
+		}
+
+	private:
+		using entry = std::pair<T, size_t>;
+
+		/** Asks a source for its next item. The caller has already counted it as outstanding. */
+		static void request(const std::shared_ptr<state> &self, size_t i) {
+			std::shared_ptr<future<T>> f;
+			try {
+				{
+					std::lock_guard<std::mutex> guard { self->mutex };
+					++self->requests[i];
+				}
+				f = self->sources[i]();
+			} catch(...) {
+				f = future<T>::create_shared();
+				f->fail_exception_pointer(std::current_exception());
+			}
+			f->on_ready([self, i](future<T> &in) {
+				arrived(self, i, in);
+			});
+		}
+
+		static void arrived(const std::shared_ptr<state> &self, size_t i, future<T> &in) {
+			{
+				std::lock_guard<std::mutex> guard { self->mutex };
+				--self->outstanding;
+				if(in.is_done()) {
+					self->heap.emplace_back(in.value(), i);
+					std::push_heap(self->heap.begin(), self->heap.end(), heap_order { &self->compare });
+				} else if(in.is_cancelled()) {
+					if(!self->error)
+						self->error = std::make_exception_ptr(std::runtime_error("merge source was cancelled"));
+				} else if(!is_end_of_stream(in)) {
+					if(!self->error)
+						self->error = in.exception_ptr();
+				}
+			}
+			deliver(self);
+		}
+
+		/**
+		 * Hands out items while we know the minimum: that is, while nothing
+		 * is outstanding. Each item handed out means a request to its source.
+		 */
+		static void deliver(const std::shared_ptr<state> &self) {
+			for(;;) {
+				std::shared_ptr<future<T>> target;
+				bool have_item = false;
+				T item { };
+				size_t refill = 0;
+				std::exception_ptr failure;
+				{
+					std::lock_guard<std::mutex> guard { self->mutex };
+					/* Callers may have given up on their ->next since */
+					while(!self->waiting.empty() && !self->waiting.front()->is_pending())
+						self->waiting.pop_front();
+					if(self->waiting.empty() || self->outstanding > 0)
+						return;
+					target = self->waiting.front();
+					self->waiting.pop_front();
+					if(self->error) {
+						failure = self->error;
+					} else if(self->heap.empty()) {
+						failure = end_of_stream();
+					} else {
+						std::pop_heap(self->heap.begin(), self->heap.end(), heap_order { &self->compare });
+						item = std::move(self->heap.back().first);
+						refill = self->heap.back().second;
+						self->heap.pop_back();
+						have_item = true;
+						/* Count it now, so that nobody hands out another item
+						 * before this source has had its say */
+						++self->outstanding;
+					}
+				}
+				if(have_item) {
+					if(target->try_done(item)) {
+						request(self, refill);
+						continue;
+					}
+					/* Cancelled since we looked: the item goes back for the next caller */
+					std::lock_guard<std::mutex> guard { self->mutex };
+					self->heap.emplace_back(std::move(item), refill);
+					std::push_heap(self->heap.begin(), self->heap.end(), heap_order { &self->compare });
+					--self->outstanding;
+				} else if(target->is_pending()) {
+					target->fail_exception_pointer(failure);
+				}
+			}
+		}
+
+		/** std::*_heap build a max-heap, so flip the comparison to get the smallest on top */
+		struct heap_order {
+			const Compare *compare;
+			bool operator()(const entry &a, const entry &b) const {
+				return (*compare)(b.first, a.first);
+			}
+		};
+
+	public:
+		std::mutex mutex;
+		std::vector<async_source<T>> sources;
+		std::vector<size_t> requests;
+
+	private:
+		Compare compare;
+		bool started;
+		size_t outstanding;
+		std::vector<entry> heap;
+		std::deque<std::shared_ptr<future<T>>> waiting;
+		std::exception_ptr error;
+	};
+
+	/** Drives ->for_each */
+	class each_loop {
+	public:
+		each_loop(
+			std::shared_ptr<state> source,
+			std::function<void(const T &)> code,
+			std::shared_ptr<future<size_t>> result
+		):source_(std::move(source)),
+		  code_(std::move(code)),
+		  result_(std::move(result)),
+		  count_(0)
+		{
+		}
+
+		/* Synchronous sources resolve straight away, so loop rather than
+		 * recursing through on_ready for every item */
+		static void run(const std::shared_ptr<each_loop> &self) {
+			for(;;) {
+				auto f = state::next(self->source_);
+				if(f->is_pending()) {
+					f->on_ready([self](future<T> &ready) {
+						if(self->handle(ready))
+							run(self);
+					});
+					return;
+				}
+				if(!self->handle(*f))
+					return;
+			}
+		}
+
+	private:
+		/** Returns true if there may be more items */
+		bool handle(future<T> &f) {
+			if(f.is_done()) {
+				try {
+					code_(f.value());
+				} catch(...) {
+					result_->fail_exception_pointer(std::current_exception());
+					return false;
+				}
+				++count_;
+				return true;
+			}
+			if(is_end_of_stream(f))
+				result_->done(count_);
+			else if(f.is_failed())
+				result_->fail_from(f);
+			else
+				result_->cancel();
+			return false;
+		}
+
+		std::shared_ptr<state> source_;
+		std::function<void(const T &)> code_;
+		std::shared_ptr<future<size_t>> result_;
+		size_t count_;
+	};
+
+	std::shared_ptr<state> state_;
+};
+
+/** Returns a merge over the given sorted sources */
+template<typename T, typename Compare = std::less<T>>
+sorted_merge<T, Compare>
+merge_sorted(std::vector<async_source<T>> sources, Compare compare = Compare())
+{
+	return sorted_merge<T, Compare>(std::move(sources), std::move(compare));
+}
+
+};
@@ -0,0 +1,439 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/channel.h>
+#include <cps/future/executor.h>
+
+namespace cps {
+
+/** How a pipeline stage queues and runs its work */
+struct stage_options {
+	/** Items that can wait in front of the stage before upstream blocks */
+	size_t queue = 64;
+	/** Items the stage works on at once */
+	size_t concurrency = 1;
+	/** Where the stage function runs. nullptr means inline, on whichever thread delivered the item */
+	executor *exec = nullptr;
+};
+
+/** A snapshot of one stage's counters */
+struct stage_stats {
+	std::string name;
+	/** Items waiting in the stage's queue, and its capacity */
+	size_t queue_depth;
+	size_t queue_capacity;
+	/** Upstream producers blocked because the queue is full */
+	size_t blocked_upstream;
+	/** Items being worked on, including those waiting for room downstream */
+	size_t in_flight;
+	size_t concurrency;
+	size_t processed;
+	size_t failed;
+	/** Mean time items spent in the queue, and in the stage function */
+	std::chrono::nanoseconds queue_time;
+	std::chrono::nanoseconds service_time;
+	std::chrono::nanoseconds max_service_time;
+	/** Mean time spent waiting for room downstream */
+	std::chrono::nanoseconds blocked_time;
+};
+
+namespace detail {
+
+/** An item plus the time it entered a stage's queue */
+template<typename T>
+struct stamped {
+	T value;
+	std::chrono::steady_clock::time_point queued;
+};
+
+class pipeline_stage_base {
+public:
+	virtual ~pipeline_stage_base() { }
+	virtual void start() = 0;
+	/** Stops taking input: queued items still go through */
+	virtual void close() = 0;
+	virtual stage_stats stats() const = 0;
+	virtual void scale(size_t concurrency) = 0;
+	virtual const std::string &name() const = 0;
+};
+
+/**
+ * One stage: a bounded input channel, and up to `concurrency` workers each
+ * taking an item, running the stage function on the executor, and passing
+ * the result downstream. A worker doesn't take another item until
+ * downstream has accepted its last result, which is how backpressure moves
+ * upstream one stage at a time.
+ */
+template<typename In, typename Out>
+class pipeline_stage : public pipeline_stage_base, public std::enable_shared_from_this<pipeline_stage<In, Out>> {
+public:
+	using clock = std::chrono::steady_clock;
+	using function = std::function<std::shared_ptr<future<Out>>(In)>;
+	using emit_function = std::function<std::shared_ptr<future<int>>(Out)>;
+
+	pipeline_stage(
+		std::string name,
+		function code,
+		const stage_options &opts
+	):name_(std::move(name)),
+	  code_(std::move(code)),
+	  exec_(opts.exec),
+	  input_(std::make_shared<channel<stamped<In>>>(opts.queue)),
+	  target_(std::max<size_t>(1, opts.concurrency)),
+	  workers_(0),
+	  in_flight_(0),
+	  processed_(0),
+	  failed_(0),
+	  dequeued_(0),
+	  queue_ns_(0),
+	  service_ns_(0),
+	  max_service_ns_(0),
+	  blocked_ns_(0)
+	{
+	}
+
+	/** Where results go, and what to do once we've finished - set before ->start */
+	void connect(emit_function emit, std::function<void()> finish) {
+		emit_ = std::move(emit);
+		finish_ = std::move(finish);
+	}
+
+	/** Queues an item for this stage */
+	std::shared_ptr<future<int>> push(In v) {
+		return input_->push(stamped<In> { std::move(v), clock::now() });
+	}
+
+	virtual void close() override { input_->close(); }
+
+	virtual void start() override {
+		size_t n = target_;
+		workers_ += n;
+		for(size_t i = 0; i < n; ++i)
+			run(this->shared_from_this());
+	}
+
+	virtual void scale(size_t concurrency) override {
+		concurrency = std::max<size_t>(1, concurrency);
+		size_t previous = target_.exchange(concurrency);
+		/* Extra workers start now; surplus ones exit after their current item */
+		for(size_t i = previous; i < concurrency; ++i) {
+			++workers_;
+			run(this->shared_from_this());
+		}
+	}
+
+	virtual const std::string &name() const override { return name_; }
+
+	virtual stage_stats stats() const override {
+		auto mean = [](uint64_t total, size_t count) {
+			return std::chrono::nanoseconds(count ? total / count : 0);
+		};
+		size_t done = processed_ + failed_;
+		return stage_stats {
+			name_,
+			input_->size(),
+			input_->capacity(),
+			input_->blocked(),
+			in_flight_,
+			target_,
+			processed_,
+			failed_,
+			mean(queue_ns_, dequeued_),
+			mean(service_ns_, done),
+			std::chrono::nanoseconds(max_service_ns_.load()),
+			mean(blocked_ns_, processed_)
+		};
+	}
+
+private:
+	using self_ptr = std::shared_ptr<pipeline_stage<In, Out>>;
+
+	/**
+	 * One worker. While everything completes synchronously we loop here,
+	 * rather than recursing through callbacks for every item.
+	 */
+	static void run(const self_ptr &self) {
+		for(;;) {
+			if(self->retire())
+				return;
+			auto item = self->input_->pop();
+			if(item->is_pending()) {
+				item->on_ready([self](future<stamped<In>> &f) {
+					if(self->take(f))
+						run(self);
+				});
+				return;
+			}
+			if(!self->take(*item))
+				return;
+		}
+	}
+
+	/** Exits this worker if we've been scaled down. Returns true if it did. */
+	bool retire() {
+		size_t current = workers_;
+		while(current > target_) {
+			if(workers_.compare_exchange_weak(current, current - 1))
+				return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Handles one item from the queue. Returns true if it was dealt with
+	 * synchronously and the worker should carry on, false if the worker has
+	 * finished or will be restarted once the item is done.
+	 */
+	bool take(future<stamped<In>> &f) {
+		if(!f.is_done()) {
+			/* The queue has been closed and drained */
+			if(--workers_ == 0 && finish_)
+				finish_();
+			return false;
+		}
+		auto self = this->shared_from_this();
+		auto item = f.value();
+		auto started = clock::now();
+		queue_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(started - item.queued).count();
+		++dequeued_;
+		++in_flight_;
+
+		/* Whichever of us and the completion gets here second restarts the worker */
+		auto returned = std::make_shared<std::atomic<bool>>(false);
+		auto next = [self, returned]() {
+			if(returned->exchange(true))
+				run(self);
+		};
+		auto work = [self, item, started, next]() mutable {
+			std::shared_ptr<future<Out>> result;
+			try {
+				result = self->code_(std::move(item.value));
+			} catch(...) {
+				result = future<Out>::create_shared();
+				result->fail_exception_pointer(std::current_exception());
+			}
+			result->on_ready([self, started, next](future<Out> &r) {
+				auto finished = clock::now();
+				self->record_service(finished - started);
+				if(!r.is_done()) {
+					--self->in_flight_;
+					++self->failed_;
+					next();
+					return;
+				}
+				self->emit_(r.value())->on_ready([self, finished, next](future<int> &) {
+					self->blocked_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - finished).count();
+					--self->in_flight_;
+					++self->processed_;
+					next();
+				});
+			});
+		};
+		if(exec_)
+			exec_->post(work);
+		else
+			work();
+		return returned->exchange(true);
+	}
+
+	void record_service(clock::duration d) {
+		uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+		service_ns_ += ns;
+		uint64_t current = max_service_ns_;
+		while(ns > current && !max_service_ns_.compare_exchange_weak(current, ns))
+			;
+	}
+
+	const std::string name_;
+	const function code_;
+	executor *const exec_;
+	std::shared_ptr<channel<stamped<In>>> input_;
+	emit_function emit_;
+	std::function<void()> finish_;
+	/** Concurrency we're aiming for, and workers currently running */
+	std::atomic<size_t> target_;
+	std::atomic<size_t> workers_;
+	std::atomic<size_t> in_flight_;
+	std::atomic<size_t> processed_;
+	std::atomic<size_t> failed_;
+	std::atomic<size_t> dequeued_;
+	std::atomic<uint64_t> queue_ns_;
+	std::atomic<uint64_t> service_ns_;
+	std::atomic<uint64_t> max_service_ns_;
+	std::atomic<uint64_t> blocked_ns_;
+};
+
+};
+
+/**
+ * A chain of stages, each with its own bounded queue, concurrency limit
+ * and executor, built with make_pipeline<In>().
+ *
+ * Items go in through ->push, which stays pending while the first stage's
+ * queue is full. Results come out of a bounded output channel, so a slow
+ * consumer holds up the last stage, which holds up the one before, and so
+ * on back to the producer. Items whose stage function fails are counted
+ * and dropped.
+ *
+ * A stage with concurrency above one may reorder items.
+ *
+ * After ->close, each stage finishes what it has queued and then closes the
+ * next, so ->pop fails with end_of_stream once everything is through.
+ * Destroying the pipeline abandons it: every stage and the output are
+ * closed, so items stuck waiting for room anywhere are dropped rather than
+ * keeping the stages alive.
+ *
+ * ->stats reports queue depth and latency for each stage, and ->scale
+ * changes a stage's concurrency while running - a stage whose queue stays
+ * full while the next one's stays empty is the one to scale.
+ */
+template<typename In, typename Out>
+class pipeline {
+public:
+	pipeline(
+		std::function<std::shared_ptr<future<int>>(In)> push,
+		std::function<void()> close,
+		std::vector<std::shared_ptr<detail::pipeline_stage_base>> stages,
+		std::shared_ptr<channel<Out>> output
+	):push_(std::move(push)),
+	  close_(std::move(close)),
+	  stages_(std::move(stages)),
+	  output_(std::move(output))
+	{
+		for(auto &s : stages_)
+			s->start();
+	}
+
+	pipeline(const pipeline &) = delete;
+	pipeline &operator=(const pipeline &) = delete;
+
+	virtual ~pipeline() {
+		for(auto &s : stages_)
+			s->close();
+		output_->close();
+	}
+
+	/** Queues an item, resolving once the first stage has room for it */
+	std::shared_ptr<future<int>> push(In v) { return push_(std::move(v)); }
+
+	/** No more input: stages drain in turn and then the output ends */
+	void close() { close_(); }
+
+	/** Returns a future for the next result */
+	std::shared_ptr<future<Out>> pop() { return output_->pop(); }
+
+	/** Results as an async_source */
+	async_source<Out> output() const { return channel<Out>::as_source(output_); }
+
+	std::vector<stage_stats> stats() const {
+		std::vector<stage_stats> out;
+		for(auto &s : stages_)
+			out.push_back(s->stats());
+		return out;
+	}
+
+	/** Changes the concurrency of the named stage */
+	void scale(const std::string &name, size_t concurrency) {
+		for(auto &s : stages_) {
+			if(s->name() == name) {
+				s->scale(concurrency);
+				return;
+			}
+		}
+		throw std::invalid_argument("no pipeline stage called " + name);
+	}
+
+private:
+	std::function<std::shared_ptr<future<int>>(In)> push_;
+	std::function<void()> close_;
+	std::vector<std::shared_ptr<detail::pipeline_stage_base>> stages_;
+	std::shared_ptr<channel<Out>> output_;
+};
+
+/**
+ * Builds a pipeline one stage at a time:
+ *
+ *     auto p = make_pipeline<std::string>()
+ *         .stage<record>("decode", decode, { 256, 2, &pool })
+ *         .stage<double>("score", score, { 64, 8, &pool })
+ *         .build();
+ */
+template<typename In, typename Current = In>
+class pipeline_builder {
+public:
+	using emit_function = std::function<std::shared_ptr<future<int>>(Current)>;
+
+	pipeline_builder(
+	):connect_(nullptr)
+	{
+	}
+
+	/** Adds a stage taking the previous stage's output, and returning a future<Next> */
+	template<typename Next, typename F>
+	pipeline_builder<In, Next>
+	stage(std::string name, F code, stage_options opts = stage_options()) {
+		auto s = std::make_shared<detail::pipeline_stage<Current, Next>>(
+			std::move(name),
+			typename detail::pipeline_stage<Current, Next>::function(std::move(code)),
+			opts
+		);
+		pipeline_builder<In, Next> next;
+		next.stages_ = stages_;
+		next.stages_.push_back(s);
+		next.push_ = push_;
+		next.close_ = close_;
+		if(connect_) {
+			/* Hook the previous stage up to this one */
+			connect_(
+				[s](Current v) { return s->push(std::move(v)); },
+				[s] { s->close(); }
+			);
+		} else {
+			next.push_ = [s](In v) { return s->push(std::move(v)); };
+			next.close_ = [s] { s->close(); };
+		}
+		next.connect_ = [s](std::function<std::shared_ptr<future<int>>(Next)> emit, std::function<void()> finish) {
+			s->connect(std::move(emit), std::move(finish));
+		};
+		return next;
+	}
+
+	/** Finishes the pipeline, with room for this many results waiting to be popped */
+	std::shared_ptr<pipeline<In, Current>> build(size_t output_capacity = 64) {
+		if(!connect_)
+			throw std::logic_error("a pipeline needs at least one stage");
+		auto output = std::make_shared<channel<Current>>(output_capacity);
+		connect_(
+			[output](Current v) { return output->push(std::move(v)); },
+			[output] { output->close(); }
+		);
+		return std::make_shared<pipeline<In, Current>>(push_, close_, stages_, output);
+	}
+
+private:
+	template<typename, typename> friend class pipeline_builder;
+
+	std::vector<std::shared_ptr<detail::pipeline_stage_base>> stages_;
+	std::function<std::shared_ptr<future<int>>(In)> push_;
+	std::function<void()> close_;
+	/** Connects the last stage's output, once we know where it goes */
+	std::function<void(emit_function, std::function<void()>)> connect_;
+};
+
+template<typename In>
+pipeline_builder<In>
+make_pipeline()
+{
+	return pipeline_builder<In>();
+}
+
+};
@@ -0,0 +1,406 @@
+#pragma once
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/buffer.h>
+#include <cps/future/reactor.h>
+#include <cps/future/source.h>
+#include <cps/future/write_queue.h>
+
+extern char **environ;
+
+namespace cps {
+
+/** How a child process ended */
+struct exit_status {
+	/** Exit code, if it exited normally */
+	int code = 0;
+	/** The signal which killed it, or 0 if it exited normally */
+	int signal = 0;
+
+	bool success() const { return code == 0 && signal == 0; }
+};
+
+/**
+ * The read end of a pipe, as an async source of buffers.
+ *
+ * ->read returns a future for the next chunk, failing with end_of_stream
+ * once the writer has closed its end. ->read_all collects everything up to
+ * that point. Only one read should be outstanding at a time.
+ *
+ * Takes ownership of the fd, which is made nonblocking. Destroying the
+ * reader cancels any read in progress. Use from the loop thread only.
+ */
+class pipe_reader {
+public:
+	pipe_reader(
+		reactor &loop,
+		int fd
+	):state_(std::make_shared<shared_state>(loop, fd))
+	{
+		::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	pipe_reader(const pipe_reader &) = delete;
+	pipe_reader &operator=(const pipe_reader &) = delete;
+
+	~pipe_reader() {
+		state_->closed = true;
+		state_->loop.remove(state_->fd);
+		::close(state_->fd);
+	}
+
+	/** Returns a future for the next chunk of data */
+	std::shared_ptr<future<buffer>> read() {
+		auto f = future<buffer>::create_shared(u8"pipe_reader::read");
+		read_into(state_, f);
+		return f;
+	}
+
+	/** Returns a future for everything up to end of file */
+	std::shared_ptr<future<buffer>> read_all() {
+		auto out = future<buffer>::create_shared(u8"pipe_reader::read_all");
+		collect(state_, std::make_shared<buffer>(), out);
+		return out;
+	}
+
+	/** This pipe as an async_source. The source keeps the pipe open while it's around. */
+	static async_source<buffer> as_source(std::shared_ptr<pipe_reader> p) {
+		return [p] { return p->read(); };
+	}
+
+	int fd() const { return state_->fd; }
+
+private:
+	struct shared_state {
+		shared_state(
+			reactor &loop,
+			int fd
+		):loop(loop),
+		  fd(fd)
+		{
+		}
+
+		reactor &loop;
+		const int fd;
+		bool closed = false;
+		read_block incoming;
+	};
+
+	static void read_into(const std::shared_ptr<shared_state> &s, const std::shared_ptr<future<buffer>> &f) {
+		if(s->closed) {
+			f->cancel();
+			return;
+		}
+		std::error_code ec;
+		auto data = s->incoming.read(s->fd, ec);
+		if(!ec && !data.empty()) {
+			f->done(std::move(data));
+		} else if(!ec) {
+			f->fail_exception_pointer(end_of_stream());
+		} else if(ec.value() == EAGAIN || ec.value() == EWOULDBLOCK) {
+			s->loop.readable(s->fd)->on_ready([s, f](future<int> &r) {
+				if(!f->is_pending())
+					return;
+				if(r.is_done())
+					read_into(s, f);
+				else
+					f->cancel();
+			});
+		} else {
+			f->fail(std::system_error(ec, "read failed"));
+		}
+	}
+
+	/* Data that's already there arrives synchronously, so loop rather than recursing */
+	static void collect(const std::shared_ptr<shared_state> &s, const std::shared_ptr<buffer> &acc, const std::shared_ptr<future<buffer>> &out) {
+		for(;;) {
+			auto f = future<buffer>::create_shared(u8"pipe_reader::read");
+			read_into(s, f);
+			if(f->is_pending()) {
+				f->on_ready([s, acc, out](future<buffer> &r) {
+					if(collected(r, *acc, *out))
+						collect(s, acc, out);
+				});
+				return;
+			}
+			if(!collected(*f, *acc, *out))
+				return;
+		}
+	}
+
+	/** Returns true if there may be more to read */
+	static bool collected(future<buffer> &f, buffer &acc, future<buffer> &out) {
+		if(f.is_done()) {
+			acc.append(f.value());
+			return true;
+		}
+		if(is_end_of_stream(f))
+			out.done(acc);
+		else if(f.is_failed())
+			out.fail_from(f);
+		else
+			out.cancel();
+		return false;
+	}
+
+	std::shared_ptr<shared_state> state_;
+};
+
+/** What to hook up when spawning a child */
+struct spawn_options {
+	/** Give the child a pipe for stdin, written through ->write_stdin */
+	bool pipe_stdin = false;
+	/** Capture stdout and stderr, read through ->stdout_pipe and ->stderr_pipe */
+	bool capture_stdout = false;
+	bool capture_stderr = false;
+	/** Environment for the child, as NAME=value strings. Empty means inherit ours. */
+	std::vector<std::string> env;
+};
+
+/**
+ * A child process started by spawn().
+ *
+ * Exit is watched through a pidfd registered with the reactor, so there's
+ * no thread blocked in waitpid and no SIGCHLD handler: each child costs one
+ * fd plus whatever pipes it has. ->exited resolves with how the child
+ * ended, once it has been reaped. ->kill signals it through the pidfd, so
+ * it can never hit some other process that has reused the pid.
+ *
+ * Needs Linux 5.3 or later for pidfd_open. Don't reap our children
+ * elsewhere - waitpid(-1, ...) or ignoring SIGCHLD will steal their exit
+ * status. Writing to the stdin of a child which has exited raises SIGPIPE,
+ * as for any pipe, so ignore or block that if children may quit early.
+ * Use from the loop thread only.
+ */
+class child_process {
+public:
+	child_process(const child_process &) = delete;
+	child_process &operator=(const child_process &) = delete;
+
+	~child_process() {
+		if(stdin_)
+			close_stdin();
+	}
+
+	pid_t pid() const { return state_->pid; }
+
+	/** Resolves once the child has exited and been reaped */
+	std::shared_ptr<future<exit_status>> exited() const { return state_->exited; }
+
+	/** Sends a signal to the child. Does nothing once it has been reaped. */
+	void kill(int sig = SIGTERM) {
+		if(state_->pidfd < 0)
+			return;
+		if(::syscall(SYS_pidfd_send_signal, state_->pidfd, sig, nullptr, 0) < 0 && errno != ESRCH)
+			throw std::system_error(errno, std::system_category(), "pidfd_send_signal failed");
+	}
+
+	/** Queues data for the child's stdin. Needs spawn_options::pipe_stdin. */
+	std::shared_ptr<future<size_t>> write_stdin(buffer data) {
+		if(!stdin_)
+			throw std::logic_error("child has no stdin pipe");
+		last_write_ = stdin_->send(std::move(data));
+		return last_write_;
+	}
+
+	/** Closes stdin once everything queued has been written, so the child sees end of file */
+	void close_stdin() {
+		if(!stdin_)
+			return;
+		auto fd = stdin_fd_;
+		auto &loop = loop_;
+		std::shared_ptr<write_queue> queue = std::move(stdin_);
+		auto finish = [queue, fd, &loop]() mutable {
+			queue.reset();
+			loop.remove(fd);
+			::close(fd);
+		};
+		if(last_write_ && last_write_->is_pending())
+			last_write_->on_ready([finish](future<size_t> &) mutable { finish(); });
+		else
+			finish();
+		last_write_.reset();
+	}
+
+	/** The child's stdout, if captured */
+	std::shared_ptr<pipe_reader> stdout_pipe() const { return stdout_; }
+	/** The child's stderr, if captured */
+	std::shared_ptr<pipe_reader> stderr_pipe() const { return stderr_; }
+
+private:
+	friend std::shared_ptr<child_process> spawn(reactor &, const std::vector<std::string> &, const spawn_options &);
+
+	struct shared_state {
+		reactor &loop;
+		pid_t pid;
+		int pidfd;
+		std::shared_ptr<future<exit_status>> exited;
+	};
+
+	child_process(
+		reactor &loop,
+		pid_t pid,
+		int pidfd
+	):loop_(loop),
+	  state_(std::make_shared<shared_state>(shared_state {
+		loop,
+		pid,
+		pidfd,
+		future<exit_status>::create_shared(u8"child_process::exited")
+	  })),
+	  stdin_fd_(-1)
+	{
+		watch(state_);
+	}
+
+	/** Waits for the pidfd to become readable, which it does when the child exits */
+	static void watch(const std::shared_ptr<shared_state> &s) {
+		s->loop.readable(s->pidfd)->on_ready([s](future<int> &r) {
+			if(!r.is_done())
+				return;
+			int status = 0;
+			pid_t rslt;
+			do {
+				rslt = ::waitpid(s->pid, &status, WNOHANG);
+			} while(rslt < 0 && errno == EINTR);
+			if(rslt == 0) {
+				watch(s);
+				return;
+			}
+			s->loop.remove(s->pidfd);
+			::close(s->pidfd);
+			s->pidfd = -1;
+			if(rslt < 0) {
+				s->exited->fail(std::system_error(errno, std::system_category(), "waitpid failed"));
+				return;
+			}
+			exit_status e;
+			if(WIFEXITED(status))
+				e.code = WEXITSTATUS(status);
+			else if(WIFSIGNALED(status))
+				e.signal = WTERMSIG(status);
+			s->exited->done(e);
+		});
+	}
+
+	reactor &loop_;
+	std::shared_ptr<shared_state> state_;
+	std::shared_ptr<write_queue> stdin_;
+	int stdin_fd_;
+	std::shared_ptr<future<size_t>> last_write_;
+	std::shared_ptr<pipe_reader> stdout_;
+	std::shared_ptr<pipe_reader> stderr_;
+};
+
+/**
+ * Starts argv[0] (searched for in PATH) with the given arguments, and
+ * returns a handle for watching and talking to it.
+ *
+ * The child starts with default signal handling and nothing blocked,
+ * whatever our own mask is - see signal_set. Only the pipes asked for in
+ * opts are passed on; every other fd we have stays behind as long as it is
+ * close-on-exec.
+ *
+ * @throws std::system_error if the process could not be started, including
+ * when the program doesn't exist
+ */
+inline std::shared_ptr<child_process>
+spawn(reactor &loop, const std::vector<std::string> &argv, const spawn_options &opts = spawn_options())
+{
+	if(argv.empty())
+		throw std::invalid_argument("spawn needs a program to run");
+
+	/* [0] is the parent's end, [1] the child's - reversed for stdin */
+	int in[2] = { -1, -1 }, out[2] = { -1, -1 }, err[2] = { -1, -1 };
+	auto cleanup = [&] {
+		for(int fd : { in[0], in[1], out[0], out[1], err[0], err[1] })
+			if(fd >= 0)
+				::close(fd);
+	};
+	auto fail = [&](int e, const char *what) {
+		cleanup();
+		throw std::system_error(e, std::system_category(), what);
+	};
+	if(opts.pipe_stdin && ::pipe2(in, O_CLOEXEC) < 0)
+		fail(errno, "could not create stdin pipe");
+	if(opts.capture_stdout && ::pipe2(out, O_CLOEXEC) < 0)
+		fail(errno, "could not create stdout pipe");
+	if(opts.capture_stderr && ::pipe2(err, O_CLOEXEC) < 0)
+		fail(errno, "could not create stderr pipe");
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	/* dup2 clears close-on-exec on the new fd, and the originals go away on exec */
+	if(opts.pipe_stdin)
+		posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+	if(opts.capture_stdout)
+		posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+	if(opts.capture_stderr)
+		posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t none, all;
+	sigemptyset(&none);
+	sigfillset(&all);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setsigdefault(&attr, &all);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	std::vector<char *> args;
+	for(auto &a : argv)
+		args.push_back(const_cast<char *>(a.c_str()));
+	args.push_back(nullptr);
+	std::vector<char *> env;
+	for(auto &e : opts.env)
+		env.push_back(const_cast<char *>(e.c_str()));
+	env.push_back(nullptr);
+
+	pid_t pid;
+	int rslt = ::posix_spawnp(&pid, args[0], &actions, &attr, args.data(), opts.env.empty() ? environ : env.data());
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if(rslt != 0)
+		fail(rslt, "could not start process");
+
+	/* The child is ours and not yet reaped, so the pid can't have been reused */
+	int pidfd = static_cast<int>(::syscall(SYS_pidfd_open, pid, 0));
+	if(pidfd < 0) {
+		int e = errno;
+		::kill(pid, SIGKILL);
+		::waitpid(pid, nullptr, 0);
+		fail(e, "pidfd_open failed");
+	}
+	::fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+
+	std::shared_ptr<child_process> child { new child_process(loop, pid, pidfd) };
+	if(opts.pipe_stdin) {
+		::close(in[0]);
+		::fcntl(in[1], F_SETFL, ::fcntl(in[1], F_GETFL) | O_NONBLOCK);
+		child->stdin_fd_ = in[1];
+		child->stdin_ = std::make_shared<write_queue>(loop, in[1]);
+	}
+	if(opts.capture_stdout) {
+		::close(out[1]);
+		child->stdout_ = std::make_shared<pipe_reader>(loop, out[0]);
+	}
+	if(opts.capture_stderr) {
+		::close(err[1]);
+		child->stderr_ = std::make_shared<pipe_reader>(loop, err[0]);
+	}
+	return child;
+}
+
+};
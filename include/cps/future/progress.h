@@ -0,0 +1,224 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cps/future.h>
+
+namespace cps {
+
+/** How far a long-running operation has got */
+struct progress {
+	uint64_t completed;
+	/** Zero if not known */
+	uint64_t total;
+
+	/** Completed as a fraction of the total, or 0 if we don't know the total */
+	double fraction() const {
+		return total ? static_cast<double>(completed) / total : 0.0;
+	}
+};
+
+/**
+ * A future which can also report progress before it resolves.
+ *
+ * The producer calls ->advance or ->report as often as it likes: each is
+ * a couple of atomic updates plus a clock read and a comparison, and takes
+ * no lock unless a subscriber is due an update.
+ *
+ * Consumers subscribe with ->on_progress(code, interval), and get at most
+ * one call per interval. Updates in between are coalesced - the next call
+ * sees the latest figures - so a producer reporting every item never
+ * floods its subscribers. Progress calls for one future never overlap,
+ * and are made on whichever producer thread found an update due.
+ *
+ * Each subscriber also gets a last call with the final figures when the
+ * future resolves, if it hasn't seen them already, so progress bars
+ * finish at the right place. Reports after that are ignored.
+ *
+ *     auto load = progress_future<size_t>::create_shared(u8"bulk load");
+ *     load->on_progress([](const progress &p) {
+ *         std::cout << p.completed << "/" << p.total << std::endl;
+ *     }, std::chrono::milliseconds(250));
+ */
+template<typename T>
+class progress_future : public future<T> {
+public:
+	using clock = std::chrono::steady_clock;
+
+	static std::shared_ptr<progress_future<T>> create_shared(
+		const std::string &label = u8"unlabelled future"
+	) {
+		auto p = std::make_shared<progress_future<T>>(label);
+		p->shared(p);
+		return p;
+	}
+
+	progress_future(
+		const std::string &label = u8"unlabelled future"
+	):future<T>(label),
+	  completed_(0),
+	  total_(0),
+	  version_(0),
+	  next_due_(std::numeric_limits<int64_t>::max()),
+	  delivering_(false),
+	  delivering_thread_(),
+	  notifications_(0)
+	{
+	}
+
+	/** Sets the total amount of work expected */
+	void set_total(uint64_t total) {
+		total_.store(total, std::memory_order_relaxed);
+		updated();
+	}
+
+	/** Sets the amount of work completed so far */
+	void report(uint64_t completed) {
+		completed_.store(completed, std::memory_order_relaxed);
+		updated();
+	}
+
+	/** Adds to the amount of work completed. Safe to call from several threads at once. */
+	void advance(uint64_t n = 1) {
+		completed_.fetch_add(n, std::memory_order_relaxed);
+		updated();
+	}
+
+	/** The latest figures */
+	progress current() const {
+		return progress {
+			completed_.load(std::memory_order_relaxed),
+			total_.load(std::memory_order_relaxed)
+		};
+	}
+
+	/**
+	 * Calls the given code with the latest figures, no more often than the
+	 * given interval. The first call happens on the next update.
+	 */
+	std::shared_ptr<progress_future<T>>
+	on_progress(
+		std::function<void(const progress &)> code,
+		clock::duration interval = std::chrono::milliseconds(100)
+	) {
+		auto sub = std::make_shared<subscription>(subscription {
+			std::move(code),
+			std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count(),
+			0,
+			0
+		});
+		{
+			std::lock_guard<std::mutex> guard { subscription_mutex_ };
+			subscriptions_.push_back(sub);
+			/* Due straight away */
+			next_due_.store(std::numeric_limits<int64_t>::min(), std::memory_order_relaxed);
+		}
+		this->call_when_ready([this, sub](future<T> &) {
+			flush(*sub);
+		});
+		return std::static_pointer_cast<progress_future<T>>(this->shared());
+	}
+
+	/** Number of progress calls made so far, across all subscribers */
+	size_t notifications() const { return notifications_.load(); }
+
+private:
+	struct subscription {
+		std::function<void(const progress &)> code;
+		int64_t interval;
+		/** Earliest time for the next call, in nanoseconds on our clock */
+		int64_t next;
+		/** The last version this subscriber has seen */
+		uint64_t seen;
+	};
+
+	static int64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+	}
+
+	void updated() {
+		version_.fetch_add(1, std::memory_order_release);
+		/* The common case: nobody is due anything yet */
+		int64_t t = now();
+		if(t < next_due_.load(std::memory_order_relaxed))
+			return;
+		if(delivering_.exchange(true, std::memory_order_acquire))
+			return;
+		delivering_thread_ = std::this_thread::get_id();
+		deliver(t);
+		delivering_thread_ = std::thread::id();
+		delivering_.store(false, std::memory_order_release);
+	}
+
+	/** Calls every subscriber who is due. Only one thread at a time gets here. */
+	void deliver(int64_t t) {
+		std::vector<std::shared_ptr<subscription>> due;
+		auto p = current();
+		{
+			std::lock_guard<std::mutex> guard { subscription_mutex_ };
+			if(!this->is_pending()) {
+				next_due_.store(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
+				return;
+			}
+			uint64_t version = version_.load(std::memory_order_acquire);
+			int64_t next = std::numeric_limits<int64_t>::max();
+			for(auto &sub : subscriptions_) {
+				if(sub->next <= t && sub->seen < version) {
+					sub->seen = version;
+					sub->next = t + sub->interval;
+					due.push_back(sub);
+				}
+				next = std::min(next, sub->next);
+			}
+			next_due_.store(next, std::memory_order_relaxed);
+		}
+		for(auto &sub : due) {
+			++notifications_;
+			sub->code(p);
+		}
+	}
+
+	/** The last call, once we've resolved: wait for any delivery in progress so calls don't overlap */
+	void flush(subscription &sub) {
+		/* A progress call might resolve the future itself, and then we're already delivering */
+		bool nested = delivering_thread_ == std::this_thread::get_id();
+		while(!nested && delivering_.exchange(true, std::memory_order_acquire))
+			std::this_thread::yield();
+		uint64_t version = version_.load(std::memory_order_acquire);
+		bool call;
+		{
+			std::lock_guard<std::mutex> guard { subscription_mutex_ };
+			call = sub.seen < version;
+			sub.seen = version;
+		}
+		if(call) {
+			++notifications_;
+			sub.code(current());
+		}
+		if(!nested)
+			delivering_.store(false, std::memory_order_release);
+	}
+
+	std::atomic<uint64_t> completed_;
+	std::atomic<uint64_t> total_;
+	/** Bumped on every update, so we know who has seen the latest figures */
+	std::atomic<uint64_t> version_;
+	/** The earliest time any subscriber is due a call */
+	std::atomic<int64_t> next_due_;
+	/** Set while a thread is making progress calls */
+	std::atomic<bool> delivering_;
+	std::atomic<std::thread::id> delivering_thread_;
+	std::atomic<size_t> notifications_;
+	std::mutex subscription_mutex_;
+	std::vector<std::shared_ptr<subscription>> subscriptions_;
+};
+
+};
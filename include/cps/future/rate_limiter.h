@@ -0,0 +1,225 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/scheduler.h>
+
+namespace cps {
+
+/**
+ * A token bucket: tokens refill at `rate` per second up to `burst`, and
+ * ->acquire(n) returns a future which resolves once n tokens are ours.
+ *
+ * Internally this is the equivalent "virtual scheduling" form of the
+ * bucket: a single atomic holds the time at which the bucket would be
+ * empty, and taking n tokens pushes that time forward by n / rate. While
+ * there's enough in the bucket that is one compare-and-swap with no lock,
+ * which is all ->try_acquire ever does.
+ *
+ * When there isn't enough, ->acquire still reserves the tokens with the
+ * same compare-and-swap, so we know exactly when they'll be available and
+ * callers are served in order. The caller joins a queue of waiters, and
+ * the bucket keeps one timer on the scheduler, for the earliest of them;
+ * when it fires, everyone who is due is released together. A thousand
+ * waiters cost one timer registration, not a thousand.
+ *
+ * Use one bucket per destination: they can all share a scheduler.
+ * Cancelling a pending acquire does not give the tokens back. The future
+ * from acquire resolves on the scheduler's thread.
+ */
+class token_bucket {
+public:
+	token_bucket(
+		scheduler &sched,
+		double rate,
+		double burst
+	):state_(std::make_shared<state>(sched, rate, burst))
+	{
+	}
+
+	/**
+	 * Takes n tokens if they're available now, without waiting or locking.
+	 * Returns false otherwise, including when others are already waiting.
+	 */
+	bool try_acquire(size_t n = 1) {
+		auto &s = *state_;
+		if(n > s.burst)
+			return false;
+		int64_t now = s.now();
+		int64_t cost = s.cost(n);
+		int64_t tat = s.tat.load(std::memory_order_relaxed);
+		for(;;) {
+			int64_t next = std::max(tat, now) + cost;
+			if(next - now > s.tolerance)
+				return false;
+			if(s.tat.compare_exchange_weak(tat, next, std::memory_order_acq_rel, std::memory_order_relaxed))
+				return true;
+		}
+	}
+
+	/**
+	 * Returns a future which resolves once n tokens have been taken. Fails
+	 * straight away if n is more than the bucket can ever hold.
+	 */
+	std::shared_ptr<future<int>> acquire(size_t n = 1) {
+		auto f = future<int>::create_shared(u8"token bucket");
+		auto &s = *state_;
+		if(n > s.burst)
+			return f->fail_exception_pointer(std::make_exception_ptr(std::invalid_argument("asked for more tokens than the bucket holds")));
+		int64_t now = s.now();
+		int64_t cost = s.cost(n);
+		int64_t tat = s.tat.load(std::memory_order_relaxed);
+		int64_t next;
+		do {
+			next = std::max(tat, now) + cost;
+		} while(!s.tat.compare_exchange_weak(tat, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+		int64_t ready = next - s.tolerance;
+		if(ready <= now)
+			return f->done(0);
+		state::wait(state_, ready, f);
+		return f;
+	}
+
+	/** Tokens in the bucket right now. Negative if they're already promised to waiters. */
+	double available() const {
+		auto &s = *state_;
+		int64_t now = s.now();
+		int64_t tat = std::max(s.tat.load(std::memory_order_relaxed), now);
+		return (s.tolerance - (tat - now)) / s.interval;
+	}
+
+	/** Number of acquires waiting for tokens */
+	size_t waiting() const {
+		std::lock_guard<std::mutex> guard { state_->mutex };
+		return state_->waiters.size();
+	}
+
+	/** Number of timers registered with the scheduler so far */
+	size_t timers() const {
+		std::lock_guard<std::mutex> guard { state_->mutex };
+		return state_->timers;
+	}
+
+	double rate() const { return 1e9 / state_->interval; }
+	double burst() const { return state_->burst; }
+
+private:
+	class state {
+	public:
+		state(
+			scheduler &sched,
+			double rate,
+			double burst
+		):sched(sched),
+		  interval(1e9 / rate),
+		  burst(burst),
+		  tolerance(std::llround(burst * 1e9 / rate)),
+		  tat(0),
+		  armed(false),
+		  armed_for(0),
+		  generation(0),
+		  timers(0)
+		{
+			if(!(rate > 0) || !(burst >= 1))
+				throw std::invalid_argument("token bucket needs a positive rate and a burst of at least one token");
+			/* Empty at "now" means full */
+			tat = this->now();
+		}
+
+		int64_t now() const {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(sched.now().time_since_epoch()).count();
+		}
+
+		int64_t cost(size_t n) const {
+			return std::llround(n * interval);
+		}
+
+		/** Queues a waiter for the given time, and makes sure a timer covers it */
+		static void wait(const std::shared_ptr<state> &self, int64_t ready, std::shared_ptr<future<int>> f) {
+			{
+				std::lock_guard<std::mutex> guard { self->mutex };
+				self->waiters.push(waiter { ready, std::move(f) });
+			}
+			arm(self);
+		}
+
+		/** Registers a timer for the earliest waiter, unless one is already due by then */
+		static void arm(const std::shared_ptr<state> &self) {
+			int64_t when;
+			uint64_t gen;
+			{
+				std::lock_guard<std::mutex> guard { self->mutex };
+				if(self->waiters.empty())
+					return;
+				when = self->waiters.top().ready;
+				if(self->armed && self->armed_for <= when)
+					return;
+				self->armed = true;
+				self->armed_for = when;
+				gen = ++self->generation;
+				++self->timers;
+			}
+			auto tp = scheduler::time_point(std::chrono::duration_cast<scheduler::duration>(std::chrono::nanoseconds(when)));
+			self->sched.at(tp)->on_ready([self, gen](future<int> &) {
+				fire(self, gen);
+			});
+		}
+
+		/** Releases everyone who is due, then re-arms for whoever is next */
+		static void fire(const std::shared_ptr<state> &self, uint64_t gen) {
+			std::vector<std::shared_ptr<future<int>>> due;
+			{
+				std::lock_guard<std::mutex> guard { self->mutex };
+				/* An earlier timer may have replaced us, in which case that one is still armed */
+				if(gen == self->generation)
+					self->armed = false;
+				int64_t now = self->now();
+				while(!self->waiters.empty() && self->waiters.top().ready <= now) {
+					due.push_back(self->waiters.top().f);
+					self->waiters.pop();
+				}
+			}
+			arm(self);
+			for(auto &f : due) {
+				if(f->is_pending())
+					f->done(0);
+			}
+		}
+
+		struct waiter {
+			int64_t ready;
+			std::shared_ptr<future<int>> f;
+
+			bool operator>(const waiter &other) const { return ready > other.ready; }
+		};
+
+		scheduler &sched;
+		/** Nanoseconds per token */
+		const double interval;
+		const double burst;
+		/** How far ahead of now the empty time may run: the burst, in nanoseconds */
+		const int64_t tolerance;
+		/** When the bucket will be empty, in nanoseconds on the scheduler's clock */
+		std::atomic<int64_t> tat;
+
+		mutable std::mutex mutex;
+		std::priority_queue<waiter, std::vector<waiter>, std::greater<waiter>> waiters;
+		bool armed;
+		int64_t armed_for;
+		uint64_t generation;
+		size_t timers;
+	};
+
+	std::shared_ptr<state> state_;
+};
+
+};
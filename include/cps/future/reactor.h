@@ -0,0 +1,275 @@
+#pragma once
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+#include <system_error>
+
+#include <cps/future.h>
+
+namespace cps {
+
+/**
+ * A minimal epoll-based event loop.
+ *
+ * File descriptor readiness is exposed as futures: ->readable(fd) and
+ * ->writable(fd) each return a future that resolves (with the fd) the next
+ * time the kernel reports that condition. Interest is one-shot, so ask again
+ * after handling the event.
+ *
+ * Each call to ->run_once is one loop iteration: wait for events, resolve
+ * the readiness futures, then run anything queued through ->defer. That last
+ * step gives batching helpers such as write_queue a place to coalesce work
+ * queued during the iteration.
+ *
+ * Everything except ->post and ->stop must be called from the thread running
+ * the loop.
+ */
+class reactor {
+public:
+	reactor(
+	):epoll_fd_(::epoll_create1(EPOLL_CLOEXEC)),
+	  wake_fd_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+	  stopping_(false),
+	  syscalls_(0)
+	{
+		if(epoll_fd_ < 0 || wake_fd_ < 0)
+			throw std::system_error(errno, std::system_category(), "could not create reactor");
+		struct epoll_event ev { };
+		ev.events = EPOLLIN;
+		ev.data.fd = wake_fd_;
+		if(::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) < 0)
+			throw std::system_error(errno, std::system_category(), "could not watch wakeup fd");
+	}
+
+	reactor(const reactor &) = delete;
+	reactor &operator=(const reactor &) = delete;
+
+	virtual ~reactor() {
+		::close(wake_fd_);
+		::close(epoll_fd_);
+	}
+
+	/** Returns a future which resolves once the given fd is readable */
+	std::shared_ptr<future<int>>
+	readable(int fd)
+	{
+		auto &w = watches_[fd];
+		/* A watcher somebody cancelled is no use to the next caller */
+		if(!w.read || !w.read->is_pending())
+			w.read = future<int>::create_shared(u8"readable");
+		arm(fd, w);
+		return w.read;
+	}
+
+	/** Returns a future which resolves once the given fd is writable */
+	std::shared_ptr<future<int>>
+	writable(int fd)
+	{
+		auto &w = watches_[fd];
+		if(!w.write || !w.write->is_pending())
+			w.write = future<int>::create_shared(u8"writable");
+		arm(fd, w);
+		return w.write;
+	}
+
+	/**
+	 * Stops watching the given fd. Any pending readiness futures are
+	 * cancelled. Call this before closing the fd.
+	 */
+	void
+	remove(int fd)
+	{
+		auto it = watches_.find(fd);
+		if(it == watches_.end())
+			return;
+		auto w = std::move(it->second);
+		watches_.erase(it);
+		if(w.registered) {
+			++syscalls_;
+			::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+		}
+		if(w.read && w.read->is_pending()) w.read->cancel();
+		if(w.write && w.write->is_pending()) w.write->cancel();
+	}
+
+	/**
+	 * Queues code to run at the end of the current loop iteration, after all
+	 * readiness futures for that iteration have been resolved.
+	 */
+	void
+	defer(std::function<void()> code)
+	{
+		deferred_.push_back(std::move(code));
+	}
+
+	/**
+	 * Queues code to run on the loop thread. Safe to call from any thread.
+	 */
+	void
+	post(std::function<void()> code)
+	{
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			posted_.push_back(std::move(code));
+		}
+		wake();
+	}
+
+	/**
+	 * Runs a single iteration of the loop, waiting up to timeout_ms
+	 * milliseconds (-1 to wait indefinitely) for events. Does not block if
+	 * there is deferred work pending.
+	 * @returns the number of events handled
+	 */
+	size_t
+	run_once(int timeout_ms = -1)
+	{
+		struct epoll_event events[64];
+		if(!deferred_.empty())
+			timeout_ms = 0;
+		int n;
+		do {
+			++syscalls_;
+			n = ::epoll_wait(epoll_fd_, events, 64, timeout_ms);
+		} while(n < 0 && errno == EINTR);
+		if(n < 0)
+			throw std::system_error(errno, std::system_category(), "epoll_wait failed");
+
+		std::vector<std::pair<std::shared_ptr<future<int>>, int>> ready;
+		for(int i = 0; i < n; ++i) {
+			int fd = events[i].data.fd;
+			if(fd == wake_fd_) {
+				uint64_t v;
+				while(++syscalls_, ::read(wake_fd_, &v, sizeof(v)) > 0) { }
+				std::vector<std::function<void()>> posted;
+				{
+					std::lock_guard<std::mutex> guard { mutex_ };
+					posted.swap(posted_);
+				}
+				for(auto &code : posted)
+					defer(std::move(code));
+				continue;
+			}
+			auto it = watches_.find(fd);
+			if(it == watches_.end())
+				continue;
+			auto &w = it->second;
+			/* Interest is oneshot, so the registration is now disarmed */
+			w.armed = 0;
+			const uint32_t e = events[i].events;
+			const bool err = e & (EPOLLERR | EPOLLHUP);
+			if(w.read && (err || (e & EPOLLIN))) {
+				ready.emplace_back(std::move(w.read), fd);
+				w.read.reset();
+			}
+			if(w.write && (err || (e & EPOLLOUT))) {
+				ready.emplace_back(std::move(w.write), fd);
+				w.write.reset();
+			}
+			/* Anything we didn't report this time needs rearming */
+			arm(fd, w);
+		}
+
+		/* Callbacks may ask for more readiness notifications, so we resolve
+		 * only after we're done touching the watch list.
+		 */
+		for(auto &it : ready) {
+			if(it.first->is_pending())
+				it.first->done(it.second);
+		}
+
+		/* Deferred handlers may queue more deferred work, which will
+		 * run on the next iteration
+		 */
+		std::vector<std::function<void()>> deferred;
+		deferred.swap(deferred_);
+		for(auto &code : deferred)
+			code();
+		return static_cast<size_t>(n);
+	}
+
+	/** Runs the loop until ->stop is called */
+	void
+	run()
+	{
+		while(!stopping_.exchange(false))
+			run_once();
+	}
+
+	/** Asks ->run to return after the current iteration. Safe from any thread. */
+	void
+	stop()
+	{
+		stopping_ = true;
+		wake();
+	}
+
+	/** System calls made on the loop thread so far: waits, and changes to the epoll set */
+	size_t
+	syscalls() const
+	{
+		return syscalls_;
+	}
+
+protected:
+	/** Readiness futures for a single fd */
+	struct watch {
+		std::shared_ptr<future<int>> read;
+		std::shared_ptr<future<int>> write;
+		/** True once the fd has been added to the epoll set */
+		bool registered = false;
+		/** Events we currently have armed */
+		uint32_t armed = 0;
+	};
+
+	/** Updates the epoll registration to match the futures we're waiting on */
+	void
+	arm(int fd, watch &w)
+	{
+		uint32_t want = (w.read ? uint32_t(EPOLLIN) : 0) | (w.write ? uint32_t(EPOLLOUT) : 0);
+		if(!want || want == w.armed)
+			return;
+		struct epoll_event ev { };
+		ev.events = want | EPOLLONESHOT;
+		ev.data.fd = fd;
+		++syscalls_;
+		if(::epoll_ctl(epoll_fd_, w.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+			throw std::system_error(errno, std::system_category(), "epoll_ctl failed");
+		w.registered = true;
+		w.armed = want;
+	}
+
+	/** Interrupts epoll_wait */
+	void
+	wake()
+	{
+		uint64_t v = 1;
+		ssize_t rslt = ::write(wake_fd_, &v, sizeof(v));
+		(void)rslt;
+	}
+
+protected:
+	int epoll_fd_;
+	int wake_fd_;
+	std::atomic<bool> stopping_;
+	size_t syscalls_;
+	/** Readiness futures, keyed by fd */
+	std::unordered_map<int, watch> watches_;
+	/** Work to run at the end of this iteration */
+	std::vector<std::function<void()>> deferred_;
+	/** Guard for posted_, since ->post can be called from any thread */
+	std::mutex mutex_;
+	/** Work queued from other threads */
+	std::vector<std::function<void()>> posted_;
+};
+
+};
+
@@ -0,0 +1,234 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(__SANITIZE_THREAD__)
+#define CPS_READINESS_AVX2 1
+#include <immintrin.h>
+#else
+#define CPS_READINESS_AVX2 0
+#endif
+
+#include <cps/future.h>
+
+namespace cps {
+
+namespace detail {
+
+/** Clears and reports one word's worth of ready bits */
+inline void
+take_word(std::atomic<uint64_t> &word, size_t base, std::vector<size_t> &out)
+{
+	uint64_t bits = word.exchange(0, std::memory_order_acq_rel);
+	while(bits) {
+		out.push_back(base + static_cast<size_t>(__builtin_ctzll(bits)));
+		bits &= bits - 1;
+	}
+}
+
+/** Walks words [first, count) of the bitmap one at a time */
+inline void
+scan_scalar(std::atomic<uint64_t> *words, size_t count, std::vector<size_t> &out, size_t first = 0)
+{
+	for(size_t i = first; i < count; ++i)
+		if(words[i].load(std::memory_order_relaxed))
+			take_word(words[i], i * 64, out);
+}
+
+#if CPS_READINESS_AVX2
+/**
+ * Walks the bitmap 512 bits - two AVX2 loads - at a time, only touching
+ * words atomically once a vector load has shown something set in them.
+ * The vector load may race with a setter; that only means a bit set right
+ * now is picked up by the next scan instead, which the notification covers.
+ */
+__attribute__((target("avx2"))) inline void
+scan_avx2(std::atomic<uint64_t> *words, size_t count, std::vector<size_t> &out)
+{
+	static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "atomic words must be plain words");
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8) {
+		auto *p = reinterpret_cast<const __m256i *>(words + i);
+		__m256i a = _mm256_loadu_si256(p);
+		__m256i b = _mm256_loadu_si256(p + 1);
+		__m256i any = _mm256_or_si256(a, b);
+		if(_mm256_testz_si256(any, any))
+			continue;
+		for(size_t j = i; j < i + 8; ++j)
+			if(words[j].load(std::memory_order_relaxed))
+				take_word(words[j], j * 64, out);
+	}
+	scan_scalar(words, count, out, i);
+}
+
+inline bool
+have_avx2()
+{
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	return avx2;
+}
+#else
+inline bool
+have_avx2()
+{
+	return false;
+}
+#endif
+
+}
+
+/**
+ * Tells you which of a large, fixed population of futures have resolved,
+ * without touching any of the ones that haven't.
+ *
+ * Each entry is a key below the capacity - a session number, say - and
+ * one bit in a dense bitmap. ->watch registers a future against a key;
+ * when it resolves, however it resolves, its callback sets the key's bit.
+ * ->take then collects and clears every set bit, scanning the bitmap 512
+ * bits at a time with AVX2 where the CPU has it (checked once, at run
+ * time) and a word at a time otherwise. 100k entries is 12.5kB of bitmap,
+ * rather than 100k futures spread across the heap.
+ *
+ * ->wait returns a future which resolves once anything is ready. However
+ * many bits are set between two ->take calls, only the first of them does
+ * any work beyond the bit itself, so a burst of resolutions costs one
+ * wakeup:
+ *
+ *     readiness_set sessions { 100000 };
+ *     sessions.watch(id, conn->read());
+ *     sessions.wait()->on_done([&](int) {
+ *         std::vector<size_t> ready;
+ *         sessions.take(ready);
+ *         for(auto id : ready) ...   // and watch the next read
+ *     });
+ *
+ * Any thread may watch or mark; run ->take on one thread at a time. A
+ * key can be watched again once its bit has been taken. The set only
+ * records that something happened - look at the future itself for the
+ * value.
+ */
+class readiness_set {
+public:
+	explicit readiness_set(
+		size_t capacity
+	):state_(std::make_shared<shared_state>(capacity))
+	{
+	}
+
+	readiness_set(const readiness_set &) = delete;
+	readiness_set &operator=(const readiness_set &) = delete;
+
+	/** Sets the key's bit once the future resolves */
+	template<typename T>
+	void watch(size_t key, const std::shared_ptr<future<T>> &f) {
+		state_->check(key);
+		auto s = state_;
+		f->on_ready([s, key](future<T> &) {
+			s->mark(key);
+		});
+	}
+
+	/** Sets the key's bit now */
+	void mark(size_t key) {
+		state_->check(key);
+		state_->mark(key);
+	}
+
+	/**
+	 * Appends every key whose bit is set to `out`, in key order, and
+	 * clears them. Returns how many there were.
+	 */
+	size_t take(std::vector<size_t> &out) {
+		/* Clear this first: anything set from here on signals again */
+		state_->signalled.store(false, std::memory_order_seq_cst);
+		size_t before = out.size();
+#if CPS_READINESS_AVX2
+		if(detail::have_avx2()) {
+			detail::scan_avx2(state_->words.get(), state_->word_count, out);
+			return out.size() - before;
+		}
+#endif
+		detail::scan_scalar(state_->words.get(), state_->word_count, out);
+		return out.size() - before;
+	}
+
+	/** Returns a future which resolves once any bit is set, straight away if one is */
+	std::shared_ptr<future<int>> wait() {
+		auto f = future<int>::create_shared(u8"readiness_set::wait");
+		{
+			std::lock_guard<std::mutex> guard { state_->mutex };
+			if(!state_->signalled.load(std::memory_order_seq_cst)) {
+				state_->waiting.push_back(f);
+				return f;
+			}
+		}
+		return f->done(0);
+	}
+
+	/** True if the key's bit is set */
+	bool is_set(size_t key) const {
+		state_->check(key);
+		return state_->words[key / 64].load(std::memory_order_acquire) & (uint64_t(1) << (key % 64));
+	}
+
+	size_t capacity() const { return state_->capacity; }
+
+	/** Times a newly set bit had to wake anyone, rather than riding along with an earlier one */
+	size_t notifications() const { return state_->notifications.load(std::memory_order_relaxed); }
+
+	/** True if ->take uses the AVX2 scan on this machine */
+	static bool vectorized() { return detail::have_avx2(); }
+
+private:
+	struct shared_state {
+		explicit shared_state(
+			size_t capacity
+		):capacity(capacity),
+		  word_count((capacity + 63) / 64),
+		  words(new std::atomic<uint64_t>[word_count ? word_count : 1]),
+		  signalled(false),
+		  notifications(0)
+		{
+			for(size_t i = 0; i < word_count; ++i)
+				words[i].store(0, std::memory_order_relaxed);
+		}
+
+		void check(size_t key) const {
+			if(key >= capacity)
+				throw std::out_of_range("readiness_set key is out of range");
+		}
+
+		void mark(size_t key) {
+			words[key / 64].fetch_or(uint64_t(1) << (key % 64), std::memory_order_acq_rel);
+			if(signalled.exchange(true, std::memory_order_seq_cst))
+				return;
+			notifications.fetch_add(1, std::memory_order_relaxed);
+			std::vector<std::shared_ptr<future<int>>> wake;
+			{
+				std::lock_guard<std::mutex> guard { mutex };
+				wake.swap(waiting);
+			}
+			/* Waiters may have given up, even while we're waking the rest */
+			int ready = 0;
+			for(auto &f : wake)
+				f->try_done(ready);
+		}
+
+		const size_t capacity;
+		const size_t word_count;
+		std::unique_ptr<std::atomic<uint64_t>[]> words;
+		/** Set by the first bit after a ->take; whoever sets it wakes the waiters */
+		std::atomic<bool> signalled;
+		std::atomic<size_t> notifications;
+		std::mutex mutex;
+		std::vector<std::shared_ptr<future<int>>> waiting;
+	};
+
+	std::shared_ptr<shared_state> state_;
+};
+
+};
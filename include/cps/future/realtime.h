@@ -0,0 +1,151 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/scheduler.h>
+
+namespace cps {
+
+/**
+ * A scheduler on the real clock, with one thread serving every timer.
+ *
+ * Timers sit in a heap; the thread sleeps until the earliest is due, then
+ * runs everything that has come due in one go. Posted code and timer
+ * callbacks - including the continuations of futures returned by ->at -
+ * all run on that thread, so keep them short.
+ *
+ * ->post, ->at and ->now may be called from any thread. Destroying the
+ * scheduler cancels any timers still pending and drops posted code that
+ * has not run yet.
+ */
+class realtime_scheduler : public scheduler {
+public:
+	realtime_scheduler(
+	):sequence_(0),
+	  fired_(0),
+	  stopping_(false)
+	{
+		thread_ = std::thread([this] { loop(); });
+	}
+
+	realtime_scheduler(const realtime_scheduler &) = delete;
+	realtime_scheduler &operator=(const realtime_scheduler &) = delete;
+
+	virtual ~realtime_scheduler() {
+		std::vector<std::shared_ptr<future<int>>> timers;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			stopping_ = true;
+			while(!events_.empty()) {
+				if(events_.top().timer)
+					timers.push_back(events_.top().timer);
+				events_.pop();
+			}
+		}
+		wake_.notify_all();
+		thread_.join();
+		for(auto &t : timers) {
+			if(t->is_pending())
+				t->cancel();
+		}
+	}
+
+	virtual time_point now() const override { return clock::now(); }
+
+	virtual void post(std::function<void()> code) override {
+		schedule(clock::now(), std::move(code), nullptr);
+	}
+
+	virtual std::shared_ptr<future<int>> at(time_point when) override {
+		auto f = future<int>::create_shared(u8"realtime timer");
+		schedule(when, [f]() {
+			if(f->is_pending())
+				f->done(0);
+		}, f);
+		return f;
+	}
+
+	/** Timers and posted code still waiting to run */
+	size_t pending() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return events_.size();
+	}
+
+	/** Number of times the thread has woken up with something to run */
+	size_t wakeups() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return fired_;
+	}
+
+private:
+	struct event {
+		time_point when;
+		/** Breaks ties, so events at the same time run in FIFO order */
+		uint64_t sequence;
+		std::function<void()> code;
+		/** Set for ->at, so we can cancel it on shutdown */
+		std::shared_ptr<future<int>> timer;
+
+		bool operator>(const event &other) const {
+			return when != other.when ? when > other.when : sequence > other.sequence;
+		}
+	};
+
+	void schedule(time_point when, std::function<void()> code, std::shared_ptr<future<int>> timer) {
+		bool earliest;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			if(stopping_)
+				return;
+			earliest = events_.empty() || when < events_.top().when;
+			events_.push(event { when, sequence_++, std::move(code), std::move(timer) });
+		}
+		/* Only a new earliest event changes how long the thread should sleep */
+		if(earliest)
+			wake_.notify_one();
+	}
+
+	void loop() {
+		std::unique_lock<std::mutex> lock { mutex_ };
+		std::vector<std::function<void()>> due;
+		while(!stopping_) {
+			if(events_.empty()) {
+				wake_.wait(lock);
+				continue;
+			}
+			auto when = events_.top().when;
+			if(clock::now() < when) {
+				wake_.wait_until(lock, when);
+				continue;
+			}
+			auto now = clock::now();
+			while(!events_.empty() && events_.top().when <= now) {
+				/* priority_queue only hands out const refs, and we want to move the code out */
+				due.push_back(std::move(const_cast<event &>(events_.top()).code));
+				events_.pop();
+			}
+			++fired_;
+			lock.unlock();
+			for(auto &code : due)
+				code();
+			due.clear();
+			lock.lock();
+		}
+	}
+
+	mutable std::mutex mutex_;
+	std::condition_variable wake_;
+	std::priority_queue<event, std::vector<event>, std::greater<event>> events_;
+	uint64_t sequence_;
+	size_t fired_;
+	bool stopping_;
+	std::thread thread_;
+};
+
+};
@@ -0,0 +1,269 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace cps {
+
+/**
+ * Destroying things somewhere other than the thread that let go of them.
+ *
+ * When a future resolves, its callbacks run and are then destroyed on the
+ * resolving thread - often an I/O thread, and closures often hold the last
+ * reference to large buffers, maps or whole graphs of shared_ptrs. Wrap
+ * such a callback in reclaim::later and, with a reclaimer active, it is
+ * handed to the reclaimer once spent, which destroys it in batches on a
+ * thread of its own, so the resolving thread doesn't pay for the free()
+ * calls and destructor chains:
+ *
+ *     f->on_done(reclaim::later([index](int v) { ... }));
+ *
+ * Only wrap closures whose captures may be destroyed on any thread: not
+ * ones keeping alive an object tied to a reactor, say. Callbacks which
+ * aren't wrapped, the library's own included, are destroyed where they
+ * always were.
+ *
+ * Values are handed over too, when the future holding them is destroyed,
+ * for types that opt in through reclaim_in_background. Anything else can
+ * be passed to reclaim::retire directly. With no reclaimer active, all of
+ * these destroy things where they are.
+ */
+namespace reclaim {
+
+/** Anything, type-erased, waiting to be destroyed */
+struct garbage {
+	virtual ~garbage() { }
+};
+
+template<typename V>
+struct holder : garbage {
+	explicit holder(V &&v):v(std::move(v)) { }
+
+	V v;
+};
+
+/** Where retired objects go to be destroyed */
+class sink {
+public:
+	virtual ~sink() { }
+
+	virtual void take(std::unique_ptr<garbage> g) = 0;
+};
+
+/** The sink retired objects go to, or nullptr if they're destroyed where they are */
+inline std::atomic<sink *> &
+active()
+{
+	static std::atomic<sink *> instance { nullptr };
+	return instance;
+}
+
+/** Starts handing retired objects to the given sink. Pass nullptr to stop. */
+inline void
+destroy_on(sink *s)
+{
+	active() = s;
+}
+
+/**
+ * Moves the object to the active sink, returning true, or leaves it where
+ * it is and returns false if there isn't one.
+ */
+template<typename V>
+inline bool
+retire(V &&v)
+{
+	static_assert(!std::is_lvalue_reference<V>::value, "retire takes ownership: pass an rvalue");
+	auto s = active().load(std::memory_order_acquire);
+	if(!s)
+		return false;
+	s->take(std::unique_ptr<garbage> { new holder<typename std::decay<V>::type> { std::move(v) } });
+	return true;
+}
+
+/**
+ * A callable which, when the last copy of it goes, retires the closure it
+ * wraps rather than destroying it there and then. Copies share the one
+ * closure, so it is fine to pass to anything taking a std::function.
+ */
+template<typename F>
+class later_closure {
+public:
+	explicit later_closure(F f):f_(std::make_shared<F>(std::move(f))) { }
+
+	later_closure(const later_closure &) = default;
+	later_closure(later_closure &&) = default;
+	later_closure &operator=(const later_closure &) = delete;
+	later_closure &operator=(later_closure &&) = delete;
+
+	~later_closure() {
+		/* Copies going on two threads at once may both miss this, which just means destroying it here */
+		if(f_ && f_.use_count() == 1)
+			retire(std::move(f_));
+	}
+
+	template<typename... Args>
+	decltype(auto) operator()(Args &&... args) const {
+		return (*f_)(std::forward<Args>(args)...);
+	}
+
+private:
+	std::shared_ptr<F> f_;
+};
+
+/** Marks a callback as fine to destroy on the active sink's thread once it's spent */
+template<typename F>
+inline later_closure<typename std::decay<F>::type>
+later(F &&f)
+{
+	return later_closure<typename std::decay<F>::type> { std::forward<F>(f) };
+}
+
+}
+
+/**
+ * Specialise this as std::true_type for value types which are worth
+ * destroying in the background - big containers, say - and a future's
+ * value of that type goes to the active reclaimer when the future is
+ * destroyed.
+ */
+template<typename T>
+struct reclaim_in_background : std::false_type { };
+
+/**
+ * A thread which destroys whatever is retired to it, in batches.
+ *
+ * ->take queues an object under a lock. Once something is queued the
+ * thread waits up to `delay` for `batch` objects to gather, then destroys
+ * whatever there is. So a busy resolving thread pays a lock and a push
+ * per future and a wakeup or two every `batch` futures, and an idle
+ * reclaimer doesn't wake at all.
+ *
+ *     reclaimer background;
+ *     reclaim::destroy_on(&background);
+ *     f->on_done(reclaim::later([index](int v) { ... }));
+ *     ...
+ *     reclaim::destroy_on(nullptr);
+ *
+ * Stop using a reclaimer, and make sure no thread is still resolving
+ * futures through it, before destroying it. Destroying it destroys
+ * anything still queued.
+ */
+class reclaimer : public reclaim::sink {
+public:
+	explicit reclaimer(
+		size_t batch = 64,
+		std::chrono::milliseconds delay = std::chrono::milliseconds(1)
+	):batch_(batch ? batch : 1),
+	  delay_(delay),
+	  stopping_(false),
+	  flushing_(0),
+	  retired_(0),
+	  reclaimed_(0),
+	  batches_(0)
+	{
+		thread_ = std::thread([this] { work(); });
+	}
+
+	reclaimer(const reclaimer &) = delete;
+	reclaimer &operator=(const reclaimer &) = delete;
+
+	virtual ~reclaimer() {
+		auto *self = static_cast<reclaim::sink *>(this);
+		reclaim::active().compare_exchange_strong(self, nullptr);
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			stopping_ = true;
+		}
+		wake_.notify_one();
+		thread_.join();
+	}
+
+	void take(std::unique_ptr<reclaim::garbage> g) override {
+		bool wake;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			queue_.push_back(std::move(g));
+			++retired_;
+			/* The first wakes the thread to start the clock, the batch-th to end it */
+			wake = queue_.size() == 1 || queue_.size() == batch_;
+		}
+		if(wake)
+			wake_.notify_one();
+	}
+
+	/** Waits until everything retired so far has been destroyed */
+	void flush() {
+		std::unique_lock<std::mutex> lock { mutex_ };
+		const size_t target = retired_;
+		++flushing_;
+		wake_.notify_one();
+		finished_.wait(lock, [&] { return reclaimed_ >= target; });
+		--flushing_;
+	}
+
+	/** Objects handed to us so far */
+	size_t retired() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return retired_;
+	}
+
+	/** Objects destroyed so far */
+	size_t reclaimed() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return reclaimed_;
+	}
+
+	/** Times the thread woke up and destroyed something */
+	size_t batches() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return batches_;
+	}
+
+	/** The thread objects are destroyed on */
+	std::thread::id thread_id() const { return thread_.get_id(); }
+
+private:
+	void work() {
+		std::vector<std::unique_ptr<reclaim::garbage>> doomed;
+		std::unique_lock<std::mutex> lock { mutex_ };
+		for(;;) {
+			wake_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+			if(queue_.empty())
+				return;
+			/* Give the rest of the batch a chance to turn up */
+			wake_.wait_for(lock, delay_, [this] {
+				return stopping_ || flushing_ || queue_.size() >= batch_;
+			});
+			doomed.swap(queue_);
+			lock.unlock();
+			const size_t n = doomed.size();
+			doomed.clear();
+			lock.lock();
+			reclaimed_ += n;
+			++batches_;
+			finished_.notify_all();
+		}
+	}
+
+	const size_t batch_;
+	const std::chrono::milliseconds delay_;
+	mutable std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable finished_;
+	std::vector<std::unique_ptr<reclaim::garbage>> queue_;
+	bool stopping_;
+	size_t flushing_;
+	size_t retired_;
+	size_t reclaimed_;
+	size_t batches_;
+	std::thread thread_;
+};
+
+};
@@ -0,0 +1,40 @@
+#pragma once
+#include <chrono>
+#include <memory>
+
+#include <cps/future.h>
+#include <cps/future/executor.h>
+
+namespace cps {
+
+/**
+ * An executor which also knows about time.
+ *
+ * Code that needs timeouts, delays or retries should take a scheduler rather
+ * than reading the clock directly. That way the same code can run against
+ * real time in production and against a simulated clock in tests and
+ * benchmarks.
+ */
+class scheduler : public executor {
+public:
+	using clock = std::chrono::steady_clock;
+	using time_point = clock::time_point;
+	using duration = clock::duration;
+
+	/** The current time, according to this scheduler */
+	virtual time_point now() const = 0;
+
+	/**
+	 * Returns a future which resolves once the given time is reached.
+	 * Cancelling the future is allowed, and means it will not fire.
+	 */
+	virtual std::shared_ptr<future<int>> at(time_point when) = 0;
+
+	/** Returns a future which resolves after the given delay */
+	std::shared_ptr<future<int>> after(duration delay) {
+		return at(now() + delay);
+	}
+};
+
+};
+
@@ -0,0 +1,535 @@
+#pragma once
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <cps/future.h>
+
+namespace cps {
+
+/**
+ * Sender/receiver interop.
+ *
+ * This follows the shape of the std::execution proposal closely enough to
+ * sit at either end of a sender chain, without tying us to any one
+ * implementation of it:
+ *
+ * - a receiver has ->set_value(v), ->set_error(std::exception_ptr) and
+ *   ->set_stopped(), and may have a ->get_stop_token() method
+ * - a sender has a value_type and a ->connect(receiver) method, which
+ *   returns an operation state
+ * - an operation state has ->start(), and must not move or go away until
+ *   one of the completion methods has been called on its receiver
+ *
+ * as_sender turns a future into a sender, and as_future goes the other way.
+ * Cancelling the future maps onto a stop request and vice versa.
+ */
+namespace execution {
+
+class stop_source;
+class stop_token;
+
+namespace detail {
+
+class stop_state;
+
+/**
+ * An entry in a stop_state's callback list. Intrusive, so registering
+ * for stop requests doesn't allocate.
+ */
+class stop_callback_base {
+public:
+	stop_callback_base(
+	):state_(nullptr),
+	  prev_(nullptr),
+	  next_(nullptr),
+	  done_(false),
+	  detached_(nullptr)
+	{
+	}
+
+	stop_callback_base(const stop_callback_base &) = delete;
+	stop_callback_base &operator=(const stop_callback_base &) = delete;
+
+	virtual ~stop_callback_base() { }
+
+	/**
+	 * Starts listening for stop requests on the given token. If a stop was
+	 * already requested, ->on_stop is called right away.
+	 */
+	inline void attach(const stop_token &token);
+
+	/**
+	 * Stops listening. If ->on_stop is running on another thread, waits for
+	 * it to return first.
+	 */
+	inline void detach();
+
+protected:
+	/** Called once, from whichever thread requested the stop */
+	virtual void on_stop() = 0;
+
+private:
+	friend class stop_state;
+
+	stop_state *state_;
+	stop_callback_base *prev_;
+	stop_callback_base *next_;
+	/** Set once ->on_stop has returned */
+	std::atomic<bool> done_;
+	/** While ->on_stop runs, points at a flag telling the caller we've been detached (and maybe destroyed) */
+	bool *detached_;
+	/** Keeps the state alive for as long as we're attached */
+	std::shared_ptr<stop_state> owner_;
+};
+
+/** Shared between a stop_source and its tokens */
+class stop_state {
+public:
+	stop_state(
+	):stopped_(false),
+	  head_(nullptr),
+	  running_(nullptr)
+	{
+	}
+
+	bool stop_requested() const { return stopped_; }
+
+	/** Returns false if a stop was already requested */
+	bool request_stop() {
+		std::unique_lock<std::mutex> lock { mutex_ };
+		if(stopped_)
+			return false;
+		stopped_ = true;
+		stopping_thread_ = std::this_thread::get_id();
+		/* Callbacks may detach each other, so take them off the list one at
+		 * a time and drop the lock while each one runs */
+		while(head_) {
+			auto cb = head_;
+			unlink(cb);
+			running_ = cb;
+			bool detached = false;
+			cb->detached_ = &detached;
+			lock.unlock();
+			cb->on_stop();
+			if(!detached) {
+				cb->detached_ = nullptr;
+				cb->done_ = true;
+			}
+			lock.lock();
+			running_ = nullptr;
+		}
+		return true;
+	}
+
+	/** Returns false if we were already stopped, in which case nothing was added */
+	bool add(stop_callback_base *cb) {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		if(stopped_)
+			return false;
+		cb->prev_ = nullptr;
+		cb->next_ = head_;
+		if(head_)
+			head_->prev_ = cb;
+		head_ = cb;
+		return true;
+	}
+
+	void remove(stop_callback_base *cb) {
+		std::unique_lock<std::mutex> lock { mutex_ };
+		if(cb->prev_ || head_ == cb) {
+			unlink(cb);
+			return;
+		}
+		/* Already taken off the list by ->request_stop, so it's either run
+		 * or running. A callback detaching itself mustn't wait for itself. */
+		if(running_ != cb)
+			return;
+		if(stopping_thread_ == std::this_thread::get_id()) {
+			*cb->detached_ = true;
+			return;
+		}
+		lock.unlock();
+		while(!cb->done_)
+			std::this_thread::yield();
+	}
+
+private:
+	void unlink(stop_callback_base *cb) {
+		if(cb->prev_)
+			cb->prev_->next_ = cb->next_;
+		else
+			head_ = cb->next_;
+		if(cb->next_)
+			cb->next_->prev_ = cb->prev_;
+		cb->prev_ = cb->next_ = nullptr;
+	}
+
+	std::mutex mutex_;
+	std::atomic<bool> stopped_;
+	stop_callback_base *head_;
+	stop_callback_base *running_;
+	std::thread::id stopping_thread_;
+};
+
+};
+
+/**
+ * Tells an operation whether someone has asked it to stop. A
+ * default-constructed token can never be stopped.
+ */
+class stop_token {
+public:
+	stop_token() { }
+
+	bool stop_requested() const { return state_ && state_->stop_requested(); }
+	bool stop_possible() const { return static_cast<bool>(state_); }
+
+private:
+	friend class stop_source;
+	friend class detail::stop_callback_base;
+
+	explicit stop_token(
+		std::shared_ptr<detail::stop_state> state
+	):state_(std::move(state))
+	{
+	}
+
+	std::shared_ptr<detail::stop_state> state_;
+};
+
+/** The sending side of a stop_token */
+class stop_source {
+public:
+	stop_source(
+	):state_(std::make_shared<detail::stop_state>())
+	{
+	}
+
+	stop_token get_token() const { return stop_token { state_ }; }
+	bool stop_requested() const { return state_->stop_requested(); }
+
+	/**
+	 * Runs every registered stop callback, on this thread.
+	 * Returns false if a stop had already been requested.
+	 */
+	bool request_stop() { return state_->request_stop(); }
+
+private:
+	std::shared_ptr<detail::stop_state> state_;
+};
+
+/**
+ * Runs the given code when a stop is requested on the token, or straight
+ * away if one already was. Destroying the callback unregisters it.
+ */
+template<typename F>
+class stop_callback : private detail::stop_callback_base {
+public:
+	stop_callback(
+		const stop_token &token,
+		F code
+	):code_(std::move(code))
+	{
+		attach(token);
+	}
+
+	~stop_callback() { detach(); }
+
+private:
+	virtual void on_stop() override { code_(); }
+
+	F code_;
+};
+
+void
+detail::stop_callback_base::attach(const stop_token &token)
+{
+	if(!token.state_)
+		return;
+	owner_ = token.state_;
+	state_ = owner_.get();
+	if(!state_->add(this)) {
+		/* Nobody else can see us yet, and on_stop may destroy us */
+		state_ = nullptr;
+		owner_.reset();
+		on_stop();
+	}
+}
+
+void
+detail::stop_callback_base::detach()
+{
+	if(!state_)
+		return;
+	state_->remove(this);
+	state_ = nullptr;
+	owner_.reset();
+}
+
+namespace detail {
+
+/* Receivers don't have to provide a stop token, in which case they get one that never stops */
+template<typename R>
+auto
+get_stop_token(const R &r, int) -> decltype(r.get_stop_token())
+{
+	return r.get_stop_token();
+}
+
+template<typename R>
+stop_token
+get_stop_token(const R &, long)
+{
+	return stop_token { };
+}
+
+};
+
+/** Returns the receiver's stop token, or one that will never be stopped if it doesn't have one */
+template<typename R>
+auto
+get_stop_token(const R &r) -> decltype(detail::get_stop_token(r, 0))
+{
+	return detail::get_stop_token(r, 0);
+}
+
+/**
+ * The operation state for a future_sender. Completes the receiver from
+ * the future's on_ready callback, and cancels the future if the receiver's
+ * stop token is triggered.
+ */
+template<typename T, typename R>
+class future_operation : private detail::stop_callback_base {
+public:
+	future_operation(
+		std::shared_ptr<future<T>> f,
+		R receiver
+	):future_(std::move(f)),
+	  receiver_(std::move(receiver))
+	{
+	}
+
+	/** Only valid before ->start */
+	future_operation(
+		future_operation &&src
+	):future_(std::move(src.future_)),
+	  receiver_(std::move(src.receiver_))
+	{
+	}
+
+	future_operation &operator=(future_operation &&) = delete;
+
+	void start() {
+		/* A stop request before the future resolves cancels it, in which
+		 * case on_ready completes the receiver straight away */
+		attach(execution::get_stop_token(receiver_));
+		/* The callback only captures this, so std::function keeps it inline.
+		 * It may also destroy us, so nothing can come after it - and we hold
+		 * our own reference to the future in case ours was the last. */
+		auto keep = future_;
+		keep->on_ready([this](future<T> &f) {
+			complete(f);
+		});
+	}
+
+private:
+	virtual void on_stop() override {
+		/* We can lose the race against whoever is resolving the future, in
+		 * which case they get to complete the receiver */
+		auto f = future_;
+		if(!f->is_pending())
+			return;
+		try {
+			f->cancel();
+		} catch(const std::logic_error &) {
+		}
+	}
+
+	void complete(future<T> &f) {
+		detach();
+		/* The receiver may destroy us, so this must be the last thing we do */
+		if(f.is_done())
+			receiver_.set_value(f.value());
+		else if(f.is_failed())
+			receiver_.set_error(f.exception_ptr());
+		else
+			receiver_.set_stopped();
+	}
+
+	std::shared_ptr<future<T>> future_;
+	R receiver_;
+};
+
+/**
+ * A sender which completes when the given future does: set_value for
+ * done, set_error for failed and set_stopped for cancelled.
+ */
+template<typename T>
+class future_sender {
+public:
+	using value_type = T;
+
+	explicit future_sender(
+		std::shared_ptr<future<T>> f
+	):future_(std::move(f))
+	{
+	}
+
+	template<typename R>
+	future_operation<T, typename std::decay<R>::type>
+	connect(R &&receiver) const {
+		return future_operation<T, typename std::decay<R>::type>(future_, std::forward<R>(receiver));
+	}
+
+private:
+	std::shared_ptr<future<T>> future_;
+};
+
+template<typename T, typename R>
+class just_operation {
+public:
+	just_operation(
+		T value,
+		R receiver
+	):value_(std::move(value)),
+	  receiver_(std::move(receiver))
+	{
+	}
+
+	void start() { receiver_.set_value(std::move(value_)); }
+
+private:
+	T value_;
+	R receiver_;
+};
+
+/** A sender which completes immediately with the given value */
+template<typename T>
+class just_sender {
+public:
+	using value_type = T;
+
+	explicit just_sender(
+		T value
+	):value_(std::move(value))
+	{
+	}
+
+	template<typename R>
+	just_operation<T, typename std::decay<R>::type>
+	connect(R &&receiver) const {
+		return just_operation<T, typename std::decay<R>::type>(value_, std::forward<R>(receiver));
+	}
+
+private:
+	T value_;
+};
+
+template<typename T>
+just_sender<typename std::decay<T>::type>
+just(T &&value)
+{
+	return just_sender<typename std::decay<T>::type>(std::forward<T>(value));
+}
+
+/** Returns a sender which completes when the given future does */
+template<typename T>
+future_sender<T>
+as_sender(std::shared_ptr<future<T>> f)
+{
+	return future_sender<T>(std::move(f));
+}
+
+namespace detail {
+
+/** Resolves a future from a sender's completion */
+template<typename T>
+class future_receiver {
+public:
+	future_receiver(
+		std::shared_ptr<future<T>> f,
+		stop_token token
+	):future_(std::move(f)),
+	  token_(std::move(token))
+	{
+	}
+
+	void set_value(T v) { resolve([&v](future<T> &f) { f.done(std::move(v)); }); }
+	void set_error(std::exception_ptr ex) { resolve([&ex](future<T> &f) { f.fail_exception_pointer(ex); }); }
+	void set_stopped() { resolve([](future<T> &f) { f.cancel(); }); }
+
+	stop_token get_stop_token() const { return token_; }
+
+private:
+	/* The future may have been cancelled while the sender was completing */
+	template<typename F>
+	void resolve(F code) {
+		if(!future_->is_pending())
+			return;
+		try {
+			code(*future_);
+		} catch(const std::logic_error &) {
+		}
+	}
+
+	std::shared_ptr<future<T>> future_;
+	stop_token token_;
+};
+
+/** Owns a connected sender until it completes */
+template<typename S, typename T>
+class sender_state {
+public:
+	using operation = decltype(std::declval<S>().connect(std::declval<future_receiver<T>>()));
+
+	sender_state(
+		S &&sender,
+		const std::shared_ptr<future<T>> &f
+	):operation_(std::forward<S>(sender).connect(future_receiver<T>(f, stop_.get_token())))
+	{
+	}
+
+	stop_source &stop() { return stop_; }
+	void start() { operation_.start(); }
+
+private:
+	/* Must be constructed before the operation, since the receiver takes a token from it */
+	stop_source stop_;
+	operation operation_;
+};
+
+};
+
+/**
+ * Connects the sender and starts it, returning a future for the result.
+ *
+ * The operation state lives until the sender completes, which costs one
+ * allocation. Cancelling the future requests a stop through the stop token
+ * the sender sees on its receiver.
+ */
+template<typename S>
+std::shared_ptr<future<typename std::decay<S>::type::value_type>>
+as_future(S &&sender, const std::string &label = u8"unlabelled future")
+{
+	using value_type = typename std::decay<S>::type::value_type;
+	auto f = future<value_type>::create_shared(label);
+	auto state = std::make_shared<detail::sender_state<S, value_type>>(std::forward<S>(sender), f);
+	/* The future keeps the operation alive until it resolves, and the
+	 * operation keeps the future alive through its receiver */
+	f->on_ready([state](future<value_type> &result) {
+		if(result.is_cancelled())
+			state->stop().request_stop();
+	});
+	state->start();
+	return f;
+}
+
+};
+
+};
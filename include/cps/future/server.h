@@ -0,0 +1,333 @@
+#pragma once
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/reactor.h>
+#include <cps/future/socket_io.h>
+
+namespace cps {
+
+/** How a sharded_server listens, and how many shards it runs */
+struct server_options {
+	/** IPv4 address to listen on */
+	std::string address = "0.0.0.0";
+	/** Port to listen on; 0 picks a free one, see sharded_server::port */
+	uint16_t port = 0;
+	/** Reactors, each on its own thread with its own listening socket */
+	size_t shards = std::max(1u, std::thread::hardware_concurrency());
+	/** Pin shard i's thread to the i-th CPU we're allowed to run on, wrapping around */
+	bool pin = true;
+	int backlog = 1024;
+	io_backend backend = io_backend::automatic;
+};
+
+/** A connection handed to a sharded_server's handler, on the thread of the shard that accepted it */
+struct accepted_connection {
+	int fd;
+	size_t shard;
+	reactor &loop;
+	socket_io &io;
+};
+
+/**
+ * A TCP server spread over several reactors, with no shared accept loop.
+ *
+ * Each shard is a thread running its own reactor and socket_io, with its
+ * own listening socket bound to the same address with SO_REUSEPORT. The
+ * kernel spreads incoming connections across the listeners by hashing
+ * the connection's addresses, so shards accept in parallel and never
+ * contend with each other, and a connection is handled start to finish on
+ * the thread - and, with `pin`, the core - that accepted it.
+ *
+ * The handler is called for each connection on the accepting shard's
+ * thread, and returns a future which resolves once it is finished with
+ * the connection; the server then closes it. Use the accepted_connection's
+ * io and loop for everything on the socket.
+ *
+ *     sharded_server server { opts, [](const accepted_connection &c) {
+ *         auto finished = future<int>::create_shared();
+ *         c.io.recv(c.fd)->on_done([c, finished](buffer request) {
+ *             c.io.send(c.fd, respond(request))->on_ready([finished](future<size_t> &) {
+ *                 finished->done(0);
+ *             });
+ *         });
+ *         return finished;
+ *     } };
+ *
+ * The constructor throws std::system_error if it can't listen. Stopping
+ * the server - ->stop, or destroying it - closes the listeners and every
+ * connection still open, cancelling whatever is outstanding on them, then
+ * joins the threads. The counters may be read from any thread.
+ */
+class sharded_server {
+public:
+	using handler = std::function<std::shared_ptr<future<int>>(const accepted_connection &)>;
+
+	sharded_server(
+		server_options opts,
+		handler code
+	):code_(std::move(code)),
+	  port_(opts.port),
+	  stopped_(false)
+	{
+		if(!opts.shards)
+			opts.shards = 1;
+		auto cpus = allowed_cpus();
+		try {
+			for(size_t i = 0; i < opts.shards; ++i) {
+				shards_.push_back(std::make_shared<shard>(i));
+				auto &s = *shards_.back();
+				s.listener = listen(opts);
+				s.timer = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+				if(s.timer < 0)
+					throw std::system_error(errno, std::system_category(), "could not create timer");
+				s.io = make_socket_io(s.loop, opts.backend);
+				if(opts.pin && !cpus.empty())
+					s.cpu = cpus[i % cpus.size()];
+			}
+		} catch(...) {
+			for(auto &s : shards_) {
+				s->io.reset();
+				if(s->listener >= 0)
+					::close(s->listener);
+			}
+			throw;
+		}
+		for(auto &s : shards_) {
+			auto *p = s.get();
+			p->loop.post([this, p] { accept(*p); });
+			p->thread = std::thread([p] {
+				p->owner = std::this_thread::get_id();
+				if(p->cpu >= 0) {
+					cpu_set_t set;
+					CPU_ZERO(&set);
+					CPU_SET(p->cpu, &set);
+					/* Not being allowed to pin is no reason not to serve */
+					::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+				}
+				p->loop.run();
+			});
+		}
+	}
+
+	sharded_server(const sharded_server &) = delete;
+	sharded_server &operator=(const sharded_server &) = delete;
+
+	virtual ~sharded_server() {
+		stop();
+	}
+
+	/** Closes the listeners and any open connections, and waits for the shards to finish */
+	void stop() {
+		if(stopped_.exchange(true))
+			return;
+		for(auto &s : shards_) {
+			auto *p = s.get();
+			p->loop.post([p] { shut_down(*p); });
+		}
+		for(auto &s : shards_) {
+			s->thread.join();
+			/* Anything still outstanding is cancelled here */
+			s->io.reset();
+		}
+	}
+
+	/** The port we're listening on, which is the one picked if we asked for 0 */
+	uint16_t port() const { return port_; }
+
+	size_t shards() const { return shards_.size(); }
+
+	/** Connections shard i has accepted so far */
+	size_t accepted(size_t i) const { return shards_.at(i)->accepted.load(std::memory_order_relaxed); }
+
+	/** Connections shard i has open right now */
+	size_t active(size_t i) const { return shards_.at(i)->active.load(std::memory_order_relaxed); }
+
+	/** The CPU shard i is pinned to, or -1 */
+	int cpu(size_t i) const { return shards_.at(i)->cpu; }
+
+private:
+	struct shard : std::enable_shared_from_this<shard> {
+		explicit shard(
+			size_t index
+		):index(index),
+		  accepted(0),
+		  active(0)
+		{
+		}
+
+		~shard() {
+			if(timer >= 0)
+				::close(timer);
+		}
+
+		const size_t index;
+		int listener = -1;
+		/** For backing off when accept fails */
+		int timer = -1;
+		std::chrono::milliseconds backoff { 0 };
+		int cpu = -1;
+		bool stopping = false;
+		reactor loop;
+		std::unique_ptr<socket_io> io;
+		/** Connections handed to the handler and not yet closed */
+		std::unordered_set<int> open;
+		std::atomic<size_t> accepted;
+		std::atomic<size_t> active;
+		std::thread thread;
+		/** The thread's id, set by the thread itself before it serves anything */
+		std::thread::id owner;
+	};
+
+	static std::vector<int> allowed_cpus() {
+		std::vector<int> cpus;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if(::sched_getaffinity(0, sizeof(set), &set) != 0)
+			return cpus;
+		for(int i = 0; i < CPU_SETSIZE; ++i)
+			if(CPU_ISSET(i, &set))
+				cpus.push_back(i);
+		return cpus;
+	}
+
+	/** Binds one shard's listener; the first one binding port 0 decides the port for the rest */
+	int listen(const server_options &opts) {
+		struct sockaddr_in addr { };
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port_);
+		if(::inet_pton(AF_INET, opts.address.c_str(), &addr.sin_addr) != 1)
+			throw std::system_error(EINVAL, std::system_category(), "not an IPv4 address: " + opts.address);
+		int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(fd < 0)
+			throw std::system_error(errno, std::system_category(), "could not create listener");
+		int one = 1;
+		if(::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+		|| ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0
+		|| ::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0
+		|| ::listen(fd, opts.backlog) != 0) {
+			int e = errno;
+			::close(fd);
+			throw std::system_error(e, std::system_category(), "could not listen");
+		}
+		if(!port_) {
+			socklen_t len = sizeof(addr);
+			::getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &len);
+			port_ = ntohs(addr.sin_port);
+		}
+		return fd;
+	}
+
+	void accept(shard &s) {
+		s.io->accept(s.listener)->on_ready([this, &s](future<int> &f) {
+			if(s.stopping)
+				return;
+			if(f.is_done()) {
+				s.backoff = std::chrono::milliseconds(0);
+				serve(s, f.value());
+				accept(s);
+			} else {
+				/* Out of fds, most likely: wait for some to be closed, a little longer each time */
+				s.backoff = std::min(std::max(s.backoff * 2, std::chrono::milliseconds(1)), std::chrono::milliseconds(1000));
+				retry_later(s);
+			}
+		});
+	}
+
+	void retry_later(shard &s) {
+		struct itimerspec spec { };
+		spec.it_value.tv_sec = s.backoff.count() / 1000;
+		spec.it_value.tv_nsec = (s.backoff.count() % 1000) * 1000000;
+		::timerfd_settime(s.timer, 0, &spec, nullptr);
+		s.loop.readable(s.timer)->on_ready([this, &s](future<int> &r) {
+			if(!r.is_done() || s.stopping)
+				return;
+			uint64_t expirations;
+			while(::read(s.timer, &expirations, sizeof(expirations)) > 0) { }
+			accept(s);
+		});
+	}
+
+	void serve(shard &s, int fd) {
+		s.accepted.fetch_add(1, std::memory_order_relaxed);
+		s.active.fetch_add(1, std::memory_order_relaxed);
+		s.open.insert(fd);
+		std::shared_ptr<future<int>> finished;
+		try {
+			finished = code_(accepted_connection { fd, s.index, s.loop, *s.io });
+		} catch(...) {
+			finished.reset();
+		}
+		if(!finished) {
+			release(s, fd);
+			return;
+		}
+		/*
+		 * The handler may resolve this on another thread, and after the server
+		 * has gone: hop back to the shard's own thread, if it's still there
+		 */
+		std::weak_ptr<shard> weak = s.shared_from_this();
+		finished->on_ready([weak, fd](future<int> &) {
+			auto p = weak.lock();
+			if(!p)
+				return;
+			if(std::this_thread::get_id() == p->owner) {
+				if(!p->stopping)
+					release(*p, fd);
+				return;
+			}
+			p->loop.post([weak, fd] {
+				auto p = weak.lock();
+				if(p && !p->stopping)
+					release(*p, fd);
+			});
+		});
+	}
+
+	/** Closes a connection the handler is finished with */
+	static void release(shard &s, int fd) {
+		if(!s.open.erase(fd))
+			return;
+		s.active.fetch_sub(1, std::memory_order_relaxed);
+		s.io->close(fd);
+	}
+
+	/** Runs on the shard's own thread, so everything is cancelled while the io is still there */
+	static void shut_down(shard &s) {
+		s.stopping = true;
+		s.loop.remove(s.timer);
+		s.io->close(s.listener);
+		auto open = std::move(s.open);
+		s.open.clear();
+		for(int fd : open) {
+			s.active.fetch_sub(1, std::memory_order_relaxed);
+			s.io->close(fd);
+		}
+		s.loop.stop();
+	}
+
+	handler code_;
+	uint16_t port_;
+	std::atomic<bool> stopped_;
+	std::vector<std::shared_ptr<shard>> shards_;
+};
+
+};
@@ -0,0 +1,132 @@
+#pragma once
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <deque>
+#include <initializer_list>
+#include <memory>
+#include <system_error>
+
+#include <cps/future.h>
+#include <cps/future/reactor.h>
+
+namespace cps {
+
+/**
+ * Delivers signals as futures, through a signalfd watched by the reactor.
+ *
+ * The signals are blocked on the calling thread when the set is created,
+ * so they queue up for the signalfd instead of running a handler. Threads
+ * inherit their mask, so create the set before starting any other threads
+ * - otherwise a process-wide signal may go to a thread which still has it
+ * unblocked. Children started with spawn() get a clean mask regardless.
+ *
+ * ->next returns a future for the next signal to arrive, resolving with its
+ * number. Signals that arrive with nobody waiting are kept, in order, for
+ * the next call. Destroying the set cancels anything still waiting and
+ * restores the previous mask on the calling thread, so create and destroy
+ * it on the loop thread.
+ */
+class signal_set {
+public:
+	signal_set(
+		reactor &loop,
+		std::initializer_list<int> signals
+	):state_(std::make_shared<shared_state>(loop))
+	{
+		sigset_t mask;
+		sigemptyset(&mask);
+		for(int sig : signals)
+			sigaddset(&mask, sig);
+		int rslt = ::pthread_sigmask(SIG_BLOCK, &mask, &previous_);
+		if(rslt != 0)
+			throw std::system_error(rslt, std::system_category(), "could not block signals");
+		state_->fd = ::signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if(state_->fd < 0) {
+			int e = errno;
+			::pthread_sigmask(SIG_SETMASK, &previous_, nullptr);
+			throw std::system_error(e, std::system_category(), "could not create signalfd");
+		}
+	}
+
+	signal_set(const signal_set &) = delete;
+	signal_set &operator=(const signal_set &) = delete;
+
+	~signal_set() {
+		state_->closed = true;
+		state_->loop.remove(state_->fd);
+		::close(state_->fd);
+		auto waiting = std::move(state_->waiting);
+		for(auto &f : waiting)
+			if(f->is_pending())
+				f->cancel();
+		::pthread_sigmask(SIG_SETMASK, &previous_, nullptr);
+	}
+
+	/** Returns a future for the next signal */
+	std::shared_ptr<future<int>> next() {
+		auto f = future<int>::create_shared(u8"signal_set::next");
+		if(!state_->received.empty()) {
+			int sig = state_->received.front();
+			state_->received.pop_front();
+			return f->done(sig);
+		}
+		state_->waiting.push_back(f);
+		/* Something may have arrived since the last time we looked */
+		drain(state_);
+		return f;
+	}
+
+private:
+	struct shared_state {
+		explicit shared_state(reactor &loop):loop(loop) { }
+
+		reactor &loop;
+		int fd = -1;
+		bool closed = false;
+		bool watching = false;
+		/** Signals that arrived with nobody waiting */
+		std::deque<int> received;
+		std::deque<std::shared_ptr<future<int>>> waiting;
+	};
+
+	/** Reads everything the signalfd has, handing signals to waiters in order */
+	static void drain(const std::shared_ptr<shared_state> &s) {
+		struct signalfd_siginfo info[16];
+		for(;;) {
+			ssize_t n = ::read(s->fd, info, sizeof(info));
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				break;
+			for(size_t i = 0; i < static_cast<size_t>(n) / sizeof(info[0]); ++i)
+				s->received.push_back(static_cast<int>(info[i].ssi_signo));
+		}
+		while(!s->received.empty() && !s->waiting.empty()) {
+			auto f = std::move(s->waiting.front());
+			s->waiting.pop_front();
+			/* A waiter that gave up doesn't use up a signal */
+			if(!f->is_pending())
+				continue;
+			int sig = s->received.front();
+			s->received.pop_front();
+			f->done(sig);
+			if(s->closed)
+				return;
+		}
+		if(!s->waiting.empty() && !s->watching) {
+			s->watching = true;
+			s->loop.readable(s->fd)->on_ready([s](future<int> &r) {
+				s->watching = false;
+				if(r.is_done() && !s->closed)
+					drain(s);
+			});
+		}
+	}
+
+	std::shared_ptr<shared_state> state_;
+	sigset_t previous_;
+};
+
+};
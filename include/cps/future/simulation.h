@@ -0,0 +1,207 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/scheduler.h>
+
+namespace cps {
+
+/**
+ * A scheduler running on virtual time.
+ *
+ * Nothing here ever sleeps: ->run pulls the next event off the queue, moves
+ * the clock forward to that event's time and runs it. A simulated hour of
+ * timeouts and retries takes only as long as the callbacks themselves.
+ *
+ * Events at the same time run in the order they were queued, and all
+ * randomness comes from the seeded engine returned by ->random, so a run is
+ * reproducible from its seed.
+ *
+ * Single-threaded: everything, including resolving any futures that feed
+ * into the simulation, must happen on the thread calling ->run.
+ */
+class simulated_scheduler : public scheduler {
+public:
+	simulated_scheduler(
+		uint64_t seed = 0
+	):now_(),
+	  sequence_(0),
+	  executed_(0),
+	  random_(seed)
+	{
+	}
+
+	virtual time_point now() const override { return now_; }
+
+	/** Queues code to run at the current virtual time, after anything already queued for it */
+	virtual void post(std::function<void()> code) override {
+		schedule(now_, std::move(code));
+	}
+
+	virtual std::shared_ptr<future<int>> at(time_point when) override {
+		auto f = future<int>::create_shared(u8"simulated timer");
+		schedule(when, [f]() {
+			if(f->is_pending())
+				f->done(0);
+		});
+		return f;
+	}
+
+	/** Queues code to run at the given virtual time */
+	void schedule(time_point when, std::function<void()> code) {
+		if(when < now_)
+			when = now_;
+		events_.push(event { when, sequence_++, std::move(code) });
+	}
+
+	/** The random engine for this run */
+	std::mt19937_64 &random() { return random_; }
+
+	/**
+	 * Runs the next event, if there is one.
+	 * @returns false if there was nothing to run
+	 */
+	bool step() {
+		if(events_.empty())
+			return false;
+		/* priority_queue only hands out const refs, and we want to move the code out */
+		auto ev = std::move(const_cast<event &>(events_.top()));
+		events_.pop();
+		now_ = ev.when;
+		++executed_;
+		ev.code();
+		return true;
+	}
+
+	/** Runs until there are no more events. Returns the number of events run. */
+	size_t run() {
+		size_t n = 0;
+		while(step())
+			++n;
+		return n;
+	}
+
+	/**
+	 * Runs all events up to and including the given time, then moves the
+	 * clock to that time.
+	 */
+	size_t run_until(time_point when) {
+		size_t n = 0;
+		while(!events_.empty() && events_.top().when <= when) {
+			step();
+			++n;
+		}
+		if(now_ < when)
+			now_ = when;
+		return n;
+	}
+
+	/** Runs for the given amount of virtual time */
+	size_t run_for(duration d) {
+		return run_until(now_ + d);
+	}
+
+	/** Number of events waiting to run */
+	size_t pending() const { return events_.size(); }
+	/** Number of events run so far */
+	size_t executed() const { return executed_; }
+
+private:
+	struct event {
+		time_point when;
+		/** Breaks ties, so events at the same time run in FIFO order */
+		uint64_t sequence;
+		std::function<void()> code;
+
+		bool operator>(const event &other) const {
+			return when != other.when ? when > other.when : sequence > other.sequence;
+		}
+	};
+
+	time_point now_;
+	uint64_t sequence_;
+	size_t executed_;
+	std::mt19937_64 random_;
+	std::priority_queue<event, std::vector<event>, std::greater<event>> events_;
+};
+
+/**
+ * Resolves futures after a delay sampled from a latency distribution, for
+ * standing in for a remote service in simulations.
+ *
+ *     latency_injector backend {
+ *         sim,
+ *         latency_injector::from_distribution(std::lognormal_distribution<double>(8.0, 0.6))
+ *     };
+ *     backend.respond(std::string { "reply" })->on_done(...);
+ */
+class latency_injector {
+public:
+	using duration = scheduler::duration;
+	using sampler = std::function<duration(std::mt19937_64 &)>;
+
+	/**
+	 * Wraps a standard random distribution, treating each sample as a
+	 * number of Unit (microseconds by default).
+	 */
+	template<typename Distribution, typename Unit = std::chrono::microseconds>
+	static sampler from_distribution(Distribution dist) {
+		return [dist](std::mt19937_64 &rng) mutable -> duration {
+			using fractional = std::chrono::duration<double, typename Unit::period>;
+			auto v = dist(rng);
+			return std::chrono::duration_cast<duration>(fractional(v < 0 ? 0 : v));
+		};
+	}
+
+	/** Always the same delay */
+	static sampler fixed(duration d) {
+		return [d](std::mt19937_64 &) { return d; };
+	}
+
+	latency_injector(
+		simulated_scheduler &sim,
+		sampler latency,
+		double failure_rate = 0.0
+	):sim_(sim),
+	  latency_(std::move(latency)),
+	  failure_rate_(failure_rate)
+	{
+	}
+
+	/** Draws the next delay */
+	duration sample() { return latency_(sim_.random()); }
+
+	/**
+	 * Returns a future which will be resolved with the given value after a
+	 * sampled delay - or failed, at the configured failure rate.
+	 */
+	template<typename T>
+	std::shared_ptr<future<T>> respond(T value) {
+		auto f = future<T>::create_shared(u8"simulated response");
+		auto delay = sample();
+		bool fails = failure_rate_ > 0.0
+			&& std::uniform_real_distribution<double>(0.0, 1.0)(sim_.random()) < failure_rate_;
+		sim_.schedule(sim_.now() + delay, [f, fails, value]() {
+			if(!f->is_pending())
+				return;
+			if(fails)
+				f->fail("simulated failure");
+			else
+				f->done(value);
+		});
+		return f;
+	}
+
+private:
+	simulated_scheduler &sim_;
+	sampler latency_;
+	double failure_rate_;
+};
+
+};
+
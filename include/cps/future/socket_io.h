@@ -0,0 +1,1079 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <system_error>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/* Multishot recv is the newest thing we use, so it tells us whether the headers are recent enough */
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define CPS_HAVE_IO_URING 1
+#else
+#define CPS_HAVE_IO_URING 0
+#endif
+
+#include <cps/future.h>
+#include <cps/future/buffer.h>
+#include <cps/future/reactor.h>
+#include <cps/future/source.h>
+
+namespace cps {
+
+/**
+ * Completion-style socket I/O on a reactor: ask for the next connection,
+ * the next chunk of data, or for some data to be sent, and get a future
+ * for the result.
+ *
+ * ->accept resolves with the next connection on a listening socket, as a
+ * nonblocking, close-on-exec fd. ->recv resolves with the next chunk
+ * received, failing with end_of_stream once the peer has shut down its
+ * side. ->send resolves with the size of the buffer once the kernel has
+ * taken all of it; sends on one socket go out in the order they were
+ * made. Keep one ->accept or ->recv outstanding per socket at a time.
+ *
+ * ->close cancels anything outstanding on the fd and closes it. Sockets
+ * are otherwise left alone, including when the backend goes away, which
+ * cancels everything still outstanding.
+ *
+ * There are two implementations - epoll_socket_io and uring_socket_io -
+ * and make_socket_io picks between them at run time. All of them must be
+ * used from the loop thread only. Sockets should be nonblocking, as the
+ * ones from ->accept are.
+ */
+class socket_io {
+public:
+	virtual ~socket_io() { }
+
+	/** Returns a future for the next connection on a listening socket */
+	virtual std::shared_ptr<future<int>> accept(int listener) = 0;
+	/** Returns a future for the next chunk of data */
+	virtual std::shared_ptr<future<buffer>> recv(int fd) = 0;
+	/** Sends the whole buffer, returning a future for its size */
+	virtual std::shared_ptr<future<size_t>> send(int fd, buffer data) = 0;
+	/** Cancels anything outstanding on the fd, then closes it */
+	virtual void close(int fd) = 0;
+
+	/** Short name for the implementation */
+	virtual const char *name() const = 0;
+	/** System calls made by this backend, not counting the reactor's own */
+	virtual size_t syscalls() const = 0;
+
+	/** A connected socket as an async_source of the chunks it receives */
+	static async_source<buffer> as_source(socket_io &io, int fd) {
+		return [&io, fd] { return io.recv(fd); };
+	}
+};
+
+/**
+ * socket_io over the reactor's readiness notifications: try the call
+ * straight away, and if it would block, wait for the fd to be ready and
+ * try again. That's one syscall per operation, plus the reactor's
+ * epoll_ctl to rearm its one-shot interest whenever we have to wait.
+ */
+class epoll_socket_io : public socket_io {
+public:
+	explicit epoll_socket_io(
+		reactor &loop
+	):state_(std::make_shared<shared_state>(loop))
+	{
+	}
+
+	epoll_socket_io(const epoll_socket_io &) = delete;
+	epoll_socket_io &operator=(const epoll_socket_io &) = delete;
+
+	~epoll_socket_io() {
+		auto connections = std::move(state_->connections);
+		for(auto &it : connections)
+			forget(*state_, it.first, *it.second);
+	}
+
+	std::shared_ptr<future<int>> accept(int listener) override {
+		auto f = future<int>::create_shared(u8"socket_io::accept");
+		accept_into(state_, connection_for(listener), f);
+		return f;
+	}
+
+	std::shared_ptr<future<buffer>> recv(int fd) override {
+		auto f = future<buffer>::create_shared(u8"socket_io::recv");
+		recv_into(state_, connection_for(fd), f);
+		return f;
+	}
+
+	std::shared_ptr<future<size_t>> send(int fd, buffer data) override {
+		auto f = future<size_t>::create_shared(u8"socket_io::send");
+		auto c = connection_for(fd);
+		if(data.empty())
+			return f->done(0);
+		c->sends.push_back(pending_send { std::move(data), 0, f });
+		if(c->sends.size() == 1)
+			pump(state_, c);
+		return f;
+	}
+
+	void close(int fd) override {
+		auto it = state_->connections.find(fd);
+		if(it != state_->connections.end()) {
+			auto c = std::move(it->second);
+			state_->connections.erase(it);
+			forget(*state_, fd, *c);
+		}
+		++state_->syscalls;
+		::close(fd);
+	}
+
+	const char *name() const override { return "epoll"; }
+	size_t syscalls() const override { return state_->syscalls; }
+
+private:
+	struct pending_send {
+		buffer data;
+		size_t sent;
+		std::shared_ptr<future<size_t>> f;
+	};
+
+	struct connection {
+		explicit connection(int fd):fd(fd) { }
+
+		const int fd;
+		bool closed = false;
+		/** Sends in order; the first is the one going out */
+		std::deque<pending_send> sends;
+	};
+
+	struct shared_state {
+		explicit shared_state(reactor &loop):loop(loop) { }
+
+		reactor &loop;
+		size_t syscalls = 0;
+		/** Every recv goes through this, since they all happen on the loop's thread */
+		read_block incoming;
+		std::unordered_map<int, std::shared_ptr<connection>> connections;
+	};
+
+	std::shared_ptr<connection> connection_for(int fd) {
+		auto &c = state_->connections[fd];
+		if(!c)
+			c = std::make_shared<connection>(fd);
+		return c;
+	}
+
+	/** Stops watching the fd, which cancels any waiting accept or recv, and cancels sends */
+	static void forget(shared_state &s, int fd, connection &c) {
+		c.closed = true;
+		s.loop.remove(fd);
+		auto sends = std::move(c.sends);
+		for(auto &p : sends)
+			if(p.f->is_pending())
+				p.f->cancel();
+	}
+
+	static void accept_into(const std::shared_ptr<shared_state> &s, const std::shared_ptr<connection> &c, const std::shared_ptr<future<int>> &f) {
+		if(c->closed) {
+			f->cancel();
+			return;
+		}
+		int fd;
+		do {
+			++s->syscalls;
+			fd = ::accept4(c->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		} while(fd < 0 && errno == EINTR);
+		if(fd >= 0) {
+			f->done(fd);
+		} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			s->loop.readable(c->fd)->on_ready([s, c, f](future<int> &r) {
+				if(!f->is_pending())
+					return;
+				if(r.is_done())
+					accept_into(s, c, f);
+				else
+					f->cancel();
+			});
+		} else {
+			f->fail(std::system_error(errno, std::system_category(), "accept failed"));
+		}
+	}
+
+	static void recv_into(const std::shared_ptr<shared_state> &s, const std::shared_ptr<connection> &c, const std::shared_ptr<future<buffer>> &f) {
+		if(c->closed) {
+			f->cancel();
+			return;
+		}
+		std::error_code ec;
+		++s->syscalls;
+		auto data = s->incoming.recv(c->fd, MSG_DONTWAIT, ec);
+		if(!data.empty()) {
+			f->done(std::move(data));
+		} else if(!ec) {
+			f->fail_exception_pointer(end_of_stream());
+		} else if(ec.value() == EAGAIN || ec.value() == EWOULDBLOCK) {
+			s->loop.readable(c->fd)->on_ready([s, c, f](future<int> &r) {
+				if(!f->is_pending())
+					return;
+				if(r.is_done())
+					recv_into(s, c, f);
+				else
+					f->cancel();
+			});
+		} else {
+			f->fail(std::system_error(ec, "recv failed"));
+		}
+	}
+
+	/** Sends from the front of the queue until it's empty or the socket is full */
+	static void pump(const std::shared_ptr<shared_state> &s, const std::shared_ptr<connection> &c) {
+		while(!c->closed && !c->sends.empty()) {
+			auto &p = c->sends.front();
+			auto rest = p.data.slice(p.sent);
+			std::vector<struct iovec> iov(std::min<size_t>(rest.segment_count(), IOV_MAX));
+			struct msghdr msg { };
+			msg.msg_iov = iov.data();
+			msg.msg_iovlen = rest.to_iovec(iov.data(), iov.size());
+			ssize_t n;
+			do {
+				++s->syscalls;
+				n = ::sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+			} while(n < 0 && errno == EINTR);
+			if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				s->loop.writable(c->fd)->on_ready([s, c](future<int> &r) {
+					if(r.is_done())
+						pump(s, c);
+				});
+				return;
+			}
+			if(n < 0) {
+				std::system_error e(errno, std::system_category(), "send failed");
+				auto sends = std::move(c->sends);
+				for(auto &it : sends)
+					if(it.f->is_pending())
+						it.f->fail(e);
+				return;
+			}
+			p.sent += static_cast<size_t>(n);
+			if(p.sent < p.data.size())
+				continue;
+			auto f = std::move(p.f);
+			size_t size = p.data.size();
+			c->sends.pop_front();
+			if(f->is_pending())
+				f->done(size);
+		}
+	}
+
+	std::shared_ptr<shared_state> state_;
+};
+
+#if CPS_HAVE_IO_URING
+
+/** Sizes for a uring_socket_io */
+struct uring_options {
+	/** Submission queue entries; the completion queue gets four times as many */
+	unsigned entries = 256;
+	/** Slots in the fixed file table; sockets beyond that are used by fd */
+	unsigned fixed_files = 1024;
+	/** Receive buffers shared by all sockets */
+	unsigned buffers = 256;
+	unsigned buffer_size = 16384;
+	/** Chunks held per socket, nobody having asked for them, before we stop receiving */
+	size_t max_queued = 16;
+	/** Use multishot accept and recv, if the kernel has them */
+	bool multishot = true;
+};
+
+namespace detail {
+
+/** The rings themselves, set up and driven through the raw system calls */
+class uring {
+public:
+	uring(
+		const uring_options &opts
+	):fd_(-1),
+	  sq_map_(MAP_FAILED),
+	  sqes_(static_cast<struct io_uring_sqe *>(MAP_FAILED)),
+	  syscalls_(0),
+	  sqe_tail_(0),
+	  submitted_(0)
+	{
+		std::memset(&params_, 0, sizeof(params_));
+		params_.flags = IORING_SETUP_CQSIZE;
+		params_.cq_entries = opts.entries * 4;
+		++syscalls_;
+		fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, opts.entries, &params_));
+		if(fd_ < 0)
+			throw std::system_error(errno, std::system_category(), "io_uring_setup failed");
+		::fcntl(fd_, F_SETFD, FD_CLOEXEC);
+		if(!(params_.features & IORING_FEAT_SINGLE_MMAP) || !(params_.features & IORING_FEAT_NODROP)) {
+			::close(fd_);
+			throw std::system_error(ENOSYS, std::system_category(), "io_uring is too old");
+		}
+		sq_size_ = std::max(
+			params_.sq_off.array + params_.sq_entries * sizeof(unsigned),
+			params_.cq_off.cqes + params_.cq_entries * sizeof(struct io_uring_cqe)
+		);
+		sq_map_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+		sqes_size_ = params_.sq_entries * sizeof(struct io_uring_sqe);
+		void *sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+		if(sq_map_ == MAP_FAILED || sqes == MAP_FAILED) {
+			int e = errno;
+			release();
+			throw std::system_error(e, std::system_category(), "could not map io_uring");
+		}
+		sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+		char *sq = static_cast<char *>(sq_map_);
+		sq_head_ = reinterpret_cast<unsigned *>(sq + params_.sq_off.head);
+		sq_tail_ = reinterpret_cast<unsigned *>(sq + params_.sq_off.tail);
+		sq_mask_ = *reinterpret_cast<unsigned *>(sq + params_.sq_off.ring_mask);
+		sq_flags_ = reinterpret_cast<unsigned *>(sq + params_.sq_off.flags);
+		auto *array = reinterpret_cast<unsigned *>(sq + params_.sq_off.array);
+		/* Slot i always holds entry i, so the array never needs touching again */
+		for(unsigned i = 0; i < params_.sq_entries; ++i)
+			array[i] = i;
+		cq_head_ = reinterpret_cast<unsigned *>(sq + params_.cq_off.head);
+		cq_tail_ = reinterpret_cast<unsigned *>(sq + params_.cq_off.tail);
+		cq_mask_ = *reinterpret_cast<unsigned *>(sq + params_.cq_off.ring_mask);
+		cqes_ = reinterpret_cast<struct io_uring_cqe *>(sq + params_.cq_off.cqes);
+		sqe_tail_ = submitted_ = *sq_tail_;
+	}
+
+	uring(const uring &) = delete;
+	uring &operator=(const uring &) = delete;
+
+	~uring() { release(); }
+
+	int fd() const { return fd_; }
+
+	/** Returns a cleared submission entry, or nullptr if the queue is full until we ->submit */
+	struct io_uring_sqe *next_sqe() {
+		unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+		if(sqe_tail_ - head >= params_.sq_entries)
+			return nullptr;
+		auto *sqe = &sqes_[sqe_tail_ & sq_mask_];
+		++sqe_tail_;
+		std::memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	/** Entries filled in but not yet handed to the kernel */
+	unsigned unsubmitted() const { return sqe_tail_ - submitted_; }
+
+	/** Hands everything queued to the kernel in one call */
+	void submit() {
+		__atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+		while(submitted_ != sqe_tail_) {
+			++syscalls_;
+			int n = static_cast<int>(::syscall(__NR_io_uring_enter, fd_, sqe_tail_ - submitted_, 0, 0, nullptr, 0));
+			if(n < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+				/* Completions need reaping first: the caller will be back */
+				if(errno != EINTR)
+					return;
+				continue;
+			}
+			if(n < 0)
+				throw std::system_error(errno, std::system_category(), "io_uring_enter failed");
+			submitted_ += static_cast<unsigned>(n);
+		}
+	}
+
+	/** Waits for at least one completion, then copies out everything waiting */
+	void wait(std::vector<struct io_uring_cqe> &out) {
+		int n;
+		do {
+			++syscalls_;
+			n = static_cast<int>(::syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+		} while(n < 0 && errno == EINTR);
+		reap(out);
+	}
+
+	/** Copies out every completion waiting, freeing up their slots */
+	void reap(std::vector<struct io_uring_cqe> &out) {
+		for(;;) {
+			unsigned head = *cq_head_;
+			unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+			for(; head != tail; ++head)
+				out.push_back(cqes_[head & cq_mask_]);
+			__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+			/* Completions that didn't fit are held by the kernel until we ask for them */
+			if(!(__atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+				return;
+			++syscalls_;
+			::syscall(__NR_io_uring_enter, fd_, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+		}
+	}
+
+	/** io_uring_register, counted */
+	int enroll(unsigned op, const void *arg, unsigned count) {
+		++syscalls_;
+		return static_cast<int>(::syscall(__NR_io_uring_register, fd_, op, arg, count));
+	}
+
+	size_t syscalls() const { return syscalls_; }
+
+private:
+	void release() {
+		if(sqes_ != MAP_FAILED)
+			::munmap(sqes_, sqes_size_);
+		if(sq_map_ != MAP_FAILED)
+			::munmap(sq_map_, sq_size_);
+		if(fd_ >= 0)
+			::close(fd_);
+	}
+
+	int fd_;
+	struct io_uring_params params_;
+	void *sq_map_;
+	size_t sq_size_ = 0;
+	size_t sqes_size_ = 0;
+	struct io_uring_sqe *sqes_;
+	unsigned *sq_head_ = nullptr;
+	unsigned *sq_tail_ = nullptr;
+	unsigned *sq_flags_ = nullptr;
+	unsigned sq_mask_ = 0;
+	unsigned *cq_head_ = nullptr;
+	unsigned *cq_tail_ = nullptr;
+	unsigned cq_mask_ = 0;
+	struct io_uring_cqe *cqes_ = nullptr;
+	size_t syscalls_;
+	/** Our copy of the submission tail, ahead of the kernel's while we're filling entries */
+	unsigned sqe_tail_;
+	unsigned submitted_;
+};
+
+}
+
+/**
+ * socket_io on io_uring, driven by the reactor.
+ *
+ * Operations become submission queue entries, which are handed to the
+ * kernel together at the end of the reactor iteration - one io_uring_enter
+ * however many sockets had something to do. The ring's fd is watched by
+ * the reactor, and completions resolve the futures.
+ *
+ * Where the kernel has them (6.0 on), accept and recv are multishot: one
+ * submission keeps producing connections or data until cancelled, so a
+ * busy socket costs no submissions at all. Received data lands in a pool
+ * of buffers provided to the kernel up front, which picks one per chunk;
+ * the chunk is copied out and the buffer goes back with the next batch.
+ * A socket whose chunks aren't being asked for stops receiving after
+ * max_queued, so a slow reader can't use up every buffer. Sockets get a
+ * slot in the registered file table while there are slots free, which
+ * saves the kernel looking up the fd on every operation. Sends go
+ * straight from the buffer's own segments with sendmsg, rather than being
+ * copied into registered buffers, so they're zero-copy on our side.
+ *
+ * ->supported says whether the kernel can do all this; make_socket_io
+ * falls back to epoll_socket_io if it can't. Without multishot support
+ * each accept and recv is a separate submission, still batched.
+ */
+class uring_socket_io : public socket_io {
+public:
+	explicit uring_socket_io(
+		reactor &loop,
+		uring_options opts = uring_options { }
+	):state_(std::make_shared<shared_state>(loop, opts))
+	{
+		watch(state_);
+	}
+
+	uring_socket_io(const uring_socket_io &) = delete;
+	uring_socket_io &operator=(const uring_socket_io &) = delete;
+
+	~uring_socket_io() {
+		auto &s = *state_;
+		s.closed = true;
+		s.loop.remove(s.ring.fd());
+		auto connections = std::move(s.connections);
+		for(auto &it : connections)
+			abandon(*it.second);
+		/* Closing the ring, when the state goes, cancels whatever is still in flight */
+	}
+
+	/** True if this kernel has everything we need */
+	static bool supported() {
+		static const bool ok = [] {
+			try {
+				reactor loop;
+				uring_options opts;
+				opts.entries = 4;
+				opts.fixed_files = 0;
+				opts.buffers = 1;
+				uring_socket_io io { loop, opts };
+				return true;
+			} catch(const std::system_error &) {
+				return false;
+			}
+		}();
+		return ok;
+	}
+
+	/** True if accept and recv are multishot */
+	bool multishot() const { return state_->multishot; }
+
+	std::shared_ptr<future<int>> accept(int listener) override {
+		auto f = future<int>::create_shared(u8"socket_io::accept");
+		auto c = connection_for(listener);
+		if(!c->accepted.empty()) {
+			int fd = c->accepted.front();
+			c->accepted.pop_front();
+			return f->done(fd);
+		}
+		c->acceptor = f;
+		if(!c->accept_op)
+			start_accept(state_, c);
+		return f;
+	}
+
+	std::shared_ptr<future<buffer>> recv(int fd) override {
+		auto f = future<buffer>::create_shared(u8"socket_io::recv");
+		auto c = connection_for(fd);
+		if(!c->received.empty()) {
+			auto data = std::move(c->received.front());
+			c->received.pop_front();
+			if(!c->recv_op && !c->eof && !c->error && state_->multishot)
+				start_recv(state_, c);
+			return f->done(std::move(data));
+		}
+		if(c->eof)
+			return f->fail_exception_pointer(end_of_stream());
+		if(c->error)
+			return f->fail(std::system_error(c->error, "recv failed"));
+		c->reader = f;
+		if(!c->recv_op)
+			start_recv(state_, c);
+		return f;
+	}
+
+	std::shared_ptr<future<size_t>> send(int fd, buffer data) override {
+		auto f = future<size_t>::create_shared(u8"socket_io::send");
+		if(data.empty())
+			return f->done(0);
+		auto c = connection_for(fd);
+		c->sends.push_back(pending_send { std::move(data), 0, f });
+		if(!c->send_op)
+			start_send(state_, c);
+		return f;
+	}
+
+	void close(int fd) override {
+		auto &s = *state_;
+		auto it = s.connections.find(fd);
+		if(it != s.connections.end()) {
+			auto c = std::move(it->second);
+			s.connections.erase(it);
+			for(uint64_t op : { c->accept_op, c->recv_op, c->send_op })
+				if(op)
+					cancel(state_, op);
+			abandon(*c);
+			/* Anything queued against the fd or its slot must be in the kernel's
+			 * hands before either can be reused for another socket */
+			if(s.ring.unsubmitted())
+				s.ring.submit();
+			if(c->slot >= 0) {
+				int none = -1;
+				struct io_uring_files_update update { };
+				update.offset = static_cast<unsigned>(c->slot);
+				update.fds = reinterpret_cast<uintptr_t>(&none);
+				s.ring.enroll(IORING_REGISTER_FILES_UPDATE, &update, 1);
+				s.free_slots.push_back(c->slot);
+			}
+		}
+		++s.closes;
+		::close(fd);
+	}
+
+	const char *name() const override { return "io_uring"; }
+	size_t syscalls() const override { return state_->ring.syscalls() + state_->closes; }
+
+private:
+	enum class op_kind { accept, recv, send, cancel };
+
+	struct pending_send {
+		buffer data;
+		size_t sent;
+		std::shared_ptr<future<size_t>> f;
+	};
+
+	struct connection {
+		explicit connection(int fd):fd(fd) { }
+
+		const int fd;
+		/** Our slot in the registered file table, or -1 */
+		int slot = -1;
+		bool closed = false;
+		/** What recv failed with: every recv after that fails the same way */
+		std::error_code error;
+
+		std::deque<int> accepted;
+		std::shared_ptr<future<int>> acceptor;
+		uint64_t accept_op = 0;
+
+		std::deque<buffer> received;
+		bool eof = false;
+		std::shared_ptr<future<buffer>> reader;
+		uint64_t recv_op = 0;
+
+		std::deque<pending_send> sends;
+		uint64_t send_op = 0;
+	};
+
+	/** What a submission was for, found again through its user_data */
+	struct operation {
+		op_kind kind;
+		std::shared_ptr<connection> conn;
+		bool multishot = false;
+		/** For sends: the iovecs have to stay put until the kernel is done */
+		std::vector<struct iovec> iov;
+		struct msghdr msg { };
+		/** For recv without a buffer ring */
+		std::unique_ptr<char[]> data;
+	};
+
+	struct shared_state {
+		shared_state(
+			reactor &loop,
+			const uring_options &opts
+		):loop(loop),
+		  opts(opts),
+		  ring(opts)
+		{
+			probe();
+			if(opts.fixed_files) {
+				std::vector<int> none(opts.fixed_files, -1);
+				if(ring.enroll(IORING_REGISTER_FILES, none.data(), opts.fixed_files) == 0) {
+					for(unsigned i = opts.fixed_files; i > 0; --i)
+						free_slots.push_back(static_cast<int>(i - 1));
+				}
+			}
+			if(multishot)
+				setup_buffers();
+		}
+
+		/** Checks we have the operations we need, and whether we have the newer ones */
+		void probe() {
+			const unsigned ops = 256;
+			std::vector<char> storage(sizeof(struct io_uring_probe) + ops * sizeof(struct io_uring_probe_op));
+			auto *p = reinterpret_cast<struct io_uring_probe *>(storage.data());
+			if(ring.enroll(IORING_REGISTER_PROBE, p, ops) < 0)
+				throw std::system_error(errno, std::system_category(), "could not probe io_uring");
+			auto has = [p](unsigned op) {
+				return op <= p->last_op && (p->ops[op].flags & IO_URING_OP_SUPPORTED);
+			};
+			if(!has(IORING_OP_ACCEPT) || !has(IORING_OP_RECV) || !has(IORING_OP_SENDMSG) || !has(IORING_OP_ASYNC_CANCEL))
+				throw std::system_error(ENOSYS, std::system_category(), "io_uring lacks socket operations");
+			/* Multishot recv and buffer rings came in 6.0, alongside SEND_ZC: there's no probe for flags */
+			multishot = opts.multishot && has(IORING_OP_SEND_ZC);
+		}
+
+		/**
+		 * Hands the kernel our receive buffers, falling back to a buffer per
+		 * recv if it won't take them. These are the original provided
+		 * buffers rather than a registered buffer ring: returning one is an
+		 * entry in the next batch instead of a store to shared memory, but
+		 * they work everywhere multishot recv does.
+		 */
+		void setup_buffers() {
+			buffers.reset(new char[static_cast<size_t>(opts.buffers) * opts.buffer_size]);
+			auto *sqe = ring.next_sqe();
+			sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+			sqe->fd = static_cast<int>(opts.buffers);
+			sqe->addr = reinterpret_cast<uintptr_t>(buffers.get());
+			sqe->len = opts.buffer_size;
+			sqe->buf_group = 0;
+			sqe->off = 0;
+			std::vector<struct io_uring_cqe> cqes;
+			ring.submit();
+			ring.wait(cqes);
+			if(cqes.empty() || cqes.front().res < 0) {
+				buffers.reset();
+				multishot = false;
+			}
+		}
+
+		/** Returns a receive buffer to the kernel, with the next batch */
+		void give_back(uint16_t bid) {
+			auto *sqe = ring.next_sqe();
+			if(!sqe) {
+				ring.submit();
+				sqe = ring.next_sqe();
+			}
+			sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+			sqe->fd = 1;
+			sqe->addr = reinterpret_cast<uintptr_t>(buffers.get() + static_cast<size_t>(bid) * opts.buffer_size);
+			sqe->len = opts.buffer_size;
+			sqe->buf_group = 0;
+			sqe->off = bid;
+		}
+
+		reactor &loop;
+		const uring_options opts;
+		detail::uring ring;
+		bool multishot = false;
+		bool closed = false;
+		bool flush_queued = false;
+		size_t closes = 0;
+		std::vector<int> free_slots;
+		std::unique_ptr<char[]> buffers;
+		uint64_t next_op = 1;
+		std::unordered_map<uint64_t, std::unique_ptr<operation>> operations;
+		std::unordered_map<int, std::shared_ptr<connection>> connections;
+		std::vector<struct io_uring_cqe> completions;
+	};
+
+	std::shared_ptr<connection> connection_for(int fd) {
+		auto &s = *state_;
+		auto &c = s.connections[fd];
+		if(!c) {
+			c = std::make_shared<connection>(fd);
+			if(!s.free_slots.empty()) {
+				int slot = s.free_slots.back();
+				struct io_uring_files_update update { };
+				update.offset = static_cast<unsigned>(slot);
+				update.fds = reinterpret_cast<uintptr_t>(&fd);
+				if(s.ring.enroll(IORING_REGISTER_FILES_UPDATE, &update, 1) == 1) {
+					s.free_slots.pop_back();
+					c->slot = slot;
+				}
+			}
+		}
+		return c;
+	}
+
+	/** Cancels the futures waiting on a connection we're done with */
+	static void abandon(connection &c) {
+		c.closed = true;
+		auto acceptor = std::move(c.acceptor);
+		auto reader = std::move(c.reader);
+		auto sends = std::move(c.sends);
+		for(int fd : c.accepted)
+			::close(fd);
+		c.accepted.clear();
+		if(acceptor && acceptor->is_pending())
+			acceptor->cancel();
+		if(reader && reader->is_pending())
+			reader->cancel();
+		for(auto &p : sends)
+			if(p.f->is_pending())
+				p.f->cancel();
+	}
+
+	/** Starts watching the ring for completions */
+	static void watch(const std::shared_ptr<shared_state> &s) {
+		std::weak_ptr<shared_state> weak = s;
+		s->loop.readable(s->ring.fd())->on_ready([weak](future<int> &r) {
+			auto s = weak.lock();
+			if(!s || !r.is_done() || s->closed)
+				return;
+			complete(s);
+			watch(s);
+		});
+	}
+
+	/** Hands what we've queued to the kernel at the end of this iteration */
+	static void schedule_flush(const std::shared_ptr<shared_state> &s) {
+		if(s->flush_queued)
+			return;
+		s->flush_queued = true;
+		std::weak_ptr<shared_state> weak = s;
+		s->loop.defer([weak] {
+			auto s = weak.lock();
+			if(!s)
+				return;
+			s->flush_queued = false;
+			if(s->closed)
+				return;
+			s->ring.submit();
+			/* Plenty of operations complete during submission: no need to wait for epoll to say so */
+			complete(s);
+		});
+	}
+
+	/** Returns an entry for a new operation, with its user_data filled in */
+	static struct io_uring_sqe *prepare(const std::shared_ptr<shared_state> &s, std::unique_ptr<operation> op, uint64_t &id) {
+		auto *sqe = s->ring.next_sqe();
+		if(!sqe) {
+			s->ring.submit();
+			sqe = s->ring.next_sqe();
+			if(!sqe)
+				throw std::system_error(EBUSY, std::system_category(), "io_uring submission queue is full");
+		}
+		id = s->next_op++;
+		sqe->user_data = id;
+		if(op->conn) {
+			if(op->conn->slot >= 0) {
+				sqe->fd = op->conn->slot;
+				sqe->flags |= IOSQE_FIXED_FILE;
+			} else {
+				sqe->fd = op->conn->fd;
+			}
+		}
+		s->operations.emplace(id, std::move(op));
+		schedule_flush(s);
+		return sqe;
+	}
+
+	static void start_accept(const std::shared_ptr<shared_state> &s, const std::shared_ptr<connection> &c) {
+		std::unique_ptr<operation> op { new operation };
+		op->kind = op_kind::accept;
+		op->conn = c;
+		op->multishot = s->multishot;
+		auto *sqe = prepare(s, std::move(op), c->accept_op);
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		if(s->multishot)
+			sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+	}
+
+	static void start_recv(const std::shared_ptr<shared_state> &s, const std::shared_ptr<connection> &c) {
+		std::unique_ptr<operation> op { new operation };
+		op->kind = op_kind::recv;
+		op->conn = c;
+		op->multishot = s->multishot;
+		char *data = nullptr;
+		if(!s->multishot) {
+			op->data.reset(new char[s->opts.buffer_size]);
+			data = op->data.get();
+		}
+		auto *sqe = prepare(s, std::move(op), c->recv_op);
+		sqe->opcode = IORING_OP_RECV;
+		if(s->multishot) {
+			sqe->flags |= IOSQE_BUFFER_SELECT;
+			sqe->buf_group = 0;
+			sqe->ioprio |= IORING_RECV_MULTISHOT;
+		} else {
+			sqe->addr = reinterpret_cast<uintptr_t>(data);
+			sqe->len = s->opts.buffer_size;
+		}
+	}
+
+	/** Sends as much of the queue as one sendmsg can carry */
+	static void start_send(const std::shared_ptr<shared_state> &s, const std::shared_ptr<connection> &c) {
+		std::unique_ptr<operation> op { new operation };
+		op->kind = op_kind::send;
+		op->conn = c;
+		for(auto &p : c->sends) {
+			auto rest = p.sent ? p.data.slice(p.sent) : p.data;
+			size_t room = IOV_MAX - op->iov.size();
+			if(!room)
+				break;
+			size_t at = op->iov.size();
+			op->iov.resize(at + std::min(rest.segment_count(), room));
+			rest.to_iovec(op->iov.data() + at, op->iov.size() - at);
+		}
+		op->msg.msg_iov = op->iov.data();
+		op->msg.msg_iovlen = op->iov.size();
+		auto *msg = &op->msg;
+		auto *sqe = prepare(s, std::move(op), c->send_op);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->addr = reinterpret_cast<uintptr_t>(msg);
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+
+	static void cancel(const std::shared_ptr<shared_state> &s, uint64_t target) {
+		std::unique_ptr<operation> op { new operation };
+		op->kind = op_kind::cancel;
+		uint64_t id;
+		auto *sqe = prepare(s, std::move(op), id);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = target;
+	}
+
+	/** Reaps every completion, resolving futures once we're done with the ring */
+	static void complete(const std::shared_ptr<shared_state> &s) {
+		auto &cqes = s->completions;
+		for(;;) {
+			cqes.clear();
+			s->ring.reap(cqes);
+			if(cqes.empty())
+				return;
+			/* Resolving may submit more, which may complete in turn, so take a copy */
+			auto batch = cqes;
+			for(auto &cqe : batch) {
+				auto it = s->operations.find(cqe.user_data);
+				if(it == s->operations.end())
+					continue;
+				bool last = !it->second->multishot || !(cqe.flags & IORING_CQE_F_MORE);
+				std::unique_ptr<operation> done;
+				operation *op = it->second.get();
+				if(last) {
+					done = std::move(it->second);
+					s->operations.erase(it);
+				}
+				switch(op->kind) {
+				case op_kind::accept: accepted(s, *op, cqe, last); break;
+				case op_kind::recv: received(s, *op, cqe, last); break;
+				case op_kind::send: sent(s, *op, cqe); break;
+				case op_kind::cancel: break;
+				}
+				if(s->closed)
+					return;
+			}
+		}
+	}
+
+	static void accepted(const std::shared_ptr<shared_state> &s, operation &op, const struct io_uring_cqe &cqe, bool last) {
+		auto c = op.conn;
+		if(last)
+			c->accept_op = 0;
+		if(c->closed) {
+			if(cqe.res >= 0)
+				::close(cqe.res);
+			return;
+		}
+		auto f = std::move(c->acceptor);
+		if(f && !f->is_pending())
+			f.reset();
+		if(cqe.res >= 0) {
+			if(f)
+				f->done(cqe.res);
+			else
+				c->accepted.push_back(cqe.res);
+		} else if(cqe.res != -ECANCELED) {
+			/*
+			 * An aborted connection or running out of fds fails this accept
+			 * only: the next one starts over
+			 */
+			if(f)
+				f->fail(std::system_error(std::error_code(-cqe.res, std::system_category()), "accept failed"));
+			return;
+		} else {
+			c->acceptor = std::move(f);
+		}
+		if(!c->accept_op && !c->closed && c->acceptor)
+			start_accept(s, c);
+	}
+
+	static void received(const std::shared_ptr<shared_state> &s, operation &op, const struct io_uring_cqe &cqe, bool last) {
+		auto c = op.conn;
+		if(last)
+			c->recv_op = 0;
+		buffer data;
+		if(cqe.flags & IORING_CQE_F_BUFFER) {
+			uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			if(cqe.res > 0)
+				data = buffer::copy(s->buffers.get() + static_cast<size_t>(bid) * s->opts.buffer_size, static_cast<size_t>(cqe.res));
+			s->give_back(bid);
+			schedule_flush(s);
+		} else if(cqe.res > 0) {
+			data = buffer::copy(op.data.get(), static_cast<size_t>(cqe.res));
+		}
+		if(c->closed)
+			return;
+		if(c->reader && !c->reader->is_pending())
+			c->reader.reset();
+		if(cqe.res > 0) {
+			if(c->reader) {
+				auto f = std::move(c->reader);
+				f->done(std::move(data));
+			} else {
+				c->received.push_back(std::move(data));
+				/* Nobody's reading: stop until they catch up */
+				if(c->received.size() == s->opts.max_queued && c->recv_op)
+					cancel(s, c->recv_op);
+			}
+		} else if(cqe.res == 0) {
+			c->eof = true;
+			if(c->reader) {
+				auto f = std::move(c->reader);
+				f->fail_exception_pointer(end_of_stream());
+			}
+			return;
+		} else if(cqe.res != -ECANCELED && cqe.res != -ENOBUFS) {
+			c->error = std::error_code(-cqe.res, std::system_category());
+			if(c->reader) {
+				auto f = std::move(c->reader);
+				f->fail(std::system_error(c->error, "recv failed"));
+			}
+			return;
+		}
+		if(!c->recv_op && !c->closed && c->reader)
+			start_recv(s, c);
+	}
+
+	static void sent(const std::shared_ptr<shared_state> &s, operation &op, const struct io_uring_cqe &cqe) {
+		auto c = op.conn;
+		c->send_op = 0;
+		if(c->closed)
+			return;
+		if(cqe.res < 0) {
+			std::system_error e(std::error_code(-cqe.res, std::system_category()), "send failed");
+			auto sends = std::move(c->sends);
+			for(auto &p : sends)
+				if(p.f->is_pending())
+					p.f->fail(e);
+			return;
+		}
+		/* Collect what finished first, so callbacks see a consistent queue */
+		std::vector<std::pair<std::shared_ptr<future<size_t>>, size_t>> finished;
+		size_t n = static_cast<size_t>(cqe.res);
+		while(n && !c->sends.empty()) {
+			auto &p = c->sends.front();
+			size_t take = std::min(n, p.data.size() - p.sent);
+			p.sent += take;
+			n -= take;
+			if(p.sent < p.data.size())
+				break;
+			finished.emplace_back(std::move(p.f), p.data.size());
+			c->sends.pop_front();
+		}
+		if(!c->sends.empty())
+			start_send(s, c);
+		for(auto &it : finished)
+			if(it.first->is_pending())
+				it.first->done(it.second);
+	}
+
+	std::shared_ptr<shared_state> state_;
+};
+
+#endif
+
+/** Which socket_io make_socket_io should use */
+enum class io_backend {
+	/** io_uring if the kernel supports it, epoll otherwise */
+	automatic,
+	epoll,
+	io_uring
+};
+
+/**
+ * Returns a socket_io for the loop. With io_backend::io_uring this throws
+ * std::system_error if io_uring isn't available; automatic falls back to
+ * epoll instead.
+ */
+inline std::unique_ptr<socket_io>
+make_socket_io(reactor &loop, io_backend backend = io_backend::automatic)
+{
+#if CPS_HAVE_IO_URING
+	if(backend == io_backend::io_uring)
+		return std::unique_ptr<socket_io> { new uring_socket_io { loop } };
+	if(backend == io_backend::automatic && uring_socket_io::supported()) {
+		try {
+			return std::unique_ptr<socket_io> { new uring_socket_io { loop } };
+		} catch(const std::system_error &) {
+			/* Out of locked memory, most likely: epoll will do */
+		}
+	}
+#else
+	if(backend == io_backend::io_uring)
+		throw std::system_error(ENOSYS, std::system_category(), "built without io_uring support");
+#endif
+	return std::unique_ptr<socket_io> { new epoll_socket_io { loop } };
+}
+
+};
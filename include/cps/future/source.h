@@ -0,0 +1,62 @@
+#pragma once
+#include <exception>
+#include <functional>
+#include <memory>
+#include <system_error>
+
+#include <cps/future.h>
+
+namespace cps {
+
+/**
+ * A stream of values delivered one future at a time.
+ *
+ * Each call returns a future for the next item. The end of the stream is
+ * signalled by failing that future with a std::system_error carrying
+ * future_errc::no_more_items - see end_of_stream and is_end_of_stream.
+ * Callers should wait for one item before asking for the next.
+ */
+template<typename T>
+using async_source = std::function<std::shared_ptr<future<T>>()>;
+
+/** Returns the exception used to signal the end of a stream */
+inline std::exception_ptr
+end_of_stream()
+{
+	return std::make_exception_ptr(std::system_error(make_error_code(future_errc::no_more_items)));
+}
+
+/** Returns true if the future failed because its stream has ended */
+template<typename T>
+bool
+is_end_of_stream(const future<T> &f)
+{
+	if(!f.is_failed() || !f.exception_ptr())
+		return false;
+	try {
+		std::rethrow_exception(f.exception_ptr());
+	} catch(const std::system_error &e) {
+		return e.code() == make_error_code(future_errc::no_more_items);
+	} catch(...) {
+	}
+	return false;
+}
+
+/** Wraps a synchronous generator, so each item is an already-resolved future */
+template<typename T>
+async_source<T>
+from_generator(generator<T> gen)
+{
+	return [gen]() mutable {
+		auto f = future<T>::create_shared();
+		std::error_code ec;
+		auto v = gen.next(ec);
+		if(ec == make_error_code(future_errc::no_more_items))
+			return f->fail_exception_pointer(end_of_stream());
+		if(ec)
+			return f->fail_exception_pointer(std::make_exception_ptr(std::system_error(ec)));
+		return f->done(std::move(v));
+	};
+}
+
+};
@@ -0,0 +1,409 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <cps/future.h>
+#include <cps/future/buffer.h>
+#include <cps/future/source.h>
+
+namespace cps {
+
+/** Limits for a spilling_channel */
+struct spill_options {
+	/** Bytes of items to hold in memory before spilling to disk */
+	size_t memory_bytes = 16 << 20;
+	/** Bytes of items to hold on disk before producers have to wait */
+	size_t spill_bytes = 1 << 30;
+	/** Size of each segment file; items bigger than this get a segment to themselves */
+	size_t segment_bytes = 64 << 20;
+	/** Where the segment files go */
+	std::string directory = "/tmp";
+};
+
+namespace detail {
+
+/**
+ * One append-only segment file, mapped for reading.
+ *
+ * The file is unlinked as soon as it's created, so nothing is left behind
+ * if the process dies, and its space goes back to the filesystem once the
+ * last reference - the channel, or a buffer read from it - is gone. Writes
+ * go through pwrite; the page cache is shared with the mapping, so a
+ * record is readable through it as soon as pwrite returns.
+ */
+class spill_segment {
+public:
+	spill_segment(
+		const std::string &directory,
+		size_t capacity
+	):fd_(-1),
+	  data_(nullptr),
+	  capacity_(capacity),
+	  written_(0)
+	{
+		fd_ = ::open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		if(fd_ < 0) {
+			/* No O_TMPFILE on this filesystem: make one and unlink it */
+			std::string path = directory + "/cps-spill-XXXXXX";
+			fd_ = ::mkostemp(&path[0], O_CLOEXEC);
+			if(fd_ < 0)
+				throw std::system_error(errno, std::system_category(), "could not create spill file");
+			::unlink(path.c_str());
+		}
+		if(::ftruncate(fd_, static_cast<off_t>(capacity_)) < 0) {
+			int e = errno;
+			::close(fd_);
+			throw std::system_error(e, std::system_category(), "could not size spill file");
+		}
+		void *p = ::mmap(nullptr, capacity_, PROT_READ, MAP_SHARED, fd_, 0);
+		if(p == MAP_FAILED) {
+			int e = errno;
+			::close(fd_);
+			throw std::system_error(e, std::system_category(), "could not map spill file");
+		}
+		data_ = static_cast<const char *>(p);
+	}
+
+	spill_segment(const spill_segment &) = delete;
+	spill_segment &operator=(const spill_segment &) = delete;
+
+	~spill_segment() {
+		::munmap(const_cast<char *>(data_), capacity_);
+		::close(fd_);
+	}
+
+	/**
+	 * Appends a length-prefixed record, returning false with ec set if the
+	 * write failed. A record that fails halfway is forgotten, and the next
+	 * one goes over it.
+	 */
+	bool append(const buffer &b, std::error_code &ec) {
+		size_t start = written_;
+		uint32_t length = static_cast<uint32_t>(b.size());
+		bool ok = write(&length, sizeof(length), ec);
+		for(auto it = b.begin(); ok && it != b.end(); ++it)
+			ok = write(it->data(), it->size(), ec);
+		if(!ok)
+			written_ = start;
+		return ok;
+	}
+
+	bool has_room(size_t record) const { return capacity_ - written_ >= record; }
+
+	const char *data() const { return data_; }
+	size_t written() const { return written_; }
+
+private:
+	bool write(const void *p, size_t n, std::error_code &ec) {
+		const char *c = static_cast<const char *>(p);
+		while(n) {
+			ssize_t rslt = ::pwrite(fd_, c, n, static_cast<off_t>(written_));
+			if(rslt < 0 && errno == EINTR)
+				continue;
+			if(rslt <= 0) {
+				ec = std::error_code(rslt < 0 ? errno : ENOSPC, std::system_category());
+				return false;
+			}
+			c += rslt;
+			n -= static_cast<size_t>(rslt);
+			written_ += static_cast<size_t>(rslt);
+		}
+		return true;
+	}
+
+	int fd_;
+	const char *data_;
+	const size_t capacity_;
+	size_t written_;
+};
+
+}
+
+/**
+ * A channel of buffers which overflows to disk instead of pushing back.
+ *
+ * Items are held in memory up to memory_bytes. Beyond that they're
+ * appended to segment files on disk, up to spill_bytes, and ->push still
+ * resolves straight away. Only once the disk allowance is used up does a
+ * push stay pending, as with a full channel. Once anything has spilled,
+ * later items follow it onto disk so order is kept, until the consumer
+ * has read its way back.
+ *
+ * Spilled items are read back through a mapping of the segment file, so
+ * ->pop hands out a buffer pointing straight at the mapped pages, with no
+ * copy; the segment stays mapped while any such buffer is alive. Reads
+ * are sequential, which is the pattern readahead is built for. A segment
+ * is released once it has been read to the end, so the disk used shrinks
+ * as the consumer catches up.
+ *
+ * Disk writes happen on the pushing thread, under the channel's lock. They
+ * normally land in the page cache, but a slow disk slows producers rather
+ * than blocking the consumer. If a write fails, that push fails with the
+ * error. Otherwise ->pop, ->close and ->as_source behave as for channel.
+ * Any thread may push, pop or close.
+ */
+class spilling_channel {
+public:
+	explicit spilling_channel(
+		spill_options options = spill_options { }
+	):options_(std::move(options)),
+	  closed_(false),
+	  memory_used_(0),
+	  spilled_(0),
+	  spilled_bytes_(0),
+	  read_offset_(0),
+	  segments_created_(0)
+	{
+	}
+
+	spilling_channel(const spilling_channel &) = delete;
+	spilling_channel &operator=(const spilling_channel &) = delete;
+
+	virtual ~spilling_channel() { }
+
+	/**
+	 * Queues an item. The future resolves once it is accepted, in memory or
+	 * on disk, and fails if the channel is closed first or the disk write
+	 * fails.
+	 */
+	std::shared_ptr<future<int>> push(buffer v) {
+		auto accepted = future<int>::create_shared(u8"spilling_channel::push");
+		for(;;) {
+			std::shared_ptr<future<buffer>> consumer;
+			{
+				std::lock_guard<std::mutex> guard { mutex_ };
+				if(closed_)
+					return accepted->fail("channel is closed");
+				/* Consumers may have given up on their ->pop since */
+				while(!consumers_.empty() && !consumers_.front()->is_pending())
+					consumers_.pop_front();
+				if(!consumers_.empty()) {
+					consumer = std::move(consumers_.front());
+					consumers_.pop_front();
+				} else if(producers_.empty() && has_room(v)) {
+					std::error_code ec;
+					if(!store(std::move(v), ec))
+						return accepted->fail_exception_pointer(std::make_exception_ptr(std::system_error(ec, "could not spill item")));
+					return accepted->done(0);
+				} else {
+					producers_.emplace_back(std::move(v), accepted);
+					return accepted;
+				}
+			}
+			/* ... or give up now we've let go of the lock, leaving us the item to try again with */
+			if(consumer->try_done(v))
+				return accepted->done(0);
+		}
+	}
+
+	/** Returns a future for the next item */
+	std::shared_ptr<future<buffer>> pop() {
+		auto item = future<buffer>::create_shared(u8"spilling_channel::pop");
+		std::vector<std::pair<std::shared_ptr<future<int>>, std::error_code>> producers;
+		buffer v;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			/* Producers who have given up on their ->push take their items with them */
+			while(!producers_.empty() && !producers_.front().second->is_pending())
+				producers_.pop_front();
+			if(!memory_.empty()) {
+				v = std::move(memory_.front());
+				memory_.pop_front();
+				memory_used_ -= v.size();
+			} else if(spilled_) {
+				v = unspill();
+			} else if(!producers_.empty()) {
+				/* Only when an item is too big for memory and disk both */
+				v = std::move(producers_.front().first);
+				producers.emplace_back(std::move(producers_.front().second), std::error_code { });
+				producers_.pop_front();
+			} else if(closed_) {
+				return item->fail_exception_pointer(end_of_stream());
+			} else {
+				consumers_.push_back(item);
+				return item;
+			}
+			/* That made room for someone who was waiting */
+			while(!producers_.empty() && has_room(producers_.front().first)) {
+				if(!producers_.front().second->is_pending()) {
+					producers_.pop_front();
+					continue;
+				}
+				std::error_code ec;
+				store(std::move(producers_.front().first), ec);
+				producers.emplace_back(std::move(producers_.front().second), ec);
+				producers_.pop_front();
+			}
+		}
+		for(auto &p : producers) {
+			if(!p.first->is_pending())
+				continue;
+			int accepted = 0;
+			if(p.second)
+				p.first->fail_exception_pointer(std::make_exception_ptr(std::system_error(p.second, "could not spill item")));
+			else
+				p.first->try_done(accepted);
+		}
+		return item->done(std::move(v));
+	}
+
+	/** Stops accepting items. Anything already queued, in memory or on disk, can still be popped. */
+	void close() {
+		std::vector<std::shared_ptr<future<buffer>>> consumers;
+		std::vector<std::shared_ptr<future<int>>> producers;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			if(closed_)
+				return;
+			closed_ = true;
+			for(auto &c : consumers_)
+				consumers.push_back(std::move(c));
+			consumers_.clear();
+			for(auto &p : producers_)
+				producers.push_back(std::move(p.second));
+			producers_.clear();
+		}
+		for(auto &c : consumers)
+			if(c->is_pending())
+				c->fail_exception_pointer(end_of_stream());
+		for(auto &p : producers)
+			if(p->is_pending())
+				p->fail("channel is closed");
+	}
+
+	/** Returns the channel as an async_source, ending when it is closed and drained */
+	static async_source<buffer> as_source(std::shared_ptr<spilling_channel> ch) {
+		return [ch] { return ch->pop(); };
+	}
+
+	/** Items queued, in memory and on disk */
+	size_t size() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return memory_.size() + spilled_;
+	}
+
+	/** Items queued on disk */
+	size_t spilled() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return spilled_;
+	}
+
+	/** Bytes of items queued on disk, including their length prefixes */
+	size_t spilled_bytes() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return spilled_bytes_;
+	}
+
+	/** Bytes of items queued in memory */
+	size_t memory_bytes() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return memory_used_;
+	}
+
+	/** Segment files created so far */
+	size_t segments_created() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return segments_created_;
+	}
+
+	/** Producers waiting for room */
+	size_t blocked() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return producers_.size();
+	}
+
+	bool closed() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return closed_;
+	}
+
+private:
+	static size_t record_size(const buffer &v) { return sizeof(uint32_t) + v.size(); }
+
+	bool has_room(const buffer &v) const {
+		if(!spilled_ && memory_used_ + v.size() <= options_.memory_bytes)
+			return true;
+		return spilled_bytes_ + record_size(v) <= options_.spill_bytes;
+	}
+
+	/** Puts an item in memory or on disk: call has_room first */
+	bool store(buffer v, std::error_code &ec) {
+		if(!spilled_ && memory_used_ + v.size() <= options_.memory_bytes) {
+			memory_used_ += v.size();
+			memory_.push_back(std::move(v));
+			return true;
+		}
+		size_t record = record_size(v);
+		if(segments_.empty() || !segments_.back()->has_room(record)) {
+			try {
+				segments_.push_back(std::make_shared<detail::spill_segment>(
+					options_.directory,
+					std::max(options_.segment_bytes, record)
+				));
+			} catch(const std::system_error &e) {
+				ec = e.code();
+				return false;
+			}
+			++segments_created_;
+		}
+		if(!segments_.back()->append(v, ec))
+			return false;
+		++spilled_;
+		spilled_bytes_ += record;
+		return true;
+	}
+
+	/** Takes the oldest item from disk, pointing straight into the mapping */
+	buffer unspill() {
+		auto &seg = segments_.front();
+		if(read_offset_ == seg->written()) {
+			/* Finished this one: whatever comes next is at the start of the next */
+			segments_.pop_front();
+			read_offset_ = 0;
+		}
+		auto current = segments_.front();
+		uint32_t length;
+		std::memcpy(&length, current->data() + read_offset_, sizeof(length));
+		auto v = buffer::wrap(current, current->data() + read_offset_ + sizeof(length), length);
+		read_offset_ += sizeof(length) + length;
+		--spilled_;
+		spilled_bytes_ -= sizeof(length) + length;
+		if(!spilled_) {
+			/* Read back to memory: let the files go, the next spill starts new ones */
+			segments_.clear();
+			read_offset_ = 0;
+		}
+		return v;
+	}
+
+	const spill_options options_;
+	mutable std::mutex mutex_;
+	bool closed_;
+	std::deque<buffer> memory_;
+	size_t memory_used_;
+	/** Segment files still to be read, oldest first; the last is the one being written */
+	std::deque<std::shared_ptr<detail::spill_segment>> segments_;
+	size_t spilled_;
+	size_t spilled_bytes_;
+	/** Where the next record starts in the oldest segment */
+	size_t read_offset_;
+	size_t segments_created_;
+	/** Items waiting for room, and the futures to resolve once there is */
+	std::deque<std::pair<buffer, std::shared_ptr<future<int>>>> producers_;
+	/** ->pop calls waiting for items */
+	std::deque<std::shared_ptr<future<buffer>>> consumers_;
+};
+
+};
@@ -0,0 +1,265 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <cps/future.h>
+
+namespace cps {
+
+/**
+ * Bridges std::future into cps::future without a thread per future.
+ *
+ * One poller thread owns every std::future handed to ->watch and checks
+ * them with wait_for(0) in rounds. New futures are handed over in batches:
+ * ->watch only appends to a list under a short lock, and the poller picks
+ * up the whole list at the start of each round.
+ *
+ * Between rounds the poller sleeps. The interval starts at min_interval,
+ * doubles after each round in which nothing completed, up to max_interval,
+ * and drops back to the minimum as soon as something completes or new
+ * futures arrive. With nothing to watch, the thread sleeps until there is.
+ *
+ * Cancelling a bridged cps::future does not discard the std::future: some
+ * std::future destructors block (std::async ones, for example), so we keep
+ * polling and drop the result once it arrives.
+ */
+class std_future_poller {
+public:
+	std_future_poller(
+		std::chrono::microseconds min_interval = std::chrono::microseconds(50),
+		std::chrono::microseconds max_interval = std::chrono::milliseconds(5)
+	):min_interval_(min_interval),
+	  max_interval_(max_interval),
+	  stopping_(false),
+	  pending_(0),
+	  rounds_(0)
+	{
+	}
+
+	std_future_poller(const std_future_poller &) = delete;
+	std_future_poller &operator=(const std_future_poller &) = delete;
+
+	/**
+	 * Stops the poller thread. Anything still being watched is cancelled,
+	 * and the std::futures are destroyed here, on the calling thread.
+	 */
+	virtual ~std_future_poller() {
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			stopping_ = true;
+		}
+		wake_.notify_one();
+		if(thread_.joinable())
+			thread_.join();
+		for(auto &e : incoming_)
+			watching_.push_back(std::move(e));
+		for(auto &e : watching_)
+			e->cancel();
+	}
+
+	/** A poller shared by everything in the process */
+	static std_future_poller &instance() {
+		static std_future_poller poller;
+		return poller;
+	}
+
+	/**
+	 * Returns a cps::future which resolves with the std::future's value,
+	 * or fails with its exception.
+	 */
+	template<typename T>
+	std::shared_ptr<future<T>>
+	watch(std::future<T> source, const std::string &label = u8"unlabelled future") {
+		static_assert(!std::is_void<T>::value, "cps::future<void> is not supported");
+		auto f = future<T>::create_shared(label);
+		add(std::unique_ptr<entry>(new typed_entry<T>(std::move(source), f)));
+		return f;
+	}
+
+	/** How many std::futures we are waiting on */
+	size_t pending() const { return pending_; }
+	/** Number of polling rounds so far */
+	size_t rounds() const { return rounds_; }
+
+private:
+	/** A std::future and the cps::future it resolves */
+	class entry {
+	public:
+		virtual ~entry() { }
+		/** Returns true once the std::future was ready and the result passed on */
+		virtual bool poll() = 0;
+		virtual void cancel() = 0;
+	};
+
+	template<typename T>
+	class typed_entry : public entry {
+	public:
+		typed_entry(
+			std::future<T> source,
+			std::shared_ptr<future<T>> target
+		):source_(std::move(source)),
+		  target_(std::move(target))
+		{
+		}
+
+		virtual bool poll() override {
+			if(source_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+				return false;
+			std::exception_ptr ex;
+			bool got = false;
+			try {
+				/* Moved from get straight into done: T needn't be default-constructible */
+				auto v = source_.get();
+				got = true;
+				resolve([&v](future<T> &f) { f.done(std::move(v)); });
+			} catch(...) {
+				/* Only the std::future's own failure is ours to pass on */
+				if(got)
+					throw;
+				ex = std::current_exception();
+			}
+			if(ex)
+				resolve([&ex](future<T> &f) { f.fail_exception_pointer(ex); });
+			return true;
+		}
+
+		virtual void cancel() override {
+			resolve([](future<T> &f) { f.cancel(); });
+		}
+
+	private:
+		/* Someone may have cancelled the cps::future in the meantime */
+		template<typename F>
+		void resolve(F code) {
+			if(!target_->is_pending())
+				return;
+			try {
+				code(*target_);
+			} catch(const std::logic_error &) {
+			}
+		}
+
+		std::future<T> source_;
+		std::shared_ptr<future<T>> target_;
+	};
+
+	void add(std::unique_ptr<entry> e) {
+		bool wake = false;
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			if(stopping_)
+				throw std::logic_error("std_future_poller is shutting down");
+			/* Only the first future in a batch needs to wake the poller */
+			wake = incoming_.empty();
+			incoming_.push_back(std::move(e));
+			++pending_;
+			if(!thread_.joinable())
+				thread_ = std::thread([this] { run(); });
+		}
+		if(wake)
+			wake_.notify_one();
+	}
+
+	void run() {
+		auto interval = min_interval_;
+		std::unique_lock<std::mutex> lock { mutex_ };
+		while(!stopping_) {
+			if(watching_.empty() && incoming_.empty()) {
+				wake_.wait(lock, [this] { return stopping_ || !incoming_.empty(); });
+				continue;
+			}
+			bool arrived = !incoming_.empty();
+			for(auto &e : incoming_)
+				watching_.push_back(std::move(e));
+			incoming_.clear();
+			lock.unlock();
+
+			/* watching_ is only touched by this thread while we're running */
+			size_t completed = 0;
+			for(size_t i = 0; i < watching_.size(); ) {
+				if(watching_[i]->poll()) {
+					std::swap(watching_[i], watching_.back());
+					watching_.pop_back();
+					++completed;
+				} else {
+					++i;
+				}
+			}
+			pending_ -= completed;
+			++rounds_;
+
+			interval = (completed || arrived) ? min_interval_ : std::min(interval * 2, max_interval_);
+			lock.lock();
+			if(!watching_.empty())
+				wake_.wait_for(lock, interval, [this] { return stopping_ || !incoming_.empty(); });
+		}
+	}
+
+	const std::chrono::microseconds min_interval_;
+	const std::chrono::microseconds max_interval_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	bool stopping_;
+	/** Handed over by ->watch, picked up by the poller each round */
+	std::vector<std::unique_ptr<entry>> incoming_;
+	/** Owned by the poller thread */
+	std::vector<std::unique_ptr<entry>> watching_;
+	std::atomic<size_t> pending_;
+	std::atomic<size_t> rounds_;
+	std::thread thread_;
+};
+
+/**
+ * Returns a cps::future for the given std::future, using the shared
+ * poller.
+ */
+template<typename T>
+std::shared_ptr<future<T>>
+from_std_future(std::future<T> source, const std::string &label = u8"unlabelled future")
+{
+	return std_future_poller::instance().watch(std::move(source), label);
+}
+
+/**
+ * Fulfils the std::promise once the cps::future is ready. Failures pass the
+ * original exception through, and cancellation becomes a std::system_error
+ * with future_errc::is_cancelled.
+ */
+template<typename T>
+void
+fulfil(const std::shared_ptr<future<T>> &f, std::promise<T> promise)
+{
+	/* std::function needs something copyable */
+	auto p = std::make_shared<std::promise<T>>(std::move(promise));
+	f->on_ready([p](future<T> &ready) {
+		if(ready.is_done())
+			p->set_value(ready.value());
+		else if(ready.is_failed())
+			p->set_exception(ready.exception_ptr());
+		else
+			p->set_exception(std::make_exception_ptr(std::system_error(make_error_code(future_errc::is_cancelled))));
+	});
+}
+
+/** Returns a std::future which completes when the cps::future does */
+template<typename T>
+std::future<T>
+to_std_future(const std::shared_ptr<future<T>> &f)
+{
+	std::promise<T> p;
+	auto out = p.get_future();
+	fulfil(f, std::move(p));
+	return out;
+}
+
+};
@@ -0,0 +1,91 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cps/future/executor.h>
+
+namespace cps {
+
+/**
+ * A fixed set of threads running posted work in FIFO order.
+ *
+ * Destroying the pool runs whatever is still queued, then joins the threads.
+ */
+class thread_pool : public executor {
+public:
+	explicit thread_pool(
+		size_t threads = std::max(1u, std::thread::hardware_concurrency())
+	):stopping_(false),
+	  busy_(0)
+	{
+		for(size_t i = 0; i < threads; ++i)
+			threads_.emplace_back([this] { work(); });
+	}
+
+	thread_pool(const thread_pool &) = delete;
+	thread_pool &operator=(const thread_pool &) = delete;
+
+	virtual ~thread_pool() {
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			stopping_ = true;
+		}
+		wake_.notify_all();
+		for(auto &t : threads_)
+			t.join();
+	}
+
+	virtual void post(std::function<void()> code) override {
+		{
+			std::lock_guard<std::mutex> guard { mutex_ };
+			queue_.push_back(std::move(code));
+		}
+		wake_.notify_one();
+	}
+
+	/** Number of threads */
+	size_t size() const { return threads_.size(); }
+
+	/** Work waiting for a thread */
+	size_t queued() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return queue_.size();
+	}
+
+	/** Threads currently running something */
+	size_t busy() const {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		return busy_;
+	}
+
+private:
+	void work() {
+		std::unique_lock<std::mutex> lock { mutex_ };
+		for(;;) {
+			wake_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+			if(queue_.empty())
+				return;
+			auto code = std::move(queue_.front());
+			queue_.pop_front();
+			++busy_;
+			lock.unlock();
+			code();
+			lock.lock();
+			--busy_;
+		}
+	}
+
+	mutable std::mutex mutex_;
+	std::condition_variable wake_;
+	std::deque<std::function<void()>> queue_;
+	bool stopping_;
+	size_t busy_;
+	std::vector<std::thread> threads_;
+};
+
+};
@@ -0,0 +1,287 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace cps {
+
+/**
+ * Recording of future graphs.
+ *
+ * When built with FUTURE_TRACE set to 1, each future reports its creation
+ * and resolution, and ->then, needs_all and needs_any report the edges
+ * between futures, to whichever recorder is currently active. The result is
+ * a compact binary trace of graph shape and timing, with no values or
+ * labels, which can be replayed against a later build of the library.
+ *
+ * The format is an 8-byte magic, a version byte, then a sequence of records:
+ *
+ *     type:u8 time_delta:varint thread:varint id:varint [payload]
+ *
+ * where time_delta is nanoseconds since the previous record, thread is a
+ * small index assigned in order of first appearance, and the payload is
+ * target:varint kind:u8 for links, state:u8 for resolution and empty for
+ * creation. All varints are unsigned LEB128.
+ */
+namespace trace {
+
+/** Format version written after the magic */
+static const uint8_t format_version = 1;
+
+/** What kind of record this is */
+enum class event_type : uint8_t {
+	created = 1,
+	linked,
+	resolved
+};
+
+/** How two futures were connected */
+enum class link : uint8_t {
+	/** target = source->then(...) */
+	then = 1,
+	/** source is the future returned by the ->then callback for target */
+	then_result,
+	/** source is one of the inputs to target = needs_all(...) */
+	needs_all,
+	/** source is one of the inputs to target = needs_any(...) */
+	needs_any
+};
+
+/** Resolution states, matching the order of future<T>::state */
+enum class resolution : uint8_t {
+	pending = 0,
+	done,
+	failed,
+	cancelled
+};
+
+/** A single decoded record */
+struct event {
+	event_type type;
+	/** Nanoseconds since the recording started */
+	uint64_t time;
+	/** Recording thread index */
+	uint32_t thread;
+	/** The future this event is about - the source, for links */
+	uint64_t id;
+	/** Target future, for links */
+	uint64_t target;
+	link kind;
+	resolution state;
+};
+
+/**
+ * Writes trace records to an output stream.
+ *
+ * Records are buffered and written out in blocks, under a mutex, so any
+ * thread can report events. Call ->flush or destroy the recorder to write
+ * out anything that's left.
+ */
+class recorder {
+public:
+	recorder(
+		std::ostream &out
+	):out_(out),
+	  start_(std::chrono::steady_clock::now()),
+	  last_(0),
+	  events_(0)
+	{
+		out_.write("CPSTRACE", 8);
+		out_.put(static_cast<char>(format_version));
+	}
+
+	recorder(const recorder &) = delete;
+	recorder &operator=(const recorder &) = delete;
+
+	~recorder() { flush(); }
+
+	void created(uint64_t id) {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		header(event_type::created, id);
+		maybe_flush();
+	}
+
+	void linked(uint64_t source, uint64_t target, link kind) {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		header(event_type::linked, source);
+		varint(target);
+		buffer_.push_back(static_cast<char>(kind));
+		maybe_flush();
+	}
+
+	void resolved(uint64_t id, resolution state) {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		header(event_type::resolved, id);
+		buffer_.push_back(static_cast<char>(state));
+		maybe_flush();
+	}
+
+	/** Writes out any buffered records */
+	void flush() {
+		std::lock_guard<std::mutex> guard { mutex_ };
+		out_.write(buffer_.data(), buffer_.size());
+		out_.flush();
+		buffer_.clear();
+	}
+
+	/** Number of records written so far */
+	size_t events() const { return events_; }
+
+private:
+	void header(event_type type, uint64_t id) {
+		uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start_
+		).count();
+		buffer_.push_back(static_cast<char>(type));
+		varint(now - last_);
+		last_ = now;
+		auto ins = threads_.emplace(std::this_thread::get_id(), static_cast<uint32_t>(threads_.size()));
+		varint(ins.first->second);
+		varint(id);
+		++events_;
+	}
+
+	void varint(uint64_t v) {
+		while(v >= 0x80) {
+			buffer_.push_back(static_cast<char>((v & 0x7F) | 0x80));
+			v >>= 7;
+		}
+		buffer_.push_back(static_cast<char>(v));
+	}
+
+	void maybe_flush() {
+		if(buffer_.size() < 65536)
+			return;
+		out_.write(buffer_.data(), buffer_.size());
+		buffer_.clear();
+	}
+
+	std::mutex mutex_;
+	std::ostream &out_;
+	std::chrono::steady_clock::time_point start_;
+	/** Time of the previous record, for deltas */
+	uint64_t last_;
+	std::atomic<size_t> events_;
+	std::string buffer_;
+	std::unordered_map<std::thread::id, uint32_t> threads_;
+};
+
+/**
+ * Reads a trace back in.
+ * @throws std::runtime_error if the trace is truncated or not a trace at all
+ */
+inline std::vector<event>
+read(std::istream &in)
+{
+	char magic[8];
+	if(!in.read(magic, 8) || std::string(magic, 8) != "CPSTRACE")
+		throw std::runtime_error("not a cps::future trace");
+	int version = in.get();
+	if(version != format_version)
+		throw std::runtime_error("unsupported trace version " + std::to_string(version));
+
+	auto varint = [&in]() -> uint64_t {
+		uint64_t v = 0;
+		for(int shift = 0; shift < 64; shift += 7) {
+			int c = in.get();
+			if(c == EOF)
+				throw std::runtime_error("truncated trace");
+			v |= static_cast<uint64_t>(c & 0x7F) << shift;
+			if(!(c & 0x80))
+				return v;
+		}
+		throw std::runtime_error("invalid varint in trace");
+	};
+	auto byte = [&in]() -> uint8_t {
+		int c = in.get();
+		if(c == EOF)
+			throw std::runtime_error("truncated trace");
+		return static_cast<uint8_t>(c);
+	};
+
+	std::vector<event> events;
+	uint64_t time = 0;
+	int c;
+	while((c = in.get()) != EOF) {
+		event ev { };
+		ev.type = static_cast<event_type>(c);
+		time += varint();
+		ev.time = time;
+		ev.thread = static_cast<uint32_t>(varint());
+		ev.id = varint();
+		switch(ev.type) {
+		case event_type::created:
+			break;
+		case event_type::linked:
+			ev.target = varint();
+			ev.kind = static_cast<link>(byte());
+			break;
+		case event_type::resolved:
+			ev.state = static_cast<resolution>(byte());
+			break;
+		default:
+			throw std::runtime_error("unknown record type in trace");
+		}
+		events.push_back(ev);
+	}
+	return events;
+}
+
+/** The recorder that hooks report to, or nullptr if we're not recording */
+inline std::atomic<recorder *> &
+active()
+{
+	static std::atomic<recorder *> instance { nullptr };
+	return instance;
+}
+
+/** Starts sending events to the given recorder. Pass nullptr to stop. */
+inline void
+record_to(recorder *r)
+{
+	active() = r;
+}
+
+/** Hands out trace IDs for futures */
+inline uint64_t
+next_id()
+{
+	static std::atomic<uint64_t> id { 0 };
+	return ++id;
+}
+
+/* Hooks, called from the future implementation */
+
+inline void
+created(uint64_t id)
+{
+	if(auto r = active().load(std::memory_order_acquire))
+		r->created(id);
+}
+
+inline void
+linked(uint64_t source, uint64_t target, link kind)
+{
+	if(auto r = active().load(std::memory_order_acquire))
+		r->linked(source, target, kind);
+}
+
+inline void
+resolved(uint64_t id, resolution state)
+{
+	if(auto r = active().load(std::memory_order_acquire))
+		r->resolved(id, state);
+}
+
+};
+
+};
+
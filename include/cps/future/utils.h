@@ -57,6 +57,7 @@ needs_all(std::shared_ptr<future<T>> first)
 {
 	auto f = future<int>::create_shared();
 	std::function<void(future<T> &)> code = [f, first](future<T> &in) {
+		/* Whoever holds our future may have cancelled it */
 		if(f->is_ready()) return;
 		if(!in.is_done()) {
 			f->fail("error");
@@ -64,6 +65,7 @@ needs_all(std::shared_ptr<future<T>> first)
 		}
 		f->done(0);
 	};
+	CPS_FUTURE_TRACE_LINK(*first, *f, needs_all);
 	first->on_ready(code);
 	return f;
 }
@@ -79,13 +81,17 @@ needs_all(std::vector<std::shared_ptr<future<T>>> first)
 	std::function<void(future<T> &)> code = [f, first, pending](future<T> &in) {
 		if(f->is_ready()) return;
 		if(!in.is_done()) {
-			f->fail("error");
+			/* Inputs may fail concurrently, and only the first one
+			 * to zero the counter gets to report it */
+			if(pending->exchange(0) > 0) f->fail("error");
 			return;
 		}
 		if(!--(*pending)) f->done(0);
 	};
-	for(auto &it : first)
+	for(auto &it : first) {
+		CPS_FUTURE_TRACE_LINK(*it, *f, needs_all);
 		it->on_ready(code);
+	}
 	return f;
 }
 
@@ -100,12 +106,16 @@ needs_all(std::shared_ptr<future<T>> first, Types ... rest)
 	std::function<void(future<T> &)> code = [f, first, remainder, pending](future<T> &in) {
 		if(f->is_ready()) return;
 		if(!in.is_done()) {
-			f->fail("error");
+			/* Inputs may fail concurrently, and only the first one
+			 * to zero the counter gets to report it */
+			if(pending->exchange(0) > 0) f->fail("error");
 			return;
 		}
 		if(!--(*pending)) f->done(0);
 	};
+	CPS_FUTURE_TRACE_LINK(*first, *f, needs_all);
 	first->on_ready(code);
+	CPS_FUTURE_TRACE_LINK(*remainder, *f, needs_all);
 	remainder->on_ready(code);
 	return f;
 }
@@ -136,16 +146,20 @@ std::shared_ptr<future<int>>
 needs_any(std::vector<std::shared_ptr<future<T>>> first)
 {
 	auto f = future<int>::create_shared();
-	std::function<void(future<T> &)> code = [f, first](future<T> &in) {
-		if(f->is_ready()) return;
+	auto claimed = std::make_shared<std::atomic<bool>>(false);
+	std::function<void(future<T> &)> code = [f, first, claimed](future<T> &in) {
+		/* First input to complete wins, even if several complete at once */
+		if(f->is_ready() || claimed->exchange(true)) return;
 		if(!in.is_done()) {
 			f->fail("error");
 			return;
 		}
 		f->done(0);
 	};
-	for(auto &it : first)
+	for(auto &it : first) {
+		CPS_FUTURE_TRACE_LINK(*it, *f, needs_any);
 		it->on_ready(code);
+	}
 	return f;
 }
 
@@ -156,15 +170,18 @@ needs_any(std::shared_ptr<future<T>> first, Types ... rest)
 {
 	auto remainder = needs_all(rest...);
 	auto f = future<int>::create_shared();
-	std::function<void(future<T> &)> code = [f, first, remainder](future<T> &in) {
-		if(f->is_ready()) return;
+	auto claimed = std::make_shared<std::atomic<bool>>(false);
+	std::function<void(future<T> &)> code = [f, first, remainder, claimed](future<T> &in) {
+		if(f->is_ready() || claimed->exchange(true)) return;
 		if(!in.is_done()) {
 			f->fail("error");
 			return;
 		}
 		f->done(0);
 	};
+	CPS_FUTURE_TRACE_LINK(*first, *f, needs_any);
 	first->on_ready(code);
+	CPS_FUTURE_TRACE_LINK(*remainder, *f, needs_any);
 	remainder->on_ready(code);
 	return f;
 }
@@ -0,0 +1,290 @@
+#pragma once
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <system_error>
+
+#include <cps/future.h>
+#include <cps/future/buffer.h>
+#include <cps/future/reactor.h>
+
+namespace cps {
+
+/**
+ * Outbound message queue for a single file descriptor.
+ *
+ * Messages passed to ->send during a reactor iteration are held until the
+ * end of that iteration, then flushed together with a single sendmsg. Fds
+ * which aren't sockets get a writev instead. It only takes more than one
+ * call if there are over IOV_MAX segments. Each message's future resolves,
+ * with the message size, once all of its bytes have been accepted by the
+ * kernel. If the socket buffer fills up we wait for the fd to become
+ * writable and carry on from where we left off.
+ *
+ * Like the reactor itself, this is not thread-safe: use it from the loop
+ * thread only.
+ */
+class write_queue {
+public:
+	/**
+	 * Sets up a queue for the given fd, which should be nonblocking. We do
+	 * not take ownership of the fd.
+	 */
+	write_queue(
+		reactor &loop,
+		int fd
+	):state_(std::make_shared<shared_state>(loop, fd))
+	{
+	}
+
+	write_queue(const write_queue &) = delete;
+	write_queue &operator=(const write_queue &) = delete;
+
+	/**
+	 * Pending messages are cancelled when the queue goes away.
+	 */
+	~write_queue() {
+		state_->closed = true;
+		auto pending = std::move(state_->queue);
+		for(auto &it : pending)
+			if(it.f->is_pending())
+				it.f->cancel();
+	}
+
+	/**
+	 * Queues a message for sending.
+	 * @returns a future which resolves with the message size once the kernel
+	 * has accepted every byte, or fails if the write fails
+	 */
+	std::shared_ptr<future<size_t>>
+	send(buffer data)
+	{
+		auto f = future<size_t>::create_shared(u8"write_queue::send");
+		if(state_->ec) {
+			f->fail(std::system_error(state_->ec, "write failed"));
+			return f;
+		}
+		size_t size = data.size();
+		state_->queued_bytes += size;
+		state_->queue.push_back(pending_write { std::move(data), 0, f });
+		schedule(state_);
+		return f;
+	}
+
+	/**
+	 * Writes as much of the queue as the kernel will take, right now.
+	 * Normally this is left to the end of the reactor iteration.
+	 */
+	void flush() { flush(state_); }
+
+	/** Bytes queued but not yet accepted by the kernel */
+	size_t queued_bytes() const { return state_->queued_bytes; }
+	/** Messages queued but not yet fully written */
+	size_t queued_messages() const { return state_->queue.size(); }
+	/** Number of writev calls made so far */
+	size_t write_calls() const { return state_->write_calls; }
+	/** Number of messages completed so far */
+	size_t messages_sent() const { return state_->messages_sent; }
+
+private:
+	struct pending_write {
+		buffer data;
+		/** How much of data has been accepted so far */
+		size_t written;
+		std::shared_ptr<future<size_t>> f;
+	};
+
+	/**
+	 * State shared with the deferred flush and writable handlers, so that
+	 * those are safe to run after the queue itself has gone.
+	 */
+	struct shared_state {
+		shared_state(
+			reactor &loop,
+			int fd
+		):loop(loop),
+		  fd(fd)
+		{
+		}
+
+		reactor &loop;
+		int fd;
+		std::deque<pending_write> queue;
+		/** True once a flush is queued for the end of this iteration */
+		bool scheduled = false;
+		/** True while we're waiting for the fd to become writable */
+		bool blocked = false;
+		/** Set once the owning write_queue is destroyed */
+		bool closed = false;
+		/** Cleared if sendmsg tells us this isn't a socket */
+		bool socket = true;
+		/** First write error, if any: all later sends fail with this */
+		std::error_code ec;
+		size_t queued_bytes = 0;
+		size_t write_calls = 0;
+		size_t messages_sent = 0;
+	};
+
+	static void
+	schedule(const std::shared_ptr<shared_state> &state)
+	{
+		if(state->scheduled || state->blocked)
+			return;
+		state->scheduled = true;
+		std::weak_ptr<shared_state> weak = state;
+		state->loop.defer([weak]() {
+			if(auto s = weak.lock()) {
+				s->scheduled = false;
+				if(!s->closed)
+					flush(s);
+			}
+		});
+	}
+
+	static void
+	flush(const std::shared_ptr<shared_state> &state)
+	{
+		auto &s = *state;
+		std::vector<std::pair<std::shared_ptr<future<size_t>>, size_t>> done;
+		struct iovec iov[IOV_MAX];
+		while(!s.queue.empty()) {
+			/* Gather segments from the front of the queue, skipping anything
+			 * that went out in a previous partial write
+			 */
+			int count = 0;
+			for(auto &it : s.queue) {
+				size_t skip = it.written;
+				for(auto &seg : it.data) {
+					if(count == IOV_MAX)
+						break;
+					if(skip >= seg.size()) {
+						skip -= seg.size();
+						continue;
+					}
+					iov[count].iov_base = const_cast<char *>(seg.data() + skip);
+					iov[count].iov_len = seg.size() - skip;
+					skip = 0;
+					++count;
+				}
+				if(count == IOV_MAX)
+					break;
+			}
+
+			ssize_t rslt = 0;
+			if(count > 0) {
+				++s.write_calls;
+				rslt = write_vector(s, iov, count);
+			}
+			if(rslt < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK) {
+					wait_for_writable(state);
+					break;
+				}
+				s.ec = std::error_code(errno, std::system_category());
+				break;
+			}
+
+			/* Step through the queue, completing each message that's
+			 * now entirely written
+			 */
+			size_t n = static_cast<size_t>(rslt);
+			s.queued_bytes -= n;
+			while(!s.queue.empty()) {
+				auto &front = s.queue.front();
+				size_t remaining = front.data.size() - front.written;
+				if(n < remaining) {
+					front.written += n;
+					break;
+				}
+				n -= remaining;
+				done.emplace_back(std::move(front.f), front.data.size());
+				s.queue.pop_front();
+				++s.messages_sent;
+			}
+			/* Short write means the socket buffer is full */
+			if(!s.queue.empty() && static_cast<size_t>(rslt) < total(iov, count)) {
+				wait_for_writable(state);
+				break;
+			}
+		}
+
+		std::deque<pending_write> failed;
+		if(s.ec) {
+			failed.swap(s.queue);
+			s.queued_bytes = 0;
+		}
+
+		/* Resolve only once our own state is consistent, since callbacks are
+		 * free to queue more messages
+		 */
+		for(auto &it : done)
+			if(it.first->is_pending())
+				it.first->done(it.second);
+		for(auto &it : failed)
+			if(it.f->is_pending())
+				it.f->fail(std::system_error(s.ec, "write failed"));
+	}
+
+	/**
+	 * Sockets go through sendmsg so that we can pass MSG_NOSIGNAL and get
+	 * EPIPE instead of SIGPIPE. Anything else falls back to writev.
+	 */
+	static ssize_t
+	write_vector(shared_state &s, struct iovec *iov, int count)
+	{
+		ssize_t rslt;
+		if(s.socket) {
+			struct msghdr msg { };
+			msg.msg_iov = iov;
+			msg.msg_iovlen = count;
+			do {
+				rslt = ::sendmsg(s.fd, &msg, MSG_NOSIGNAL);
+			} while(rslt < 0 && errno == EINTR);
+			if(rslt >= 0 || errno != ENOTSOCK)
+				return rslt;
+			s.socket = false;
+		}
+		do {
+			rslt = ::writev(s.fd, iov, count);
+		} while(rslt < 0 && errno == EINTR);
+		return rslt;
+	}
+
+	static size_t
+	total(const struct iovec *iov, int count)
+	{
+		size_t n = 0;
+		for(int i = 0; i < count; ++i)
+			n += iov[i].iov_len;
+		return n;
+	}
+
+	static void
+	wait_for_writable(const std::shared_ptr<shared_state> &state)
+	{
+		if(state->blocked)
+			return;
+		state->blocked = true;
+		std::weak_ptr<shared_state> weak = state;
+		state->loop.writable(state->fd)->on_ready([weak](future<int> &f) {
+			auto s = weak.lock();
+			if(!s)
+				return;
+			/* Cancelled waits included: otherwise we'd never flush again */
+			s->blocked = false;
+			if(s->closed || !f.is_done())
+				return;
+			flush(s);
+		});
+	}
+
+private:
+	std::shared_ptr<shared_state> state_;
+};
+
+};
+
@@ -0,0 +1,159 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/actor.h>
+#include <cps/future/thread_pool.h>
+
+#include <atomic>
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("lock-free mailboxes", "[actor]") {
+	GIVEN("an empty queue") {
+		mpsc_queue<int> q;
+		int v = 0;
+		THEN("there's nothing to pop") {
+			CHECK(!q.pop(v));
+		}
+		WHEN("we push a few items") {
+			for(int i = 1; i <= 3; ++i)
+				q.push(i);
+			THEN("they come out in order") {
+				std::vector<int> out;
+				while(q.pop(v))
+					out.push_back(v);
+				CHECK(out == (std::vector<int> { 1, 2, 3 }));
+			}
+		}
+	}
+	GIVEN("several producers and one consumer") {
+		mpsc_queue<std::pair<int, int>> q;
+		const int producers = 4, each = 20000;
+		std::vector<std::thread> threads;
+		for(int p = 0; p < producers; ++p)
+			threads.emplace_back([&q, p] {
+				for(int i = 0; i < each; ++i)
+					q.push({ p, i });
+			});
+		std::vector<int> last(producers, -1);
+		int seen = 0;
+		bool ordered = true;
+		std::pair<int, int> v;
+		while(seen < producers * each) {
+			if(!q.pop(v)) {
+				std::this_thread::yield();
+				continue;
+			}
+			ordered = ordered && v.second == last[v.first] + 1;
+			last[v.first] = v.second;
+			++seen;
+		}
+		for(auto &t : threads)
+			t.join();
+		THEN("every item arrives, in order per producer") {
+			CHECK(ordered);
+			CHECK(!q.pop(v));
+		}
+	}
+}
+
+SCENARIO("actors", "[actor]") {
+	GIVEN("a counting actor running inline") {
+		inline_executor exec;
+		actor<int, int> counter { exec, [total = 0](int &n) mutable {
+			if(n < 0)
+				throw std::invalid_argument("negative");
+			return total += n;
+		} };
+		WHEN("we tell it things and then ask") {
+			counter.tell(1);
+			counter.tell(2);
+			auto f = counter.ask(3);
+			THEN("the reply reflects everything before it") {
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 6);
+				CHECK(counter.queued() == 0);
+			}
+		}
+		WHEN("the handler throws") {
+			auto f = counter.ask(-1);
+			THEN("the ask fails, and the actor carries on") {
+				CHECK(f->is_failed());
+				CHECK(counter.ask(1)->value() == 1);
+			}
+		}
+	}
+	GIVEN("an actor on an executor we run by hand") {
+		struct queued_executor : executor {
+			void post(std::function<void()> code) override { queue.push_back(std::move(code)); }
+			void run() {
+				while(!queue.empty()) {
+					auto code = std::move(queue.front());
+					queue.erase(queue.begin());
+					code();
+				}
+			}
+			std::vector<std::function<void()>> queue;
+		} exec;
+		actor<int, int> doubler { exec, [](int &n) { return n * 2; } };
+		WHEN("an ask is cancelled before the actor gets to it") {
+			auto gone = doubler.ask(1);
+			gone->cancel();
+			exec.run();
+			auto f = doubler.ask(2);
+			exec.run();
+			THEN("the actor carries on with the next message") {
+				CHECK(gone->is_cancelled());
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 4);
+				CHECK(doubler.queued() == 0);
+			}
+		}
+	}
+	GIVEN("an actor which messages itself") {
+		inline_executor exec;
+		std::vector<int> order;
+		std::unique_ptr<actor<int>> self;
+		self.reset(new actor<int> { exec, [&](int &n) {
+			order.push_back(n);
+			if(n < 3)
+				self->tell(n + 1);
+			return 0;
+		} });
+		self->tell(0);
+		THEN("the messages are handled in turn, not nested") {
+			CHECK(order == (std::vector<int> { 0, 1, 2, 3 }));
+			CHECK(self->activations() == 1);
+		}
+	}
+	GIVEN("an actor on a thread pool, with several senders") {
+		thread_pool pool { 3 };
+		std::atomic<int> inside { 0 };
+		std::atomic<bool> overlapped { false };
+		actor<int, long> sum { pool, [&, total = 0L](int &n) mutable {
+			if(inside++ != 0)
+				overlapped = true;
+			total += n;
+			--inside;
+			return total;
+		}, 16 };
+		std::vector<std::thread> senders;
+		for(int t = 0; t < 4; ++t)
+			senders.emplace_back([&sum] {
+				for(int i = 0; i < 10000; ++i)
+					sum.tell(1);
+			});
+		for(auto &t : senders)
+			t.join();
+		auto f = sum.ask(0);
+		while(f->is_pending())
+			std::this_thread::yield();
+		THEN("every message is handled, one at a time") {
+			CHECK(f->value() == 40000);
+			CHECK(!overlapped);
+		}
+	}
+}
@@ -0,0 +1,233 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/broadcast.h>
+#include <cps/future/thread_pool.h>
+
+#include <atomic>
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("broadcast channels", "[broadcast]") {
+	GIVEN("a broadcast with room for four items and a few subscribers") {
+		broadcast<int> bc { 4 };
+		auto a = bc.subscribe();
+		auto b = bc.subscribe();
+		CHECK(bc.subscribers() == 2);
+		WHEN("items are published") {
+			for(int i = 1; i <= 3; ++i)
+				CHECK(bc.publish(i)->is_done());
+			THEN("every subscriber reads all of them, in order") {
+				for(int i = 1; i <= 3; ++i) {
+					CHECK(a->next()->value() == i);
+					CHECK(b->next()->value() == i);
+				}
+				CHECK(a->lag() == 0);
+				CHECK(a->next()->is_pending());
+			}
+		}
+		WHEN("subscribers are waiting") {
+			auto fa = a->next();
+			auto fb = b->next();
+			CHECK(fa->is_pending());
+			bc.publish(7);
+			THEN("the item is handed to both") {
+				REQUIRE(fa->is_done());
+				REQUIRE(fb->is_done());
+				CHECK(fa->value() == 7);
+				CHECK(fb->value() == 7);
+			}
+		}
+		WHEN("a subscriber waits for more than one item") {
+			auto first = a->next();
+			auto second = a->next();
+			bc.publish(1);
+			bc.publish(2);
+			THEN("they are handed out in order") {
+				CHECK(first->value() == 1);
+				CHECK(second->value() == 2);
+			}
+		}
+		WHEN("someone subscribes late") {
+			bc.publish(1);
+			auto late = bc.subscribe();
+			bc.publish(2);
+			THEN("they only see what's published afterwards") {
+				CHECK(late->next()->value() == 2);
+			}
+		}
+		WHEN("the broadcast is closed") {
+			auto waiting = a->next();
+			bc.publish(1);
+			auto fb = b->next();
+			bc.close();
+			THEN("publishing fails and subscribers see the end once they've read everything") {
+				CHECK(bc.publish(2)->is_failed());
+				CHECK(waiting->value() == 1);
+				CHECK(fb->value() == 1);
+				CHECK(is_end_of_stream(*a->next()));
+			}
+		}
+		WHEN("a subscriber gives up on a ->next") {
+			auto gone = a->next();
+			auto fb = b->next();
+			gone->cancel();
+			auto accepted = bc.publish(1);
+			THEN("everyone else still gets the item, and it stays for the next ->next") {
+				CHECK(accepted->is_done());
+				REQUIRE(fb->is_done());
+				CHECK(fb->value() == 1);
+				auto again = a->next();
+				REQUIRE(again->is_done());
+				CHECK(again->value() == 1);
+			}
+		}
+		WHEN("the broadcast is closed after a subscriber gave up") {
+			auto gone = a->next();
+			gone->cancel();
+			bc.close();
+			THEN("close doesn't trip over it") {
+				CHECK(gone->is_cancelled());
+			}
+		}
+		WHEN("a subscriber goes away while waiting") {
+			auto f = a->next();
+			a.reset();
+			THEN("its wait is cancelled and it's no longer counted") {
+				CHECK(f->is_cancelled());
+				CHECK(bc.subscribers() == 1);
+			}
+		}
+	}
+	GIVEN("a broadcast with a slow subscriber of each kind") {
+		broadcast<int> bc { 4 };
+		auto dropping = bc.subscribe(lag_policy::drop);
+		auto skipping = bc.subscribe(lag_policy::skip_to_latest);
+		WHEN("ten items are published") {
+			for(int i = 0; i < 10; ++i)
+				CHECK(bc.publish(i)->is_done());
+			THEN("drop carries on from the oldest item still in the ring") {
+				CHECK(dropping->lag() == 10);
+				CHECK(dropping->next()->value() == 6);
+				CHECK(dropping->missed() == 6);
+				CHECK(dropping->next()->value() == 7);
+			}
+			THEN("skip_to_latest carries on from the newest") {
+				CHECK(skipping->next()->value() == 9);
+				CHECK(skipping->missed() == 9);
+				CHECK(skipping->next()->is_pending());
+			}
+		}
+		WHEN("they fall behind by less than the ring") {
+			for(int i = 0; i < 4; ++i)
+				bc.publish(i);
+			THEN("nothing is lost") {
+				CHECK(dropping->next()->value() == 0);
+				CHECK(skipping->next()->value() == 0);
+				CHECK(skipping->missed() == 0);
+			}
+		}
+	}
+	GIVEN("a broadcast with a backpressure subscriber") {
+		broadcast<int> bc { 2 };
+		auto slow = bc.subscribe(lag_policy::backpressure);
+		auto fast = bc.subscribe(lag_policy::drop);
+		CHECK(bc.publish(1)->is_done());
+		CHECK(bc.publish(2)->is_done());
+		WHEN("the ring fills up") {
+			auto third = bc.publish(3);
+			auto fourth = bc.publish(4);
+			THEN("the publisher waits for it") {
+				CHECK(third->is_pending());
+				CHECK(fourth->is_pending());
+				CHECK(bc.blocked() == 2);
+				CHECK(bc.published() == 2);
+			}
+			AND_WHEN("it reads an item") {
+				CHECK(slow->next()->value() == 1);
+				THEN("one waiting publish gets in") {
+					CHECK(third->is_done());
+					CHECK(fourth->is_pending());
+				}
+				AND_WHEN("it reads the rest") {
+					CHECK(slow->next()->value() == 2);
+					CHECK(slow->next()->value() == 3);
+					CHECK(slow->next()->value() == 4);
+					THEN("nothing was lost") {
+						CHECK(fourth->is_done());
+						CHECK(slow->missed() == 0);
+						CHECK(fast->next()->value() == 3);
+					}
+				}
+			}
+			AND_WHEN("it unsubscribes") {
+				slow.reset();
+				THEN("the publisher is let go") {
+					CHECK(third->is_done());
+					CHECK(fourth->is_done());
+				}
+			}
+			AND_WHEN("the broadcast is closed") {
+				bc.close();
+				THEN("the waiting publishes fail") {
+					CHECK(third->is_failed());
+					CHECK(fourth->is_failed());
+				}
+			}
+		}
+		WHEN("it is waiting at the head when the ring wraps") {
+			CHECK(slow->next()->value() == 1);
+			CHECK(slow->next()->value() == 2);
+			auto f = slow->next();
+			CHECK(bc.publish(3)->is_done());
+			CHECK(bc.publish(4)->is_done());
+			THEN("it holds up publishing once it is a ring behind") {
+				CHECK(f->value() == 3);
+				CHECK(bc.publish(5)->is_done());
+				auto sixth = bc.publish(6);
+				CHECK(sixth->is_pending());
+				CHECK(slow->next()->value() == 4);
+				CHECK(sixth->is_done());
+			}
+		}
+	}
+	GIVEN("a publisher and backpressure subscribers on other threads") {
+		const int count = 5000;
+		auto bc = std::make_shared<broadcast<int>>(16);
+		std::vector<std::shared_ptr<broadcast<int>::subscriber>> subs;
+		for(int i = 0; i < 3; ++i)
+			subs.push_back(bc->subscribe(lag_policy::backpressure));
+		std::atomic<int> good { 0 };
+		std::vector<std::thread> readers;
+		for(auto &s : subs) {
+			readers.emplace_back([s, &good, count] {
+				int expected = 0;
+				for(;;) {
+					auto f = s->next();
+					while(f->is_pending())
+						std::this_thread::yield();
+					if(!f->is_done())
+						break;
+					if(f->value() != expected++)
+						return;
+				}
+				if(expected == count && s->missed() == 0)
+					++good;
+			});
+		}
+		for(int i = 0; i < count; ++i) {
+			auto p = bc->publish(i);
+			while(p->is_pending())
+				std::this_thread::yield();
+		}
+		bc->close();
+		for(auto &t : readers)
+			t.join();
+		THEN("each subscriber sees every item, in order") {
+			CHECK(good == 3);
+		}
+	}
+}
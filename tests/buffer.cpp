@@ -0,0 +1,169 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/buffer.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("buffer construction and slicing", "[buffer]") {
+	GIVEN("a buffer taken from a string") {
+		std::string s(64, 'x');
+		const char *original = s.data();
+		auto b = buffer::take(std::move(s));
+		THEN("the bytes were not copied") {
+			REQUIRE(b.segment_count() == 1);
+			CHECK(b.begin()->data() == original);
+			CHECK(b.size() == 64);
+		}
+		WHEN("we slice it") {
+			auto part = b.slice(10, 20);
+			THEN("the slice refers to the same storage") {
+				REQUIRE(part.size() == 20);
+				CHECK(part.begin()->data() == original + 10);
+			}
+		}
+		WHEN("we slice past the end") {
+			THEN("we get an exception") {
+				REQUIRE_THROWS(b.slice(60, 10));
+				REQUIRE_THROWS(b.slice(65));
+			}
+		}
+	}
+	GIVEN("two buffers appended together") {
+		auto b = buffer::copy("hello, ");
+		b.append(buffer::copy("world"));
+		THEN("we have two segments") {
+			CHECK(b.segment_count() == 2);
+			CHECK(b.size() == 12);
+			CHECK(b.to_string() == "hello, world");
+		}
+		WHEN("we slice across the boundary") {
+			auto part = b.slice(5, 4);
+			THEN("we get both segments") {
+				CHECK(part.segment_count() == 2);
+				CHECK(part.to_string() == ", wo");
+			}
+			AND_THEN("it compares equal to a single-segment copy") {
+				CHECK(part == buffer::copy(", wo"));
+				CHECK(part != buffer::copy(", wx"));
+			}
+		}
+		WHEN("we fill in iovecs") {
+			struct iovec iov[4];
+			auto n = b.to_iovec(iov, 4);
+			THEN("there is one per segment") {
+				REQUIRE(n == 2);
+				CHECK(iov[0].iov_len == 7);
+				CHECK(iov[1].iov_len == 5);
+			}
+		}
+	}
+}
+
+SCENARIO("buffers through futures", "[buffer][shared]") {
+	GIVEN("a pending future<buffer>") {
+		auto f = future<buffer>::create_shared();
+		std::string s(4096, 'z');
+		const char *original = s.data();
+		WHEN("we pass a buffer through on_done and then") {
+			const char *seen = nullptr;
+			auto chained = f->then([](buffer b) {
+				return resolved_future(b.slice(1));
+			});
+			chained->on_done([&seen](buffer b) {
+				seen = b.begin()->data();
+			});
+			f->done(buffer::take(std::move(s)));
+			THEN("the consumer sees the original bytes") {
+				REQUIRE(chained->is_done());
+				CHECK(seen == original + 1);
+				CHECK(f->value().begin()->data() == original);
+			}
+		}
+	}
+}
+
+SCENARIO("buffer I/O", "[buffer]") {
+	GIVEN("a pipe") {
+		int fds[2];
+		REQUIRE(::pipe(fds) == 0);
+		WHEN("we write a multi-segment buffer") {
+			auto b = buffer::copy("some ");
+			b.append(buffer::copy("data"));
+			std::error_code ec;
+			auto n = b.write(fds[1], ec);
+			REQUIRE(!ec);
+			REQUIRE(n == 9);
+			THEN("we can read it back") {
+				auto in = buffer::read(fds[0], 128, ec);
+				REQUIRE(!ec);
+				CHECK(in == b);
+			}
+		}
+		WHEN("the write end is closed") {
+			::close(fds[1]);
+			fds[1] = -1;
+			std::error_code ec;
+			auto in = buffer::read(fds[0], 128, ec);
+			THEN("we get an empty buffer without error") {
+				CHECK(!ec);
+				CHECK(in.empty());
+			}
+		}
+		::close(fds[0]);
+		if(fds[1] >= 0)
+			::close(fds[1]);
+	}
+	GIVEN("a read block and a blocking socket pair") {
+		read_block block { 16 };
+		int fds[2];
+		REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+		std::error_code ec;
+		WHEN("we recv with nothing there, without waiting") {
+			auto in = block.recv(fds[0], MSG_DONTWAIT, ec);
+			THEN("we get EAGAIN rather than blocking") {
+				CHECK(ec.value() == EAGAIN);
+				CHECK(in.empty());
+			}
+		}
+		WHEN("we read a little, twice") {
+			buffer::copy("hello").write(fds[1], ec);
+			auto first = block.read(fds[0], ec);
+			buffer::copy("world").write(fds[1], ec);
+			auto second = block.recv(fds[0], MSG_DONTWAIT, ec);
+			THEN("each keeps its own bytes, though the block was reused") {
+				CHECK(!ec);
+				CHECK(first.to_string() == "hello");
+				CHECK(second.to_string() == "world");
+			}
+		}
+		WHEN("a read fills most of the block") {
+			buffer::copy("0123456789abcdef").write(fds[1], ec);
+			auto big = block.read(fds[0], ec);
+			buffer::copy("next").write(fds[1], ec);
+			auto next = block.read(fds[0], ec);
+			THEN("the buffer takes the block, and the next read gets a new one") {
+				CHECK(big.to_string() == "0123456789abcdef");
+				CHECK(next.to_string() == "next");
+			}
+		}
+		WHEN("the other end is closed") {
+			::close(fds[1]);
+			fds[1] = -1;
+			auto in = block.read(fds[0], ec);
+			THEN("we get an empty buffer without error") {
+				CHECK(!ec);
+				CHECK(in.empty());
+			}
+		}
+		::close(fds[0]);
+		if(fds[1] >= 0)
+			::close(fds[1]);
+	}
+}
+
@@ -0,0 +1,177 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/channel.h>
+#include <cps/future/thread_pool.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("bounded channels", "[channel]") {
+	GIVEN("a channel with room for two items") {
+		auto ch = std::make_shared<channel<int>>(2);
+		WHEN("we push within capacity") {
+			auto a = ch->push(1);
+			auto b = ch->push(2);
+			THEN("the pushes are accepted straight away") {
+				CHECK(a->is_done());
+				CHECK(b->is_done());
+				CHECK(ch->size() == 2);
+			}
+			AND_WHEN("we push one more") {
+				auto c = ch->push(3);
+				THEN("the producer has to wait") {
+					CHECK(c->is_pending());
+					CHECK(ch->blocked() == 1);
+				}
+				AND_WHEN("a consumer takes an item") {
+					auto v = ch->pop();
+					THEN("the waiting item moves into the queue, in order") {
+						REQUIRE(v->is_done());
+						CHECK(v->value() == 1);
+						CHECK(c->is_done());
+						CHECK(ch->size() == 2);
+						CHECK(ch->pop()->value() == 2);
+						CHECK(ch->pop()->value() == 3);
+					}
+				}
+				AND_WHEN("the waiting producer gives up") {
+					c->cancel();
+					auto v = ch->pop();
+					THEN("its item is dropped rather than queued") {
+						CHECK(v->value() == 1);
+						CHECK(ch->blocked() == 0);
+						CHECK(ch->size() == 1);
+					}
+					AND_WHEN("the channel is closed") {
+						ch->close();
+						THEN("close doesn't trip over it") {
+							CHECK(c->is_cancelled());
+						}
+					}
+				}
+				AND_WHEN("the channel is closed") {
+					ch->close();
+					THEN("the waiting producer fails, but queued items can still be read") {
+						CHECK(c->is_failed());
+						CHECK(ch->push(4)->is_failed());
+						CHECK(ch->pop()->value() == 1);
+						CHECK(ch->pop()->value() == 2);
+						CHECK(is_end_of_stream(*ch->pop()));
+					}
+				}
+			}
+		}
+		WHEN("a consumer is waiting") {
+			auto v = ch->pop();
+			CHECK(v->is_pending());
+			ch->push(7);
+			THEN("the item goes straight to it") {
+				REQUIRE(v->is_done());
+				CHECK(v->value() == 7);
+				CHECK(ch->size() == 0);
+			}
+		}
+		WHEN("a waiting consumer gives up before an item arrives") {
+			auto gone = ch->pop();
+			auto v = ch->pop();
+			gone->cancel();
+			auto accepted = ch->push(7);
+			THEN("the item goes to the next consumer") {
+				CHECK(accepted->is_done());
+				REQUIRE(v->is_done());
+				CHECK(v->value() == 7);
+				CHECK(gone->is_cancelled());
+			}
+		}
+		WHEN("the only waiting consumer gives up") {
+			auto gone = ch->pop();
+			gone->cancel();
+			ch->push(8);
+			THEN("the item is queued") {
+				CHECK(ch->size() == 1);
+				CHECK(ch->pop()->value() == 8);
+			}
+		}
+		WHEN("the channel is closed after a consumer gave up") {
+			auto gone = ch->pop();
+			gone->cancel();
+			ch->close();
+			THEN("close doesn't trip over it") {
+				CHECK(gone->is_cancelled());
+			}
+		}
+		WHEN("consumers give up on another thread while items are pushed") {
+			const int count = 20000;
+			std::atomic<bool> stop { false };
+			std::atomic<int> received { 0 };
+			std::thread consumer([&] {
+				while(!stop) {
+					auto v = ch->pop();
+					try {
+						v->cancel();
+					} catch(const std::logic_error &) {
+						/* An item got there first */
+					}
+					if(v->is_done())
+						++received;
+				}
+			});
+			bool threw = false;
+			for(int i = 0; i < count; ++i) {
+				try {
+					ch->push(i);
+				} catch(const std::logic_error &) {
+					threw = true;
+				}
+			}
+			stop = true;
+			consumer.join();
+			int left = 0;
+			while(ch->size() || ch->blocked()) {
+				ch->pop();
+				++left;
+			}
+			THEN("every item is either received or still queued") {
+				CHECK(!threw);
+				CHECK(received + left == count);
+			}
+		}
+		WHEN("the channel is closed with a consumer waiting") {
+			auto v = ch->pop();
+			ch->close();
+			THEN("the consumer sees the end of the stream") {
+				CHECK(is_end_of_stream(*v));
+			}
+		}
+	}
+	GIVEN("a channel with no capacity") {
+		channel<int> ch { 0 };
+		auto pushed = ch.push(5);
+		THEN("every push waits for a consumer") {
+			CHECK(pushed->is_pending());
+			CHECK(ch.pop()->value() == 5);
+			CHECK(pushed->is_done());
+		}
+	}
+}
+
+SCENARIO("thread pools", "[channel]") {
+	GIVEN("a pool with a few threads") {
+		std::atomic<int> ran { 0 };
+		{
+			thread_pool pool { 3 };
+			CHECK(pool.size() == 3);
+			for(int i = 0; i < 100; ++i)
+				pool.post([&ran] { ++ran; });
+		}
+		THEN("everything posted runs before the pool goes away") {
+			CHECK(ran == 100);
+		}
+	}
+}
@@ -0,0 +1,141 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/fiber.h>
+
+#include <stdexcept>
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("fibers awaiting futures", "[fiber]") {
+	GIVEN("a fiber scheduler") {
+		fiber_scheduler sched;
+		WHEN("we spawn a fiber that returns straight away") {
+			auto f = sched.spawn([] { return 3; });
+			THEN("nothing runs until the scheduler does") {
+				CHECK(f->is_pending());
+				CHECK(sched.fibers() == 1);
+				sched.run();
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 3);
+				CHECK(sched.fibers() == 0);
+			}
+		}
+		WHEN("we spawn a fiber that returns nothing") {
+			bool ran = false;
+			auto f = sched.spawn([&ran] { ran = true; });
+			sched.run();
+			THEN("its future resolves to 0 once it has run") {
+				CHECK(ran);
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 0);
+			}
+		}
+		WHEN("a fiber which returns nothing throws") {
+			auto f = sched.spawn([] { throw std::runtime_error("no"); });
+			sched.run();
+			THEN("its future fails") {
+				REQUIRE(f->is_failed());
+				CHECK(f->failure_reason() == "no");
+			}
+		}
+		WHEN("a fiber awaits a pending future") {
+			auto input = future<int>::create_shared();
+			std::vector<std::string> steps;
+			auto f = sched.spawn([input, &steps] {
+				steps.push_back("before");
+				auto v = await(input);
+				steps.push_back("after");
+				return v * 2;
+			});
+			sched.run_once();
+			THEN("the fiber is suspended") {
+				CHECK(steps == (std::vector<std::string> { "before" }));
+				CHECK(f->is_pending());
+				CHECK(!sched.run_once());
+			}
+			AND_WHEN("the future resolves") {
+				input->done(21);
+				sched.run();
+				THEN("the fiber carries on from where it was") {
+					CHECK(steps == (std::vector<std::string> { "before", "after" }));
+					REQUIRE(f->is_done());
+					CHECK(f->value() == 42);
+				}
+			}
+			AND_WHEN("the future fails") {
+				input->fail("no data");
+				sched.run();
+				THEN("await throws inside the fiber and the result fails") {
+					CHECK(steps == (std::vector<std::string> { "before" }));
+					REQUIRE(f->is_failed());
+					CHECK(f->failure_reason() == "no data");
+				}
+			}
+		}
+		WHEN("a fiber awaits something that is already done") {
+			auto f = sched.spawn([] { return await(resolved_future(5)) + 1; });
+			sched.run_once();
+			THEN("it completes without suspending") {
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 6);
+				CHECK(sched.switches() == 1);
+			}
+		}
+		WHEN("the future is resolved from another thread") {
+			auto input = future<int>::create_shared();
+			auto f = sched.spawn([input] { return await(input) + 1; });
+			sched.run_once();
+			std::thread t([input] {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				input->done(9);
+			});
+			sched.run();
+			t.join();
+			THEN("run waits for it, then finishes the fiber") {
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 10);
+			}
+		}
+		WHEN("fibers yield to each other") {
+			std::vector<int> order;
+			auto body = [&order](int id) {
+				return [&order, id] {
+					for(int i = 0; i < 3; ++i) {
+						order.push_back(id);
+						fiber_scheduler::yield();
+					}
+					return id;
+				};
+			};
+			sched.spawn(body(1));
+			sched.spawn(body(2));
+			sched.run();
+			THEN("they take turns") {
+				CHECK(order == (std::vector<int> { 1, 2, 1, 2, 1, 2 }));
+			}
+		}
+		WHEN("we run many fibers one after another") {
+			for(int i = 0; i < 100; ++i)
+				sched.spawn([i] { return i; });
+			sched.run();
+			THEN("stacks are reused") {
+				CHECK(sched.stacks().allocated() == 100);
+				CHECK(sched.stacks().available() == 100);
+				sched.spawn([] { return 0; });
+				sched.run();
+				CHECK(sched.stacks().allocated() == 100);
+			}
+		}
+	}
+	GIVEN("code that isn't in a fiber") {
+		THEN("awaiting a pending future is an error") {
+			CHECK(!fiber_scheduler::in_fiber());
+			REQUIRE_THROWS(await(future<int>::create_shared()));
+			CHECK(await(resolved_future(1)) == 1);
+		}
+	}
+}
@@ -0,0 +1,149 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/file_watch.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+void
+write_file(const std::string &path, const std::string &content)
+{
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	REQUIRE(fd >= 0);
+	REQUIRE(::write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size()));
+	::close(fd);
+}
+
+/** Runs the loop until the future resolves, or for the given time at most */
+template<typename T>
+bool
+wait_for(reactor &loop, const std::shared_ptr<future<T>> &f, std::chrono::milliseconds limit = std::chrono::seconds(5))
+{
+	auto deadline = std::chrono::steady_clock::now() + limit;
+	while(f->is_pending() && std::chrono::steady_clock::now() < deadline)
+		loop.run_once(10);
+	return !f->is_pending();
+}
+
+}
+
+SCENARIO("file change futures", "[file_watch]") {
+	GIVEN("a directory with a config file") {
+		char tmpl[] = "/tmp/cps-watch-XXXXXX";
+		REQUIRE(::mkdtemp(tmpl) != nullptr);
+		std::string dir = tmpl;
+		std::string config = dir + "/service.conf";
+		write_file(config, "a=1\n");
+
+		reactor loop;
+		file_watcher watcher { loop, std::chrono::milliseconds(20) };
+		WHEN("we wait for the file to change") {
+			auto f = watcher.changed(config);
+			wait_for(loop, f, std::chrono::milliseconds(50));
+			CHECK(f->is_pending());
+			write_file(config, "a=2\n");
+			REQUIRE(wait_for(loop, f));
+			THEN("the future resolves with what happened") {
+				CHECK(f->value().path == config);
+				CHECK((f->value().mask & IN_CLOSE_WRITE));
+			}
+			AND_THEN("the one-shot watch is gone") {
+				CHECK(watcher.watches() == 0);
+			}
+		}
+		WHEN("the file is replaced by a rename, as editors do") {
+			auto w = watcher.watch(config);
+			auto f = w->next();
+			write_file(config + ".tmp", "a=3\n");
+			REQUIRE(::rename((config + ".tmp").c_str(), config.c_str()) == 0);
+			REQUIRE(wait_for(loop, f));
+			THEN("we see it") {
+				CHECK((f->value().mask & IN_MOVED_TO));
+			}
+			AND_WHEN("it changes again") {
+				auto g = w->next();
+				write_file(config, "a=4\n");
+				REQUIRE(wait_for(loop, g));
+				THEN("we're still following it") {
+					CHECK((g->value().mask & IN_MODIFY));
+				}
+			}
+		}
+		WHEN("a burst of changes happens") {
+			auto w = watcher.watch(config);
+			auto f = w->next();
+			for(int i = 0; i < 10; ++i)
+				write_file(config, "a=" + std::to_string(i) + "\n");
+			REQUIRE(wait_for(loop, f));
+			THEN("it is delivered as one event") {
+				CHECK(f->value().count >= 10);
+				CHECK(watcher.delivered() == 1);
+			}
+		}
+		WHEN("other files in the directory change") {
+			auto f = watcher.changed(config);
+			write_file(dir + "/other", "x");
+			wait_for(loop, f, std::chrono::milliseconds(100));
+			THEN("a file watch doesn't hear about them") {
+				CHECK(f->is_pending());
+			}
+		}
+		WHEN("we watch the directory and a file in it") {
+			auto d = watcher.watch(dir);
+			auto c = watcher.watch(config);
+			THEN("they share one inotify watch") {
+				CHECK(watcher.watches() == 1);
+			}
+			auto df = d->next();
+			write_file(dir + "/new", "x");
+			REQUIRE(wait_for(loop, df));
+			THEN("the directory watch names the entry") {
+				CHECK(df->value().name == "new");
+			}
+		}
+		WHEN("changes happen while nobody is waiting") {
+			auto w = watcher.watch(config);
+			write_file(config, "a=5\n");
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+			while(std::chrono::steady_clock::now() < deadline)
+				loop.run_once(10);
+			auto f = w->next();
+			THEN("they're waiting for the next call") {
+				REQUIRE(f->is_done());
+				CHECK((f->value().mask & IN_MODIFY));
+			}
+		}
+		WHEN("the watcher goes away with someone waiting") {
+			std::shared_ptr<future<file_event>> f;
+			{
+				file_watcher short_lived { loop };
+				f = short_lived.changed(config);
+			}
+			THEN("they're cancelled") {
+				CHECK(f->is_cancelled());
+			}
+		}
+
+		::unlink((dir + "/other").c_str());
+		::unlink((dir + "/new").c_str());
+		::unlink(config.c_str());
+		::rmdir(dir.c_str());
+	}
+	GIVEN("a directory that doesn't exist") {
+		reactor loop;
+		file_watcher watcher { loop };
+		THEN("watching a file in it throws") {
+			CHECK_THROWS_AS(watcher.watch("/nonexistent-dir/file"), const std::system_error &);
+		}
+	}
+}
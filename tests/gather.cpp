@@ -0,0 +1,104 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/gather.h>
+#include <cps/future/simulation.h>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("gathering with a deadline", "[gather]") {
+	GIVEN("three shards and a 50ms budget") {
+		simulated_scheduler sim;
+		std::vector<std::shared_ptr<future<int>>> shards;
+		for(int i = 0; i < 3; ++i)
+			shards.push_back(future<int>::create_shared());
+		auto g = gather_within(sim, std::chrono::milliseconds(50), shards);
+		THEN("there is a single timer") {
+			CHECK(sim.pending() == 1);
+			CHECK(g->is_pending());
+		}
+		WHEN("every shard answers in time") {
+			shards[2]->done(30);
+			shards[0]->done(10);
+			shards[1]->done(20);
+			THEN("we don't wait for the deadline") {
+				REQUIRE(g->is_done());
+				CHECK(g->value().complete());
+				CHECK(g->value().values == (std::vector<int> { 10, 20, 30 }));
+				CHECK(sim.now() == scheduler::time_point());
+			}
+		}
+		WHEN("one shard is slow") {
+			shards[0]->done(10);
+			shards[2]->done(30);
+			sim.run_for(std::chrono::milliseconds(49));
+			CHECK(g->is_pending());
+			sim.run_for(std::chrono::milliseconds(1));
+			THEN("the deadline gives us what we have") {
+				REQUIRE(g->is_done());
+				auto r = g->value();
+				CHECK(r.missing() == 1);
+				CHECK(r.status[1] == gather_status::missing);
+				CHECK(r.values[0] == 10);
+				CHECK(r.values[2] == 30);
+			}
+			AND_THEN("the slow shard is cancelled") {
+				CHECK(shards[1]->is_cancelled());
+			}
+		}
+		WHEN("the caller gives up on the gather") {
+			shards[0]->done(10);
+			g->cancel();
+			THEN("the shards still pending are cancelled, and the deadline does nothing") {
+				CHECK(shards[1]->is_cancelled());
+				CHECK(shards[2]->is_cancelled());
+				CHECK_NOTHROW(sim.run());
+				CHECK(g->is_cancelled());
+			}
+		}
+		WHEN("a shard fails") {
+			shards[1]->fail("shard down");
+			shards[0]->done(10);
+			shards[2]->done(30);
+			THEN("the others still count") {
+				REQUIRE(g->is_done());
+				CHECK(g->value().status[1] == gather_status::failed);
+				CHECK(g->value().missing() == 1);
+			}
+		}
+	}
+	GIVEN("a gather which abandons slow inputs") {
+		simulated_scheduler sim;
+		auto slow = future<int>::create_shared();
+		auto g = gather_within(sim, std::chrono::milliseconds(10), std::vector<std::shared_ptr<future<int>>> { slow }, gather_policy::abandon_rest);
+		sim.run();
+		THEN("the slow input is left alone") {
+			REQUIRE(g->is_done());
+			CHECK(g->value().missing() == 1);
+			CHECK(slow->is_pending());
+			slow->done(1);
+			CHECK(g->value().status[0] == gather_status::missing);
+		}
+	}
+	GIVEN("inputs that are already resolved") {
+		simulated_scheduler sim;
+		auto g = gather_within(sim, std::chrono::milliseconds(10), std::vector<std::shared_ptr<future<int>>> {
+			resolved_future(1), resolved_future(2)
+		});
+		THEN("the result is ready straight away") {
+			REQUIRE(g->is_done());
+			CHECK(g->value().values == (std::vector<int> { 1, 2 }));
+		}
+	}
+	GIVEN("no inputs at all") {
+		simulated_scheduler sim;
+		auto g = gather_within(sim, std::chrono::milliseconds(10), std::vector<std::shared_ptr<future<int>>> { });
+		THEN("the result is ready and empty") {
+			REQUIRE(g->is_done());
+			CHECK(g->value().complete());
+			CHECK(sim.pending() == 0);
+		}
+	}
+}
@@ -0,0 +1,163 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/merge.h>
+
+#include <deque>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+/**
+ * A source whose items we hand out by hand, so tests can control exactly
+ * when each shard answers.
+ */
+struct manual_source {
+	std::deque<std::shared_ptr<future<int>>> requests;
+
+	async_source<int> source() {
+		return [this] {
+			auto f = future<int>::create_shared();
+			requests.push_back(f);
+			return f;
+		};
+	}
+
+	void send(int v) {
+		auto f = requests.front();
+		requests.pop_front();
+		f->done(v);
+	}
+
+	void finish() {
+		auto f = requests.front();
+		requests.pop_front();
+		f->fail_exception_pointer(end_of_stream());
+	}
+};
+
+}
+
+SCENARIO("merging sorted sources", "[merge]") {
+	GIVEN("several sorted generators") {
+		auto merged = merge_sorted<int>({
+			from_generator(foreach(std::vector<int> { 1, 4, 7, 10 })),
+			from_generator(foreach(std::vector<int> { 2, 5, 8 })),
+			from_generator(foreach(std::vector<int> { })),
+			from_generator(foreach(std::vector<int> { 3, 6, 9, 11, 12 }))
+		});
+		WHEN("we read everything") {
+			std::vector<int> out;
+			auto count = merged.for_each([&out](const int &v) { out.push_back(v); });
+			THEN("we get every item in order") {
+				REQUIRE(count->is_done());
+				CHECK(count->value() == 12);
+				CHECK(out == (std::vector<int> { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 }));
+			}
+			AND_THEN("each source was asked once per item, plus once to find its end") {
+				CHECK(merged.requests() == (std::vector<size_t> { 5, 4, 1, 6 }));
+			}
+			AND_WHEN("we ask for more") {
+				auto f = merged.next();
+				THEN("the stream has ended") {
+					CHECK(is_end_of_stream(*f));
+				}
+			}
+		}
+	}
+	GIVEN("a descending comparison") {
+		auto merged = merge_sorted<int>({
+			from_generator(foreach(std::vector<int> { 9, 5, 1 })),
+			from_generator(foreach(std::vector<int> { 8, 7, 2 }))
+		}, std::greater<int>());
+		std::vector<int> out;
+		merged.for_each([&out](const int &v) { out.push_back(v); });
+		THEN("items come out largest first") {
+			CHECK(out == (std::vector<int> { 9, 8, 7, 5, 2, 1 }));
+		}
+	}
+	GIVEN("shards which answer at different times") {
+		manual_source a, b, c;
+		auto merged = merge_sorted<int>({ a.source(), b.source(), c.source() });
+		auto first = merged.next();
+		THEN("every shard is asked for its first item") {
+			CHECK(a.requests.size() == 1);
+			CHECK(b.requests.size() == 1);
+			CHECK(c.requests.size() == 1);
+		}
+		WHEN("only some of them have answered") {
+			a.send(1);
+			b.send(2);
+			THEN("we can't know the minimum yet") {
+				CHECK(first->is_pending());
+			}
+			AND_WHEN("the last one answers") {
+				c.send(3);
+				THEN("the smallest item comes out, and only its shard is asked for more") {
+					REQUIRE(first->is_done());
+					CHECK(first->value() == 1);
+					CHECK(a.requests.size() == 1);
+					CHECK(b.requests.empty());
+					CHECK(c.requests.empty());
+				}
+				AND_WHEN("that shard answers") {
+					auto second = merged.next();
+					CHECK(second->is_pending());
+					a.send(5);
+					THEN("the next item comes out straight away") {
+						REQUIRE(second->is_done());
+						CHECK(second->value() == 2);
+						CHECK(b.requests.size() == 1);
+					}
+				}
+				AND_WHEN("that shard ends") {
+					a.finish();
+					auto second = merged.next();
+					THEN("the others carry on") {
+						REQUIRE(second->is_done());
+						CHECK(second->value() == 2);
+					}
+				}
+			}
+		}
+		WHEN("the first caller gives up before the shards answer") {
+			first->cancel();
+			a.send(1);
+			b.send(2);
+			c.send(3);
+			auto second = merged.next();
+			THEN("its item goes to the next caller instead") {
+				REQUIRE(second->is_done());
+				CHECK(second->value() == 1);
+			}
+			AND_WHEN("we keep reading") {
+				auto third = merged.next();
+				a.send(4);
+				THEN("the merge carries on") {
+					REQUIRE(third->is_done());
+					CHECK(third->value() == 2);
+				}
+			}
+		}
+		WHEN("a shard fails") {
+			a.send(1);
+			b.requests.front()->fail("shard down");
+			b.requests.pop_front();
+			c.send(3);
+			THEN("the merge fails with the same error") {
+				REQUIRE(first->is_failed());
+				CHECK(first->failure_reason() == "shard down");
+				CHECK(merged.next()->is_failed());
+			}
+		}
+	}
+	GIVEN("no sources at all") {
+		auto merged = merge_sorted<int>({ });
+		THEN("the stream is empty") {
+			CHECK(is_end_of_stream(*merged.next()));
+		}
+	}
+}
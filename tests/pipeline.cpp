@@ -0,0 +1,150 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/pipeline.h>
+#include <cps/future/thread_pool.h>
+
+#include <deque>
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+/** Collects everything a pipeline produces, until it ends */
+template<typename T>
+std::vector<T>
+drain(pipeline<int, T> &p)
+{
+	std::vector<T> out;
+	for(;;) {
+		auto f = p.pop();
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while(f->is_pending() && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		if(!f->is_done())
+			return out;
+		out.push_back(f->value());
+	}
+}
+
+}
+
+SCENARIO("staged pipelines", "[pipeline]") {
+	GIVEN("a pipeline of inline stages") {
+		auto p = make_pipeline<int>()
+			.stage<int>("double", [](int v) { return resolved_future(v * 2); })
+			.stage<std::string>("format", [](int v) { return resolved_future(std::to_string(v)); })
+			.build();
+		WHEN("we push some items and close it") {
+			for(int i = 0; i < 5; ++i)
+				CHECK(p->push(i)->is_done());
+			p->close();
+			THEN("the results come out in order") {
+				CHECK(drain(*p) == (std::vector<std::string> { "0", "2", "4", "6", "8" }));
+			}
+			AND_THEN("the stats add up") {
+				auto stats = p->stats();
+				REQUIRE(stats.size() == 2);
+				CHECK(stats[0].name == "double");
+				CHECK(stats[0].processed == 5);
+				CHECK(stats[1].processed == 5);
+				CHECK(stats[0].failed == 0);
+				CHECK(stats[0].in_flight == 0);
+			}
+		}
+	}
+	GIVEN("a stage that fails some items") {
+		auto p = make_pipeline<int>()
+			.stage<int>("odd only", [](int v) {
+				if(v % 2 == 0)
+					throw std::runtime_error("even");
+				return resolved_future(v);
+			})
+			.build();
+		for(int i = 0; i < 6; ++i)
+			p->push(i);
+		p->close();
+		THEN("failed items are counted and dropped") {
+			CHECK(drain(*p) == (std::vector<int> { 1, 3, 5 }));
+			CHECK(p->stats()[0].failed == 3);
+			CHECK(p->stats()[0].processed == 3);
+		}
+	}
+	GIVEN("a slow stage and small queues") {
+		/* The stage completes items only when we say so */
+		auto pending = std::make_shared<std::deque<std::shared_ptr<future<int>>>>();
+		auto p = make_pipeline<int>()
+			.stage<int>("fast", [](int v) { return resolved_future(v); }, { 1, 1, nullptr })
+			.stage<int>("slow", [pending](int) {
+				auto f = future<int>::create_shared();
+				pending->push_back(f);
+				return f;
+			}, { 1, 1, nullptr })
+			.build(1);
+		std::vector<std::shared_ptr<future<int>>> pushes;
+		for(int i = 0; i < 6; ++i)
+			pushes.push_back(p->push(i));
+		THEN("backpressure reaches the producer") {
+			/* slow has one item in hand and one queued, fast has one waiting
+			 * for room and one queued, and the last two are held at the door */
+			CHECK(pending->size() == 1);
+			auto stats = p->stats();
+			CHECK(stats[1].queue_depth == 1);
+			CHECK(stats[1].blocked_upstream == 1);
+			CHECK(stats[0].queue_depth == 1);
+			CHECK(stats[0].blocked_upstream == 2);
+			CHECK(pushes[3]->is_done());
+			CHECK(pushes[4]->is_pending());
+			/* The stage function holds the pending futures, which hold the stage */
+			pending->clear();
+		}
+		WHEN("the slow stage catches up") {
+			std::vector<int> out;
+			for(int i = 0; i < 6; ++i) {
+				REQUIRE(!pending->empty());
+				auto f = pending->front();
+				pending->pop_front();
+				f->done(i * 10);
+				out.push_back(p->pop()->value());
+			}
+			THEN("everything gets through") {
+				CHECK(out == (std::vector<int> { 0, 10, 20, 30, 40, 50 }));
+				for(auto &f : pushes)
+					CHECK(f->is_done());
+			}
+		}
+	}
+	GIVEN("stages running on a thread pool") {
+		thread_pool pool { 4 };
+		auto p = make_pipeline<int>()
+			.stage<int>("square", [](int v) { return resolved_future(v * v); }, { 8, 4, &pool })
+			.stage<int>("negate", [](int v) { return resolved_future(-v); }, { 8, 2, &pool })
+			.build();
+		std::thread producer([p] {
+			for(int i = 0; i < 1000; ++i) {
+				auto accepted = p->push(i);
+				while(accepted->is_pending())
+					std::this_thread::yield();
+			}
+			p->close();
+		});
+		auto out = drain(*p);
+		producer.join();
+		THEN("every item comes out, perhaps reordered") {
+			REQUIRE(out.size() == 1000);
+			std::sort(out.begin(), out.end());
+			CHECK(out.front() == -999 * 999);
+			CHECK(out.back() == 0);
+		}
+		AND_WHEN("we scale a stage") {
+			p->scale("negate", 6);
+			THEN("the stats show it") {
+				CHECK(p->stats()[1].concurrency == 6);
+				CHECK_THROWS(p->scale("missing", 1));
+			}
+		}
+	}
+}
@@ -0,0 +1,145 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/process.h>
+#include <cps/future/signal.h>
+
+#include <chrono>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+/** Runs the loop until the future resolves, giving up after a few seconds */
+template<typename T>
+bool
+wait_for(reactor &loop, const std::shared_ptr<future<T>> &f)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while(f->is_pending() && std::chrono::steady_clock::now() < deadline)
+		loop.run_once(100);
+	return !f->is_pending();
+}
+
+}
+
+SCENARIO("child processes", "[process]") {
+	GIVEN("a reactor") {
+		reactor loop;
+		WHEN("we run something that exits with a status") {
+			auto child = spawn(loop, { "sh", "-c", "exit 3" });
+			REQUIRE(wait_for(loop, child->exited()));
+			THEN("we get the exit code") {
+				CHECK(child->exited()->value().code == 3);
+				CHECK(child->exited()->value().signal == 0);
+				CHECK(!child->exited()->value().success());
+			}
+		}
+		WHEN("we capture a child's output") {
+			spawn_options opts;
+			opts.capture_stdout = true;
+			opts.capture_stderr = true;
+			auto child = spawn(loop, { "sh", "-c", "echo out; echo err >&2" }, opts);
+			auto out = child->stdout_pipe()->read_all();
+			auto err = child->stderr_pipe()->read_all();
+			REQUIRE(wait_for(loop, out));
+			REQUIRE(wait_for(loop, err));
+			REQUIRE(wait_for(loop, child->exited()));
+			THEN("both streams come through separately") {
+				CHECK(out->value().to_string() == "out\n");
+				CHECK(err->value().to_string() == "err\n");
+				CHECK(child->exited()->value().success());
+			}
+		}
+		WHEN("we feed a child through stdin") {
+			spawn_options opts;
+			opts.pipe_stdin = true;
+			opts.capture_stdout = true;
+			auto child = spawn(loop, { "cat" }, opts);
+			child->write_stdin(buffer::copy(std::string("hello ")));
+			child->write_stdin(buffer::copy(std::string("world")));
+			child->close_stdin();
+			auto out = child->stdout_pipe()->read_all();
+			REQUIRE(wait_for(loop, out));
+			THEN("it sees everything, then end of file") {
+				CHECK(out->value().to_string() == "hello world");
+				REQUIRE(wait_for(loop, child->exited()));
+				CHECK(child->exited()->value().success());
+			}
+		}
+		WHEN("we kill a child") {
+			auto child = spawn(loop, { "sleep", "30" });
+			child->kill(SIGKILL);
+			REQUIRE(wait_for(loop, child->exited()));
+			THEN("we see the signal") {
+				CHECK(child->exited()->value().signal == SIGKILL);
+				/* Too late to signal it now, and that's not an error */
+				child->kill();
+			}
+		}
+		WHEN("we start lots of children at once") {
+			std::vector<std::shared_ptr<child_process>> children;
+			for(int i = 0; i < 200; ++i)
+				children.push_back(spawn(loop, { "true" }));
+			bool all = true;
+			for(auto &c : children)
+				all = wait_for(loop, c->exited()) && all;
+			THEN("they're all reaped") {
+				CHECK(all);
+				for(auto &c : children)
+					CHECK(c->exited()->value().success());
+			}
+		}
+		WHEN("the program doesn't exist") {
+			THEN("spawn throws") {
+				CHECK_THROWS_AS(spawn(loop, { "/nonexistent/program" }), const std::system_error &);
+			}
+		}
+	}
+}
+
+SCENARIO("signals as futures", "[process]") {
+	GIVEN("a signal set for SIGUSR1 and SIGUSR2") {
+		reactor loop;
+		auto set = std::make_shared<signal_set>(loop, std::initializer_list<int> { SIGUSR1, SIGUSR2 });
+		WHEN("we wait for a signal") {
+			auto f = set->next();
+			CHECK(f->is_pending());
+			/* raise() targets this thread, where the signals are blocked */
+			::raise(SIGUSR2);
+			REQUIRE(wait_for(loop, f));
+			THEN("we get its number") {
+				CHECK(f->value() == SIGUSR2);
+			}
+		}
+		WHEN("signals arrive with nobody waiting") {
+			::raise(SIGUSR1);
+			loop.run_once(0);
+			auto f = set->next();
+			THEN("they're kept for the next caller") {
+				REQUIRE(f->is_done());
+				CHECK(f->value() == SIGUSR1);
+			}
+		}
+		WHEN("a waiter gives up before its signal arrives") {
+			auto gone = set->next();
+			gone->cancel();
+			::raise(SIGUSR1);
+			loop.run_once(0);
+			auto f = set->next();
+			THEN("the signal is kept for the next caller") {
+				REQUIRE(f->is_done());
+				CHECK(f->value() == SIGUSR1);
+			}
+		}
+		WHEN("the set goes away with someone waiting") {
+			auto f = set->next();
+			set.reset();
+			THEN("they're cancelled") {
+				CHECK(f->is_cancelled());
+			}
+		}
+	}
+}
@@ -0,0 +1,115 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/progress.h>
+
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("progress reporting", "[progress]") {
+	GIVEN("a progress future with no subscribers") {
+		auto f = progress_future<int>::create_shared();
+		f->set_total(10);
+		f->advance(3);
+		f->advance();
+		THEN("it keeps track of the figures") {
+			CHECK(f->current().completed == 4);
+			CHECK(f->current().total == 10);
+			CHECK(f->current().fraction() == Approx(0.4));
+			CHECK(f->notifications() == 0);
+		}
+		AND_THEN("it still works as a future") {
+			f->done(42);
+			CHECK(f->value() == 42);
+		}
+	}
+	GIVEN("a subscriber with a long interval") {
+		auto f = progress_future<int>::create_shared();
+		std::vector<uint64_t> seen;
+		f->on_progress([&seen](const progress &p) {
+			seen.push_back(p.completed);
+		}, std::chrono::hours(1));
+		WHEN("we report many times") {
+			for(int i = 1; i <= 1000; ++i)
+				f->report(i);
+			THEN("only the first update gets through") {
+				CHECK(seen == (std::vector<uint64_t> { 1 }));
+			}
+			AND_WHEN("the future resolves") {
+				f->done(0);
+				THEN("the subscriber gets the final figures") {
+					CHECK(seen == (std::vector<uint64_t> { 1, 1000 }));
+				}
+				AND_THEN("later reports are ignored") {
+					f->report(2000);
+					CHECK(seen.size() == 2);
+				}
+			}
+		}
+		WHEN("the future fails after a single report") {
+			f->report(5);
+			f->fail("broken");
+			THEN("there's nothing new to tell the subscriber") {
+				CHECK(seen == (std::vector<uint64_t> { 5 }));
+			}
+		}
+	}
+	GIVEN("a subscriber with no interval") {
+		auto f = progress_future<int>::create_shared();
+		std::vector<uint64_t> seen;
+		f->on_progress([&seen](const progress &p) {
+			seen.push_back(p.completed);
+		}, std::chrono::nanoseconds(0));
+		for(int i = 1; i <= 5; ++i)
+			f->report(i);
+		f->done(0);
+		THEN("every update gets through, once") {
+			CHECK(seen == (std::vector<uint64_t> { 1, 2, 3, 4, 5 }));
+			CHECK(f->notifications() == 5);
+		}
+	}
+	GIVEN("a subscriber which resolves the future itself") {
+		auto f = progress_future<int>::create_shared();
+		f->set_total(3);
+		auto raw = f.get();
+		f->on_progress([raw](const progress &p) {
+			if(p.completed == p.total)
+				raw->done(1);
+		}, std::chrono::nanoseconds(0));
+		for(int i = 0; i < 3; ++i)
+			f->advance();
+		THEN("that's allowed") {
+			CHECK(f->is_done());
+		}
+	}
+	GIVEN("several threads advancing the same future") {
+		auto f = progress_future<int>::create_shared();
+		std::atomic<int> calls { 0 };
+		std::atomic<int> overlapping { 0 };
+		std::atomic<bool> inside { false };
+		f->on_progress([&](const progress &) {
+			if(inside.exchange(true))
+				++overlapping;
+			++calls;
+			inside = false;
+		}, std::chrono::milliseconds(1));
+		std::vector<std::thread> threads;
+		for(int t = 0; t < 4; ++t) {
+			threads.emplace_back([f] {
+				for(int i = 0; i < 10000; ++i)
+					f->advance();
+			});
+		}
+		for(auto &t : threads)
+			t.join();
+		f->done(0);
+		THEN("no update is lost and calls never overlap") {
+			CHECK(f->current().completed == 40000);
+			CHECK(calls > 0);
+			CHECK(overlapping == 0);
+		}
+	}
+}
@@ -0,0 +1,121 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/rate_limiter.h>
+#include <cps/future/realtime.h>
+#include <cps/future/simulation.h>
+
+#include <atomic>
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("token buckets", "[rate_limiter]") {
+	GIVEN("a bucket of 10 tokens refilling at 10 per second") {
+		simulated_scheduler sim;
+		auto start = sim.now();
+		token_bucket bucket { sim, 10, 10 };
+		THEN("it starts full") {
+			CHECK(bucket.available() == Approx(10));
+			for(int i = 0; i < 10; ++i)
+				CHECK(bucket.try_acquire());
+			CHECK(!bucket.try_acquire());
+		}
+		WHEN("we take the whole burst at once") {
+			REQUIRE(bucket.acquire(10)->is_done());
+			THEN("one token comes back every 100ms") {
+				CHECK(!bucket.try_acquire());
+				sim.run_for(std::chrono::milliseconds(100));
+				CHECK(bucket.try_acquire());
+				CHECK(!bucket.try_acquire());
+			}
+			AND_WHEN("several callers wait") {
+				std::vector<std::pair<int, scheduler::duration>> released;
+				for(int i = 0; i < 5; ++i) {
+					bucket.acquire(2)->on_done([&, i](int) {
+						released.emplace_back(i, sim.now() - start);
+					});
+				}
+				THEN("they share one timer") {
+					CHECK(bucket.waiting() == 5);
+					CHECK(bucket.timers() == 1);
+					CHECK(sim.pending() == 1);
+				}
+				sim.run();
+				THEN("they're served in order, as the tokens refill") {
+					REQUIRE(released.size() == 5);
+					for(int i = 0; i < 5; ++i) {
+						CHECK(released[i].first == i);
+						CHECK(released[i].second == std::chrono::milliseconds(200 * (i + 1)));
+					}
+					CHECK(bucket.timers() == 5);
+					CHECK(bucket.waiting() == 0);
+				}
+			}
+		}
+		WHEN("we ask for more than the bucket can hold") {
+			auto f = bucket.acquire(11);
+			THEN("it fails straight away") {
+				CHECK(f->is_failed());
+				CHECK(!bucket.try_acquire(11));
+				CHECK(bucket.available() == Approx(10));
+			}
+		}
+	}
+	GIVEN("a bad configuration") {
+		simulated_scheduler sim;
+		THEN("the bucket refuses it") {
+			CHECK_THROWS_AS(token_bucket(sim, 0, 10), const std::invalid_argument &);
+			CHECK_THROWS_AS(token_bucket(sim, 10, 0.5), const std::invalid_argument &);
+		}
+	}
+}
+
+SCENARIO("real time scheduling", "[rate_limiter]") {
+	GIVEN("a realtime scheduler") {
+		realtime_scheduler sched;
+		WHEN("we set a timer") {
+			auto start = sched.now();
+			auto f = sched.after(std::chrono::milliseconds(20));
+			while(f->is_pending())
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			THEN("it fires no earlier than asked") {
+				CHECK(f->is_done());
+				CHECK(sched.now() - start >= std::chrono::milliseconds(20));
+			}
+		}
+		WHEN("we post code") {
+			std::atomic<bool> ran { false };
+			sched.post([&ran] { ran = true; });
+			while(!ran)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			THEN("it runs on the scheduler's thread") {
+				CHECK(ran);
+			}
+		}
+		WHEN("a bucket waits on it") {
+			token_bucket bucket { sched, 1000, 1 };
+			auto start = sched.now();
+			std::shared_ptr<future<int>> last;
+			for(int i = 0; i < 20; ++i)
+				last = bucket.acquire();
+			while(last->is_pending())
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			THEN("the tokens are spread out at the given rate") {
+				CHECK(sched.now() - start >= std::chrono::milliseconds(19));
+			}
+		}
+	}
+	GIVEN("a timer still pending when the scheduler goes away") {
+		std::shared_ptr<future<int>> f;
+		{
+			realtime_scheduler sched;
+			f = sched.after(std::chrono::hours(1));
+		}
+		THEN("it is cancelled") {
+			CHECK(f->is_cancelled());
+		}
+	}
+}
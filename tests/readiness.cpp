@@ -0,0 +1,139 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/readiness.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("readiness sets", "[readiness]") {
+	GIVEN("a set with a thousand entries") {
+		readiness_set set { 1000 };
+		std::vector<std::shared_ptr<future<int>>> futures;
+		for(size_t i = 0; i < set.capacity(); ++i) {
+			futures.push_back(future<int>::create_shared());
+			set.watch(i, futures.back());
+		}
+		WHEN("nothing has resolved") {
+			std::vector<size_t> ready;
+			THEN("there is nothing to take, and waiting waits") {
+				CHECK(set.take(ready) == 0);
+				CHECK(set.wait()->is_pending());
+			}
+		}
+		WHEN("a few futures resolve, in any way") {
+			auto w = set.wait();
+			futures[999]->done(1);
+			futures[3]->fail("no");
+			futures[64]->cancel();
+			futures[500]->done(2);
+			THEN("one notification covers all of them") {
+				CHECK(w->is_done());
+				CHECK(set.notifications() == 1);
+				CHECK(set.is_set(500));
+				CHECK(!set.is_set(501));
+			}
+			THEN("take returns them in key order and clears them") {
+				std::vector<size_t> ready;
+				CHECK(set.take(ready) == 4);
+				CHECK(ready == (std::vector<size_t> { 3, 64, 500, 999 }));
+				CHECK(set.take(ready) == 0);
+				CHECK(!set.is_set(500));
+			}
+			AND_WHEN("something else resolves after the take") {
+				std::vector<size_t> ready;
+				set.take(ready);
+				auto again = set.wait();
+				CHECK(again->is_pending());
+				futures[10]->done(3);
+				THEN("that notifies again") {
+					CHECK(again->is_done());
+					CHECK(set.notifications() == 2);
+				}
+			}
+		}
+		WHEN("one of two waiters gives up before anything resolves") {
+			auto gone = set.wait();
+			auto w = set.wait();
+			gone->cancel();
+			REQUIRE_NOTHROW(futures[1]->done(1));
+			THEN("the other is still woken") {
+				CHECK(gone->is_cancelled());
+				CHECK(w->is_done());
+			}
+		}
+		WHEN("a key is watched again after being taken") {
+			std::vector<size_t> ready;
+			futures[7]->done(1);
+			set.take(ready);
+			auto next = future<int>::create_shared();
+			set.watch(7, next);
+			next->done(2);
+			THEN("it is reported again") {
+				ready.clear();
+				CHECK(set.take(ready) == 1);
+				CHECK(ready.front() == 7);
+			}
+		}
+		WHEN("a key is out of range") {
+			THEN("watching or marking it throws") {
+				CHECK_THROWS_AS(set.mark(1000), const std::out_of_range &);
+				CHECK_THROWS_AS(set.watch(5000, futures[0]), const std::out_of_range &);
+			}
+		}
+	}
+	GIVEN("a bitmap with bits scattered through it") {
+		const size_t words = 37;
+		std::unique_ptr<std::atomic<uint64_t>[]> a(new std::atomic<uint64_t>[words]);
+		std::unique_ptr<std::atomic<uint64_t>[]> b(new std::atomic<uint64_t>[words]);
+		for(size_t i = 0; i < words; ++i) {
+			uint64_t v = i % 5 == 0 ? 0x8000000000000001ull * (i + 1) : 0;
+			a[i] = v;
+			b[i] = v;
+		}
+		THEN("the vector scan finds what the scalar one does") {
+			std::vector<size_t> scalar, vector;
+			detail::scan_scalar(a.get(), words, scalar);
+			if(readiness_set::vectorized()) {
+#if CPS_READINESS_AVX2
+				detail::scan_avx2(b.get(), words, vector);
+#endif
+				CHECK(vector == scalar);
+			}
+			CHECK(!scalar.empty());
+			for(size_t i = 0; i < words; ++i)
+				CHECK(a[i] == 0);
+		}
+	}
+	GIVEN("futures resolved from another thread") {
+		const size_t count = 20000;
+		readiness_set set { count };
+		std::vector<std::shared_ptr<future<int>>> futures;
+		for(size_t i = 0; i < count; ++i) {
+			futures.push_back(future<int>::create_shared());
+			set.watch(i, futures.back());
+		}
+		std::thread resolver([&futures] {
+			for(auto &f : futures)
+				f->done(1);
+		});
+		std::vector<size_t> ready;
+		while(ready.size() < count) {
+			auto w = set.wait();
+			while(w->is_pending())
+				std::this_thread::yield();
+			set.take(ready);
+		}
+		resolver.join();
+		THEN("every key is taken exactly once") {
+			CHECK(ready.size() == count);
+			std::sort(ready.begin(), ready.end());
+			CHECK(std::unique(ready.begin(), ready.end()) == ready.end());
+			CHECK(set.notifications() <= count);
+		}
+	}
+}
@@ -0,0 +1,189 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/reclaim.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+/** Records the thread it was destroyed on */
+struct tracker {
+	explicit tracker(std::thread::id *where):where(where) { }
+	~tracker() { *where = std::this_thread::get_id(); }
+
+	std::thread::id *where;
+};
+
+/** A value type which opts in to background destruction */
+struct heavy {
+	heavy():where(nullptr) { }
+	explicit heavy(std::thread::id *where):where(where) { }
+	heavy(heavy &&src):where(src.where) { src.where = nullptr; }
+	heavy(const heavy &src):where(src.where) { }
+	heavy &operator=(heavy &&src) { where = src.where; src.where = nullptr; return *this; }
+	heavy &operator=(const heavy &src) { where = src.where; return *this; }
+	~heavy() {
+		if(where)
+			*where = std::this_thread::get_id();
+	}
+
+	std::thread::id *where;
+};
+
+/** Turns background destruction on for the lifetime of a test */
+struct active_reclaimer {
+	explicit active_reclaimer(size_t batch = 64):background(batch) { reclaim::destroy_on(&background); }
+	~active_reclaimer() { reclaim::destroy_on(nullptr); }
+
+	reclaimer background;
+};
+
+}
+
+namespace cps {
+
+template<>
+struct reclaim_in_background<heavy> : std::true_type { };
+
+}
+
+SCENARIO("reclaiming callbacks and values in the background", "[reclaim]") {
+	GIVEN("no reclaimer") {
+		REQUIRE(reclaim::active().load() == nullptr);
+		std::thread::id where;
+		{
+			auto f = future<int>::create_shared();
+			auto t = make_shared<tracker>(&where);
+			f->on_done(reclaim::later([t](int) { }));
+			t.reset();
+			f->done(1);
+		}
+		THEN("even callbacks marked for later are destroyed on the resolving thread") {
+			CHECK(where == std::this_thread::get_id());
+		}
+		THEN("retire leaves things where they are") {
+			auto v = make_shared<int>(1);
+			CHECK(!reclaim::retire(std::move(v)));
+		}
+	}
+	GIVEN("an active reclaimer") {
+		active_reclaimer r;
+		WHEN("a future with a callback marked for later resolves") {
+			std::thread::id where;
+			bool called = false;
+			auto f = future<int>::create_shared();
+			{
+				auto t = make_shared<tracker>(&where);
+				f->on_done(reclaim::later([t, &called](int) { called = true; }));
+			}
+			f->done(1);
+			r.background.flush();
+			THEN("the callback runs here, but is destroyed on the reclaimer's thread") {
+				CHECK(called);
+				CHECK(where == r.background.thread_id());
+				CHECK(r.background.retired() == 1);
+				CHECK(r.background.reclaimed() == 1);
+			}
+		}
+		WHEN("a future with a callback which isn't marked resolves") {
+			std::thread::id where;
+			auto f = future<int>::create_shared();
+			{
+				auto t = make_shared<tracker>(&where);
+				f->on_ready([t](future<int> &) { });
+			}
+			f->done(1);
+			THEN("the callback is destroyed on the resolving thread") {
+				CHECK(where == std::this_thread::get_id());
+				CHECK(r.background.retired() == 0);
+			}
+		}
+		WHEN("a future resolves with no callbacks") {
+			future<int>::create_shared()->done(1);
+			THEN("nothing is handed over") {
+				CHECK(r.background.retired() == 0);
+			}
+		}
+		WHEN("a future holding a value which opts in is destroyed") {
+			std::thread::id where;
+			{
+				auto f = future<heavy>::create_shared();
+				f->done(heavy { &where });
+			}
+			r.background.flush();
+			THEN("the value is destroyed on the reclaimer's thread") {
+				CHECK(where == r.background.thread_id());
+			}
+		}
+		WHEN("a pending future holding such a value is destroyed") {
+			future<heavy>::create_shared();
+			THEN("there's no value to hand over") {
+				CHECK(r.background.retired() == 0);
+			}
+		}
+		WHEN("a value which doesn't opt in is destroyed") {
+			{
+				auto f = future<int>::create_shared();
+				f->done(1);
+			}
+			THEN("it stays where it is") {
+				CHECK(r.background.retired() == 0);
+			}
+		}
+		WHEN("something is retired directly") {
+			std::thread::id where;
+			auto t = make_shared<tracker>(&where);
+			CHECK(reclaim::retire(std::move(t)));
+			CHECK(!t);
+			r.background.flush();
+			THEN("it is destroyed on the reclaimer's thread") {
+				CHECK(where == r.background.thread_id());
+			}
+		}
+	}
+	GIVEN("a reclaimer with a batch size of 100") {
+		active_reclaimer r { 100 };
+		WHEN("many futures resolve in a burst") {
+			std::atomic<size_t> destroyed { 0 };
+			struct counted {
+				explicit counted(std::atomic<size_t> &n):n(n) { }
+				~counted() { ++n; }
+				std::atomic<size_t> &n;
+			};
+			for(int i = 0; i < 1000; ++i) {
+				auto f = future<int>::create_shared();
+				auto c = make_shared<counted>(destroyed);
+				f->on_done(reclaim::later([c](int) { }));
+				c.reset();
+				f->done(i);
+			}
+			r.background.flush();
+			THEN("they are destroyed in far fewer batches") {
+				CHECK(destroyed == 1000);
+				CHECK(r.background.reclaimed() == 1000);
+				CHECK(r.background.batches() <= 100);
+			}
+		}
+	}
+	GIVEN("a reclaimer destroyed with things still queued") {
+		std::thread::id where;
+		{
+			reclaimer background { 1000, std::chrono::milliseconds(10000) };
+			reclaim::destroy_on(&background);
+			auto t = make_shared<tracker>(&where);
+			reclaim::retire(std::move(t));
+		}
+		THEN("they are destroyed too, and it stops being the active one") {
+			CHECK(where != std::thread::id { });
+			CHECK(reclaim::active().load() == nullptr);
+		}
+	}
+}
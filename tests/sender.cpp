@@ -0,0 +1,268 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/sender.h>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace cps::execution;
+using namespace std;
+
+namespace {
+
+/** Records how it was completed */
+struct test_receiver {
+	struct result {
+		int completions = 0;
+		int value = 0;
+		std::string error;
+		bool stopped = false;
+	};
+
+	result *out;
+	stop_token token;
+
+	void set_value(int v) { ++out->completions; out->value = v; }
+	void set_error(std::exception_ptr ex) {
+		++out->completions;
+		try {
+			std::rethrow_exception(ex);
+		} catch(const std::exception &e) {
+			out->error = e.what();
+		}
+	}
+	void set_stopped() { ++out->completions; out->stopped = true; }
+	stop_token get_stop_token() const { return token; }
+};
+
+/** No stop token at all, so it gets one that never stops */
+struct plain_receiver {
+	int *value;
+
+	void set_value(int v) { *value = v; }
+	void set_error(std::exception_ptr) { }
+	void set_stopped() { }
+};
+
+/**
+ * A sender we complete by hand, which also reports whether it has been
+ * asked to stop.
+ */
+struct manual_sender {
+	using value_type = int;
+
+	struct control {
+		std::function<void(int)> value;
+		std::function<void()> error;
+		std::function<void()> stopped;
+		bool stop_requested = false;
+	};
+
+	template<typename R>
+	struct operation {
+		control *ctl;
+		R receiver;
+		std::unique_ptr<stop_callback<std::function<void()>>> on_stop;
+
+		void start() {
+			auto c = ctl;
+			auto r = &receiver;
+			ctl->value = [r](int v) { r->set_value(v); };
+			ctl->error = [r] { r->set_error(std::make_exception_ptr(std::runtime_error("sender failed"))); };
+			ctl->stopped = [r] { r->set_stopped(); };
+			on_stop.reset(new stop_callback<std::function<void()>>(
+				execution::get_stop_token(receiver),
+				[c] { c->stop_requested = true; }
+			));
+		}
+	};
+
+	control *ctl;
+
+	template<typename R>
+	operation<typename std::decay<R>::type>
+	connect(R &&receiver) const {
+		return operation<typename std::decay<R>::type> { ctl, std::forward<R>(receiver), nullptr };
+	}
+};
+
+}
+
+SCENARIO("stop tokens", "[sender]") {
+	GIVEN("a stop source") {
+		stop_source source;
+		auto token = source.get_token();
+		int calls = 0;
+		THEN("the token can be stopped but hasn't been") {
+			CHECK(token.stop_possible());
+			CHECK(!token.stop_requested());
+		}
+		WHEN("we register a callback and request a stop") {
+			stop_callback<std::function<void()>> cb { token, [&calls] { ++calls; } };
+			CHECK(calls == 0);
+			CHECK(source.request_stop());
+			THEN("the callback ran once") {
+				CHECK(calls == 1);
+				CHECK(token.stop_requested());
+				CHECK(!source.request_stop());
+				CHECK(calls == 1);
+			}
+		}
+		WHEN("a callback is destroyed before the stop") {
+			{
+				stop_callback<std::function<void()>> cb { token, [&calls] { ++calls; } };
+			}
+			source.request_stop();
+			THEN("it does not run") {
+				CHECK(calls == 0);
+			}
+		}
+		WHEN("we register a callback after the stop") {
+			source.request_stop();
+			stop_callback<std::function<void()>> cb { token, [&calls] { ++calls; } };
+			THEN("it runs straight away") {
+				CHECK(calls == 1);
+			}
+		}
+	}
+	GIVEN("a default token") {
+		stop_token token;
+		THEN("it can never be stopped") {
+			CHECK(!token.stop_possible());
+			CHECK(!token.stop_requested());
+		}
+	}
+}
+
+SCENARIO("futures as senders", "[sender]") {
+	GIVEN("a pending future connected to a receiver") {
+		auto f = future<int>::create_shared();
+		stop_source source;
+		test_receiver::result result;
+		auto op = as_sender(f).connect(test_receiver { &result, source.get_token() });
+		op.start();
+		THEN("nothing has completed yet") {
+			CHECK(result.completions == 0);
+		}
+		WHEN("the future resolves") {
+			f->done(42);
+			THEN("we get set_value") {
+				CHECK(result.completions == 1);
+				CHECK(result.value == 42);
+			}
+			AND_WHEN("a stop is requested afterwards") {
+				source.request_stop();
+				THEN("nothing else happens") {
+					CHECK(result.completions == 1);
+					CHECK(f->is_done());
+				}
+			}
+		}
+		WHEN("the future fails") {
+			f->fail("it broke");
+			THEN("we get set_error with the original exception") {
+				CHECK(result.completions == 1);
+				CHECK(result.error == "it broke");
+			}
+		}
+		WHEN("the future is cancelled") {
+			f->cancel();
+			THEN("we get set_stopped") {
+				CHECK(result.completions == 1);
+				CHECK(result.stopped);
+			}
+		}
+		WHEN("a stop is requested") {
+			source.request_stop();
+			THEN("the future is cancelled and we get set_stopped") {
+				CHECK(f->is_cancelled());
+				CHECK(result.completions == 1);
+				CHECK(result.stopped);
+			}
+		}
+	}
+	GIVEN("a stop requested before we start") {
+		auto f = future<int>::create_shared();
+		stop_source source;
+		source.request_stop();
+		test_receiver::result result;
+		auto op = as_sender(f).connect(test_receiver { &result, source.get_token() });
+		op.start();
+		THEN("the future is cancelled straight away") {
+			CHECK(f->is_cancelled());
+			CHECK(result.stopped);
+		}
+	}
+	GIVEN("a future that is already done, and a receiver without a stop token") {
+		int value = 0;
+		auto op = as_sender(resolved_future(7)).connect(plain_receiver { &value });
+		op.start();
+		THEN("we complete during start") {
+			CHECK(value == 7);
+		}
+	}
+}
+
+SCENARIO("senders as futures", "[sender]") {
+	GIVEN("a sender that completes immediately") {
+		auto f = as_future(just(5));
+		THEN("the future is already done") {
+			REQUIRE(f->is_done());
+			CHECK(f->value() == 5);
+		}
+	}
+	GIVEN("a sender we complete by hand") {
+		manual_sender::control ctl;
+		auto f = as_future(manual_sender { &ctl }, "manual");
+		THEN("the future is pending") {
+			CHECK(f->is_pending());
+			CHECK(f->label() == "manual");
+			/* The operation lives until the sender completes */
+			ctl.stopped();
+		}
+		WHEN("the sender completes with a value") {
+			ctl.value(12);
+			THEN("the future is done") {
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 12);
+			}
+		}
+		WHEN("the sender completes with an error") {
+			ctl.error();
+			THEN("the future fails with it") {
+				REQUIRE(f->is_failed());
+				CHECK(f->failure_reason() == "sender failed");
+			}
+		}
+		WHEN("the sender stops") {
+			ctl.stopped();
+			THEN("the future is cancelled") {
+				CHECK(f->is_cancelled());
+			}
+		}
+		WHEN("we cancel the future") {
+			f->cancel();
+			THEN("the sender sees a stop request") {
+				CHECK(ctl.stop_requested);
+			}
+		}
+	}
+	GIVEN("a future round-tripped through a sender") {
+		auto original = future<int>::create_shared();
+		auto f = as_future(as_sender(original));
+		WHEN("the original resolves") {
+			original->done(3);
+			THEN("so does the copy") {
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 3);
+			}
+		}
+		WHEN("the copy is cancelled") {
+			f->cancel();
+			THEN("the original is cancelled too") {
+				CHECK(original->is_cancelled());
+			}
+		}
+	}
+}
+
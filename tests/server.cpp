@@ -0,0 +1,267 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/server.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+/** A blocking client socket, which gives up on reads after a few seconds */
+int
+connect_loopback(uint16_t port)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct timeval timeout { 5, 0 };
+	::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	struct sockaddr_in addr { };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	REQUIRE(::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0);
+	return fd;
+}
+
+/** Reads until the peer closes, or the read times out */
+string
+read_all(int fd)
+{
+	string out;
+	char buf[256];
+	for(;;) {
+		ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return out;
+		out.append(buf, static_cast<size_t>(n));
+	}
+}
+
+/** Echoes one chunk back, then is finished with the connection */
+shared_ptr<future<int>>
+echo_once(const accepted_connection &c)
+{
+	auto finished = future<int>::create_shared();
+	c.io.recv(c.fd)->on_ready([c, finished](future<buffer> &got) {
+		if(!got.is_done()) {
+			finished->done(0);
+			return;
+		}
+		c.io.send(c.fd, got.value())->on_ready([finished](future<size_t> &) {
+			finished->done(0);
+		});
+	});
+	return finished;
+}
+
+server_options
+loopback(size_t shards)
+{
+	server_options opts;
+	opts.address = "127.0.0.1";
+	opts.shards = shards;
+	return opts;
+}
+
+/** Waits for a counter another thread updates */
+bool
+eventually(std::function<bool()> done)
+{
+	for(int i = 0; i < 5000 && !done(); ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return done();
+}
+
+}
+
+SCENARIO("sharded server", "[server]") {
+	GIVEN("a server with two shards echoing one message per connection") {
+		sharded_server server { loopback(2), echo_once };
+		REQUIRE(server.port() != 0);
+		REQUIRE(server.shards() == 2);
+		WHEN("a client connects and sends something") {
+			int fd = connect_loopback(server.port());
+			REQUIRE(::send(fd, "ping", 4, 0) == 4);
+			THEN("it is echoed, and the server closes the connection") {
+				CHECK(read_all(fd) == "ping");
+				CHECK(eventually([&] { return server.active(0) + server.active(1) == 0; }));
+				CHECK(server.accepted(0) + server.accepted(1) == 1);
+			}
+			::close(fd);
+		}
+		WHEN("many clients connect") {
+			const size_t count = 64;
+			size_t echoed = 0;
+			for(size_t i = 0; i < count; ++i) {
+				int fd = connect_loopback(server.port());
+				REQUIRE(::send(fd, "x", 1, 0) == 1);
+				if(read_all(fd) == "x")
+					++echoed;
+				::close(fd);
+			}
+			THEN("every one is served, and both shards take a share") {
+				CHECK(echoed == count);
+				CHECK(server.accepted(0) + server.accepted(1) == count);
+				CHECK(server.accepted(0) > 0);
+				CHECK(server.accepted(1) > 0);
+			}
+		}
+	}
+	GIVEN("a server which pins its shards") {
+		sharded_server server { loopback(3), echo_once };
+		THEN("each shard has a CPU we may run on") {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			REQUIRE(::sched_getaffinity(0, sizeof(set), &set) == 0);
+			for(size_t i = 0; i < server.shards(); ++i) {
+				REQUIRE(server.cpu(i) >= 0);
+				CHECK(CPU_ISSET(server.cpu(i), &set));
+			}
+		}
+	}
+	GIVEN("a server which doesn't pin") {
+		auto opts = loopback(1);
+		opts.pin = false;
+		sharded_server server { opts, echo_once };
+		THEN("no shard has a CPU") {
+			CHECK(server.cpu(0) == -1);
+		}
+	}
+	GIVEN("a handler which throws") {
+		std::atomic<size_t> calls { 0 };
+		sharded_server server { loopback(1), [&](const accepted_connection &) -> shared_ptr<future<int>> {
+			++calls;
+			throw runtime_error("no");
+		} };
+		WHEN("a client connects") {
+			int fd = connect_loopback(server.port());
+			THEN("the connection is closed") {
+				CHECK(read_all(fd).empty());
+				CHECK(calls == 1);
+				CHECK(eventually([&] { return server.active(0) == 0; }));
+			}
+			::close(fd);
+		}
+	}
+	GIVEN("a handler which never finishes") {
+		auto opts = loopback(2);
+		shared_ptr<sharded_server> server = make_shared<sharded_server>(opts, [](const accepted_connection &) {
+			return future<int>::create_shared();
+		});
+		int a = connect_loopback(server->port());
+		int b = connect_loopback(server->port());
+		REQUIRE(eventually([&] { return server->active(0) + server->active(1) == 2; }));
+		WHEN("the server stops") {
+			server->stop();
+			THEN("open connections are closed, and nothing is listening") {
+				CHECK(read_all(a).empty());
+				CHECK(read_all(b).empty());
+				CHECK(server->active(0) + server->active(1) == 0);
+				int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+				struct sockaddr_in addr { };
+				addr.sin_family = AF_INET;
+				addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+				addr.sin_port = htons(server->port());
+				CHECK(::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0);
+				::close(fd);
+			}
+		}
+		::close(a);
+		::close(b);
+	}
+	GIVEN("a handler which finishes on another thread") {
+		std::mutex mutex;
+		shared_ptr<future<int>> held;
+		auto handler = [&](const accepted_connection &) {
+			auto f = future<int>::create_shared();
+			std::lock_guard<std::mutex> guard { mutex };
+			held = f;
+			return f;
+		};
+		auto taken = [&] {
+			std::lock_guard<std::mutex> guard { mutex };
+			return held;
+		};
+		WHEN("it finishes while the server is running") {
+			sharded_server server { loopback(1), handler };
+			int fd = connect_loopback(server.port());
+			REQUIRE(eventually([&] { return taken() != nullptr; }));
+			std::thread([&] { taken()->done(0); }).join();
+			THEN("the connection is closed on the shard's thread") {
+				CHECK(read_all(fd).empty());
+				CHECK(eventually([&] { return server.active(0) == 0; }));
+			}
+			::close(fd);
+		}
+		WHEN("it finishes after the server has gone") {
+			{
+				sharded_server server { loopback(1), handler };
+				int fd = connect_loopback(server.port());
+				REQUIRE(eventually([&] { return taken() != nullptr; }));
+				::close(fd);
+			}
+			std::thread([&] { taken()->done(0); }).join();
+			THEN("nothing is left to touch") {
+				CHECK(taken()->is_done());
+			}
+		}
+	}
+	GIVEN("a server which runs out of fds") {
+		sharded_server server { loopback(1), echo_once };
+		int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		struct timeval timeout { 5, 0 };
+		::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		struct sockaddr_in addr { };
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(server.port());
+		struct rlimit before;
+		REQUIRE(::getrlimit(RLIMIT_NOFILE, &before) == 0);
+		WHEN("a client connects while it can't accept") {
+			/* Nothing in the process can open another fd */
+			int spare = ::dup(0);
+			::close(spare);
+			struct rlimit none = before;
+			none.rlim_cur = static_cast<rlim_t>(spare);
+			REQUIRE(::setrlimit(RLIMIT_NOFILE, &none) == 0);
+			REQUIRE(::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0);
+			REQUIRE(::send(fd, "ping", 4, 0) == 4);
+			std::clock_t cpu = std::clock();
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			cpu = std::clock() - cpu;
+			::setrlimit(RLIMIT_NOFILE, &before);
+			THEN("it waits rather than spinning, and serves the client once it can") {
+				CHECK(cpu < CLOCKS_PER_SEC / 20);
+				CHECK(read_all(fd) == "ping");
+			}
+		}
+		::setrlimit(RLIMIT_NOFILE, &before);
+		::close(fd);
+	}
+	GIVEN("an address that isn't one") {
+		auto opts = loopback(1);
+		opts.address = "nowhere";
+		THEN("the server throws") {
+			CHECK_THROWS_AS(sharded_server(opts, echo_once), const std::system_error &);
+		}
+	}
+}
@@ -0,0 +1,90 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/simulation.h>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("virtual time scheduling", "[simulation]") {
+	GIVEN("a simulated scheduler") {
+		simulated_scheduler sim;
+		auto start = sim.now();
+		WHEN("we set up some timers") {
+			std::vector<int> order;
+			sim.after(std::chrono::hours(3))->on_done([&order](int) { order.push_back(3); });
+			sim.after(std::chrono::hours(1))->on_done([&order](int) { order.push_back(1); });
+			sim.after(std::chrono::hours(2))->on_done([&order](int) { order.push_back(2); });
+			auto cancelled = sim.after(std::chrono::minutes(30));
+			cancelled->cancel();
+			THEN("nothing fires until we run") {
+				CHECK(order.empty());
+				CHECK(sim.pending() == 4);
+			}
+			AND_WHEN("we run part of the way") {
+				sim.run_for(std::chrono::minutes(90));
+				THEN("only the first timer has fired") {
+					REQUIRE(order.size() == 1);
+					CHECK(sim.now() - start == std::chrono::minutes(90));
+				}
+			}
+			AND_WHEN("we run to completion") {
+				sim.run();
+				THEN("timers fire in time order") {
+					CHECK(order == (std::vector<int> { 1, 2, 3 }));
+				}
+				AND_THEN("the clock has moved to the last event") {
+					CHECK(sim.now() - start == std::chrono::hours(3));
+				}
+			}
+		}
+		WHEN("we post several items") {
+			std::vector<int> order;
+			for(int i = 0; i < 5; ++i)
+				sim.post([&order, i] { order.push_back(i); });
+			sim.run();
+			THEN("they run in FIFO order without moving the clock") {
+				CHECK(order == (std::vector<int> { 0, 1, 2, 3, 4 }));
+				CHECK(sim.now() == start);
+			}
+		}
+	}
+}
+
+SCENARIO("latency injection", "[simulation]") {
+	GIVEN("two simulations with the same seed") {
+		auto run = [](uint64_t seed) {
+			simulated_scheduler sim { seed };
+			latency_injector backend {
+				sim,
+				latency_injector::from_distribution(std::exponential_distribution<double>(1.0 / 1000.0)),
+				0.1
+			};
+			std::vector<std::pair<int, std::chrono::nanoseconds>> results;
+			for(int i = 0; i < 100; ++i) {
+				auto issued = sim.now();
+				backend.respond(i)->on_ready([&results, &sim, issued, i](future<int> &f) {
+					results.emplace_back(f.is_done() ? i : -1, sim.now() - issued);
+				});
+			}
+			sim.run();
+			return results;
+		};
+		WHEN("we run both") {
+			auto a = run(42);
+			auto b = run(42);
+			auto c = run(43);
+			THEN("the results are identical") {
+				REQUIRE(a.size() == 100);
+				CHECK(a == b);
+			}
+			AND_THEN("a different seed gives different results") {
+				CHECK(a != c);
+			}
+			AND_THEN("some of the requests failed") {
+				CHECK(std::count_if(a.begin(), a.end(), [](const std::pair<int, std::chrono::nanoseconds> &it) { return it.first < 0; }) > 0);
+			}
+		}
+	}
+}
@@ -0,0 +1,211 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/socket_io.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <functional>
+#include <string>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+/** A nonblocking listener on a free loopback port */
+int
+listen_loopback(uint16_t &port)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	struct sockaddr_in addr { };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	REQUIRE(::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0);
+	REQUIRE(::listen(fd, 16) == 0);
+	socklen_t len = sizeof(addr);
+	::getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &len);
+	port = ntohs(addr.sin_port);
+	return fd;
+}
+
+int
+connect_loopback(uint16_t port)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in addr { };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	REQUIRE(::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0);
+	::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+/** Runs the loop until the condition holds, or we give up */
+bool
+run_until(reactor &loop, std::function<bool()> done)
+{
+	for(int i = 0; i < 20000 && !done(); ++i)
+		loop.run_once(10);
+	return done();
+}
+
+/** The same checks against each backend */
+void
+exercise(reactor &loop, socket_io &io)
+{
+	uint16_t port;
+	int listener = listen_loopback(port);
+	auto incoming = io.accept(listener);
+	int client = connect_loopback(port);
+	REQUIRE(run_until(loop, [&] { return !incoming->is_pending(); }));
+	REQUIRE(incoming->is_done());
+	int server = incoming->value();
+
+	WHEN("data is sent one way and echoed back") {
+		auto sent = io.send(client, buffer::copy("hello"));
+		auto got = io.recv(server);
+		REQUIRE(run_until(loop, [&] { return !got->is_pending(); }));
+		CHECK(sent->value() == 5);
+		CHECK(got->value().to_string() == "hello");
+		auto echoed = io.send(server, got->value());
+		auto back = io.recv(client);
+		REQUIRE(run_until(loop, [&] { return !back->is_pending(); }));
+		THEN("both ends see it") {
+			CHECK(echoed->value() == 5);
+			CHECK(back->value().to_string() == "hello");
+		}
+	}
+	WHEN("more is sent than the socket buffers hold") {
+		std::string big(4 << 20, 'x');
+		for(size_t i = 0; i < big.size(); i += 4096)
+			big[i] = static_cast<char>('a' + (i / 4096) % 26);
+		auto first = io.send(client, buffer::copy(big.substr(0, big.size() / 2)));
+		auto second = io.send(client, buffer::copy(big.substr(big.size() / 2)));
+		std::string received;
+		std::shared_ptr<future<buffer>> next;
+		REQUIRE(run_until(loop, [&] {
+			while(received.size() < big.size() && (!next || next->is_done())) {
+				if(next)
+					received += next->value().to_string();
+				next = received.size() < big.size() ? io.recv(server) : nullptr;
+			}
+			return received.size() == big.size();
+		}));
+		THEN("it all arrives, in order") {
+			CHECK(first->is_done());
+			CHECK(second->is_done());
+			CHECK(received == big);
+		}
+	}
+	WHEN("the peer shuts down its side") {
+		auto sent = io.send(client, buffer::copy("last"));
+		REQUIRE(run_until(loop, [&] { return !sent->is_pending(); }));
+		::shutdown(client, SHUT_WR);
+		auto a = io.recv(server);
+		REQUIRE(run_until(loop, [&] { return !a->is_pending(); }));
+		auto b = io.recv(server);
+		REQUIRE(run_until(loop, [&] { return !b->is_pending(); }));
+		THEN("we get what was sent, then end of stream") {
+			CHECK(a->value().to_string() == "last");
+			CHECK(is_end_of_stream(*b));
+		}
+	}
+	WHEN("a socket is closed with a recv outstanding") {
+		auto waiting = io.recv(server);
+		loop.run_once(0);
+		io.close(server);
+		server = -1;
+		THEN("the recv is cancelled") {
+			CHECK(waiting->is_cancelled());
+		}
+	}
+	WHEN("a recv is cancelled and then data arrives") {
+		io.recv(server)->cancel();
+		loop.run_once(0);
+		auto sent = io.send(client, buffer::copy("late"));
+		REQUIRE(run_until(loop, [&] { return !sent->is_pending(); }));
+		for(int i = 0; i < 10; ++i)
+			loop.run_once(10);
+		auto got = io.recv(server);
+		REQUIRE(run_until(loop, [&] { return !got->is_pending(); }));
+		THEN("the next recv gets it") {
+			CHECK(got->value().to_string() == "late");
+		}
+	}
+	WHEN("an accept is cancelled and then a connection arrives") {
+		auto waiting = io.accept(listener);
+		loop.run_once(0);
+		waiting->cancel();
+		int other = connect_loopback(port);
+		for(int i = 0; i < 10; ++i)
+			loop.run_once(10);
+		auto next = io.accept(listener);
+		REQUIRE(run_until(loop, [&] { return !next->is_pending(); }));
+		THEN("the next accept gets it") {
+			REQUIRE(next->is_done());
+			io.close(next->value());
+		}
+		io.close(other);
+	}
+	if(server >= 0)
+		io.close(server);
+	io.close(client);
+	io.close(listener);
+	loop.run_once(0);
+}
+
+}
+
+SCENARIO("socket I/O over epoll", "[socket_io]") {
+	GIVEN("an epoll backend") {
+		reactor loop;
+		epoll_socket_io io { loop };
+		CHECK(std::string(io.name()) == "epoll");
+		exercise(loop, io);
+	}
+}
+
+#if CPS_HAVE_IO_URING
+SCENARIO("socket I/O over io_uring", "[socket_io]") {
+	if(!uring_socket_io::supported()) {
+		WARN("io_uring is not available here");
+		return;
+	}
+	GIVEN("an io_uring backend") {
+		reactor loop;
+		uring_socket_io io { loop };
+		CHECK(std::string(io.name()) == "io_uring");
+		exercise(loop, io);
+	}
+	GIVEN("an io_uring backend with no fixed files and a couple of small receive buffers") {
+		reactor loop;
+		uring_options opts;
+		opts.fixed_files = 0;
+		opts.buffers = 2;
+		opts.buffer_size = 512;
+		opts.max_queued = 2;
+		uring_socket_io io { loop, opts };
+		exercise(loop, io);
+	}
+	GIVEN("an io_uring backend without multishot operations") {
+		reactor loop;
+		uring_options opts;
+		opts.multishot = false;
+		uring_socket_io io { loop, opts };
+		CHECK(!io.multishot());
+		exercise(loop, io);
+	}
+	GIVEN("a backend picked automatically") {
+		reactor loop;
+		auto io = make_socket_io(loop);
+		THEN("it is io_uring, since that's available") {
+			CHECK(std::string(io->name()) == "io_uring");
+		}
+	}
+}
+#endif
@@ -0,0 +1,156 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/spill.h>
+
+#include <string>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+std::string
+item(int i)
+{
+	return "item " + std::to_string(i) + std::string(static_cast<size_t>(i % 7), '.');
+}
+
+}
+
+SCENARIO("channels that spill to disk", "[spill]") {
+	GIVEN("a channel with room for a few bytes in memory") {
+		spill_options opts;
+		opts.memory_bytes = 20;
+		opts.spill_bytes = 200;
+		opts.segment_bytes = 64;
+		auto ch = std::make_shared<spilling_channel>(opts);
+		WHEN("producers push more than fits in memory") {
+			std::vector<std::shared_ptr<future<int>>> pushed;
+			for(int i = 0; i < 8; ++i)
+				pushed.push_back(ch->push(buffer::copy(item(i))));
+			THEN("every push is accepted straight away, with the overflow on disk") {
+				for(auto &p : pushed)
+					CHECK(p->is_done());
+				CHECK(ch->size() == 8);
+				CHECK(ch->spilled() > 0);
+				CHECK(ch->memory_bytes() <= 20);
+				CHECK(ch->segments_created() > 1);
+			}
+			THEN("the consumer reads everything back in order") {
+				for(int i = 0; i < 8; ++i) {
+					auto v = ch->pop();
+					REQUIRE(v->is_done());
+					CHECK(v->value().to_string() == item(i));
+				}
+				CHECK(ch->size() == 0);
+				CHECK(ch->spilled_bytes() == 0);
+				CHECK(ch->pop()->is_pending());
+			}
+			AND_WHEN("more is pushed while the consumer catches up") {
+				CHECK(ch->pop()->value().to_string() == item(0));
+				ch->push(buffer::copy(item(8)));
+				THEN("order is still kept across memory and disk") {
+					for(int i = 1; i <= 8; ++i)
+						CHECK(ch->pop()->value().to_string() == item(i));
+				}
+			}
+			AND_WHEN("the channel drains and is used again") {
+				for(int i = 0; i < 8; ++i)
+					ch->pop();
+				ch->push(buffer::copy(item(20)));
+				THEN("items go back to memory") {
+					CHECK(ch->spilled() == 0);
+					CHECK(ch->pop()->value().to_string() == item(20));
+				}
+			}
+		}
+		WHEN("we hold on to an item read back from disk") {
+			for(int i = 0; i < 8; ++i)
+				ch->push(buffer::copy(item(i)));
+			std::vector<buffer> held;
+			for(int i = 0; i < 8; ++i)
+				held.push_back(ch->pop()->value());
+			THEN("it stays readable after its segment has been released") {
+				for(int i = 0; i < 8; ++i)
+					CHECK(held[i].to_string() == item(i));
+			}
+		}
+		WHEN("the disk allowance runs out") {
+			std::vector<std::shared_ptr<future<int>>> pushed;
+			for(int i = 0; i < 40; ++i)
+				pushed.push_back(ch->push(buffer::copy(item(i))));
+			THEN("producers have to wait") {
+				CHECK(pushed.front()->is_done());
+				CHECK(pushed.back()->is_pending());
+				CHECK(ch->blocked() > 0);
+				CHECK(ch->spilled_bytes() <= 200);
+			}
+			AND_WHEN("the consumer reads everything") {
+				for(int i = 0; i < 40; ++i)
+					CHECK(ch->pop()->value().to_string() == item(i));
+				THEN("every producer got in, in order") {
+					for(auto &p : pushed)
+						CHECK(p->is_done());
+				}
+			}
+			AND_WHEN("the last waiting producer gives up") {
+				pushed.back()->cancel();
+				for(int i = 0; i < 39; ++i)
+					CHECK(ch->pop()->value().to_string() == item(i));
+				THEN("its item is dropped rather than queued") {
+					CHECK(ch->blocked() == 0);
+					CHECK(ch->size() == 0);
+				}
+			}
+			AND_WHEN("the channel is closed") {
+				ch->close();
+				THEN("waiting producers fail, but accepted items can still be read") {
+					CHECK(pushed.back()->is_failed());
+					CHECK(ch->push(buffer::copy("x", 1))->is_failed());
+					int accepted = 0;
+					for(auto &p : pushed)
+						accepted += p->is_done();
+					for(int i = 0; i < accepted; ++i)
+						CHECK(ch->pop()->value().to_string() == item(i));
+					CHECK(is_end_of_stream(*ch->pop()));
+				}
+			}
+		}
+		WHEN("a consumer is waiting") {
+			auto v = ch->pop();
+			ch->push(buffer::copy(item(1)));
+			THEN("the item goes straight to it") {
+				CHECK(v->value().to_string() == item(1));
+			}
+		}
+		WHEN("a waiting consumer gives up before an item arrives") {
+			auto gone = ch->pop();
+			gone->cancel();
+			auto accepted = ch->push(buffer::copy(item(2)));
+			THEN("the item is kept for the next consumer") {
+				CHECK(accepted->is_done());
+				CHECK(ch->size() == 1);
+				CHECK(ch->pop()->value().to_string() == item(2));
+			}
+			AND_WHEN("the channel is closed") {
+				ch->close();
+				THEN("close doesn't trip over it") {
+					CHECK(gone->is_cancelled());
+				}
+			}
+		}
+	}
+	GIVEN("a channel whose spill directory doesn't exist") {
+		spill_options opts;
+		opts.memory_bytes = 4;
+		opts.directory = "/nonexistent/cps-spill";
+		spilling_channel ch { opts };
+		THEN("spilling fails the push, and nothing is lost from memory") {
+			CHECK(ch.push(buffer::copy("abc", 3))->is_done());
+			CHECK(ch.push(buffer::copy("defg", 4))->is_failed());
+			CHECK(ch.pop()->value().to_string() == "abc");
+		}
+	}
+}
@@ -0,0 +1,140 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/std_future.h>
+
+#include "catch.hpp"
+
+using namespace cps;
+/* No using namespace std here: std::future and cps::future would clash */
+
+namespace {
+
+/** Waits a while for the future to resolve, since the poller runs on its own thread */
+template<typename T>
+bool
+settle(const std::shared_ptr<future<T>> &f)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while(f->is_pending() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return f->is_ready();
+}
+
+}
+
+SCENARIO("std::future to cps::future", "[std_future]") {
+	GIVEN("a poller") {
+		std_future_poller poller;
+		WHEN("we bridge a std::future that completes later") {
+			std::promise<int> p;
+			auto f = poller.watch(p.get_future(), "bridged");
+			THEN("it is pending until the promise is fulfilled") {
+				CHECK(f->is_pending());
+				CHECK(f->label() == "bridged");
+				p.set_value(17);
+				REQUIRE(settle(f));
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 17);
+				CHECK(poller.pending() == 0);
+			}
+		}
+		WHEN("the promise reports an exception") {
+			std::promise<int> p;
+			auto f = poller.watch(p.get_future());
+			p.set_exception(std::make_exception_ptr(std::out_of_range("no such thing")));
+			THEN("the cps::future fails with the same exception") {
+				REQUIRE(settle(f));
+				REQUIRE(f->is_failed());
+				CHECK(f->failure_reason() == "no such thing");
+				CHECK_THROWS_AS(std::rethrow_exception(f->exception_ptr()), const std::out_of_range &);
+			}
+		}
+		WHEN("we bridge a batch of futures") {
+			std::vector<std::promise<int>> promises(100);
+			std::vector<std::shared_ptr<future<int>>> bridged;
+			for(auto &p : promises)
+				bridged.push_back(poller.watch(p.get_future()));
+			CHECK(poller.pending() == 100);
+			for(size_t i = 0; i < promises.size(); ++i)
+				promises[i].set_value(static_cast<int>(i));
+			THEN("they all resolve with the right values") {
+				for(size_t i = 0; i < bridged.size(); ++i) {
+					REQUIRE(settle(bridged[i]));
+					CHECK(bridged[i]->value() == static_cast<int>(i));
+				}
+			}
+		}
+		WHEN("the bridged future is cancelled before the std::future completes") {
+			std::promise<int> p;
+			auto f = poller.watch(p.get_future());
+			f->cancel();
+			p.set_value(1);
+			THEN("the result is dropped once it arrives") {
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+				while(poller.pending() && std::chrono::steady_clock::now() < deadline)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				CHECK(poller.pending() == 0);
+				CHECK(f->is_cancelled());
+			}
+		}
+	}
+	GIVEN("a poller that goes away with futures still pending") {
+		std::promise<int> p;
+		std::shared_ptr<future<int>> f;
+		{
+			std_future_poller poller;
+			f = poller.watch(p.get_future());
+		}
+		THEN("they are cancelled") {
+			CHECK(f->is_cancelled());
+		}
+	}
+	GIVEN("the shared poller") {
+		auto f = from_std_future(std::async(std::launch::async, [] { return 5; }));
+		THEN("it works the same way") {
+			REQUIRE(settle(f));
+			CHECK(f->value() == 5);
+		}
+	}
+}
+
+SCENARIO("cps::future to std::future", "[std_future]") {
+	GIVEN("a pending cps::future bridged to a std::future") {
+		auto f = future<int>::create_shared();
+		auto s = to_std_future(f);
+		THEN("the std::future is not ready") {
+			CHECK(s.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+		}
+		WHEN("the cps::future completes") {
+			f->done(9);
+			THEN("so does the std::future") {
+				CHECK(s.get() == 9);
+			}
+		}
+		WHEN("the cps::future fails") {
+			f->fail(std::invalid_argument("bad input"));
+			THEN("the std::future rethrows the original exception") {
+				CHECK_THROWS_AS(s.get(), const std::invalid_argument &);
+			}
+		}
+		WHEN("the cps::future is cancelled") {
+			f->cancel();
+			THEN("the std::future reports it") {
+				try {
+					s.get();
+					FAIL("expected an exception");
+				} catch(const std::system_error &e) {
+					CHECK(e.code() == make_error_code(future_errc::is_cancelled));
+				}
+			}
+		}
+	}
+	GIVEN("a promise we hand over") {
+		std::promise<int> p;
+		auto s = p.get_future();
+		fulfil(resolved_future(4), std::move(p));
+		THEN("it is fulfilled") {
+			CHECK(s.get() == 4);
+		}
+	}
+}
@@ -0,0 +1,245 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "rapidcheck-catch.h"
+
+using namespace cps;
+using namespace std;
+
+using namespace rc;
+
+/*
+ * Concurrency stress for future graphs.
+ *
+ * Each property run builds a random DAG of ->then, needs_all and needs_any
+ * nodes over a set of leaf futures, cancels some of the nodes, then resolves
+ * the remaining leaves from several threads in a random order. Once the
+ * threads are done we check that every future ended up ready, that every
+ * on_ready callback fired exactly once, and that each node's state is
+ * consistent with its inputs.
+ *
+ * Run counts come from rapidcheck, so RC_PARAMS="max_success=10000" gives a
+ * longer soak.
+ */
+
+namespace {
+
+/** One step in building a random graph */
+struct op {
+	enum class kind { then, needs_all, needs_any, cancel };
+	kind type;
+	/** Indices of earlier nodes - a single node for then and cancel */
+	std::vector<size_t> inputs;
+};
+
+struct dag_plan {
+	size_t threads;
+	size_t leaves;
+	std::vector<op> ops;
+	/** For each leaf: 0 = done, 1 = fail, 2 = cancel */
+	std::vector<int> outcomes;
+	/** Which thread resolves each leaf */
+	std::vector<size_t> thread;
+	/** The order in which leaves are resolved */
+	std::vector<size_t> order;
+};
+
+std::ostream &
+operator<<(std::ostream &os, const dag_plan &p)
+{
+	static const char *names[] = { "then", "needs_all", "needs_any", "cancel" };
+	os << p.leaves << " leaves on " << p.threads << " threads:";
+	for(auto &o : p.ops) {
+		os << " " << names[static_cast<int>(o.type)] << "(";
+		for(size_t i = 0; i < o.inputs.size(); ++i)
+			os << (i ? "," : "") << o.inputs[i];
+		os << ")";
+	}
+	return os;
+}
+
+/** Totals across all property runs, for the throughput report */
+std::atomic<size_t> total_futures { 0 };
+std::atomic<uint64_t> total_nanoseconds { 0 };
+
+}
+
+namespace rc {
+
+template<>
+struct Arbitrary<dag_plan> {
+	static Gen<dag_plan> arbitrary() {
+		return gen::exec([] {
+			dag_plan p;
+			p.threads = *gen::inRange<size_t>(1, 5);
+			p.leaves = *gen::inRange<size_t>(1, 33);
+			size_t nodes = p.leaves;
+			const size_t count = *gen::inRange<size_t>(0, 65);
+			for(size_t i = 0; i < count; ++i) {
+				op o;
+				o.type = static_cast<op::kind>(*gen::inRange(0, 4));
+				const bool single = o.type == op::kind::then || o.type == op::kind::cancel;
+				const size_t width = single ? 1 : *gen::inRange<size_t>(1, 6);
+				for(size_t j = 0; j < width; ++j)
+					o.inputs.push_back(*gen::inRange<size_t>(0, nodes));
+				if(o.type != op::kind::cancel)
+					++nodes;
+				p.ops.push_back(o);
+			}
+			for(size_t i = 0; i < p.leaves; ++i) {
+				p.outcomes.push_back(*gen::inRange(0, 3));
+				p.thread.push_back(*gen::inRange<size_t>(0, p.threads));
+				p.order.push_back(i);
+			}
+			for(size_t i = p.leaves; i > 1; --i)
+				std::swap(p.order[i - 1], p.order[*gen::inRange<size_t>(0, i)]);
+			return p;
+		});
+	}
+};
+
+}
+
+SCENARIO("concurrent resolution of random future graphs", "[stress]") {
+	prop("callbacks fire once and states propagate", [](const dag_plan &plan) {
+		struct node {
+			std::shared_ptr<future<int>> f;
+			op::kind type;
+			std::vector<size_t> inputs;
+			bool leaf;
+			bool cancelled;
+		};
+		std::vector<node> nodes;
+		const size_t total = plan.leaves + std::count_if(plan.ops.begin(), plan.ops.end(), [](const op &o) {
+			return o.type != op::kind::cancel;
+		});
+		std::unique_ptr<std::atomic<int>[]> calls { new std::atomic<int>[total] };
+		auto track = [&calls, &nodes](std::shared_ptr<future<int>> f) {
+			auto *counter = &calls[nodes.size()];
+			counter->store(0);
+			f->on_ready([counter](future<int> &) { ++*counter; });
+			return f;
+		};
+
+		for(size_t i = 0; i < plan.leaves; ++i)
+			nodes.push_back(node { track(future<int>::create_shared()), op::kind::then, { }, true, false });
+		for(auto &o : plan.ops) {
+			std::vector<std::shared_ptr<future<int>>> inputs;
+			for(auto i : o.inputs)
+				inputs.push_back(nodes[i].f);
+			switch(o.type) {
+			case op::kind::then:
+				nodes.push_back(node { track(inputs[0]->then([](int v) {
+					return resolved_future(v + 1);
+				})), o.type, o.inputs, false, false });
+				break;
+			case op::kind::needs_all:
+				nodes.push_back(node { track(needs_all(inputs)), o.type, o.inputs, false, false });
+				break;
+			case op::kind::needs_any:
+				nodes.push_back(node { track(needs_any(inputs)), o.type, o.inputs, false, false });
+				break;
+			case op::kind::cancel:
+				if(inputs[0]->is_pending()) {
+					inputs[0]->cancel();
+					nodes[o.inputs[0]].cancelled = true;
+				}
+				break;
+			}
+		}
+
+		/* Resolve the leaves, with all threads released at once */
+		std::atomic<bool> go { false };
+		std::mutex errors_mutex;
+		std::vector<std::string> errors;
+		std::vector<std::thread> threads;
+		for(size_t t = 0; t < plan.threads; ++t) {
+			threads.emplace_back([&, t] {
+				while(!go) std::this_thread::yield();
+				for(auto i : plan.order) {
+					if(plan.thread[i] != t || !nodes[i].f->is_pending())
+						continue;
+					try {
+						switch(plan.outcomes[i]) {
+						case 0: nodes[i].f->done(static_cast<int>(i)); break;
+						case 1: nodes[i].f->fail("leaf failed"); break;
+						default: nodes[i].f->cancel(); break;
+						}
+					} catch(const std::exception &e) {
+						std::lock_guard<std::mutex> guard { errors_mutex };
+						errors.push_back(e.what());
+					}
+				}
+			});
+		}
+		auto start = std::chrono::high_resolution_clock::now();
+		go = true;
+		for(auto &t : threads)
+			t.join();
+		total_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::high_resolution_clock::now() - start
+		).count();
+		total_futures += nodes.size();
+
+		RC_ASSERT(errors.empty());
+		for(size_t i = 0; i < nodes.size(); ++i) {
+			auto &n = nodes[i];
+			RC_ASSERT(n.f->is_ready());
+			RC_ASSERT(calls[i].load() == 1);
+			if(n.leaf || n.cancelled)
+				continue;
+			switch(n.type) {
+			case op::kind::then: {
+				auto &in = *nodes[n.inputs[0]].f;
+				if(in.is_done()) {
+					RC_ASSERT(n.f->is_done());
+					RC_ASSERT(n.f->value() == in.value() + 1);
+				} else if(in.is_failed()) {
+					RC_ASSERT(n.f->is_failed());
+				} else {
+					RC_ASSERT(n.f->is_cancelled());
+				}
+				break;
+			}
+			case op::kind::needs_all: {
+				bool all = std::all_of(n.inputs.begin(), n.inputs.end(), [&nodes](size_t i) {
+					return nodes[i].f->is_done();
+				});
+				RC_ASSERT(n.f->is_done() == all);
+				RC_ASSERT(n.f->is_failed() == !all);
+				break;
+			}
+			case op::kind::needs_any: {
+				/* Which input wins depends on timing, so we can only check
+				 * that the outcome was possible */
+				bool any_done = std::any_of(n.inputs.begin(), n.inputs.end(), [&nodes](size_t i) {
+					return nodes[i].f->is_done();
+				});
+				bool any_not_done = std::any_of(n.inputs.begin(), n.inputs.end(), [&nodes](size_t i) {
+					return !nodes[i].f->is_done();
+				});
+				RC_ASSERT(n.f->is_done() || n.f->is_failed());
+				RC_ASSERT(!n.f->is_done() || any_done);
+				RC_ASSERT(!n.f->is_failed() || any_not_done);
+				break;
+			}
+			default:
+				break;
+			}
+		}
+	});
+	std::cout
+		<< "stress: " << total_futures << " futures resolved, "
+		<< (total_futures / (total_nanoseconds / 1e9)) << " futures/s during resolution"
+		<< std::endl;
+}
+
@@ -0,0 +1,70 @@
+#define FUTURE_TRACE 1
+#include <cps/future.h>
+#include <cps/future/trace.h>
+
+#include <sstream>
+#include <set>
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("recording a future graph", "[trace]") {
+	GIVEN("an active recorder") {
+		std::stringstream out;
+		auto r = std::unique_ptr<trace::recorder>(new trace::recorder(out));
+		trace::record_to(r.get());
+		WHEN("we build and resolve a small graph") {
+			auto a = future<int>::create_shared();
+			auto b = future<int>::create_shared();
+			auto inner = future<int>::create_shared();
+			auto chained = a->then([inner](int) { return inner; });
+			auto all = needs_all(std::vector<std::shared_ptr<future<int>>> { chained, b });
+			std::thread([a] { a->done(1); }).join();
+			b->done(2);
+			inner->done(3);
+			REQUIRE(all->is_done());
+			trace::record_to(nullptr);
+			r.reset();
+			auto events = trace::read(out);
+			auto count = [&events](trace::event_type type) {
+				return std::count_if(events.begin(), events.end(), [type](const trace::event &ev) { return ev.type == type; });
+			};
+			auto has_link = [&events](uint64_t source, uint64_t target, trace::link kind) {
+				return std::any_of(events.begin(), events.end(), [=](const trace::event &ev) {
+					return ev.type == trace::event_type::linked && ev.id == source && ev.target == target && ev.kind == kind;
+				});
+			};
+			THEN("we see every future created and resolved") {
+				CHECK(count(trace::event_type::created) == 5);
+				CHECK(count(trace::event_type::resolved) == 5);
+			}
+			AND_THEN("the edges are recorded") {
+				CHECK(has_link(a->trace_id(), chained->trace_id(), trace::link::then));
+				CHECK(has_link(inner->trace_id(), chained->trace_id(), trace::link::then_result));
+				CHECK(has_link(chained->trace_id(), all->trace_id(), trace::link::needs_all));
+				CHECK(has_link(b->trace_id(), all->trace_id(), trace::link::needs_all));
+			}
+			AND_THEN("resolution happened on two threads") {
+				std::set<uint32_t> threads;
+				for(auto &ev : events)
+					if(ev.type == trace::event_type::resolved)
+						threads.insert(ev.thread);
+				CHECK(threads.size() == 2);
+			}
+			AND_THEN("timestamps never go backwards") {
+				for(size_t i = 1; i < events.size(); ++i)
+					CHECK(events[i].time >= events[i - 1].time);
+			}
+		}
+		trace::record_to(nullptr);
+	}
+	GIVEN("something that isn't a trace") {
+		std::stringstream in { "not a trace at all" };
+		THEN("reading fails") {
+			REQUIRE_THROWS(trace::read(in));
+		}
+	}
+}
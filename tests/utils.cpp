@@ -100,5 +100,28 @@ SCENARIO("needs_all", "[composed][shared]") {
 			}
 		}
 	}
+	GIVEN("a single pending future") {
+		auto f1 = future<int>::create_shared();
+		auto na = needs_all(f1);
+		WHEN("it is marked as done") {
+			f1->done(1);
+			THEN("needs_all is complete") {
+				CHECK(na->is_done());
+			}
+		}
+		WHEN("it fails") {
+			f1->fail("...");
+			THEN("needs_all is now failed") {
+				CHECK(na->is_failed());
+			}
+		}
+		WHEN("needs_all is cancelled before it resolves") {
+			na->cancel();
+			THEN("resolving it leaves needs_all alone") {
+				CHECK_NOTHROW(f1->done(1));
+				CHECK(na->is_cancelled());
+			}
+		}
+	}
 }
 
@@ -0,0 +1,162 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+#include <cps/future/write_queue.h>
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+std::string
+drain(int fd)
+{
+	std::string out;
+	char buf[65536];
+	ssize_t n;
+	while((n = ::read(fd, buf, sizeof(buf))) > 0)
+		out.append(buf, n);
+	return out;
+}
+
+}
+
+SCENARIO("reactor readiness futures", "[reactor]") {
+	GIVEN("a reactor and a pipe") {
+		reactor loop;
+		int fds[2];
+		REQUIRE(::pipe2(fds, O_NONBLOCK) == 0);
+		auto r = loop.readable(fds[0]);
+		WHEN("nothing has been written") {
+			loop.run_once(0);
+			THEN("the readable future is still pending") {
+				CHECK(r->is_pending());
+			}
+		}
+		WHEN("we write to the pipe") {
+			REQUIRE(::write(fds[1], "x", 1) == 1);
+			loop.run_once(0);
+			THEN("the readable future resolves with the fd") {
+				REQUIRE(r->is_done());
+				CHECK(r->value() == fds[0]);
+			}
+		}
+		WHEN("we remove the fd") {
+			loop.remove(fds[0]);
+			THEN("the readable future is cancelled") {
+				CHECK(r->is_cancelled());
+			}
+		}
+		WHEN("the readable future is cancelled and we ask again") {
+			r->cancel();
+			auto again = loop.readable(fds[0]);
+			REQUIRE(::write(fds[1], "x", 1) == 1);
+			loop.run_once(0);
+			THEN("we get a new future, which resolves") {
+				CHECK(again != r);
+				REQUIRE(again->is_done());
+				CHECK(again->value() == fds[0]);
+			}
+		}
+		WHEN("we post from another context") {
+			bool called = false;
+			loop.post([&called] { called = true; });
+			loop.run_once(0);
+			THEN("the code runs on the next iteration") {
+				CHECK(called);
+			}
+		}
+		loop.remove(fds[0]);
+		::close(fds[0]);
+		::close(fds[1]);
+	}
+}
+
+SCENARIO("write coalescing", "[reactor][write_queue]") {
+	GIVEN("a write queue on a socket pair") {
+		reactor loop;
+		int fds[2];
+		REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+		write_queue q { loop, fds[0] };
+		WHEN("we send several messages in one iteration") {
+			auto f1 = q.send(buffer::copy("first "));
+			auto f2 = q.send(buffer::copy("second "));
+			auto f3 = q.send(buffer::copy("third"));
+			THEN("nothing is written until the end of the iteration") {
+				CHECK(f1->is_pending());
+				CHECK(q.write_calls() == 0);
+				CHECK(q.queued_messages() == 3);
+			}
+			AND_WHEN("the reactor runs") {
+				loop.run_once(0);
+				THEN("all messages went out in a single call") {
+					CHECK(q.write_calls() == 1);
+					REQUIRE(f1->is_done());
+					REQUIRE(f2->is_done());
+					REQUIRE(f3->is_done());
+					CHECK(f2->value() == 7);
+					CHECK(drain(fds[1]) == "first second third");
+				}
+			}
+		}
+		WHEN("we send more than the socket will take") {
+			std::string big(4 * 1024 * 1024, 'x');
+			auto f = q.send(buffer::take(std::move(big)));
+			auto small = q.send(buffer::copy("!"));
+			loop.run_once(0);
+			THEN("the messages are still pending") {
+				CHECK(f->is_pending());
+				CHECK(small->is_pending());
+				CHECK(q.queued_bytes() > 0);
+			}
+			AND_WHEN("the wait for room is cancelled, and more is sent") {
+				loop.writable(fds[0])->cancel();
+				auto more = q.send(buffer::copy("?"));
+				std::string received;
+				for(int i = 0; i < 1000 && !more->is_ready(); ++i) {
+					received += drain(fds[1]);
+					loop.run_once(10);
+				}
+				THEN("the queue still flushes") {
+					CHECK(small->is_done());
+					CHECK(more->is_done());
+				}
+			}
+			AND_WHEN("the reader catches up") {
+				std::string received;
+				for(int i = 0; i < 1000 && !small->is_ready(); ++i) {
+					received += drain(fds[1]);
+					loop.run_once(10);
+				}
+				received += drain(fds[1]);
+				THEN("both messages complete in order") {
+					REQUIRE(f->is_done());
+					REQUIRE(small->is_done());
+					CHECK(received.size() == 4 * 1024 * 1024 + 1);
+					CHECK(received.back() == '!');
+				}
+			}
+		}
+		WHEN("the peer has gone away") {
+			::close(fds[1]);
+			fds[1] = -1;
+			auto f = q.send(buffer::copy("lost"));
+			loop.run_once(0);
+			THEN("the message fails") {
+				CHECK(f->is_failed());
+			}
+			AND_THEN("later messages fail immediately") {
+				CHECK(q.send(buffer::copy("also lost"))->is_failed());
+			}
+		}
+		loop.remove(fds[0]);
+		::close(fds[0]);
+		if(fds[1] >= 0)
+			::close(fds[1]);
+	}
+}